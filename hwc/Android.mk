@@ -7,7 +7,7 @@ include $(CLEAR_VARS)
 LOCAL_PRELINK_MODULE := false
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/../vendor/lib/hw
 LOCAL_SHARED_LIBRARIES := liblog libEGL libcutils libutils libhardware libhardware_legacy
-LOCAL_SRC_FILES := hwc.c
+LOCAL_SRC_FILES := hwc.c backend.c backend_sim.c sw_vsync.c ion_pool.c tiler_slot.c yuv_conv.c
 
 LOCAL_MODULE_TAGS := optional
 
@@ -18,3 +18,42 @@ LOCAL_CFLAGS := -DLOG_TAG=\"ti_hwc\"
 # LOCAL_CFLAGS += -DLOG_NDEBUG=0
 
 include $(BUILD_SHARED_LIBRARY)
+
+# Host-side replayer for traces captured with debug.hwc.trace
+include $(CLEAR_VARS)
+LOCAL_MODULE := hwc_replay
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := replay/hwc_replay.c backend.c backend_sim.c sw_vsync.c ion_pool.c tiler_slot.c yuv_conv.c
+# the kernel's video/dsscomp.h is not on the host include path
+LOCAL_C_INCLUDES := $(LOCAL_PATH) $(LOCAL_PATH)/../include $(LOCAL_PATH)/replay/include
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_CFLAGS := -DLOG_TAG=\"ti_hwc_replay\" -DHWC_DEFAULT_BACKEND=\"sim\"
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+hwc_tests_src_files := tests/hwc_tests.c tests/test_ion_pool.c tests/test_sw_vsync.c tests/test_tiler_slot.c \
+	tests/test_yuv_conv.c backend.c backend_sim.c sw_vsync.c ion_pool.c tiler_slot.c yuv_conv.c
+
+# Host tests of the composer on the simulated display backend
+include $(CLEAR_VARS)
+LOCAL_MODULE := hwc_tests
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := $(hwc_tests_src_files)
+LOCAL_C_INCLUDES := $(LOCAL_PATH) $(LOCAL_PATH)/../include $(LOCAL_PATH)/replay/include
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_CFLAGS := -DLOG_TAG=\"ti_hwc_tests\" -DHWC_DEFAULT_BACKEND=\"sim\"
+LOCAL_LDLIBS := -lpthread -lrt -lm
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# The same tests on the device, where yuv_conv runs its NEON kernels
+include $(CLEAR_VARS)
+LOCAL_MODULE := hwc_tests
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := $(hwc_tests_src_files)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_CFLAGS := -DLOG_TAG=\"ti_hwc_tests\" -DHWC_DEFAULT_BACKEND=\"sim\"
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+#include <linux/omapfb.h>
+
+#include <cutils/properties.h>
+#include <cutils/log.h>
+#include <hardware/hardware.h>
+#include <hardware/gralloc.h>
+
+#include "backend.h"
+
+struct kernel_backend {
+    struct omap3_hwc_backend base;
+    int dsscomp_fd;
+    int fb_fd;
+    int vsync_fd;
+    IMG_gralloc_module_public_t *gralloc;
+    alloc_device_t *alloc_dev;          /* opened on first use */
+};
+
+static int kernel_query_display(struct omap3_hwc_backend *be, struct dsscomp_display_info *dis)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    return ioctl(kb->dsscomp_fd, DSSCIOC_QUERY_DISPLAY, dis) ? -errno : 0;
+}
+
+static int kernel_setup_display(struct omap3_hwc_backend *be, struct dsscomp_setup_display_data *sdis)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    return ioctl(kb->dsscomp_fd, DSSCIOC_SETUP_DISPLAY, sdis) ? -errno : 0;
+}
+
+static int kernel_setup_dispc(struct omap3_hwc_backend *be, struct dsscomp_setup_dispc_data *d)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    return ioctl(kb->dsscomp_fd, DSSCIOC_SETUP_DISPC, d) ? -errno : 0;
+}
+
+static int kernel_post2(struct omap3_hwc_backend *be, buffer_handle_t *buffers, int num_buffers,
+                        void *data, int data_length)
+{
+    return be->fb_dev->Post2((framebuffer_device_t *) be->fb_dev, buffers, num_buffers,
+                             data, data_length);
+}
+
+static int kernel_wait_vsync(struct omap3_hwc_backend *be)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+    __u32 crt = 0;
+
+    return ioctl(kb->fb_fd, FBIO_WAITFORVSYNC, &crt) ? -errno : 0;
+}
+
+static int kernel_enable_vsync(struct omap3_hwc_backend *be, int enabled)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    return ioctl(kb->fb_fd, OMAPFB_ENABLEVSYNC, &enabled) < 0 ? -errno : 0;
+}
+
+static int kernel_blank(struct omap3_hwc_backend *be, int blank)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    return ioctl(kb->fb_fd, FBIOBLANK, blank) ? -errno : 0;
+}
+
+#define OMAPDSS "/sys/devices/platform/omapdss/"
+
+static const char *const route_hdmi[] = {
+    "echo 0 > /sys/devices/platform/dsscomp/isprsz/enable",
+    "echo 0 > " OMAPDSS "display1/enabled",
+    "echo 0 > " OMAPDSS "overlay0/enabled",
+    "echo 0 > " OMAPDSS "display0/enabled",
+    "echo hdmi > " OMAPDSS "manager0/display",
+    "echo 1 > " OMAPDSS "display1/enabled",
+    "echo 1 > " OMAPDSS "overlay0/enabled",
+    NULL
+};
+
+static const char *const route_tv[] = {
+    "echo 0 > " OMAPDSS "overlay1/enabled",
+    "echo tv > " OMAPDSS "overlay1/manager",
+    "echo 1 > " OMAPDSS "overlay1/enabled",
+    "echo 1 > " OMAPDSS "display2/enabled",
+    NULL
+};
+
+static const char *const route_lcd[] = {
+    "echo 1 > /sys/devices/platform/dsscomp/isprsz/enable",
+    "echo 0 > " OMAPDSS "display1/enabled",
+    "echo 0 > " OMAPDSS "overlay0/enabled",
+    "echo 0 > " OMAPDSS "overlay1/enabled",
+    "echo 480,800 > " OMAPDSS "overlay1/output_size",
+    "echo 480,800 > " OMAPDSS "overlay0/output_size",
+    "echo lcd > " OMAPDSS "manager0/display",
+    "echo 1 > " OMAPDSS "display0/enabled",
+    "echo 1 > " OMAPDSS "overlay1/enabled",
+    "echo 1 > " OMAPDSS "overlay0/enabled",
+    NULL
+};
+
+/* runs all of the steps, even if one fails, so the display is not left half switched */
+static int kernel_route_output(struct omap3_hwc_backend *be, int output)
+{
+    const char *const *cmd = output == OMAP3_HWC_OUTPUT_HDMI ? route_hdmi :
+                             output == OMAP3_HWC_OUTPUT_TV ? route_tv : route_lcd;
+    int err = 0;
+
+    for (; *cmd; cmd++)
+        if (system(*cmd))
+            err = -EIO;
+    return err;
+}
+
+static int kernel_get_vsync_fd(struct omap3_hwc_backend *be, short *events)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    if (kb->vsync_fd < 0)
+        kb->vsync_fd = open("/sys/devices/platform/omapfb/graphics/fb0/vsync_time", O_RDONLY);
+
+    /* sysfs attributes signal changes with POLLPRI */
+    *events = POLLPRI;
+    return kb->vsync_fd;
+}
+
+static int kernel_read_vsync(struct omap3_hwc_backend *be, int64_t *timestamp)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+    char buf[32];
+    ssize_t len;
+
+    len = pread(kb->vsync_fd, buf, sizeof(buf) - 1, 0);
+    if (len < 0)
+        return -errno;
+    buf[len] = '\0';
+
+    *timestamp = strtoull(buf, NULL, 0);
+    return 0;
+}
+
+static int kernel_open_alloc(struct kernel_backend *kb)
+{
+    int err;
+
+    if (kb->alloc_dev)
+        return 0;
+
+    err = gralloc_open(&kb->gralloc->base.common, &kb->alloc_dev);
+    if (err) {
+        ALOGE("failed to open gralloc alloc device (%d)", err);
+        kb->alloc_dev = NULL;
+    }
+    return err;
+}
+
+static int kernel_alloc_buffer(struct omap3_hwc_backend *be, int width, int height, int format,
+                               buffer_handle_t *handle)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+    int stride, err;
+
+    err = kernel_open_alloc(kb);
+    if (err)
+        return err;
+
+    return kb->alloc_dev->alloc(kb->alloc_dev, width, height, format,
+                                GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_COMPOSER,
+                                handle, &stride);
+}
+
+static void kernel_free_buffer(struct omap3_hwc_backend *be, buffer_handle_t handle)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    if (kb->alloc_dev)
+        kb->alloc_dev->free(kb->alloc_dev, handle);
+}
+
+static int kernel_blit(struct omap3_hwc_backend *be, buffer_handle_t src, buffer_handle_t dest,
+                       int w, int h, int x, int y)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    if (!kb->gralloc->Blit2)
+        return -ENOSYS;
+    return kb->gralloc->Blit2(kb->gralloc, src, dest, w, h, x, y);
+}
+
+static int kernel_lock_buffer(struct omap3_hwc_backend *be, buffer_handle_t handle, void **vaddr)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+    IMG_native_handle_t *h = (IMG_native_handle_t *) handle;
+
+    return kb->gralloc->base.lock(&kb->gralloc->base, handle, GRALLOC_USAGE_SW_READ_OFTEN,
+                                  0, 0, h->iWidth, h->iHeight, vaddr);
+}
+
+static void kernel_unlock_buffer(struct omap3_hwc_backend *be, buffer_handle_t handle)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    kb->gralloc->base.unlock(&kb->gralloc->base, handle);
+}
+
+static void kernel_close(struct omap3_hwc_backend *be)
+{
+    struct kernel_backend *kb = (struct kernel_backend *) be;
+
+    if (kb->alloc_dev)
+        gralloc_close(kb->alloc_dev);
+
+    if (kb->dsscomp_fd >= 0)
+        close(kb->dsscomp_fd);
+    if (kb->fb_fd >= 0)
+        close(kb->fb_fd);
+    if (kb->vsync_fd >= 0)
+        close(kb->vsync_fd);
+    free(kb);
+}
+
+static const struct omap3_hwc_backend_ops kernel_ops = {
+    .query_display = kernel_query_display,
+    .setup_display = kernel_setup_display,
+    .setup_dispc = kernel_setup_dispc,
+    .post2 = kernel_post2,
+    .wait_vsync = kernel_wait_vsync,
+    .enable_vsync = kernel_enable_vsync,
+    .blank = kernel_blank,
+    .route_output = kernel_route_output,
+    .get_vsync_fd = kernel_get_vsync_fd,
+    .read_vsync = kernel_read_vsync,
+    .alloc_buffer = kernel_alloc_buffer,
+    .free_buffer = kernel_free_buffer,
+    .blit = kernel_blit,
+    .lock_buffer = kernel_lock_buffer,
+    .unlock_buffer = kernel_unlock_buffer,
+    .close = kernel_close,
+};
+
+int omap3_hwc_open_kernel_backend(IMG_framebuffer_device_public_t *fb_dev,
+                                  struct omap3_hwc_backend **be)
+{
+    struct kernel_backend *kb;
+    int err;
+
+    kb = calloc(1, sizeof(*kb));
+    if (!kb)
+        return -ENOMEM;
+
+    kb->base.ops = &kernel_ops;
+    kb->base.fb_dev = fb_dev;
+    kb->base.name = "kernel";
+    kb->fb_fd = kb->vsync_fd = -1;
+
+    kb->dsscomp_fd = open("/dev/dsscomp", O_RDWR);
+    if (kb->dsscomp_fd < 0) {
+        err = -errno;
+        ALOGE("failed to open dsscomp (%d)", -err);
+        goto err_out;
+    }
+
+    kb->fb_fd = open("/dev/graphics/fb0", O_RDWR);
+    if (kb->fb_fd < 0) {
+        err = -errno;
+        ALOGE("failed to open fb (%d)", -err);
+        goto err_out;
+    }
+
+    /* the framebuffer HAL is part of the gralloc module, so it is loaded already */
+    err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, (const hw_module_t **) &kb->gralloc);
+    if (err) {
+        ALOGE("failed to get gralloc module (%d)", err);
+        goto err_out;
+    }
+
+    *be = &kb->base;
+    return 0;
+
+err_out:
+    kernel_close(&kb->base);
+    return err;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OMAP3_HWC_BACKEND_H
+#define OMAP3_HWC_BACKEND_H
+
+#include <stdint.h>
+#include <linux/types.h>
+
+#include <cutils/properties.h>
+#include <video/dsscomp.h>
+
+#include "hal_public.h"
+
+/*
+ * Everything the composer needs from the display driver stack: the dsscomp
+ * device, the framebuffer device and the gralloc Post2 and Blit2 hooks.  All
+ * operations return 0 on success or a negative errno.
+ */
+
+struct omap3_hwc_backend;
+
+/* display the overlays are routed to, in the numbering of the display_support switch */
+enum omap3_hwc_output {
+    OMAP3_HWC_OUTPUT_LCD,
+    OMAP3_HWC_OUTPUT_HDMI,
+    OMAP3_HWC_OUTPUT_TV,
+};
+
+struct omap3_hwc_backend_ops {
+    /* DSSCIOC_QUERY_DISPLAY; dis->modedb_len is the room available after dis */
+    int (*query_display)(struct omap3_hwc_backend *be, struct dsscomp_display_info *dis);
+    /* DSSCIOC_SETUP_DISPLAY */
+    int (*setup_display)(struct omap3_hwc_backend *be, struct dsscomp_setup_display_data *sdis);
+    /* DSSCIOC_SETUP_DISPC */
+    int (*setup_dispc)(struct omap3_hwc_backend *be, struct dsscomp_setup_dispc_data *d);
+    /* gralloc Post2 */
+    int (*post2)(struct omap3_hwc_backend *be, buffer_handle_t *buffers, int num_buffers,
+                 void *data, int data_length);
+    /* FBIO_WAITFORVSYNC */
+    int (*wait_vsync)(struct omap3_hwc_backend *be);
+    /* OMAPFB_ENABLEVSYNC */
+    int (*enable_vsync)(struct omap3_hwc_backend *be, int enabled);
+    /* FBIOBLANK */
+    int (*blank)(struct omap3_hwc_backend *be, int blank);
+    /* omapdss sysfs: moves the overlays and the LCD manager to an omap3_hwc_output */
+    int (*route_output)(struct omap3_hwc_backend *be, int output);
+    /* returns an fd to poll for vsync and the poll events to wait for */
+    int (*get_vsync_fd)(struct omap3_hwc_backend *be, short *events);
+    /* reads the vsync timestamp after the vsync fd fired */
+    int (*read_vsync)(struct omap3_hwc_backend *be, int64_t *timestamp);
+    /* gralloc alloc: a buffer SGX can render to and DSS can scan out */
+    int (*alloc_buffer)(struct omap3_hwc_backend *be, int width, int height, int format,
+                        buffer_handle_t *handle);
+    void (*free_buffer)(struct omap3_hwc_backend *be, buffer_handle_t handle);
+    /* gralloc Blit2: copies w*h pixels of src to x, y in dest */
+    int (*blit)(struct omap3_hwc_backend *be, buffer_handle_t src, buffer_handle_t dest,
+                int w, int h, int x, int y);
+    /* gralloc lock and unlock: maps a buffer for CPU reads */
+    int (*lock_buffer)(struct omap3_hwc_backend *be, buffer_handle_t handle, void **vaddr);
+    void (*unlock_buffer)(struct omap3_hwc_backend *be, buffer_handle_t handle);
+    void (*close)(struct omap3_hwc_backend *be);
+};
+
+struct omap3_hwc_backend {
+    const struct omap3_hwc_backend_ops *ops;
+    IMG_framebuffer_device_public_t *fb_dev;
+    const char *name;
+};
+
+/* simulated display configuration */
+struct omap3_hwc_sim_config {
+    __u32 xres;                         /* LCD */
+    __u32 yres;
+    __u32 refresh;                      /* Hz */
+    __u32 pixel_clock;                  /* kHz */
+    __u32 width_in_mm;
+    __u32 height_in_mm;
+    int format;                         /* framebuffer HAL pixel format */
+    __u32 vsync_jitter_us;              /* max. random vsync timestamp error */
+    __u32 post_us;                      /* simulated Post2 duration */
+    __u32 mode_us;                      /* simulated HDMI mode switch duration */
+    __u32 tiler_size;                   /* TILER 1D slot Post2 maps buffers into, 0 for 16MB */
+    char modedb[PROPERTY_VALUE_MAX];    /* external display: "1280x720@60,720x480@60,..." */
+};
+
+/* backend using /dev/dsscomp, /dev/graphics/fb0 and the gralloc framebuffer device */
+int omap3_hwc_open_kernel_backend(IMG_framebuffer_device_public_t *fb_dev,
+                                  struct omap3_hwc_backend **be);
+
+/*
+ * in-process display simulator; if cfg is NULL, the configuration set with
+ * omap3_hwc_set_sim_config is used, or the debug.hwc.sim.* properties
+ */
+int omap3_hwc_open_sim_backend(const struct omap3_hwc_sim_config *cfg,
+                               struct omap3_hwc_backend **be);
+
+/* default configuration for simulators opened by the composer (host tools) */
+void omap3_hwc_set_sim_config(const struct omap3_hwc_sim_config *cfg);
+
+#endif /* OMAP3_HWC_BACKEND_H */
@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-process display simulator.  It stands in for dsscomp, the framebuffer
+ * driver and the gralloc Post2, alloc, Blit2 and lock hooks so that the
+ * composer can run on a host without OMAP hardware.  Buffers have no backing
+ * store; locked buffers read as zeros.  Vsync is generated from
+ * CLOCK_MONOTONIC at the configured refresh rate.  Post2 maps buffers into a
+ * model of the TILER 1D slot and fails when they do not fit, as dsscomp does.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <linux/fb.h>
+
+#include <cutils/properties.h>
+#include <cutils/log.h>
+
+#include "backend.h"
+#include "tiler_slot.h"
+
+#define SIM_MAX_MODES 16
+#define SIM_TILER_SLOT (16 << 20)
+
+struct sim_backend {
+    struct omap3_hwc_backend base;
+    IMG_framebuffer_device_public_t fb_dev;
+    struct omap3_hwc_sim_config cfg;
+
+    struct dsscomp_videomode modedb[SIM_MAX_MODES];
+    __u32 num_modes;
+    __u32 ext_mode;                     /* current external mode */
+    int output;                         /* enum omap3_hwc_output */
+
+    int64_t vsync_epoch;                /* time of vsync #0, ns */
+    int64_t vsync_period;               /* ns */
+    int vsync_enabled;
+    int vsync_fd;
+    unsigned int seed;
+    __u64 last_stamp;                   /* of allocated buffers */
+
+    struct omap3_hwc_tiler_slot tiler;  /* buffers the composition on screen has mapped */
+    void *pixels;                       /* what locked buffers read */
+    size_t pixels_size;
+};
+
+/* well-known modes: refresh, xres, yres, pixel clock in kHz, aspect flag */
+static const struct {
+    __u32 refresh, xres, yres, pclk, flag;
+} known_modes[] = {
+    { 60, 640, 480, 25175, FB_FLAG_RATIO_4_3 },
+    { 60, 720, 480, 27000, FB_FLAG_RATIO_16_9 },
+    { 50, 720, 576, 27000, FB_FLAG_RATIO_16_9 },
+    { 60, 800, 600, 40000, 0 },
+    { 60, 1024, 768, 65000, 0 },
+    { 50, 1280, 720, 74250, FB_FLAG_RATIO_16_9 },
+    { 60, 1280, 720, 74250, FB_FLAG_RATIO_16_9 },
+    { 24, 1920, 1080, 74250, FB_FLAG_RATIO_16_9 },
+    { 30, 1920, 1080, 74250, FB_FLAG_RATIO_16_9 },
+    { 50, 1920, 1080, 148500, FB_FLAG_RATIO_16_9 },
+    { 60, 1920, 1080, 148500, FB_FLAG_RATIO_16_9 },
+};
+
+static int64_t sim_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* pixel clock estimate for unknown modes: ~20% horizontal and ~5% vertical blanking */
+static __u32 sim_pclk(__u32 xres, __u32 yres, __u32 refresh)
+{
+    return (__u32) ((__u64) xres * 6 / 5 * (yres * 21 / 20) * refresh / 1000);
+}
+
+static void sim_parse_modedb(struct sim_backend *sb, const char *s)
+{
+    __u32 xres, yres, refresh, i;
+
+    while (sb->num_modes < SIM_MAX_MODES &&
+           sscanf(s, "%ux%u@%u", &xres, &yres, &refresh) == 3 && refresh) {
+        struct dsscomp_videomode *m = sb->modedb + sb->num_modes++;
+        __u32 pclk = sim_pclk(xres, yres, refresh);
+
+        memset(m, 0, sizeof(*m));
+        m->xres = xres;
+        m->yres = yres;
+        m->refresh = refresh;
+        for (i = 0; i < sizeof(known_modes) / sizeof(*known_modes); i++) {
+            if (known_modes[i].xres == xres && known_modes[i].yres == yres &&
+                known_modes[i].refresh == refresh) {
+                pclk = known_modes[i].pclk;
+                m->flag = known_modes[i].flag;
+                break;
+            }
+        }
+        /* modedb pixclock is in ps */
+        m->pixclock = 1000000000 / pclk;
+
+        s = strchr(s, ',');
+        if (!s)
+            break;
+        s++;
+    }
+}
+
+static int sim_query_display(struct omap3_hwc_backend *be, struct dsscomp_display_info *dis)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+    __u32 i;
+
+    if (dis->ix == 0) {
+        dis->channel = OMAP_DSS_CHANNEL_LCD;
+        dis->timings.x_res = sb->cfg.xres;
+        dis->timings.y_res = sb->cfg.yres;
+        dis->timings.pixel_clock = sb->cfg.pixel_clock;
+        dis->width_in_mm = sb->cfg.width_in_mm;
+        dis->height_in_mm = sb->cfg.height_in_mm;
+        dis->enabled = 1;
+        dis->modedb_len = 0;
+        return 0;
+    }
+
+    if (dis->ix != 1 || !sb->num_modes)
+        return -ENODEV;
+
+    struct dsscomp_videomode *m = sb->modedb + sb->ext_mode;
+    dis->channel = OMAP_DSS_CHANNEL_DIGIT;
+    dis->timings.x_res = m->xres;
+    dis->timings.y_res = m->yres;
+    dis->timings.pixel_clock = 1000000000 / m->pixclock;
+    dis->width_in_mm = dis->height_in_mm = 0;
+    dis->enabled = 1;
+    for (i = 0; i < dis->modedb_len && i < sb->num_modes; i++)
+        dis->modedb[i] = sb->modedb[i];
+    dis->modedb_len = i;
+    return 0;
+}
+
+static int sim_setup_display(struct omap3_hwc_backend *be, struct dsscomp_setup_display_data *sdis)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+    __u32 i;
+
+    if (sdis->ix != 1)
+        return -EINVAL;
+
+    for (i = 0; i < sb->num_modes; i++) {
+        if (sb->modedb[i].xres == sdis->mode.xres &&
+            sb->modedb[i].yres == sdis->mode.yres &&
+            sb->modedb[i].refresh == sdis->mode.refresh) {
+            if (sb->cfg.mode_us)
+                usleep(sb->cfg.mode_us);
+            sb->ext_mode = i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+static int sim_setup_dispc(struct omap3_hwc_backend *be, struct dsscomp_setup_dispc_data *d)
+{
+    return d->num_ovls > sizeof(d->ovls) / sizeof(*d->ovls) ? -EINVAL : 0;
+}
+
+/*
+ * maps the buffers of the overlays into the TILER 1D slot like dsscomp,
+ * which fails the whole composition if one does not fit; NV12 buffers are
+ * in 2D TILER containers already
+ */
+static int sim_map_buffers(struct sim_backend *sb, buffer_handle_t *buffers, int num_buffers,
+                           struct dsscomp_setup_dispc_data *d)
+{
+    struct omap3_hwc_tiler_map maps[TILER_SLOT_MAX_MAPS];
+    int i, n = 0;
+
+    for (i = 0; i < (int) d->num_ovls && n < TILER_SLOT_MAX_MAPS; i++) {
+        struct dss2_ovl_info *o = d->ovls + i;
+        IMG_native_handle_t *h;
+
+        if (o->addressing != OMAP_DSS_BUFADDR_LAYER_IX || (int) o->ba >= num_buffers ||
+            !buffers[o->ba] || o->cfg.color_mode == OMAP_DSS_COLOR_NV12)
+            continue;
+        h = (IMG_native_handle_t *) buffers[o->ba];
+        maps[n].handle = h;
+        maps[n].stamp = h->ui64Stamp;
+        maps[n].pages = tiler_slot_pages(o->cfg.stride * o->cfg.height);
+        n++;
+    }
+
+    if (tiler_slot_place(&sb->tiler, maps, n)) {
+        __u32 largest, free = tiler_slot_free(&sb->tiler, &largest);
+
+        ALOGE("could not map %d buffers into the TILER slot (%u pages free, %u in one range)",
+              n, free, largest);
+        return -ENOMEM;
+    }
+    tiler_slot_commit(&sb->tiler, maps, n);
+    return 0;
+}
+
+static int sim_post2(struct omap3_hwc_backend *be, buffer_handle_t *buffers, int num_buffers,
+                     void *data, int data_length)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+    struct dsscomp_setup_dispc_data *d = data;
+    int err;
+
+    if (data_length != sizeof(*d) || num_buffers > d->num_ovls)
+        return -EINVAL;
+
+    if (sb->cfg.post_us)
+        usleep(sb->cfg.post_us);
+    err = sim_setup_dispc(be, d);
+    return err ? err : sim_map_buffers(sb, buffers, num_buffers, d);
+}
+
+static int sim_fb_post2(framebuffer_device_t *fb, buffer_handle_t *buffers, int num_buffers,
+                        void *data, int data_length)
+{
+    struct sim_backend *sb = (struct sim_backend *)
+        ((char *) fb - offsetof(struct sim_backend, fb_dev));
+
+    return sim_post2(&sb->base, buffers, num_buffers, data, data_length);
+}
+
+static int sim_wait_vsync(struct omap3_hwc_backend *be)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+    int64_t now = sim_now();
+    int64_t next = now + sb->vsync_period - (now - sb->vsync_epoch) % sb->vsync_period;
+    struct timespec ts = {
+        .tv_sec = next / 1000000000,
+        .tv_nsec = next % 1000000000,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    return 0;
+}
+
+static int sim_enable_vsync(struct omap3_hwc_backend *be, int enabled)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+
+    sb->vsync_enabled = enabled;
+    return 0;
+}
+
+static int sim_blank(struct omap3_hwc_backend *be, int blank)
+{
+    return 0;
+}
+
+static int sim_route_output(struct omap3_hwc_backend *be, int output)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+
+    sb->output = output;
+    return 0;
+}
+
+static int sim_get_vsync_fd(struct omap3_hwc_backend *be, short *events)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+
+    if (sb->vsync_fd < 0) {
+        struct itimerspec its = {
+            .it_interval = { .tv_nsec = sb->vsync_period },
+            .it_value = {
+                .tv_sec = (sb->vsync_epoch + sb->vsync_period) / 1000000000,
+                .tv_nsec = (sb->vsync_epoch + sb->vsync_period) % 1000000000,
+            },
+        };
+
+        sb->vsync_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (sb->vsync_fd < 0)
+            return -1;
+        timerfd_settime(sb->vsync_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+
+    *events = POLLIN;
+    return sb->vsync_fd;
+}
+
+static int sim_read_vsync(struct omap3_hwc_backend *be, int64_t *timestamp)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+    __u64 expirations;
+    int64_t now, jitter = 0;
+
+    if (read(sb->vsync_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        return -errno;
+    if (!sb->vsync_enabled)
+        return -EAGAIN;
+
+    now = sim_now();
+    if (sb->cfg.vsync_jitter_us)
+        jitter = (int64_t) (rand_r(&sb->seed) % (2 * sb->cfg.vsync_jitter_us + 1)) -
+                 sb->cfg.vsync_jitter_us;
+    *timestamp = now - (now - sb->vsync_epoch) % sb->vsync_period + jitter * 1000;
+    return 0;
+}
+
+static int sim_alloc_buffer(struct omap3_hwc_backend *be, int width, int height, int format,
+                            buffer_handle_t *handle)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+    IMG_native_handle_t *h;
+    int i;
+
+    h = calloc(1, sizeof(*h));
+    if (!h)
+        return -ENOMEM;
+
+    h->base.version = sizeof(native_handle_t);
+    h->base.numFds = IMG_NATIVE_HANDLE_NUMFDS;
+    h->base.numInts = IMG_NATIVE_HANDLE_NUMINTS;
+    for (i = 0; i < MAX_SUB_ALLOCS; i++)
+        h->fd[i] = -1;
+    /* keep clear of the stamps of replayed buffers */
+    h->ui64Stamp = (1ULL << 63) | ++sb->last_stamp;
+    h->usage = GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_COMPOSER;
+    h->iWidth = width;
+    h->iHeight = height;
+    h->iFormat = format;
+    h->uiBpp = format == HAL_PIXEL_FORMAT_RGB_565 ? 16 : 32;
+
+    *handle = (buffer_handle_t) h;
+    return 0;
+}
+
+static void sim_free_buffer(struct omap3_hwc_backend *be, buffer_handle_t handle)
+{
+    free((void *) handle);
+}
+
+static int sim_blit(struct omap3_hwc_backend *be, buffer_handle_t src, buffer_handle_t dest,
+                    int w, int h, int x, int y)
+{
+    IMG_native_handle_t *s = (IMG_native_handle_t *) src;
+    IMG_native_handle_t *d = (IMG_native_handle_t *) dest;
+
+    if (!s || !d || x < 0 || y < 0 || w > s->iWidth || h > s->iHeight ||
+        x + w > d->iWidth || y + h > d->iHeight)
+        return -EINVAL;
+    return 0;
+}
+
+/* there are no pixels: every buffer reads as zeros */
+static int sim_lock_buffer(struct omap3_hwc_backend *be, buffer_handle_t handle, void **vaddr)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+    IMG_native_handle_t *h = (IMG_native_handle_t *) handle;
+    /* enough for any format at HW_ALIGN aligned rows */
+    size_t size = (size_t) (h->iWidth + HW_ALIGN - 1) / HW_ALIGN * HW_ALIGN * h->iHeight * 4;
+
+    if (size > sb->pixels_size) {
+        free(sb->pixels);
+        sb->pixels = calloc(1, size);
+        sb->pixels_size = sb->pixels ? size : 0;
+    }
+    *vaddr = sb->pixels;
+    return sb->pixels ? 0 : -ENOMEM;
+}
+
+static void sim_unlock_buffer(struct omap3_hwc_backend *be, buffer_handle_t handle)
+{
+}
+
+static void sim_close(struct omap3_hwc_backend *be)
+{
+    struct sim_backend *sb = (struct sim_backend *) be;
+
+    if (sb->vsync_fd >= 0)
+        close(sb->vsync_fd);
+    free(sb->pixels);
+    free(sb);
+}
+
+static const struct omap3_hwc_backend_ops sim_ops = {
+    .query_display = sim_query_display,
+    .setup_display = sim_setup_display,
+    .setup_dispc = sim_setup_dispc,
+    .post2 = sim_post2,
+    .wait_vsync = sim_wait_vsync,
+    .enable_vsync = sim_enable_vsync,
+    .blank = sim_blank,
+    .route_output = sim_route_output,
+    .get_vsync_fd = sim_get_vsync_fd,
+    .read_vsync = sim_read_vsync,
+    .alloc_buffer = sim_alloc_buffer,
+    .free_buffer = sim_free_buffer,
+    .blit = sim_blit,
+    .lock_buffer = sim_lock_buffer,
+    .unlock_buffer = sim_unlock_buffer,
+    .close = sim_close,
+};
+
+static const struct omap3_hwc_sim_config *default_config;
+
+void omap3_hwc_set_sim_config(const struct omap3_hwc_sim_config *cfg)
+{
+    default_config = cfg;
+}
+
+static void sim_get_config(struct omap3_hwc_sim_config *cfg)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("debug.hwc.sim.lcd", value, "480x800@60");
+    if (sscanf(value, "%ux%u@%u", &cfg->xres, &cfg->yres, &cfg->refresh) != 3) {
+        cfg->xres = 480;
+        cfg->yres = 800;
+        cfg->refresh = 60;
+    }
+    property_get("debug.hwc.sim.pclk", value, "0");
+    cfg->pixel_clock = atoi(value);
+    property_get("debug.hwc.sim.jitter_us", value, "0");
+    cfg->vsync_jitter_us = atoi(value);
+    property_get("debug.hwc.sim.post_us", value, "0");
+    cfg->post_us = atoi(value);
+    property_get("debug.hwc.sim.mode_us", value, "0");
+    cfg->mode_us = atoi(value);
+    property_get("debug.hwc.sim.tiler_kb", value, "0");
+    cfg->tiler_size = atoi(value) << 10;
+    property_get("debug.hwc.sim.modedb", cfg->modedb, "1920x1080@60,1280x720@60,720x480@60,640x480@60");
+    cfg->width_in_mm = 53;
+    cfg->height_in_mm = 88;
+    cfg->format = HAL_PIXEL_FORMAT_BGRA_8888;
+}
+
+int omap3_hwc_open_sim_backend(const struct omap3_hwc_sim_config *cfg,
+                               struct omap3_hwc_backend **be)
+{
+    struct sim_backend *sb;
+
+    sb = calloc(1, sizeof(*sb));
+    if (!sb)
+        return -ENOMEM;
+
+    if (!cfg)
+        cfg = default_config;
+    if (cfg)
+        sb->cfg = *cfg;
+    else
+        sim_get_config(&sb->cfg);
+    if (!sb->cfg.refresh)
+        sb->cfg.refresh = 60;
+    if (!sb->cfg.pixel_clock)
+        sb->cfg.pixel_clock = sim_pclk(sb->cfg.xres, sb->cfg.yres, sb->cfg.refresh);
+    sim_parse_modedb(sb, sb->cfg.modedb);
+    tiler_slot_init(&sb->tiler, sb->cfg.tiler_size ? sb->cfg.tiler_size : SIM_TILER_SLOT);
+
+    /* framebuffer_device_t fields are const, so fill in a template */
+    IMG_framebuffer_device_public_t fb_dev = {
+        .base = {
+            .width = sb->cfg.xres,
+            .height = sb->cfg.yres,
+            .stride = sb->cfg.xres,
+            .format = sb->cfg.format,
+            .fps = sb->cfg.refresh,
+        },
+        .bBypassPost = 1,
+        .Post2 = sim_fb_post2,
+    };
+    memcpy(&sb->fb_dev, &fb_dev, sizeof(fb_dev));
+
+    sb->base.ops = &sim_ops;
+    sb->base.fb_dev = &sb->fb_dev;
+    sb->base.name = "sim";
+    sb->vsync_period = 1000000000 / sb->cfg.refresh;
+    sb->vsync_epoch = sim_now();
+    sb->vsync_fd = -1;
+    sb->seed = (unsigned int) sb->vsync_epoch;
+
+    ALOGI("simulated display %ux%u@%u (pclk %ukHz), %u external modes",
+          sb->cfg.xres, sb->cfg.yres, sb->cfg.refresh, sb->cfg.pixel_clock, sb->num_modes);
+
+    *be = &sb->base;
+    return 0;
+}
@@ -18,12 +18,16 @@
 #include <malloc.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <fcntl.h>
 #include <poll.h>
-#include <sys/ioctl.h>
 #include <linux/fb.h>
 #include <linux/omapfb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
 
 #include <cutils/properties.h>
 #include <cutils/log.h>
@@ -34,7 +38,9 @@
 #include <EGL/egl.h>
 #include <hardware_legacy/uevent.h>
 
-#define ASPECT_RATIO_TOLERANCE 0.02f
+/* aspect ratios within 2% are the same */
+#define ASPECT_RATIO_TOLERANCE_NUM 1
+#define ASPECT_RATIO_TOLERANCE_DEN 50
 
 #define min(a, b) ( { typeof(a) __a = (a), __b = (b); __a < __b ? __a : __b; } )
 #define max(a, b) ( { typeof(a) __a = (a), __b = (b); __a > __b ? __a : __b; } )
@@ -46,6 +52,17 @@
 #include <video/dsscomp.h>
 
 #include "hal_public.h"
+#include "backend.h"
+#include "hwc_trace.h"
+#include "sw_vsync.h"
+#include "ion_pool.h"
+#include "tiler_slot.h"
+#include "yuv_conv.h"
+
+/* "kernel" or "sim", overridden by debug.hwc.backend */
+#ifndef HWC_DEFAULT_BACKEND
+#define HWC_DEFAULT_BACKEND "kernel"
+#endif
 
 #define MAX_HW_OVERLAYS 3
 #define NUM_NONSCALING_OVERLAYS 1
@@ -53,6 +70,7 @@
 #define HAL_PIXEL_FORMAT_TI_NV12 0x100
 #define HAL_PIXEL_FORMAT_TI_NV12_PADDED 0x101
 #define MAX_TILER_SLOT (16 << 20)
+#define COLORKEY 0x000000               /* framebuffer colour the video shows through */
 
 #define HAL_PIXEL_FORMAT_YUV_422                    27
 #define HAL_PIXEL_FORMAT_YUV_420                    19
@@ -70,6 +88,37 @@ struct ext_transform_t {
     __u8 docking  : 1;          /* docking vs. mirroring - used for state */
 };
 
+/*
+ * Pixel aspect ratio num:den, in lowest terms.  Terms stay below
+ * 2^RATIO_BITS, so products of a ratio with two screen sizes fit in 64 bits.
+ */
+#define RATIO_BITS 22
+
+struct ratio {
+    __u32 num;
+    __u32 den;
+};
+
+/*
+ * External display transform.  Mirroring and docking only rotate by quarter
+ * turns, flip and scale by a ratio of sizes, so the matrix is exact in
+ * integers scaled by the original size of each row:
+ *
+ *   x' = (m[0][0] * x + m[0][1] * y + m[0][2]) / from[0]
+ *
+ * and only the result is rounded.  The division is a multiplication by
+ * inv >> shift, which is exact for numerators below 2^EXT_NUM_BITS; OMAP3
+ * has no divide instruction.
+ */
+#define EXT_NUM_BITS 26
+
+struct ext_affine {
+    int m[2][3];
+    int from[2];                        /* > 0 */
+    __u32 inv[2];                       /* ceil(2^shift / from) */
+    int shift[2];
+};
+
 /* cloning support and state */
 struct omap3_hwc_ext {
     /* support */
@@ -87,16 +136,305 @@ struct omap3_hwc_ext {
     __u32 last_yres_used;
     __u32 last_mode;                    /* 2-s complement of last HDMI mode set, 0 if none */
     __u32 mirror_mode;                  /* 2-s complement of mode used when mirroring */
-    float last_xpy;
+    struct ratio last_xpy;
     __u16 width;                        /* external screen dimensions */
     __u16 height;
     __u32 xres;                         /* external screen resolution */
     __u32 yres;
-    float m[2][3];                      /* external transformation matrix */
+    struct ext_affine m;                /* external transformation */
     hwc_rect_t mirror_region;           /* region of screen to mirror */
+    struct omap_video_timings timings;  /* timings of the HDMI mode set */
 };
 typedef struct omap3_hwc_ext omap3_hwc_ext_t;
 
+#define MAX_CACHED_LAYERS 32
+
+#define MAX_HDMI_MODES 16
+#define HDMI_MODE_CHOICES 8
+
+/* best external display mode for one video size */
+struct omap3_hwc_mode_choice {
+    __u32 xres;
+    __u32 yres;
+    struct ratio xpy;                   /* pixel ratio */
+    __u32 pref;                         /* 2-s complement of the preferred mode, 0 if none */
+    __u32 best;                         /* 2-s complement of the best mode, 0 if none */
+    __u16 width;                        /* external screen dimensions in that mode */
+    __u16 height;
+    __u32 used;                         /* LRU clock, 0 if the entry is empty */
+};
+
+/*
+ * External display modes, captured once per hotplug, and the mode choices
+ * made for them.  Docking re-selects the mode whenever the video size or
+ * pixel ratio changes, so that is a lookup here.
+ */
+struct omap3_hwc_modedb {
+    int valid;
+    struct {
+        struct dsscomp_display_info dis;
+        struct dsscomp_videomode modedb[MAX_HDMI_MODES];
+    } d;
+    struct omap3_hwc_mode_choice choice[HDMI_MODE_CHOICES];
+    __u32 clock;
+
+    /* statistics */
+    __u32 queries;
+    __u32 hits;
+    __u32 misses;
+};
+
+/* layer attributes that the composition plan depends on */
+struct omap3_hwc_layer_key {
+    int format;                         /* 0 if no buffer */
+    int width;
+    int height;
+    int usage;                          /* only bits that affect the plan */
+    __u32 flags;
+    __u32 transform;
+    __s32 blending;
+    hwc_rect_t sourceCrop;
+    hwc_rect_t displayFrame;
+};
+
+/* what a new plan needs to know about a layer, gathered once per frame */
+struct omap3_hwc_layer_info {
+    const struct omap3_hwc_format *fmt; /* NULL if no buffer or not scanned out by DSS */
+    int reason;                         /* SGX_REASON_* from omap3_hwc_check_layer */
+    int scaled;                         /* needs a scaling overlay */
+    int is_protected;
+    int dockable;
+    __u32 mem;                          /* 1D TILER footprint */
+    struct omap3_hwc_tiler_map map;     /* 1D TILER mapping it needs */
+    __u32 area;                         /* display area */
+    __u64 bw;                           /* DSS fetch bandwidth */
+};
+
+/* last composition plan, reused while the layer geometry is unchanged */
+struct omap3_hwc_plan {
+    int valid;
+    __u32 num_layers;
+    __u32 state;                        /* device state the plan was built for */
+    struct omap3_hwc_layer_key key[MAX_CACHED_LAYERS];
+    __s32 composition[MAX_CACHED_LAYERS];
+    __u32 hints[MAX_CACHED_LAYERS];
+    int layer_ix[MAX_HW_OVERLAYS];      /* layer posted in each buffer slot, -1 for fb */
+    __u32 generation;                   /* bumped for every new plan */
+
+    /* statistics */
+    __u32 hits;
+    __u32 misses;
+};
+
+/* buffers of the last frame that reached the screen */
+struct omap3_hwc_posted {
+    int valid;
+    __u32 generation;                   /* plan the frame was composed with */
+    __u32 num_layers;
+    buffer_handle_t handle[MAX_CACHED_LAYERS];
+    __u64 stamp[MAX_CACHED_LAYERS];
+
+    /* statistics */
+    __u32 skipped_sgx;                  /* unchanged frames: swap and post avoided */
+    __u32 skipped_ovl;                  /* unchanged frames: post avoided */
+};
+
+#define MAX_FLAT_LAYERS 8
+#define FLAT_LAYER_IX (-2)              /* plan.layer_ix of the flattened buffer */
+
+/*
+ * Flattening cache: the bottom-most UI layers (e.g. the wallpaper) that kept
+ * their buffer for a number of frames are copied once into a buffer of our
+ * own with the gralloc Blit2 hook.  That buffer is scanned out on a VID pipe
+ * below the framebuffer, so SGX no longer redraws those layers every frame.
+ */
+struct omap3_hwc_flat {
+    __u32 frames;                       /* unchanged frames before flattening, 0 if off */
+    __u32 max_mem;                      /* for both buffers, bytes */
+
+    /* frames each layer has shown the same buffer for */
+    __u32 num_layers;
+    buffer_handle_t handle[MAX_CACHED_LAYERS];
+    __u64 stamp[MAX_CACHED_LAYERS];
+    __u32 age[MAX_CACHED_LAYERS];
+
+    /*
+     * A rebuild always goes to the buffer that is not on screen.  At most one
+     * frame is in flight, so that one is free again.
+     */
+    buffer_handle_t buffer[2];
+    int cur;                            /* buffer holding the flattened layers */
+    int valid;                          /* buffer[cur] still shows contents at region */
+    __u32 contents;                     /* layers copied into buffer[cur] */
+    __u32 mask;                         /* layers flattened in the current plan */
+    hwc_rect_t region;                  /* screen area of the buffer */
+    __u32 area;                         /* SGX fill avoided per frame, pixels */
+    int idle_posts;                     /* posts without flattening since last used */
+
+    /* statistics */
+    __u32 builds;
+    __u32 invalidations;
+    __u32 frames_used;
+    __u64 area_saved;
+};
+
+/*
+ * Planar 4:2:0 frames from the software decoders cannot be scanned out.  The
+ * planar layer on an overlay is converted to NV12 in two buffers from the ion
+ * pool, one per plane, once per new buffer.  Only the crop of the buffer, out
+ * to whole chroma samples, is converted.  The pool keeps released buffers
+ * until they are off the screen.
+ *
+ * The copy is a 1D buffer, which the DSS cannot rotate, so a transformed
+ * layer is pre-rotated while it is converted.  That only happens while the
+ * CPU time it takes, at the speed measured so far, is below the time SGX
+ * would spend composing the layer.
+ */
+#define PREROTATE_PS_PER_PIXEL  4000    /* until measured */
+
+struct omap3_hwc_conv {
+    int enabled;                        /* debug.hwc.convert */
+    int prerotate;                      /* debug.hwc.prerotate */
+    __u32 sgx_mpps;                     /* SGX composition fill rate, Mpixels/s */
+    int ix;                             /* layer converted in the current plan, -1 if none */
+
+    /* source of the NV12 copy */
+    buffer_handle_t handle;
+    __u64 stamp;
+    __u32 transform;
+    hwc_rect_t rect;                    /* of the buffer that was converted */
+    struct omap3_hwc_ion_buf *y;        /* NULL if there is no copy */
+    struct omap3_hwc_ion_buf *uv;
+
+    /* statistics */
+    __u32 conversions;
+    __u32 reuses;
+    __u32 failures;
+    __u64 time_ns;                      /* spent converting */
+    __u32 rotations;
+    __u64 rot_pixels;
+    __u64 rot_time_ns;
+};
+
+/*
+ * A lone video layer on the DSS changes orientation at once, while the rest
+ * of a rotation is animated by SurfaceFlinger.  We watch the video layer and
+ * compose it with SGX from a geometry change until it has been still for a
+ * few frames.
+ */
+struct omap3_hwc_transition {
+    __u32 frames;                       /* still frames before going back to the DSS */
+
+    int valid;                          /* a video layer was seen in the last frame */
+    __u32 transform;
+    hwc_rect_t sourceCrop;
+    hwc_rect_t displayFrame;
+    __u32 still;                        /* frames the video layer has not moved for */
+    int active;                         /* composing the video with SGX */
+
+    /* statistics */
+    __u32 transitions;
+};
+
+/* why a frame or layer was composed by SGX */
+enum {
+    SGX_REASON_NONE,            /* rendered by DSS */
+    SGX_REASON_IDLE,            /* screen idle: SGX composes it into the framebuffer */
+    SGX_REASON_UI,              /* OMAP3 overlays are only used for video */
+    SGX_REASON_ZORDER,          /* OMAP3 has no z-order: video with more than one UI layer */
+    SGX_REASON_TRANSITION,      /* a lone video layer during a rotation or animation */
+    SGX_REASON_SKIP,            /* skip layer or no buffer */
+    SGX_REASON_FORMAT,          /* pixel format not supported by DSS */
+    SGX_REASON_TRANSFORM,       /* transform not possible on a 1D buffer or for cloning */
+    SGX_REASON_TILER,           /* does not fit into the TILER slot */
+    SGX_REASON_CONVERT,         /* planar layer could not be converted to NV12 */
+    SGX_REASON_SCALING,         /* scaling limits */
+    SGX_REASON_BANDWIDTH,       /* DSS bandwidth budget */
+    SGX_REASON_OVERLAYS,        /* not enough (scaling) overlays */
+    SGX_REASON_RGB_ORDER,       /* rgb_order flag */
+    SGX_REASON_NV12_ONLY,       /* nv12_only flag */
+    SGX_REASON_TV,              /* TV cannot display BGR */
+    SGX_REASON_COUNT
+};
+
+static const char *sgx_reason_names[SGX_REASON_COUNT] = {
+    [SGX_REASON_NONE] = "dss",
+    [SGX_REASON_IDLE] = "idle",
+    [SGX_REASON_UI] = "ui",
+    [SGX_REASON_ZORDER] = "zorder",
+    [SGX_REASON_TRANSITION] = "transition",
+    [SGX_REASON_SKIP] = "skip",
+    [SGX_REASON_FORMAT] = "format",
+    [SGX_REASON_TRANSFORM] = "transform",
+    [SGX_REASON_TILER] = "tiler",
+    [SGX_REASON_CONVERT] = "convert",
+    [SGX_REASON_SCALING] = "scaling",
+    [SGX_REASON_BANDWIDTH] = "bandwidth",
+    [SGX_REASON_OVERLAYS] = "overlays",
+    [SGX_REASON_RGB_ORDER] = "rgb_order",
+    [SGX_REASON_NV12_ONLY] = "nv12_only",
+    [SGX_REASON_TV] = "tv",
+};
+
+struct omap3_hwc_sgx_stats {
+    __u32 frames[SGX_REASON_COUNT];     /* frames composed by SGX, by reason */
+    __u32 layers[SGX_REASON_COUNT];     /* layers composed by SGX, by reason */
+    __u32 colorkey_frames;              /* frames with the video under a colour key */
+
+    /* last composition */
+    int frame_reason;
+    unsigned int num_layers;
+    __u8 layer_reason[MAX_CACHED_LAYERS];
+};
+
+#define TELEMETRY_FRAMES 64         /* power of 2 */
+#define TELEMETRY_DUMP_FRAMES 16
+#define TELEMETRY_BUCKETS 10         /* 250us << n */
+
+/* per-frame record of what set did and how long it took */
+struct omap3_hwc_frame_rec {
+    __u32 seq;                          /* odd while being written */
+    __u32 sync_id;
+    __u8 use_sgx;
+    __u8 num_ovls;                      /* overlays posted, including the fb */
+    __u8 num_layers;
+    __u8 pad;
+    __u16 color_mode[MAX_HW_OVERLAYS];  /* dss color mode per overlay */
+    __u32 swap_us;                      /* eglSwapBuffers */
+    __u32 post_us;                      /* Post2 */
+    __u32 vsync_us;                     /* waiting for the previous frame's vsync */
+};
+
+/*
+ * Ring of the last TELEMETRY_FRAMES frames.  set is the only writer; dump
+ * reads it without taking the composer lock and drops records that were
+ * being rewritten while it copied them.
+ */
+struct omap3_hwc_telemetry {
+    struct omap3_hwc_frame_rec ring[TELEMETRY_FRAMES];
+    __u32 head;                         /* frames recorded */
+
+    /* latency histograms */
+    __u32 swap_hist[TELEMETRY_BUCKETS];
+    __u32 post_hist[TELEMETRY_BUCKETS];
+    __u32 vsync_hist[TELEMETRY_BUCKETS];
+};
+
+/* external display configuration published by the event thread */
+struct omap3_hwc_ext_request {
+    int hdmi_enabled;
+    int tv_enabled;
+};
+
+struct omap3_hwc_lock_stats {
+    __u32 count;
+    __u64 wait_ns;
+    __u64 hold_ns;
+    __u64 max_wait_ns;
+    __u64 max_hold_ns;
+    __u64 locked_at;
+};
+
 /* used by property settings */
 enum {
     EXT_ROTATION    = 3,        /* rotation while mirroring */
@@ -113,13 +451,16 @@ typedef struct omap3_hwc_module omap3_hwc_module_t;
 struct omap3_hwc_device {
     hwc_composer_device_1_t base;
     hwc_procs_t *procs;
-    pthread_t hdmi_thread;
-    pthread_t vsync_thread;
+    pthread_t event_thread;
     pthread_mutex_t lock;
-    int dsscomp_fd;
-    int fb_fd;
+    int threads;                   /* THREAD_* running */
+    int quit;                      /* the threads are to return (atomic) */
+    struct omap3_hwc_backend *backend;
     int hdmi_fb_fd;
-    int pipe_fds[2];
+    int epoll_fd;
+    int idle_fd;                   /* timerfd for the idle timeout */
+    int post_fd;                   /* eventfd: set posted after the idle timer stopped */
+    int vsync_timer_fd;            /* timerfd for predicted vsyncs */
 
     IMG_framebuffer_device_public_t *fb_dev;
     struct dsscomp_setup_dispc_data dsscomp_data;
@@ -138,13 +479,91 @@ struct omap3_hwc_device {
 
     int flags_rgb_order;
     int flags_nv12_only;
+    int flags_colorkey;
+    int colorkey;                  /* video under a colour-keyed framebuffer */
     int idle;
+    int idle_armed;                /* idle timer is running (atomic) */
+    int idle_req;                  /* idle timer asks for SGX composition (atomic) */
+    int idle_frames;               /* posts left that SGX composes after the idle timeout (atomic) */
+    __u64 last_post;               /* CLOCK_MONOTONIC of the last post, ns (atomic) */
     int ovls_blending;
 
+    __u64 dss_bw_limit;            /* DSS DMA budget, bytes/s */
+    __u64 dss_bw;                  /* predicted DMA rate of the last composition */
+
+    int csc;                       /* YUV colour standard, 601 or 709; 0 picks it by size */
+    int csc_full;                  /* YUV layers use the full 0-255 range */
+
     int force_sgx;
+
+    /*
+     * Double-buffered external display request: the event thread fills
+     * ext_req[(gen + 1) & 1] and then bumps ext_req_gen; prepare applies the
+     * request of the generation it finds.
+     */
+    struct omap3_hwc_ext_request ext_req[2];
+    __u32 ext_req_gen;
+    __u32 ext_req_applied;
+
+    /*
+     * lock serializes prepare and set; the event thread and the present
+     * worker never take it
+     */
+    struct omap3_hwc_lock_stats lock_stats;
+
+    struct omap3_hwc_plan plan;    /* cached composition plan */
+    struct omap3_hwc_layer_info layers[MAX_CACHED_LAYERS];   /* of the frame being planned */
+    struct omap3_hwc_posted posted;
+    int skip_frame;                /* prepare found nothing changed since the last post */
+    struct omap3_hwc_flat flat;
+    struct omap3_hwc_conv conv;
+    struct omap3_hwc_transition transition;
+    struct omap3_hwc_modedb modedb;
+    struct omap3_hwc_ion_pool ion_pool;   /* memory owned by the composer */
+    struct omap3_hwc_tiler_slot tiler;    /* TILER 1D mappings of the composition on screen */
+
+    int trace_fd;                  /* capture file, -1 if not tracing */
+
+    struct omap3_hwc_telemetry telemetry;
+    struct omap3_hwc_sgx_stats sgx_stats;
+
+    /* vsync model; fed and reported by the event thread */
+    pthread_mutex_t vsync_lock;
+    struct omap3_hwc_sw_vsync vsync;
+    int vsync_enabled;
+    int64_t last_vsync;            /* last timestamp reported to SurfaceFlinger */
+
+    /* present worker: waits for all-overlay frames to reach the screen */
+    pthread_t present_thread;
+    pthread_mutex_t present_lock;
+    pthread_cond_t present_cond;
+    int present_pending;           /* a frame is waiting for its vsync */
+
+    /*
+     * mode worker: sets HDMI modes for prepare, which leaves the external
+     * display dark until the switch is done
+     */
+    pthread_t mode_thread;
+    pthread_mutex_t mode_lock;
+    pthread_cond_t mode_cond;
+    struct dsscomp_setup_display_data mode_req;
+    int mode_pending;              /* mode_req is waiting for the worker */
+    int mode_busy;                 /* the worker is setting a mode */
+    int mode_err;                  /* result of the last switch */
+    struct dsscomp_videomode mode_done;   /* mode of the last switch */
+    __u32 mode_gen;                /* switches completed */
+    __u32 mode_gen_applied;        /* switches prepare has seen */
+    __u32 mode_switches;
+    __u64 mode_switch_ns;          /* time spent in DSSCIOC_SETUP_DISPLAY */
 };
 typedef struct omap3_hwc_device omap3_hwc_device_t;
 
+enum {
+    THREAD_EVENT    = 1 << 0,
+    THREAD_PRESENT  = 1 << 1,
+    THREAD_MODE     = 1 << 2,
+};
+
 static int debug = 0;
 static int hdmi_enabled = 0;
 static int tv_enabled = 0;
@@ -201,23 +620,235 @@ static void dump_dsscomp(struct dsscomp_setup_dispc_data *d)
     }
 }
 
-static int omap3_hwc_is_valid_format(int format)
+static __u64 now_ns(void)
 {
-    switch(format) {
-    case HAL_PIXEL_FORMAT_RGB_565:
-    case HAL_PIXEL_FORMAT_RGBX_8888:
-    case HAL_PIXEL_FORMAT_RGBA_8888:
-    case HAL_PIXEL_FORMAT_BGRA_8888:
-    case HAL_PIXEL_FORMAT_BGRX_8888:
-    case HAL_PIXEL_FORMAT_TI_NV12:
-    case HAL_PIXEL_FORMAT_TI_NV12_PADDED:
-    case HAL_PIXEL_FORMAT_YUV_422:
-    case HAL_PIXEL_FORMAT_YUV_420:
-        return 1;
+    struct timespec ts;
 
-    default:
-        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void omap3_hwc_lock(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_lock_stats *ls = &hwc_dev->lock_stats;
+    __u64 start = now_ns(), wait;
+
+    pthread_mutex_lock(&hwc_dev->lock);
+    ls->locked_at = now_ns();
+    wait = ls->locked_at - start;
+    ls->count++;
+    ls->wait_ns += wait;
+    if (wait > ls->max_wait_ns)
+        ls->max_wait_ns = wait;
+}
+
+static void omap3_hwc_unlock(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_lock_stats *ls = &hwc_dev->lock_stats;
+    __u64 hold = now_ns() - ls->locked_at;
+
+    ls->hold_ns += hold;
+    if (hold > ls->max_hold_ns)
+        ls->max_hold_ns = hold;
+    pthread_mutex_unlock(&hwc_dev->lock);
+}
+
+static void telemetry_hist_add(__u32 *hist, __u32 us)
+{
+    int b = 0;
+
+    while (b < TELEMETRY_BUCKETS - 1 && us >= (250U << b))
+        b++;
+    hist[b]++;
+}
+
+static void omap3_hwc_telemetry_record(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list,
+                                       __u32 swap_us, __u32 post_us, __u32 vsync_us)
+{
+    struct omap3_hwc_telemetry *t = &hwc_dev->telemetry;
+    struct dsscomp_setup_dispc_data *dsscomp = &hwc_dev->dsscomp_data;
+    __u32 head = t->head;
+    struct omap3_hwc_frame_rec *r = &t->ring[head % TELEMETRY_FRAMES];
+    __u32 seq = r->seq + 1;
+    unsigned int i;
+
+    __atomic_store_n(&r->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r->sync_id = dsscomp->sync_id;
+    r->use_sgx = hwc_dev->use_sgx;
+    r->num_ovls = hwc_dev->post2_layers;
+    r->num_layers = list ? min(list->numHwLayers, 255U) : 0;
+    for (i = 0; i < MAX_HW_OVERLAYS; i++)
+        r->color_mode[i] = i < dsscomp->num_ovls && dsscomp->ovls[i].cfg.enabled ?
+                           dsscomp->ovls[i].cfg.color_mode : 0;
+    r->swap_us = swap_us;
+    r->post_us = post_us;
+    r->vsync_us = vsync_us;
+
+    __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+
+    if (hwc_dev->use_sgx)
+        telemetry_hist_add(t->swap_hist, swap_us);
+    telemetry_hist_add(t->post_hist, post_us);
+    if (vsync_us || !hwc_dev->use_sgx)
+        telemetry_hist_add(t->vsync_hist, vsync_us);
+}
+
+static void omap3_hwc_trace_open(omap3_hwc_device_t *hwc_dev, const char *path)
+{
+    struct hwc_trace_header h = {
+        .magic = HWC_TRACE_MAGIC,
+        .version = HWC_TRACE_VERSION,
+        .fb_width = hwc_dev->fb_dev->base.width,
+        .fb_height = hwc_dev->fb_dev->base.height,
+        .fb_format = hwc_dev->fb_dev->base.format,
+        .fb_fps = hwc_dev->fb_dev->base.fps,
+    };
+
+    hwc_dev->trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (hwc_dev->trace_fd < 0) {
+        ALOGE("failed to open trace %s (%d)", path, errno);
+        return;
     }
+    if (write(hwc_dev->trace_fd, &h, sizeof(h)) != sizeof(h)) {
+        ALOGE("failed to write trace header (%d)", errno);
+        close(hwc_dev->trace_fd);
+        hwc_dev->trace_fd = -1;
+    }
+}
+
+static void omap3_hwc_trace_contents(omap3_hwc_device_t *hwc_dev, __u32 type,
+                                     hwc_display_contents_1_t *list)
+{
+    struct hwc_trace_layer tl[16];
+    struct hwc_trace_frame tf = {
+        .type = type,
+        .num_layers = list ? list->numHwLayers : 0,
+        .list_flags = list ? list->flags : 0,
+        .frame_flags = list && list->dpy && list->sur ? HWC_TRACE_HAS_SURFACE : 0,
+        .timestamp = now_ns(),
+    };
+    unsigned int i, n = 0;
+
+    if (write(hwc_dev->trace_fd, &tf, sizeof(tf)) != sizeof(tf))
+        goto err;
+
+    for (i = 0; i < tf.num_layers; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+        struct hwc_trace_layer *t = tl + n++;
+
+        memset(t, 0, sizeof(*t));
+        t->composition = layer->compositionType;
+        t->hints = layer->hints;
+        t->flags = layer->flags;
+        t->transform = layer->transform;
+        t->blending = layer->blending;
+        t->crop[0] = layer->sourceCrop.left;
+        t->crop[1] = layer->sourceCrop.top;
+        t->crop[2] = layer->sourceCrop.right;
+        t->crop[3] = layer->sourceCrop.bottom;
+        t->frame[0] = layer->displayFrame.left;
+        t->frame[1] = layer->displayFrame.top;
+        t->frame[2] = layer->displayFrame.right;
+        t->frame[3] = layer->displayFrame.bottom;
+        if (handle) {
+            t->layer_flags = HWC_TRACE_HAS_HANDLE;
+            t->format = handle->iFormat;
+            t->width = handle->iWidth;
+            t->height = handle->iHeight;
+            t->usage = handle->usage;
+            t->stamp = handle->ui64Stamp;
+        }
+
+        if (n == sizeof(tl) / sizeof(*tl) || i + 1 == tf.num_layers) {
+            if (write(hwc_dev->trace_fd, tl, n * sizeof(*tl)) != (ssize_t) (n * sizeof(*tl)))
+                goto err;
+            n = 0;
+        }
+    }
+    return;
+
+err:
+    ALOGE("failed to write trace (%d), stopping capture", errno);
+    close(hwc_dev->trace_fd);
+    hwc_dev->trace_fd = -1;
+}
+
+/* pixel format classes, named like the DSS does: RGB is BGRA in memory */
+enum {
+    FMT_RGB,
+    FMT_BGR,
+    FMT_NV12,                           /* YUV: needs a scaling overlay */
+};
+
+/*
+ * YUV2RGB conversion, coefficients * 256.  The DSS subtracts 128 from the
+ * chroma and, unless full_range is set, 16 from the luma first.
+ */
+static const struct omap_dss_cconv_coefs ctbl_bt601_5 = {
+    298,  409,    0,  298, -208, -100,  298,    0,  517, 0,
+};
+static const struct omap_dss_cconv_coefs ctbl_bt601_5_full = {
+    256,  359,    0,  256, -183,  -88,  256,    0,  454, 1,
+};
+static const struct omap_dss_cconv_coefs ctbl_bt709 = {
+    298,  459,    0,  298, -136,  -55,  298,    0,  541, 0,
+};
+static const struct omap_dss_cconv_coefs ctbl_bt709_full = {
+    256,  403,    0,  256, -120,  -48,  256,    0,  475, 1,
+};
+
+/* video of more lines than 576i/p is HD and in BT.709 colours unless it says otherwise */
+#define CSC_SD_LINES    576
+
+/* what the composer needs to know about a pixel format */
+struct omap3_hwc_format {
+    int format;                         /* HAL_PIXEL_FORMAT_* */
+    int cls;                            /* FMT_* */
+    int bpp;                            /* bits per pixel of the first plane */
+    int mem1d_bpp;                      /* bytes per pixel in the 1D TILER slot, 0 for 2D buffers */
+    enum omap_color_mode color_mode;    /* blended */
+    enum omap_color_mode opaque_mode;   /* not blended */
+    const struct omap_dss_cconv_coefs *cconv;   /* NULL for RGB formats */
+    int planar;                         /* 4:2:0 planes, scanned out from an NV12 copy */
+};
+
+/* the formats the DSS can scan out, most frequent first */
+static const struct omap3_hwc_format formats[] = {
+    { HAL_PIXEL_FORMAT_BGRA_8888, FMT_RGB, 32, 4, OMAP_DSS_COLOR_ARGB32, OMAP_DSS_COLOR_RGB24U, NULL, 0 },
+    { HAL_PIXEL_FORMAT_RGBA_8888, FMT_BGR, 32, 4, OMAP_DSS_COLOR_ARGB32, OMAP_DSS_COLOR_RGB24U, NULL, 0 },
+    /* Should be XBGR32, but this isn't supported */
+    { HAL_PIXEL_FORMAT_RGBX_8888, FMT_BGR, 32, 4, OMAP_DSS_COLOR_RGB24U, OMAP_DSS_COLOR_RGB24U, NULL, 0 },
+    { HAL_PIXEL_FORMAT_BGRX_8888, FMT_RGB, 32, 4, OMAP_DSS_COLOR_RGB24U, OMAP_DSS_COLOR_RGB24U, NULL, 0 },
+    { HAL_PIXEL_FORMAT_RGB_565, FMT_RGB, 16, 2, OMAP_DSS_COLOR_RGB16, OMAP_DSS_COLOR_RGB16, NULL, 0 },
+    { HAL_PIXEL_FORMAT_TI_NV12, FMT_NV12, 8, 0, OMAP_DSS_COLOR_NV12, OMAP_DSS_COLOR_NV12, &ctbl_bt601_5, 0 },
+    { HAL_PIXEL_FORMAT_TI_NV12_PADDED, FMT_NV12, 8, 0, OMAP_DSS_COLOR_NV12, OMAP_DSS_COLOR_NV12, &ctbl_bt601_5, 0 },
+    /* packed YUV is not in a 2D container, so it is mapped like RGB */
+    { HAL_PIXEL_FORMAT_YUV_422, FMT_NV12, 16, 2, OMAP_DSS_COLOR_UYVY, OMAP_DSS_COLOR_UYVY, &ctbl_bt601_5, 0 },
+    /* the NV12 copy comes from the ion pool */
+    { HAL_PIXEL_FORMAT_YUV_420, FMT_NV12, 8, 0, OMAP_DSS_COLOR_NV12, OMAP_DSS_COLOR_NV12, &ctbl_bt601_5, 1 },
+    { HAL_PIXEL_FORMAT_YV12, FMT_NV12, 8, 0, OMAP_DSS_COLOR_NV12, OMAP_DSS_COLOR_NV12, &ctbl_bt601_5, 1 },
+};
+
+/* returns NULL if the DSS cannot scan out the format */
+static const struct omap3_hwc_format *omap3_hwc_get_format(int format)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+        if (formats[i].format == format)
+            return formats + i;
+    return NULL;
+}
+
+static inline int fmt_is(int format, int cls)
+{
+    const struct omap3_hwc_format *f = omap3_hwc_get_format(format);
+
+    return f && f->cls == cls;
 }
 
 static int scaled(hwc_layer_1_t *layer)
@@ -231,6 +862,23 @@ static int scaled(hwc_layer_1_t *layer)
     return WIDTH(layer->displayFrame) != w || HEIGHT(layer->displayFrame) != h;
 }
 
+static inline int rects_equal(hwc_rect_t *a, hwc_rect_t *b)
+{
+    return a->left == b->left && a->top == b->top &&
+           a->right == b->right && a->bottom == b->bottom;
+}
+
+static inline int rects_overlap(hwc_rect_t *a, hwc_rect_t *b)
+{
+    return a->left < b->right && b->left < a->right && a->top < b->bottom && b->top < a->bottom;
+}
+
+/* whether a covers all of b */
+static inline int rect_covers(hwc_rect_t *a, hwc_rect_t *b)
+{
+    return a->left <= b->left && a->top <= b->top && a->right >= b->right && a->bottom >= b->bottom;
+}
+
 static int is_protected(hwc_layer_1_t *layer)
 {
     IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
@@ -242,9 +890,9 @@ static int sync_id = 0;
 
 #define is_BLENDED(blending) ((blending) != HWC_BLENDING_NONE)
 
-#define is_RGB(format) ((format) == HAL_PIXEL_FORMAT_BGRA_8888 || (format) == HAL_PIXEL_FORMAT_RGB_565 || (format) == HAL_PIXEL_FORMAT_BGRX_8888)
-#define is_BGR(format) ((format) == HAL_PIXEL_FORMAT_RGBX_8888 || (format) == HAL_PIXEL_FORMAT_RGBA_8888)
-#define is_NV12(format) ((format) == HAL_PIXEL_FORMAT_TI_NV12 || (format) == HAL_PIXEL_FORMAT_TI_NV12_PADDED || (format) == HAL_PIXEL_FORMAT_YUV_422 || (format) == HAL_PIXEL_FORMAT_YUV_420)
+#define is_RGB(format) fmt_is(format, FMT_RGB)
+#define is_BGR(format) fmt_is(format, FMT_BGR)
+#define is_NV12(format) fmt_is(format, FMT_NV12)
 
 static int dockable(hwc_layer_1_t *layer)
 {
@@ -253,70 +901,44 @@ static int dockable(hwc_layer_1_t *layer)
     return (handle->usage & GRALLOC_USAGE_EXTERNAL_DISP);
 }
 
-static unsigned int mem1d(IMG_native_handle_t *handle)
+static __u32 mem1d(IMG_native_handle_t *handle, const struct omap3_hwc_format *f)
 {
-    if (handle == NULL)
-            return 0;
+    return ALIGN(handle->iWidth, HW_ALIGN) * f->mem1d_bpp * handle->iHeight;
+}
+
+/* the 1D TILER mapping a buffer needs to be scanned out */
+static void omap3_hwc_get_map(buffer_handle_t buffer, struct omap3_hwc_tiler_map *map)
+{
+    IMG_native_handle_t *handle = (IMG_native_handle_t *)buffer;
+    const struct omap3_hwc_format *f = handle ? omap3_hwc_get_format(handle->iFormat) : NULL;
 
-    int bpp = is_NV12(handle->iFormat) ? 0 : (handle->iFormat == HAL_PIXEL_FORMAT_RGB_565 ? 2 : 4);
-    int stride = ALIGN(handle->iWidth, HW_ALIGN) * bpp;
-    return stride * handle->iHeight;
+    memset(map, 0, sizeof(*map));
+    if (!f)
+        return;
+    map->handle = handle;
+    map->stamp = handle->ui64Stamp;
+    map->pages = tiler_slot_pages(mem1d(handle, f));
 }
 
 static void
 omap3_hwc_setup_layer_base(struct dss2_ovl_cfg *oc, int index, int format, int blended, int width, int height)
 {
-    unsigned int bits_per_pixel;
-
-    /* YUV2RGB conversion */
-    const struct omap_dss_cconv_coefs ctbl_bt601_5 = {
-        298,  409,    0,  298, -208, -100,  298,    0,  517, 0,
-    };
-
-    /* convert color format */
-    switch (format) {
-    case HAL_PIXEL_FORMAT_RGBA_8888:
-    case HAL_PIXEL_FORMAT_BGRA_8888:
-        oc->color_mode = OMAP_DSS_COLOR_ARGB32;
-        bits_per_pixel = 32;
-        if (blended)
-                break;
-
-    case HAL_PIXEL_FORMAT_RGBX_8888:
-    case HAL_PIXEL_FORMAT_BGRX_8888:
-        /* Should be XBGR32, but this isn't supported */
-        oc->color_mode = OMAP_DSS_COLOR_RGB24U;
-        bits_per_pixel = 32;
-        break;
-
-    case HAL_PIXEL_FORMAT_RGB_565:
-        oc->color_mode = OMAP_DSS_COLOR_RGB16;
-        bits_per_pixel = 16;
-        break;
-
-    case HAL_PIXEL_FORMAT_TI_NV12:
-    case HAL_PIXEL_FORMAT_TI_NV12_PADDED:
-        oc->color_mode = OMAP_DSS_COLOR_NV12;
-        bits_per_pixel = 8;
-        oc->cconv = ctbl_bt601_5;
-        break;
-
-     case HAL_PIXEL_FORMAT_YUV_422:
-     case HAL_PIXEL_FORMAT_YUV_420:
-        oc->color_mode = OMAP_DSS_COLOR_UYVY;
-        bits_per_pixel = 16;
-	    oc->cconv = ctbl_bt601_5;
-	break;
+    const struct omap3_hwc_format *f = omap3_hwc_get_format(format);
 
-    default:
+    if (!f) {
         /* Should have been filtered out */
         ALOGV("Unsupported pixel format");
         return;
     }
 
+    /* convert color format */
+    oc->color_mode = blended ? f->color_mode : f->opaque_mode;
+    if (f->cconv)
+        oc->cconv = *f->cconv;
+
     oc->width = width;
     oc->height = height;
-    oc->stride = ALIGN(width, HW_ALIGN) * bits_per_pixel / 8;
+    oc->stride = ALIGN(width, HW_ALIGN) * f->bpp / 8;
 
     oc->enabled = 1;
     oc->global_alpha = 255;
@@ -332,6 +954,25 @@ omap3_hwc_setup_layer_base(struct dss2_ovl_cfg *oc, int index, int format, int b
     oc->vc1.enable = 0;
 }
 
+/*
+ * YUV2RGB table for a YUV layer.  gralloc buffers carry no colour space, so
+ * the standard follows the lines of the picture like the decoders assume it,
+ * unless debug.hwc.csc sets it.  Going by lines keeps wide SD, such as
+ * 1024x576 PAL anamorphic, in BT.601.
+ */
+static const struct omap_dss_cconv_coefs *omap3_hwc_get_cconv(omap3_hwc_device_t *hwc_dev,
+                                                              hwc_layer_1_t *layer)
+{
+    int csc = hwc_dev->csc;
+
+    if (csc != 601 && csc != 709)
+        csc = HEIGHT(layer->sourceCrop) > CSC_SD_LINES ? 709 : 601;
+
+    if (csc == 709)
+        return hwc_dev->csc_full ? &ctbl_bt709_full : &ctbl_bt709;
+    return hwc_dev->csc_full ? &ctbl_bt601_5_full : &ctbl_bt601_5;
+}
+
 static void
 omap3_hwc_setup_layer(omap3_hwc_device_t *hwc_dev, struct dss2_ovl_info *ovl,
                       hwc_layer_1_t *layer, int index,
@@ -342,6 +983,8 @@ omap3_hwc_setup_layer(omap3_hwc_device_t *hwc_dev, struct dss2_ovl_info *ovl,
 
 //    dump_layer(layer);
     omap3_hwc_setup_layer_base(oc, index, format, is_BLENDED(layer->blending), width, height);
+    if (is_NV12(format))
+        oc->cconv = *omap3_hwc_get_cconv(hwc_dev, layer);
 
      /* convert transformation - assuming 0-set config */
     if (layer->transform & HWC_TRANSFORM_FLIP_H)
@@ -375,43 +1018,86 @@ omap3_hwc_setup_layer(omap3_hwc_device_t *hwc_dev, struct dss2_ovl_info *ovl,
     oc->crop.h = HEIGHT(layer->sourceCrop);
 }
 
-const float m_unit[2][3] = { { 1., 0., 0. }, { 0., 1., 0. } };
+/*
+ * orientation part of the external transform by rotation | hflip << 2:
+ * rotation by quarter turns, then flipping x
+ */
+static const int ext_orient[8][2][2] = {
+    { {  1,  0 }, {  0,  1 } },
+    { {  0, -1 }, {  1,  0 } },
+    { { -1,  0 }, {  0, -1 } },
+    { {  0,  1 }, { -1,  0 } },
+    { { -1,  0 }, {  0,  1 } },
+    { {  0,  1 }, {  1,  0 } },
+    { {  1,  0 }, {  0, -1 } },
+    { {  0, -1 }, { -1,  0 } },
+};
 
-static inline void m_translate(float m[2][3], int dx, int dy)
+/* sets up the division of row i by d > 0 */
+static void ext_set_divisor(struct ext_affine *m, int i, int d)
 {
-    m[0][2] += dx;
-    m[1][2] += dy;
+    int l = 0;
+
+    while ((1 << l) < d)
+        l++;
+    m->from[i] = d;
+    m->shift[i] = EXT_NUM_BITS + l;
+    m->inv[i] = (__u32) (((1ULL << m->shift[i]) + d - 1) / d);
 }
 
-static inline void m_scale1(float m[3], int from, int to)
+/* n / from of row i, rounded half away from 0 */
+static inline int ext_round(const struct ext_affine *m, int i, int n)
 {
-    m[0] = m[0] * to / from;
-    m[1] = m[1] * to / from;
-    m[2] = m[2] * to / from;
+    __u32 a = (n < 0 ? -(__u32) n : (__u32) n) + (m->from[i] >> 1);
+    __u32 q;
+
+    if (a >> EXT_NUM_BITS)
+        q = a / m->from[i];
+    else
+        q = ((__u64) a * m->inv[i]) >> m->shift[i];
+    return n < 0 ? -(int) q : (int) q;
 }
 
-static inline void m_scale(float m[2][3], int x_from, int x_to, int y_from, int y_to)
+static __u32 gcd(__u32 a, __u32 b)
 {
-    m_scale1(m[0], x_from, x_to);
-    m_scale1(m[1], y_from, y_to);
+    while (b) {
+        __u32 t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
 }
 
-static void m_rotate(float m[2][3], int quarter_turns)
+/* num:den in lowest terms; 1:1 if either is 0 */
+static struct ratio make_ratio(__u64 num, __u64 den)
 {
-    if (quarter_turns & 2)
-        m_scale(m, 1, -1, 1, -1);
-    if (quarter_turns & 1) {
-        int q;
-        q = m[0][0]; m[0][0] = -m[1][0]; m[1][0] = q;
-        q = m[0][1]; m[0][1] = -m[1][1]; m[1][1] = q;
-        q = m[0][2]; m[0][2] = -m[1][2]; m[1][2] = q;
+    struct ratio r = { 1, 1 };
+
+    if (!num || !den)
+        return r;
+    /* only sizes beyond any display get here */
+    while ((num | den) >> RATIO_BITS) {
+        num = (num + 1) >> 1;
+        den = (den + 1) >> 1;
     }
+    r.num = num;
+    r.den = den;
+    __u32 g = gcd(r.num, r.den);
+    r.num /= g;
+    r.den /= g;
+    return r;
+}
+
+static inline struct ratio ratio_inv(struct ratio r)
+{
+    struct ratio i = { r.den, r.num };
+    return i;
 }
 
-static inline int m_round(float x)
+/* a < b by more than the aspect ratio tolerance */
+static inline int ratio_below(__u64 a, __u64 b)
 {
-    /* int truncates towards 0 */
-    return (int) (x < 0 ? x - 0.5 : x + 0.5);
+    return a * ASPECT_RATIO_TOLERANCE_DEN < b * (ASPECT_RATIO_TOLERANCE_DEN - ASPECT_RATIO_TOLERANCE_NUM);
 }
 
 /*
@@ -420,7 +1106,7 @@ static inline int m_round(float x)
  * The adjusted size is the largest that fits into the screen.
  */
 static void get_max_dimensions(__u32 orig_xres, __u32 orig_yres,
-                               float xpy,
+                               struct ratio xpy,
                                __u32 scr_xres, __u32 scr_yres,
                                __u32 scr_width, __u32 scr_height,
                                __u32 *adj_xres, __u32 *adj_yres)
@@ -435,15 +1121,15 @@ static void get_max_dimensions(__u32 orig_xres, __u32 orig_yres,
         scr_height = scr_yres;
     }
 
-    /* trim to keep aspect ratio */
-    float x_factor = orig_xres * xpy * scr_height;
-    float y_factor = orig_yres *       scr_width;
+    /* trim to keep aspect ratio; both factors are multiplied by xpy.den */
+    __u64 x_factor = (__u64) orig_xres * xpy.num * scr_height;
+    __u64 y_factor = (__u64) orig_yres * xpy.den * scr_width;
 
     /* allow for tolerance so we avoid scaling if framebuffer is standard size */
-    if (x_factor < y_factor * (1.f - ASPECT_RATIO_TOLERANCE))
-        *adj_xres = (__u32) (x_factor * *adj_xres / y_factor + 0.5);
-    else if (x_factor * (1.f - ASPECT_RATIO_TOLERANCE) > y_factor)
-        *adj_yres = (__u32) (y_factor * *adj_yres / x_factor + 0.5);
+    if (ratio_below(x_factor, y_factor))
+        *adj_xres = (__u32) ((2 * x_factor * *adj_xres + y_factor) / (2 * y_factor));
+    else if (ratio_below(y_factor, x_factor))
+        *adj_yres = (__u32) ((2 * y_factor * *adj_yres + x_factor) / (2 * x_factor));
 }
 
 static void set_ext_matrix(omap3_hwc_ext_t *ext, struct hwc_rect region)
@@ -452,20 +1138,19 @@ static void set_ext_matrix(omap3_hwc_ext_t *ext, struct hwc_rect region)
     int orig_h = HEIGHT(region);
 
     /* assume 1:1 lcd pixel ratio */
-    float xpy = 1.;
+    struct ratio xpy = { 1, 1 };
+    const int (*o)[2] = ext_orient[(ext->current.rotation & 3) | ext->current.hflip << 2];
+    int dx = -(orig_w >> 1) - region.left;
+    int dy = -(orig_h >> 1) - region.top;
+    struct ext_affine *m = &ext->m;
+    int i, to[2], center[2];
 
     /* reorientation matrix is:
        m = (center-from-target-center) * (scale-to-target) * (mirror) * (rotate) * (center-to-original-center) */
 
-    memcpy(ext->m, m_unit, sizeof(m_unit));
-    m_translate(ext->m, -(orig_w >> 1) - region.left, -(orig_h >> 1) - region.top);
-    m_rotate(ext->m, ext->current.rotation);
-    if (ext->current.hflip)
-        m_scale(ext->m, 1, -1, 1, 1);
-
     if (ext->current.rotation & 1) {
         swap(orig_w, orig_h);
-        xpy = 1. / xpy;
+        xpy = ratio_inv(xpy);
     }
 
     /* get target size */
@@ -474,8 +1159,30 @@ static void set_ext_matrix(omap3_hwc_ext_t *ext, struct hwc_rect region)
                        ext->xres, ext->yres, ext->width, ext->height,
                        &adj_xres, &adj_yres);
 
-    m_scale(ext->m, orig_w, adj_xres, orig_h, adj_yres);
-    m_translate(ext->m, ext->xres >> 1, ext->yres >> 1);
+    ext_set_divisor(m, 0, orig_w > 0 ? orig_w : 1);
+    ext_set_divisor(m, 1, orig_h > 0 ? orig_h : 1);
+    to[0] = adj_xres;
+    to[1] = adj_yres;
+    center[0] = ext->xres >> 1;
+    center[1] = ext->yres >> 1;
+
+    for (i = 0; i < 2; i++) {
+        m->m[i][0] = o[i][0] * to[i];
+        m->m[i][1] = o[i][1] * to[i];
+        m->m[i][2] = (o[i][0] * dx + o[i][1] * dy) * to[i] + center[i] * m->from[i];
+    }
+}
+
+/* pixel ratio of an overlay on the external display */
+static struct ratio ovl_pixel_ratio(omap3_hwc_ext_t *ext, struct dss2_ovl_cfg *oc)
+{
+    struct ratio xpy;
+
+    if (oc->rotation & 1)
+        xpy = make_ratio((__u64) oc->crop.h * oc->win.h, (__u64) oc->win.w * oc->crop.w);
+    else
+        xpy = make_ratio((__u64) oc->crop.h * oc->win.w, (__u64) oc->win.h * oc->crop.w);
+    return ext->current.rotation & 1 ? ratio_inv(xpy) : xpy;
 }
 
 static void
@@ -571,7 +1278,8 @@ static void
 omap3_hwc_adjust_ext_layer(omap3_hwc_ext_t *ext, struct dss2_ovl_info *ovl)
 {
     struct dss2_ovl_cfg *oc = &ovl->cfg;
-    float x, y, w, h;
+    const struct ext_affine *m = &ext->m;
+    int x, y, w, h;
 
     /* crop to clone region if mirroring */
     if (!ext->current.docking &&
@@ -580,15 +1288,15 @@ omap3_hwc_adjust_ext_layer(omap3_hwc_ext_t *ext, struct dss2_ovl_info *ovl)
         return;
     }
 
-    /* display position */
-    x = ext->m[0][0] * oc->win.x + ext->m[0][1] * oc->win.y + ext->m[0][2];
-    y = ext->m[1][0] * oc->win.x + ext->m[1][1] * oc->win.y + ext->m[1][2];
-    w = ext->m[0][0] * oc->win.w + ext->m[0][1] * oc->win.h;
-    h = ext->m[1][0] * oc->win.w + ext->m[1][1] * oc->win.h;
-    oc->win.x = m_round(w > 0 ? x : x + w);
-    oc->win.y = m_round(h > 0 ? y : y + h);
-    oc->win.w = m_round(w > 0 ? w : -w);
-    oc->win.h = m_round(h > 0 ? h : -h);
+    /* display position, scaled by from */
+    x = m->m[0][0] * oc->win.x + m->m[0][1] * oc->win.y + m->m[0][2];
+    y = m->m[1][0] * oc->win.x + m->m[1][1] * oc->win.y + m->m[1][2];
+    w = m->m[0][0] * oc->win.w + m->m[0][1] * oc->win.h;
+    h = m->m[1][0] * oc->win.w + m->m[1][1] * oc->win.h;
+    oc->win.x = ext_round(m, 0, w > 0 ? x : x + w);
+    oc->win.y = ext_round(m, 1, h > 0 ? y : y + h);
+    oc->win.w = ext_round(m, 0, w > 0 ? w : -w);
+    oc->win.h = ext_round(m, 1, h > 0 ? h : -h);
 
     /* combining transformations: F^a*R^b*F^i*R^j = F^(a+b)*R^(j+b*(-1)^i), because F*R = R^(-1)*F */
     oc->rotation += (oc->mirror ? -1 : 1) * ext->current.rotation;
@@ -654,7 +1362,65 @@ static int omap3_hwc_can_scale(int src_w, int src_h, int dst_w, int dst_h, int i
     return 1;
 }
 
-static int omap3_hwc_can_scale_layer(omap3_hwc_device_t *hwc_dev, hwc_layer_1_t *layer, IMG_native_handle_t *handle)
+/*
+ * Estimate the peak DMA rate (bytes/s) of an overlay while it is being
+ * scanned out: the bytes fetched per display line, after DSS decimation of
+ * whatever the scaler cannot downscale, times the line rate.
+ */
+static __u64 ovl_bandwidth(struct dss2_ovl_cfg *oc, struct omap_video_timings *t)
+{
+    __u32 src_w = oc->crop.w, src_h = oc->crop.h;
+    __u32 dst_w = oc->win.w, dst_h = oc->win.h;
+    __u32 htotal = t->x_res + t->hsw + t->hfp + t->hbp;
+    __u32 bpp2, decim_x, decim_y;
+
+    if (!oc->enabled || oc->zonly || !dst_w || !dst_h || !t->pixel_clock || !htotal)
+        return 0;
+
+    if (oc->rotation & 1)
+        swap(src_w, src_h);
+
+    /* bytes per pixel, times 2 */
+    switch (oc->color_mode) {
+    case OMAP_DSS_COLOR_NV12:
+        bpp2 = 3;
+        break;
+    case OMAP_DSS_COLOR_RGB16:
+    case OMAP_DSS_COLOR_UYVY:
+    case OMAP_DSS_COLOR_YUV2:
+        bpp2 = 4;
+        break;
+    default:
+        bpp2 = 8;
+        break;
+    }
+
+    decim_x = max((src_w + dst_w * limits.max_downscale - 1) / (dst_w * limits.max_downscale), 1U);
+    decim_y = max((src_h + dst_h * limits.max_downscale - 1) / (dst_h * limits.max_downscale), 1U);
+
+    return (__u64) bpp2 * (src_w / decim_x) * (src_h / decim_y) * t->pixel_clock * 1000 /
+           ((__u64) dst_h * htotal * 2);
+}
+
+static struct omap_video_timings *ovl_timings(omap3_hwc_device_t *hwc_dev, struct dss2_ovl_cfg *oc)
+{
+    if (oc->mgr_ix && hwc_dev->ext.timings.pixel_clock)
+        return &hwc_dev->ext.timings;
+    return &hwc_dev->fb_dis.timings;
+}
+
+/* predicted DMA rate of all enabled overlays in a composition */
+static __u64 omap3_hwc_dispc_bandwidth(omap3_hwc_device_t *hwc_dev, struct dsscomp_setup_dispc_data *d)
+{
+    __u64 bw = 0;
+    unsigned int i;
+
+    for (i = 0; i < d->num_ovls; i++)
+        bw += ovl_bandwidth(&d->ovls[i].cfg, ovl_timings(hwc_dev, &d->ovls[i].cfg));
+    return bw;
+}
+
+static int omap3_hwc_can_scale_layer(omap3_hwc_device_t *hwc_dev, hwc_layer_1_t *layer, const struct omap3_hwc_format *f)
 {
     int src_w = WIDTH(layer->sourceCrop);
     int src_h = HEIGHT(layer->sourceCrop);
@@ -667,67 +1433,116 @@ static int omap3_hwc_can_scale_layer(omap3_hwc_device_t *hwc_dev, hwc_layer_1_t
 
     /* NOTE: layers should be able to be scaled externally since
        framebuffer is able to be scaled on selected external resolution */
-    return omap3_hwc_can_scale(src_w, src_h, dst_w, dst_h, is_NV12(handle->iFormat), &hwc_dev->fb_dis, &limits,
+    return omap3_hwc_can_scale(src_w, src_h, dst_w, dst_h, f->cls == FMT_NV12, &hwc_dev->fb_dis, &limits,
                                hwc_dev->fb_dis.timings.pixel_clock);
 }
 
-static int omap3_hwc_is_valid_layer(omap3_hwc_device_t *hwc_dev,
-                                    hwc_layer_1_t *layer,
-                                    IMG_native_handle_t *handle)
+/* the part of the buffer of a planar layer that is converted: the crop on whole chroma samples */
+static hwc_rect_t omap3_hwc_conv_rect(hwc_layer_1_t *layer)
+{
+    IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+    hwc_rect_t r;
+
+    r.left = max(layer->sourceCrop.left, 0) & ~1;
+    r.top = max(layer->sourceCrop.top, 0) & ~1;
+    r.right = min(ALIGN(layer->sourceCrop.right, 2), handle->iWidth);
+    r.bottom = min(ALIGN(layer->sourceCrop.bottom, 2), handle->iHeight);
+    if (r.right <= r.left || r.bottom <= r.top) {
+        r.left = r.top = 0;
+        r.right = handle->iWidth;
+        r.bottom = handle->iHeight;
+    }
+    return r;
+}
+
+/* whether pre-rotating the crop of a planar layer costs less than SGX composing it */
+static int omap3_hwc_prerotate_pays(omap3_hwc_device_t *hwc_dev, hwc_layer_1_t *layer)
+{
+    struct omap3_hwc_conv *conv = &hwc_dev->conv;
+    hwc_rect_t r = omap3_hwc_conv_rect(layer);
+    __u64 ps = conv->rot_pixels ? conv->rot_time_ns * 1000 / conv->rot_pixels : PREROTATE_PS_PER_PIXEL;
+    __u64 cpu = (__u64) WIDTH(r) * HEIGHT(r) * ps;
+    __u64 sgx = (__u64) WIDTH(layer->displayFrame) * HEIGHT(layer->displayFrame) * 1000000 / conv->sgx_mpps;
+
+    return conv->prerotate && cpu < sgx;
+}
+
+/*
+ * returns the SGX_REASON_* why the layer cannot be put on any overlay; info
+ * has the format and the TILER footprint
+ */
+static int omap3_hwc_check_layer(omap3_hwc_device_t *hwc_dev,
+                                 hwc_layer_1_t *layer,
+                                 struct omap3_hwc_layer_info *info)
 {
     /* Skip layers are handled by SF */
-    if ((layer->flags & HWC_SKIP_LAYER) || !handle)
-        return 0;
+    if ((layer->flags & HWC_SKIP_LAYER) || !layer->handle)
+        return SGX_REASON_SKIP;
 
-    if (!omap3_hwc_is_valid_format(handle->iFormat))
-        return 0;
+    if (!info->fmt)
+        return SGX_REASON_FORMAT;
 
-    /* 1D buffers: no transform, must fit in TILER slot */
-    if (!is_NV12(handle->iFormat)) {
-        if (layer->transform)
-            return 0;
-        if (mem1d(handle) > MAX_TILER_SLOT)
-            return 0;
-    }
+    if (info->fmt->planar && !hwc_dev->conv.enabled)
+        return SGX_REASON_FORMAT;
+
+    /* 1D buffers: no transform; NV12 copies are pre-rotated if that pays */
+    if (layer->transform &&
+        (info->fmt->planar ? !omap3_hwc_prerotate_pays(hwc_dev, layer) : info->fmt->cls != FMT_NV12))
+        return SGX_REASON_TRANSFORM;
+    /* must fit in TILER slot */
+    if (tiler_slot_pages(info->mem) > hwc_dev->tiler.pages)
+        return SGX_REASON_TILER;
 
-    return omap3_hwc_can_scale_layer(hwc_dev, layer, handle);
+    return omap3_hwc_can_scale_layer(hwc_dev, layer, info->fmt) ? SGX_REASON_NONE : SGX_REASON_SCALING;
 }
 
-static int omap3_hwc_set_best_hdmi_mode(omap3_hwc_device_t *hwc_dev, __u32 xres, __u32 yres,
-                                        float xpy)
+/* captures the external display modes if they are not known since the last hotplug */
+static int omap3_hwc_query_modedb(omap3_hwc_device_t *hwc_dev)
 {
-    struct _qdis {
-        struct dsscomp_display_info dis;
-        struct dsscomp_videomode modedb[16];
-    } d = { .dis = { .ix = 1 } };
-    omap3_hwc_ext_t *ext = &hwc_dev->ext;
+    struct omap3_hwc_modedb *mdb = &hwc_dev->modedb;
+    int ret;
 
-    d.dis.modedb_len = sizeof(d.modedb) / sizeof(*d.modedb);
-    int ret = ioctl(hwc_dev->dsscomp_fd, DSSCIOC_QUERY_DISPLAY, &d);
+    if (mdb->valid)
+        return 0;
+
+    memset(mdb, 0, sizeof(*mdb));
+    mdb->d.dis.ix = 1;
+    mdb->d.dis.modedb_len = MAX_HDMI_MODES;
+    ret = hwc_dev->backend->ops->query_display(hwc_dev->backend, &mdb->d.dis);
     if (ret)
         return ret;
+    mdb->valid = 1;
+    mdb->queries++;
+    return 0;
+}
 
-    if (d.dis.timings.x_res * d.dis.timings.y_res == 0 ||
-        xres * yres == 0)
-        return -EINVAL;
-
-    __u32 i, best = ~0, best_score = 0;
-    ext->width = d.dis.width_in_mm;
-    ext->height = d.dis.height_in_mm;
-    ext->xres = d.dis.timings.x_res;
-    ext->yres = d.dis.timings.y_res;
-    __u32 ext_fb_xres, ext_fb_yres;
-    for (i = 0; i < d.dis.modedb_len; i++) {
+/*
+ * Scores the captured modes for a video of xres*yres with a pixel ratio of
+ * xpy, preferring mode ~pref.  Fills in the best mode of the choice, or 0 if
+ * no mode can show the video.
+ */
+static void omap3_hwc_score_modes(omap3_hwc_device_t *hwc_dev, struct omap3_hwc_mode_choice *c)
+{
+    struct omap3_hwc_modedb *mdb = &hwc_dev->modedb;
+    struct dsscomp_display_info *dis = &mdb->d.dis;
+    struct dsscomp_videomode *modedb = mdb->d.modedb;
+    struct ratio xpy = c->xpy;
+    __u32 xres = c->xres, yres = c->yres;
+    __u32 i, best_score = 0;
+    __u32 ext_fb_xres, ext_fb_yres;
+
+    c->best = 0;
+    for (i = 0; i < dis->modedb_len; i++) {
         __u32 score = 0;
         __u32 area = xres * yres;
-        __u32 mode_area = d.modedb[i].xres * d.modedb[i].yres;
-        __u32 ext_width = d.dis.width_in_mm;
-        __u32 ext_height = d.dis.height_in_mm;
+        __u32 mode_area = modedb[i].xres * modedb[i].yres;
+        __u32 ext_width = dis->width_in_mm;
+        __u32 ext_height = dis->height_in_mm;
 
-        if (d.modedb[i].flag & FB_FLAG_RATIO_4_3) {
+        if (modedb[i].flag & FB_FLAG_RATIO_4_3) {
             ext_width = 4;
             ext_height = 3;
-        } else if (d.modedb[i].flag & FB_FLAG_RATIO_16_9) {
+        } else if (modedb[i].flag & FB_FLAG_RATIO_16_9) {
             ext_width = 16;
             ext_height = 9;
         }
@@ -735,19 +1550,19 @@ static int omap3_hwc_set_best_hdmi_mode(omap3_hwc_device_t *hwc_dev, __u32 xres,
         if (mode_area == 0)
             continue;
 
-        get_max_dimensions(xres, yres, xpy, d.modedb[i].xres, d.modedb[i].yres,
+        get_max_dimensions(xres, yres, xpy, modedb[i].xres, modedb[i].yres,
                            ext_width, ext_height, &ext_fb_xres, &ext_fb_yres);
 
         /* we need to ensure that even TILER2D buffers can be scaled */
-        if (!d.modedb[i].pixclock ||
-            d.modedb[i].vmode ||
+        if (!modedb[i].pixclock ||
+            modedb[i].vmode ||
             !omap3_hwc_can_scale(xres, yres, ext_fb_xres, ext_fb_yres,
-                                 1, &d.dis, &limits,
-                                 1000000000 / d.modedb[i].pixclock))
+                                 1, dis, &limits,
+                                 1000000000 / modedb[i].pixclock))
             continue;
 
         /* prefer CEA modes */
-        if (d.modedb[i].flag & (FB_FLAG_RATIO_4_3 | FB_FLAG_RATIO_16_9))
+        if (modedb[i].flag & (FB_FLAG_RATIO_4_3 | FB_FLAG_RATIO_16_9))
             score = 1;
 
         /* prefer to upscale (1% tolerance) */
@@ -755,7 +1570,7 @@ static int omap3_hwc_set_best_hdmi_mode(omap3_hwc_device_t *hwc_dev, __u32 xres,
         score = (score << 1) | upscaling;
 
         /* prefer the same mode as we use for mirroring to avoid mode change */
-        score = (score << 1) | (i == ~ext->mirror_mode && ext->avoid_mode_change);
+        score = (score << 1) | (i == ~c->pref);
 
         /* pick closest screen size */
         if (ext_fb_xres * ext_fb_yres > area)
@@ -767,40 +1582,227 @@ static int omap3_hwc_set_best_hdmi_mode(omap3_hwc_device_t *hwc_dev, __u32 xres,
         score = (score << 5) | ((16 * ext_fb_xres * ext_fb_yres + (mode_area >> 1)) / mode_area);
 
         /* pick highest frame rate */
-        score = (score << 8) | d.modedb[i].refresh;
+        score = (score << 8) | modedb[i].refresh;
 
-        ALOGD("#%d: %dx%d %dHz", i, d.modedb[i].xres, d.modedb[i].yres, d.modedb[i].refresh);
+        ALOGD("#%d: %dx%d %dHz", i, modedb[i].xres, modedb[i].yres, modedb[i].refresh);
         if (debug)
             ALOGD("  score=%u adj.res=%dx%d", score, ext_fb_xres, ext_fb_yres);
         if (best_score < score) {
-            ext->width = ext_width;
-            ext->height = ext_height;
-            ext->xres = d.modedb[i].xres;
-            ext->yres = d.modedb[i].yres;
-            best = i;
+            c->width = ext_width;
+            c->height = ext_height;
+            c->best = ~i;
             best_score = score;
         }
     }
-    if (~best) {
+}
+
+/* returns the memoized mode choice for the video, scoring the modes on a miss */
+static struct omap3_hwc_mode_choice *omap3_hwc_choose_mode(omap3_hwc_device_t *hwc_dev, __u32 xres,
+                                                          __u32 yres, struct ratio xpy)
+{
+    struct omap3_hwc_modedb *mdb = &hwc_dev->modedb;
+    omap3_hwc_ext_t *ext = &hwc_dev->ext;
+    struct omap3_hwc_mode_choice *c, *lru = mdb->choice;
+    __u32 pref = ext->avoid_mode_change ? ext->mirror_mode : 0;
+    int i;
+
+    for (i = 0; i < HDMI_MODE_CHOICES; i++) {
+        c = mdb->choice + i;
+        if (c->used && c->xres == xres && c->yres == yres && c->xpy.num == xpy.num &&
+            c->xpy.den == xpy.den && c->pref == pref) {
+            c->used = ++mdb->clock;
+            mdb->hits++;
+            return c;
+        }
+        if (c->used < lru->used)
+            lru = c;
+    }
+
+    c = lru;
+    c->xres = xres;
+    c->yres = yres;
+    c->xpy = xpy;
+    c->pref = pref;
+    omap3_hwc_score_modes(hwc_dev, c);
+    c->used = ++mdb->clock;
+    mdb->misses++;
+    return c;
+}
+
+static void mode_to_timings(const struct dsscomp_videomode *m, struct omap_video_timings *t)
+{
+    t->x_res = m->xres;
+    t->y_res = m->yres;
+    t->pixel_clock = m->pixclock ? 1000000000 / m->pixclock : 0;
+    t->hsw = m->hsync_len;
+    t->hfp = m->right_margin;
+    t->hbp = m->left_margin;
+    t->vsw = m->vsync_len;
+    t->vfp = m->lower_margin;
+    t->vbp = m->upper_margin;
+}
+
+/*
+ * A mode switch takes many milliseconds, so the mode worker does it while
+ * prepare and set go on for the LCD.  A newer request replaces one the worker
+ * has not started.  Once the switch is done, the worker asks SurfaceFlinger
+ * for a new frame.
+ */
+static void *omap3_hwc_mode_thread(void *data)
+{
+    omap3_hwc_device_t *hwc_dev = data;
+    struct dsscomp_setup_display_data sdis;
+    __u64 start;
+    int err;
+
+    pthread_mutex_lock(&hwc_dev->mode_lock);
+    do {
+        while (!hwc_dev->mode_pending && !__atomic_load_n(&hwc_dev->quit, __ATOMIC_RELAXED))
+            pthread_cond_wait(&hwc_dev->mode_cond, &hwc_dev->mode_lock);
+        if (__atomic_load_n(&hwc_dev->quit, __ATOMIC_RELAXED))
+            break;
+        sdis = hwc_dev->mode_req;
+        hwc_dev->mode_pending = 0;
+        hwc_dev->mode_busy = 1;
+        pthread_mutex_unlock(&hwc_dev->mode_lock);
+
+        start = now_ns();
+        err = hwc_dev->backend->ops->setup_display(hwc_dev->backend, &sdis);
+        if (err)
+            ALOGE("failed to set HDMI mode %dx%d@%d (%d)", sdis.mode.xres, sdis.mode.yres,
+                  sdis.mode.refresh, -err);
+
+        pthread_mutex_lock(&hwc_dev->mode_lock);
+        hwc_dev->mode_busy = 0;
+        hwc_dev->mode_err = err;
+        hwc_dev->mode_done = sdis.mode;
+        hwc_dev->mode_switches++;
+        hwc_dev->mode_switch_ns += now_ns() - start;
+        __atomic_store_n(&hwc_dev->mode_gen, hwc_dev->mode_gen + 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&hwc_dev->mode_cond);
+        pthread_mutex_unlock(&hwc_dev->mode_lock);
+
+        if (hwc_dev->procs && hwc_dev->procs->invalidate)
+            hwc_dev->procs->invalidate(hwc_dev->procs);
+
+        pthread_mutex_lock(&hwc_dev->mode_lock);
+    } while (1);
+    pthread_mutex_unlock(&hwc_dev->mode_lock);
+
+    return NULL;
+}
+
+static void omap3_hwc_queue_mode(omap3_hwc_device_t *hwc_dev, struct dsscomp_setup_display_data *sdis)
+{
+    pthread_mutex_lock(&hwc_dev->mode_lock);
+    hwc_dev->mode_req = *sdis;
+    hwc_dev->mode_pending = 1;
+    pthread_cond_broadcast(&hwc_dev->mode_cond);
+    pthread_mutex_unlock(&hwc_dev->mode_lock);
+}
+
+/* whether a mode switch is queued or in progress */
+static int omap3_hwc_mode_switching(omap3_hwc_device_t *hwc_dev)
+{
+    int switching;
+
+    pthread_mutex_lock(&hwc_dev->mode_lock);
+    switching = hwc_dev->mode_pending || hwc_dev->mode_busy;
+    pthread_mutex_unlock(&hwc_dev->mode_lock);
+    return switching;
+}
+
+static void omap3_hwc_wait_mode(omap3_hwc_device_t *hwc_dev)
+{
+    pthread_mutex_lock(&hwc_dev->mode_lock);
+    while (hwc_dev->mode_pending || hwc_dev->mode_busy)
+        pthread_cond_wait(&hwc_dev->mode_cond, &hwc_dev->mode_lock);
+    pthread_mutex_unlock(&hwc_dev->mode_lock);
+}
+
+/*
+ * Picks up completed mode switches.  Returns 1 if the plan has to be rebuilt
+ * to light up the external display again.
+ */
+static int omap3_hwc_apply_mode_switch(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_modedb *mdb = &hwc_dev->modedb;
+    __u32 gen = __atomic_load_n(&hwc_dev->mode_gen, __ATOMIC_ACQUIRE);
+    struct dsscomp_videomode mode;
+    int err;
+
+    if (gen == hwc_dev->mode_gen_applied)
+        return 0;
+    hwc_dev->mode_gen_applied = gen;
+
+    pthread_mutex_lock(&hwc_dev->mode_lock);
+    err = hwc_dev->mode_err;
+    mode = hwc_dev->mode_done;
+    pthread_mutex_unlock(&hwc_dev->mode_lock);
+    if (err) {
+        /* try again with the next selection, on what the display runs now */
+        hwc_dev->ext.last_mode = 0;
+        hwc_dev->ext.last_xres_used = hwc_dev->ext.last_yres_used = 0;
+        mdb->valid = 0;
+    } else if (mdb->valid) {
+        /* the display runs this mode now, as a new query would tell */
+        mode_to_timings(&mode, &mdb->d.dis.timings);
+    }
+    return 1;
+}
+
+static int omap3_hwc_set_best_hdmi_mode(omap3_hwc_device_t *hwc_dev, __u32 xres, __u32 yres,
+                                        struct ratio xpy)
+{
+    struct omap3_hwc_modedb *mdb = &hwc_dev->modedb;
+    struct dsscomp_display_info *dis = &mdb->d.dis;
+    struct omap3_hwc_mode_choice *c;
+    omap3_hwc_ext_t *ext = &hwc_dev->ext;
+
+    int ret = omap3_hwc_query_modedb(hwc_dev);
+    if (ret)
+        return ret;
+
+    if (dis->timings.x_res * dis->timings.y_res == 0 ||
+        xres * yres == 0)
+        return -EINVAL;
+
+    c = omap3_hwc_choose_mode(hwc_dev, xres, yres, xpy);
+    if (c->best) {
+        __u32 best = ~c->best;
+        struct dsscomp_videomode *m = mdb->d.modedb + best;
         struct dsscomp_setup_display_data sdis = { .ix = 1, };
-        sdis.mode = d.dis.modedb[best];
+
+        ext->width = c->width;
+        ext->height = c->height;
+        ext->xres = m->xres;
+        ext->yres = m->yres;
+
+        sdis.mode = *m;
         /*ALOGD("picking #%d", best);*/
         /* only reconfigure on change */
         if (ext->last_mode != ~best)
-            ioctl(hwc_dev->dsscomp_fd, DSSCIOC_SETUP_DISPLAY, &sdis);
+            omap3_hwc_queue_mode(hwc_dev, &sdis);
         ext->last_mode = ~best;
+
+        mode_to_timings(m, &ext->timings);
     } else {
-        __u32 ext_width = d.dis.width_in_mm;
-        __u32 ext_height = d.dis.height_in_mm;
+        __u32 ext_width = dis->width_in_mm;
+        __u32 ext_height = dis->height_in_mm;
         __u32 ext_fb_xres, ext_fb_yres;
 
-        get_max_dimensions(xres, yres, xpy, d.dis.timings.x_res, d.dis.timings.y_res,
+        ext->width = dis->width_in_mm;
+        ext->height = dis->height_in_mm;
+        ext->xres = dis->timings.x_res;
+        ext->yres = dis->timings.y_res;
+
+        get_max_dimensions(xres, yres, xpy, dis->timings.x_res, dis->timings.y_res,
                            ext_width, ext_height, &ext_fb_xres, &ext_fb_yres);
-        if (!d.dis.timings.pixel_clock ||
-            d.dis.mgr.interlaced ||
+        if (!dis->timings.pixel_clock ||
+            dis->mgr.interlaced ||
             !omap3_hwc_can_scale(xres, yres, ext_fb_xres, ext_fb_yres,
-                                 1, &d.dis, &limits,
-                                 d.dis.timings.pixel_clock)) {
+                                 1, dis, &limits,
+                                 dis->timings.pixel_clock)) {
             ALOGE("DSS scaler cannot support HDMI cloning");
             return -1;
         }
@@ -808,7 +1810,7 @@ static int omap3_hwc_set_best_hdmi_mode(omap3_hwc_device_t *hwc_dev, __u32 xres,
     ext->last_xres_used = xres;
     ext->last_yres_used = yres;
     ext->last_xpy = xpy;
-    if (d.dis.channel == OMAP_DSS_CHANNEL_DIGIT)
+    if (dis->channel == OMAP_DSS_CHANNEL_DIGIT)
         ext->on_tv = 1;
     return 0;
 }
@@ -821,13 +1823,109 @@ struct counts {
     unsigned int BGR;
     unsigned int NV12;
     unsigned int dockable;
+    unsigned int protected;
     unsigned int displays;
     unsigned int max_hw_overlays;
     unsigned int max_scaling_overlays;
-    unsigned int mem;
+    __u32 possible;                     /* mask of the layers counted in possible_overlay_layers */
+    __u64 bandwidth;
 };
 
-static inline int can_dss_render_all(omap3_hwc_device_t *hwc_dev, struct counts *num)
+/* whether the 1D buffers of the layers in mask can be mapped next to the composition on screen */
+static int omap3_hwc_tiler_fits(omap3_hwc_device_t *hwc_dev, __u32 mask)
+{
+    struct omap3_hwc_tiler_map maps[TILER_SLOT_MAX_MAPS];
+    int i, n = 0;
+
+    for (i = 0; mask && i < MAX_CACHED_LAYERS; i++) {
+        if (!(mask & (1U << i)))
+            continue;
+        if (n == TILER_SLOT_MAX_MAPS)
+            return 0;
+        maps[n++] = hwc_dev->layers[i].map;
+    }
+    return !tiler_slot_place(&hwc_dev->tiler, maps, n);
+}
+
+/* returns the SGX_REASON_* why the layers cannot all be rendered by DSS */
+static inline int dss_render_all_reason(omap3_hwc_device_t *hwc_dev, struct counts *num)
+{
+    int on_tv = hwc_dev->ext.on_tv;
+    int tform = hwc_dev->ext.current.enabled && (hwc_dev->ext.current.rotation || hwc_dev->ext.current.hflip);
+
+    if (hwc_dev->force_sgx)
+        return SGX_REASON_UI;
+    if (num->BGR || num->RGB)
+        return SGX_REASON_UI;
+    /* must have at least one layer if using composition bypass to get sync object */
+    if (!num->possible_overlay_layers ||
+        num->possible_overlay_layers > num->max_hw_overlays)
+        return SGX_REASON_OVERLAYS;
+    if (num->scaled_layers > num->max_scaling_overlays ||
+        num->NV12 > num->max_scaling_overlays)
+        return SGX_REASON_OVERLAYS;
+    /* maps into the TILER slot */
+    if (!omap3_hwc_tiler_fits(hwc_dev, num->possible))
+        return SGX_REASON_TILER;
+    /* DSS can fetch all layers without FIFO underflow */
+    if (num->bandwidth > hwc_dev->dss_bw_limit)
+        return SGX_REASON_BANDWIDTH;
+    /* we cannot clone non-NV12 transformed layers */
+    if (tform && num->NV12 != num->possible_overlay_layers)
+        return SGX_REASON_TRANSFORM;
+    /* HDMI cannot display BGR */
+    if (num->BGR && (num->RGB || on_tv) && hwc_dev->flags_rgb_order)
+        return on_tv ? SGX_REASON_TV : SGX_REASON_RGB_ORDER;
+    return SGX_REASON_NONE;
+}
+
+/*
+ * Colour key mode: alpha blending is off, so the video pipes are on top of
+ * the framebuffer, and the video only shows where the framebuffer has the key
+ * colour.  SurfaceFlinger clears the framebuffer to transparent black under
+ * CLEAR_FB, so black is the key.  SGX then draws only the UI and never
+ * samples the video, but UI pixels over the video are either opaque or, if
+ * black, holes: translucent UI over the video is shown over black.
+ *
+ * Possible if every video layer is below every UI layer and no external
+ * display would have to apply the same key.  The UI layers over a video
+ * must not be scaled, as filtering would blend the edges of the holes with
+ * the key, and a blended one must cover the video: that is the window with
+ * the hole, while a partial one (controls, toasts) would be over black.
+ */
+static int omap3_hwc_colorkey_possible(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list)
+{
+    unsigned int i, j, num_video = 0;
+    int ui = 0;
+
+    if (!list || hdmi_enabled || tv_enabled)
+        return 0;
+
+    for (i = 0; i < list->numHwLayers; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+
+        if (handle && is_NV12(handle->iFormat)) {
+            if (ui)
+                return 0;
+            num_video++;
+            continue;
+        }
+        ui = 1;
+        for (j = 0; j < num_video; j++) {
+            hwc_rect_t *video = &list->hwLayers[j].displayFrame;
+
+            if (!rects_overlap(&layer->displayFrame, video))
+                continue;
+            if (scaled(layer) ||
+                (is_BLENDED(layer->blending) && !rect_covers(&layer->displayFrame, video)))
+                return 0;
+        }
+    }
+    return ui;
+}
+
+static inline int can_dss_render_all(omap3_hwc_device_t *hwc_dev, struct counts *num, int *reason)
 {
     omap3_hwc_ext_t *ext = &hwc_dev->ext;
     int nonscaling_ovls = NUM_NONSCALING_OVERLAYS;
@@ -882,50 +1980,971 @@ static inline int can_dss_render_all(omap3_hwc_device_t *hwc_dev, struct counts
 
     num->max_scaling_overlays = num->max_hw_overlays - nonscaling_ovls;
 
+    *reason = dss_render_all_reason(hwc_dev, num);
+    return *reason == SGX_REASON_NONE;
+}
+
+/* returns the SGX_REASON_* why the layer cannot be put on an overlay in this composition */
+static inline int dss_render_layer_reason(omap3_hwc_device_t *hwc_dev,
+            struct omap3_hwc_layer_info *info)
+{
     int on_tv = hwc_dev->ext.on_tv;
     int tform = hwc_dev->ext.current.enabled && (hwc_dev->ext.current.rotation || hwc_dev->ext.current.hflip);
 
+    if (info->reason != SGX_REASON_NONE)
+        return info->reason;
+    if (info->fmt->cls == FMT_RGB || info->fmt->cls == FMT_BGR)
+        return SGX_REASON_UI;
+    /* cannot rotate non-NV12 layers on external display */
+    if (tform && info->fmt->cls != FMT_NV12)
+        return SGX_REASON_TRANSFORM;
+    /* skip non-NV12 layers if also using SGX (if nv12_only flag is set) */
+    if (hwc_dev->flags_nv12_only && hwc_dev->use_sgx && info->fmt->cls != FMT_NV12)
+        return SGX_REASON_NV12_ONLY;
+    /* make sure RGB ordering is consistent (if rgb_order flag is set) */
+    if (info->fmt->cls == (hwc_dev->swap_rb ? FMT_RGB : FMT_BGR) &&
+        hwc_dev->flags_rgb_order)
+        return SGX_REASON_RGB_ORDER;
+    /* TV can only render RGB */
+    if (on_tv && info->fmt->cls == FMT_BGR)
+        return SGX_REASON_TV;
+    return SGX_REASON_NONE;
+}
 
-    return  !hwc_dev->force_sgx &&
-		!num->BGR && !num->RGB &&
-            /* must have at least one layer if using composition bypass to get sync object */
-            num->possible_overlay_layers &&
-            num->possible_overlay_layers <= num->max_hw_overlays &&
-            num->scaled_layers <= num->max_scaling_overlays &&
-            num->NV12 <= num->max_scaling_overlays &&
-            /* fits into TILER slot */
-            num->mem <= MAX_TILER_SLOT &&
-            /* we cannot clone non-NV12 transformed layers */
-            (!tform || num->NV12 == num->possible_overlay_layers) &&
-            /* HDMI cannot display BGR */
-            (num->BGR == 0 || (num->RGB == 0 && !on_tv) || !hwc_dev->flags_rgb_order);
+static inline int display_area(struct dss2_ovl_info *o)
+{
+    return o->cfg.win.w * o->cfg.win.h;
 }
 
-static inline int can_dss_render_layer(omap3_hwc_device_t *hwc_dev,
-            hwc_layer_1_t *layer)
+static void get_layer_key(hwc_layer_1_t *layer, struct omap3_hwc_layer_key *key)
 {
     IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
 
-    int on_tv = hwc_dev->ext.on_tv;
-    int tform = hwc_dev->ext.current.enabled && (hwc_dev->ext.current.rotation || hwc_dev->ext.current.hflip);
+    key->format = handle ? handle->iFormat : 0;
+    key->width = handle ? handle->iWidth : 0;
+    key->height = handle ? handle->iHeight : 0;
+    key->usage = handle ? handle->usage & (GRALLOC_USAGE_PROTECTED | GRALLOC_USAGE_EXTERNAL_DISP) : 0;
+    key->flags = layer->flags;
+    key->transform = layer->transform;
+    key->blending = layer->blending;
+    key->sourceCrop = layer->sourceCrop;
+    key->displayFrame = layer->displayFrame;
+}
 
-    return omap3_hwc_is_valid_layer(hwc_dev, layer, handle) &&
-		!(is_RGB(handle->iFormat)) &&
-		!(is_BGR(handle->iFormat)) &&
-           /* cannot rotate non-NV12 layers on external display */
-           (!tform || is_NV12(handle->iFormat)) &&
-           /* skip non-NV12 layers if also using SGX (if nv12_only flag is set) */
-           (!hwc_dev->flags_nv12_only || (!hwc_dev->use_sgx || is_NV12(handle->iFormat))) &&
-           /* make sure RGB ordering is consistent (if rgb_order flag is set) */
-           (!(hwc_dev->swap_rb ? is_RGB(handle->iFormat) : is_BGR(handle->iFormat)) ||
-            !hwc_dev->flags_rgb_order) &&
-           /* TV can only render RGB */
-           !(on_tv && is_BGR(handle->iFormat));
+/* device state outside of the layer list that the plan depends on */
+static __u32 get_plan_state(omap3_hwc_device_t *hwc_dev)
+{
+    omap3_hwc_ext_t *ext = &hwc_dev->ext;
+
+    return hwc_dev->last_ext_ovls |
+           hwc_dev->last_int_ovls << 4 |
+           (hwc_dev->ext_ovls_wanted != hwc_dev->ext_ovls) << 8 |
+           ext->mirror.enabled << 9 |
+           ext->dock.enabled << 10 |
+           ext->on_tv << 11 |
+           hdmi_enabled << 12 |
+           tv_enabled << 13 |
+           (__atomic_load_n(&hwc_dev->idle_frames, __ATOMIC_RELAXED) > 0) << 14;
 }
 
-static inline int display_area(struct dss2_ovl_info *o)
+/* applies the external display request of the event thread, if there is a new one */
+static void omap3_hwc_apply_ext_request(omap3_hwc_device_t *hwc_dev)
 {
-    return o->cfg.win.w * o->cfg.win.h;
+    omap3_hwc_ext_t *ext = &hwc_dev->ext;
+    struct omap3_hwc_ext_request req;
+    __u32 gen;
+
+    do {
+        gen = __atomic_load_n(&hwc_dev->ext_req_gen, __ATOMIC_ACQUIRE);
+        if (gen == hwc_dev->ext_req_applied)
+            return;
+        req = hwc_dev->ext_req[gen & 1];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        /* retry if the event thread refilled the slot while we copied it */
+    } while (__atomic_load_n(&hwc_dev->ext_req_gen, __ATOMIC_RELAXED) != gen);
+
+    hwc_dev->ext_req_applied = gen;
+    ext->dock.enabled = ext->mirror.enabled = 0;
+    hdmi_enabled = req.hdmi_enabled;
+    tv_enabled = req.tv_enabled;
+    if (!hdmi_enabled && !tv_enabled)
+        ext->last_mode = 0;
+    /* another display may have been plugged in */
+    hwc_dev->modedb.valid = 0;
+    omap3_hwc_create_ext_matrix(ext);
+    hwc_dev->plan.valid = 0;
+}
+
+/*
+ * applies the SGX composition request of the idle timer: the next two posts
+ * are composed by SGX, so a still screen is scanned out of the framebuffer
+ */
+static void omap3_hwc_apply_idle_request(omap3_hwc_device_t *hwc_dev)
+{
+    if (__atomic_exchange_n(&hwc_dev->idle_req, 0, __ATOMIC_ACQ_REL)) {
+        __atomic_store_n(&hwc_dev->idle_frames, 2, __ATOMIC_RELAXED);
+        hwc_dev->plan.valid = 0;
+    }
+}
+
+/* whether the layer geometry and device state are those the plan was built for */
+static int omap3_hwc_plan_matches(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list)
+{
+    struct omap3_hwc_plan *plan = &hwc_dev->plan;
+    struct omap3_hwc_layer_key key;
+    unsigned int i;
+
+    if (!plan->valid || !list ||
+        (list->flags & HWC_GEOMETRY_CHANGED) ||
+        list->numHwLayers != plan->num_layers ||
+        get_plan_state(hwc_dev) != plan->state)
+        return 0;
+
+    for (i = 0; i < list->numHwLayers; i++) {
+        get_layer_key(&list->hwLayers[i], &key);
+        if (memcmp(&key, plan->key + i, sizeof(key)))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Whether the frame shows exactly what is on the screen: same plan, and
+ * every layer has the buffer and contents (ui64Stamp) that were posted.
+ * Layers SurfaceFlinger draws itself cannot be checked.
+ */
+static int omap3_hwc_is_static(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list)
+{
+    struct omap3_hwc_posted *posted = &hwc_dev->posted;
+    unsigned int i;
+
+    if (!posted->valid || posted->generation != hwc_dev->plan.generation ||
+        !list || !list->numHwLayers || list->numHwLayers != posted->num_layers ||
+        !omap3_hwc_plan_matches(hwc_dev, list))
+        return 0;
+
+    for (i = 0; i < list->numHwLayers; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+
+        if ((layer->flags & HWC_SKIP_LAYER) || !handle ||
+            layer->handle != posted->handle[i] || handle->ui64Stamp != posted->stamp[i])
+            return 0;
+    }
+    return 1;
+}
+
+static void omap3_hwc_record_posted(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list)
+{
+    struct omap3_hwc_posted *posted = &hwc_dev->posted;
+    unsigned int i;
+
+    posted->valid = list && list->numHwLayers <= MAX_CACHED_LAYERS;
+    if (!posted->valid)
+        return;
+
+    for (i = 0; i < list->numHwLayers; i++) {
+        IMG_native_handle_t *handle = (IMG_native_handle_t *)list->hwLayers[i].handle;
+
+        posted->handle[i] = list->hwLayers[i].handle;
+        posted->stamp[i] = handle ? handle->ui64Stamp : 0;
+    }
+    posted->num_layers = list->numHwLayers;
+    posted->generation = hwc_dev->plan.generation;
+}
+
+/* planes of a planar 4:2:0 buffer mapped at vaddr */
+static void omap3_hwc_get_planes(IMG_native_handle_t *handle, __u8 *vaddr, struct yuv_conv_planes *p)
+{
+    __u8 *c1, *c2;
+
+    /* laid out like YV12: 16-pixel aligned rows, chroma rows of half of that aligned to 16 */
+    p->y_stride = ALIGN(handle->iWidth, 16);
+    p->c_stride = ALIGN(p->y_stride / 2, 16);
+    c1 = vaddr + p->y_stride * handle->iHeight;
+    c2 = c1 + p->c_stride * ((handle->iHeight + 1) / 2);
+
+    p->y = vaddr;
+    /* YV12 has Cr first */
+    p->cb = handle->iFormat == HAL_PIXEL_FORMAT_YV12 ? c2 : c1;
+    p->cr = handle->iFormat == HAL_PIXEL_FORMAT_YV12 ? c1 : c2;
+}
+
+static void omap3_hwc_conv_release(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_conv *conv = &hwc_dev->conv;
+
+    /* the pool holds them back while they may be on screen */
+    if (conv->y) {
+        ion_pool_put(&hwc_dev->ion_pool, conv->y);
+        ion_pool_put(&hwc_dev->ion_pool, conv->uv);
+    }
+    conv->y = conv->uv = NULL;
+    conv->handle = NULL;
+}
+
+/* makes sure the NV12 copy holds the buffer of layer; returns 0 or -errno */
+static int omap3_hwc_convert(omap3_hwc_device_t *hwc_dev, hwc_layer_1_t *layer)
+{
+    struct omap3_hwc_conv *conv = &hwc_dev->conv;
+    struct omap3_hwc_backend *be = hwc_dev->backend;
+    IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+    hwc_rect_t r = omap3_hwc_conv_rect(layer);
+    int rot = layer->transform & HWC_TRANSFORM_ROT_90;
+    __u32 width = rot ? HEIGHT(r) : WIDTH(r);
+    __u32 height = rot ? WIDTH(r) : HEIGHT(r);
+    __u32 stride = ALIGN(width, HW_ALIGN);
+    struct omap3_hwc_ion_buf *y, *uv = NULL;
+    struct yuv_conv_planes planes;
+    void *vaddr;
+    __u64 t0, t;
+    int err = -ENOMEM;
+
+    if (conv->y && conv->handle == layer->handle && conv->stamp == handle->ui64Stamp &&
+        conv->transform == layer->transform && rects_equal(&conv->rect, &r)) {
+        conv->reuses++;
+        return 0;
+    }
+
+    /* new buffers, so that the copy on screen stays intact */
+    y = ion_pool_get(&hwc_dev->ion_pool, stride * height);
+    if (y)
+        uv = ion_pool_get(&hwc_dev->ion_pool, stride * ((height + 1) / 2));
+    if (uv)
+        err = be->ops->lock_buffer(be, layer->handle, &vaddr);
+    if (err) {
+        if (uv)
+            ion_pool_put(&hwc_dev->ion_pool, uv);
+        if (y)
+            ion_pool_put(&hwc_dev->ion_pool, y);
+        conv->failures++;
+        return err;
+    }
+
+    t0 = now_ns();
+    omap3_hwc_get_planes(handle, vaddr, &planes);
+    planes.y += r.top * planes.y_stride + r.left;
+    planes.cb += r.top / 2 * planes.c_stride + r.left / 2;
+    planes.cr += r.top / 2 * planes.c_stride + r.left / 2;
+    yuv_conv_to_nv12(&planes, WIDTH(r), HEIGHT(r), layer->transform, y->vaddr, uv->vaddr, stride);
+    t = now_ns() - t0;
+    be->ops->unlock_buffer(be, layer->handle);
+
+    conv->time_ns += t;
+    if (layer->transform) {
+        conv->rotations++;
+        conv->rot_pixels += (__u64) WIDTH(r) * HEIGHT(r);
+        conv->rot_time_ns += t;
+    }
+
+    omap3_hwc_conv_release(hwc_dev);
+    conv->handle = layer->handle;
+    conv->stamp = handle->ui64Stamp;
+    conv->transform = layer->transform;
+    conv->rect = r;
+    conv->y = y;
+    conv->uv = uv;
+    conv->conversions++;
+    return 0;
+}
+
+/*
+ * converts the planar layer in mask for its overlay; returns mask without the
+ * planar layers that cannot be scanned out
+ */
+static __u32 omap3_hwc_conv_plan(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list, __u32 mask)
+{
+    struct omap3_hwc_conv *conv = &hwc_dev->conv;
+    unsigned int i;
+
+    conv->ix = -1;
+    for (i = 0; list && i < list->numHwLayers && i < MAX_CACHED_LAYERS; i++) {
+        if (!(mask & (1U << i)) || !hwc_dev->layers[i].fmt->planar)
+            continue;
+        /* one copy at a time */
+        if (conv->ix < 0 && !omap3_hwc_convert(hwc_dev, &list->hwLayers[i])) {
+            conv->ix = i;
+            continue;
+        }
+        mask &= ~(1U << i);
+        hwc_dev->sgx_stats.layer_reason[i] = SGX_REASON_CONVERT;
+    }
+    if (conv->ix < 0)
+        omap3_hwc_conv_release(hwc_dev);
+    return mask;
+}
+
+/* converts the planar layers of an all-overlay composition; returns 0 and the reason if it cannot */
+static int omap3_hwc_conv_all(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list,
+                              struct counts *num, int *reason)
+{
+    if (omap3_hwc_conv_plan(hwc_dev, list, num->possible) == num->possible)
+        return 1;
+    *reason = SGX_REASON_CONVERT;
+    return 0;
+}
+
+/* sets up an overlay for the NV12 copy of layer, which has the transform applied */
+static void omap3_hwc_conv_setup_layer(omap3_hwc_device_t *hwc_dev, struct dss2_ovl_info *o,
+                                       hwc_layer_1_t *layer, int z)
+{
+    IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+    hwc_rect_t *r = &hwc_dev->conv.rect;
+    hwc_layer_1_t copy = *layer;
+    hwc_rect_t *c = &copy.sourceCrop;
+    int w = WIDTH(*r), h = HEIGHT(*r), t;
+
+    /* the crop in the copy, which starts at the corner of the converted rect */
+    c->left -= r->left;
+    c->right -= r->left;
+    c->top -= r->top;
+    c->bottom -= r->top;
+    if (layer->transform & HWC_TRANSFORM_FLIP_H) {
+        t = c->left;
+        c->left = w - c->right;
+        c->right = w - t;
+    }
+    if (layer->transform & HWC_TRANSFORM_FLIP_V) {
+        t = c->top;
+        c->top = h - c->bottom;
+        c->bottom = h - t;
+    }
+    if (layer->transform & HWC_TRANSFORM_ROT_90) {
+        /* clockwise: x counts the rows of the flipped buffer bottom up */
+        t = c->left;
+        c->left = h - c->bottom;
+        c->bottom = c->right;
+        c->right = h - c->top;
+        c->top = t;
+        swap(w, h);
+    }
+    copy.transform = 0;
+    omap3_hwc_setup_layer(hwc_dev, o, &copy, z, handle->iFormat, w, h);
+}
+
+/* points an overlay at the NV12 copy */
+static void omap3_hwc_conv_setup_ovl(omap3_hwc_device_t *hwc_dev, struct dss2_ovl_info *o)
+{
+    ion_pool_setup_ovl(hwc_dev->conv.y, o);
+    o->uv = (__u32) (unsigned long) hwc_dev->conv.uv->handle;
+}
+
+/* places the buffers of the composition to post in the TILER slot; returns 0 or -ENOSPC */
+static int omap3_hwc_place_buffers(omap3_hwc_device_t *hwc_dev, struct omap3_hwc_tiler_map *maps)
+{
+    unsigned int i;
+
+    for (i = 0; i < hwc_dev->post2_layers; i++)
+        omap3_hwc_get_map(hwc_dev->buffers[i], maps + i);
+    return tiler_slot_place(&hwc_dev->tiler, maps, hwc_dev->post2_layers);
+}
+
+/*
+ * If SurfaceFlinger did not change the geometry and the layers still match the
+ * ones the last plan was built for, reuse that plan and only patch in the new
+ * buffer handles.  Returns 1 if the plan was reused.
+ */
+static int omap3_hwc_reuse_plan(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list)
+{
+    struct omap3_hwc_plan *plan = &hwc_dev->plan;
+    struct dsscomp_setup_dispc_data *dsscomp = &hwc_dev->dsscomp_data;
+    struct omap3_hwc_tiler_map maps[MAX_HW_OVERLAYS];
+    unsigned int i;
+
+    if (!omap3_hwc_plan_matches(hwc_dev, list))
+        goto miss;
+
+    for (i = 0; i < hwc_dev->post2_layers; i++) {
+        if (plan->layer_ix[i] == FLAT_LAYER_IX)
+            hwc_dev->buffers[i] = hwc_dev->flat.buffer[hwc_dev->flat.cur];
+        else
+            hwc_dev->buffers[i] = plan->layer_ix[i] < 0 ? NULL : list->hwLayers[plan->layer_ix[i]].handle;
+    }
+    /* new buffers are mapped next to the ones on screen */
+    if (omap3_hwc_place_buffers(hwc_dev, maps))
+        goto miss;
+    /* and a new buffer of a planar layer is converted */
+    if (hwc_dev->conv.ix >= 0) {
+        if (omap3_hwc_convert(hwc_dev, &list->hwLayers[hwc_dev->conv.ix]))
+            goto miss;
+        for (i = 0; i < dsscomp->num_ovls; i++)
+            if (dsscomp->ovls[i].addressing == OMAP_DSS_BUFADDR_ION)
+                omap3_hwc_conv_setup_ovl(hwc_dev, dsscomp->ovls + i);
+    }
+
+    for (i = 0; i < list->numHwLayers; i++) {
+        list->hwLayers[i].compositionType = plan->composition[i];
+        list->hwLayers[i].hints = plan->hints[i];
+    }
+
+    plan->hits++;
+    return 1;
+
+miss:
+    plan->valid = 0;
+    plan->misses++;
+    return 0;
+}
+
+static void omap3_hwc_store_plan(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list)
+{
+    struct omap3_hwc_plan *plan = &hwc_dev->plan;
+    unsigned int i;
+
+    if (!list || list->numHwLayers > MAX_CACHED_LAYERS)
+        return;
+
+    for (i = 0; i < list->numHwLayers; i++) {
+        get_layer_key(&list->hwLayers[i], plan->key + i);
+        plan->composition[i] = list->hwLayers[i].compositionType;
+        plan->hints[i] = list->hwLayers[i].hints;
+    }
+    plan->num_layers = list->numHwLayers;
+    plan->state = get_plan_state(hwc_dev);
+    plan->generation++;
+    plan->valid = 1;
+}
+
+/* accounts the SGX reasons of the last composition for another frame */
+static void omap3_hwc_count_sgx_reasons(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_sgx_stats *stats = &hwc_dev->sgx_stats;
+    unsigned int i;
+
+    if (hwc_dev->use_sgx)
+        stats->frames[stats->frame_reason]++;
+    for (i = 0; i < stats->num_layers; i++)
+        if (stats->layer_reason[i] != SGX_REASON_NONE)
+            stats->layers[stats->layer_reason[i]]++;
+    if (hwc_dev->colorkey)
+        stats->colorkey_frames++;
+
+    if (hwc_dev->flat.mask) {
+        hwc_dev->flat.frames_used++;
+        hwc_dev->flat.area_saved += hwc_dev->flat.area;
+    }
+}
+
+static void omap3_hwc_get_layer_info(omap3_hwc_device_t *hwc_dev, hwc_layer_1_t *layer,
+                                     struct omap3_hwc_layer_info *info)
+{
+    IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+    struct dss2_ovl_info o;
+
+    memset(info, 0, sizeof(*info));
+    if (handle) {
+        info->fmt = omap3_hwc_get_format(handle->iFormat);
+        if (info->fmt)
+            info->mem = mem1d(handle, info->fmt);
+        omap3_hwc_get_map(layer->handle, &info->map);
+    }
+    info->reason = omap3_hwc_check_layer(hwc_dev, layer, info);
+    if (info->reason != SGX_REASON_NONE)
+        return;
+
+    /* NV12 layers can only be rendered on scaling overlays */
+    info->scaled = scaled(layer) || info->fmt->cls == FMT_NV12;
+    info->is_protected = is_protected(layer);
+    info->dockable = dockable(layer);
+
+    memset(&o, 0, sizeof(o));
+    omap3_hwc_setup_layer(hwc_dev, &o, layer, 0, handle->iFormat, handle->iWidth, handle->iHeight);
+    info->area = display_area(&o);
+    info->bw = ovl_bandwidth(&o.cfg, &hwc_dev->fb_dis.timings);
+}
+
+/*
+ * One pass over the layers for a new plan: fills hwc_dev->layers and counts
+ * the layers DSS could render.  Layers past the cache are counted, but never
+ * get an overlay.
+ */
+static void omap3_hwc_analyze_layers(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list,
+                                     struct counts *num)
+{
+    struct omap3_hwc_layer_info extra;
+    unsigned int i;
+
+    for (i = 0; list && i < list->numHwLayers; i++) {
+        struct omap3_hwc_layer_info *info = i < MAX_CACHED_LAYERS ? hwc_dev->layers + i : &extra;
+
+        omap3_hwc_get_layer_info(hwc_dev, &list->hwLayers[i], info);
+        if (info->reason != SGX_REASON_NONE)
+            continue;
+
+        num->possible_overlay_layers++;
+        if (info->scaled)
+            num->scaled_layers++;
+
+        if (info->fmt->cls == FMT_BGR)
+            num->BGR++;
+        else if (info->fmt->cls == FMT_RGB)
+            num->RGB++;
+        else
+            num->NV12++;
+
+        if (info->dockable)
+            num->dockable++;
+        if (info->is_protected)
+            num->protected++;
+
+        if (i < MAX_CACHED_LAYERS)
+            num->possible |= 1U << i;
+        num->bandwidth += info->bw;
+
+        /* Check if any of the layers are protected.
+         * if so, disable the SGX force usage
+         */
+        if (hwc_dev->force_sgx && info->is_protected)
+            hwc_dev->force_sgx = 0;
+    }
+}
+
+/* the framebuffer is scanned out 1:1 */
+static __u64 fb_bandwidth(omap3_hwc_device_t *hwc_dev)
+{
+    struct dss2_ovl_info o;
+
+    memset(&o, 0, sizeof(o));
+    omap3_hwc_setup_layer_base(&o.cfg, 0, hwc_dev->fb_dev->base.format, 1,
+                               hwc_dev->fb_dev->base.width, hwc_dev->fb_dev->base.height);
+    return ovl_bandwidth(&o.cfg, &hwc_dev->fb_dis.timings);
+}
+
+/* layer that could be put on an overlay */
+struct ovl_candidate {
+    int ix;                             /* layer index */
+    __u32 area;                         /* SGX fill avoided if on an overlay */
+    __u32 mem;                          /* TILER 1D slot usage */
+    const struct omap3_hwc_tiler_map *map;
+    __u64 bw;                           /* DSS DMA rate */
+    int scaled;                         /* needs a scaling (VID) pipe */
+    int blended;
+};
+
+struct ovl_search {
+    struct ovl_candidate cand[MAX_CACHED_LAYERS];
+    int num_cand;
+    int slots;                          /* overlays available for layers */
+    int max_scaled;
+    int use_sgx;
+    __u64 bw_limit;
+    const struct omap3_hwc_tiler_slot *tiler;
+    struct omap3_hwc_tiler_map maps[MAX_HW_OVERLAYS];   /* of the set being built */
+
+    __u32 best_mask;
+    __u64 best_area;
+    __u32 best_mem;
+};
+
+static void search_ovls(struct ovl_search *s, int c, __u32 mask, int count, int scaled,
+                        __u32 mem, __u64 bw, __u64 area)
+{
+    if (area > s->best_area || (area == s->best_area && area && mem < s->best_mem)) {
+        s->best_mask = mask;
+        s->best_area = area;
+        s->best_mem = mem;
+    }
+
+    for (; c < s->num_cand && count < s->slots; c++) {
+        struct ovl_candidate *o = s->cand + c;
+
+        if (scaled + o->scaled > s->max_scaled ||
+            bw + o->bw > s->bw_limit)
+            continue;
+        /* can't have a transparent overlay in the middle of the framebuffer stack */
+        if (o->blended && s->use_sgx && mask != (1U << o->ix) - 1)
+            continue;
+        /* the set is mapped in layer order */
+        s->maps[count] = *o->map;
+        if (o->map->pages && tiler_slot_place(s->tiler, s->maps, count + 1))
+            continue;
+
+        search_ovls(s, c + 1, mask | (1U << o->ix), count + 1, scaled + o->scaled,
+                    mem + o->mem, bw + o->bw, area + o->area);
+    }
+}
+
+/*
+ * Pick the set of DSS renderable layers that saves the most SGX fill.  Layers
+ * are scored by the display area they cover; ties go to the set using less
+ * TILER space.  Returns a mask of the layers to put on overlays.
+ */
+static __u32 omap3_hwc_plan_overlays(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list,
+                                     struct counts *num)
+{
+    struct ovl_search s = {
+        .slots = num->max_hw_overlays - hwc_dev->use_sgx,
+        .max_scaled = num->max_scaling_overlays,
+        .use_sgx = hwc_dev->use_sgx,
+        .bw_limit = hwc_dev->dss_bw_limit,
+        .tiler = &hwc_dev->tiler,
+    };
+    struct omap3_hwc_sgx_stats *stats = &hwc_dev->sgx_stats;
+    unsigned int i;
+    __u64 fb_bw = hwc_dev->use_sgx ? fb_bandwidth(hwc_dev) : 0;
+
+    for (i = 0; list && i < list->numHwLayers && i < MAX_CACHED_LAYERS; i++) {
+        struct omap3_hwc_layer_info *info = hwc_dev->layers + i;
+        int reason = dss_render_layer_reason(hwc_dev, info);
+
+        if (reason == SGX_REASON_NONE && hwc_dev->force_sgx &&
+            /* render protected and dockable layers via DSS */
+            !info->is_protected &&
+            !(hwc_dev->ext.current.docking && hwc_dev->ext.current.enabled && info->dockable))
+            reason = stats->frame_reason;
+        /* with a colour key, only the video is under the framebuffer */
+        if (reason == SGX_REASON_NONE && hwc_dev->colorkey && info->fmt->cls != FMT_NV12)
+            reason = SGX_REASON_ZORDER;
+        stats->layer_reason[i] = reason;
+        if (reason != SGX_REASON_NONE)
+            continue;
+
+        struct ovl_candidate *c = s.cand + s.num_cand++;
+        c->ix = i;
+        c->area = info->area;
+        c->mem = info->mem;
+        c->map = &info->map;
+        c->bw = info->bw;
+        c->scaled = info->scaled;
+        c->blended = is_BLENDED(list->hwLayers[i].blending);
+    }
+
+    search_ovls(&s, 0, 0, 0, 0, 0, fb_bw, 0);
+
+    /* candidates that did not make it did not fit the remaining overlays or budgets */
+    for (i = 0; i < s.num_cand; i++)
+        if (!(s.best_mask & (1U << s.cand[i].ix)) && s.cand[i].ix < MAX_CACHED_LAYERS)
+            stats->layer_reason[s.cand[i].ix] = SGX_REASON_OVERLAYS;
+    return s.best_mask;
+}
+
+static unsigned int flat_mem(hwc_rect_t *region, int format)
+{
+    return ALIGN(WIDTH(*region), HW_ALIGN) * omap3_hwc_get_format(format)->mem1d_bpp *
+           HEIGHT(*region);
+}
+
+/* frees a flattening buffer and returns its memory to the pool budget */
+static void omap3_hwc_flat_release(omap3_hwc_device_t *hwc_dev, buffer_handle_t *buffer)
+{
+    IMG_native_handle_t *handle = (IMG_native_handle_t *)*buffer;
+    hwc_rect_t r = { 0, 0, handle->iWidth, handle->iHeight };
+
+    /* the handle is gone after the free */
+    ion_pool_unreserve(&hwc_dev->ion_pool, flat_mem(&r, handle->iFormat));
+    hwc_dev->backend->ops->free_buffer(hwc_dev->backend, *buffer);
+    *buffer = NULL;
+}
+
+static void omap3_hwc_flat_free(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_flat *flat = &hwc_dev->flat;
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (flat->buffer[i])
+            omap3_hwc_flat_release(hwc_dev, &flat->buffer[i]);
+    flat->valid = 0;
+}
+
+/*
+ * Follows the first video layer for one frame.  Returns 1 if the plan has to
+ * be rebuilt because a transition started or ended.
+ */
+static int omap3_hwc_transition_update(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list)
+{
+    struct omap3_hwc_transition *t = &hwc_dev->transition;
+    hwc_layer_1_t *video = NULL;
+    int active = t->active;
+    unsigned int i;
+
+    for (i = 0; list && i < list->numHwLayers && !video; i++) {
+        IMG_native_handle_t *handle = (IMG_native_handle_t *)list->hwLayers[i].handle;
+
+        if (handle && is_NV12(handle->iFormat))
+            video = &list->hwLayers[i];
+    }
+
+    if (!video) {
+        t->valid = 0;
+        t->active = 0;
+        return active;
+    }
+
+    if (!t->valid || (list->flags & HWC_GEOMETRY_CHANGED) ||
+        video->transform != t->transform ||
+        !rects_equal(&video->sourceCrop, &t->sourceCrop) ||
+        !rects_equal(&video->displayFrame, &t->displayFrame)) {
+        t->valid = 1;
+        t->transform = video->transform;
+        t->sourceCrop = video->sourceCrop;
+        t->displayFrame = video->displayFrame;
+        t->still = 0;
+    } else if (t->still < t->frames) {
+        t->still++;
+    }
+
+    t->active = t->still < t->frames;
+    if (t->active && !active)
+        t->transitions++;
+    return t->active != active;
+}
+
+/*
+ * Ages the layers by one frame.  Returns 1 if the plan has to be rebuilt
+ * because a flattened layer changed or a layer just became old enough to be
+ * flattened.
+ */
+static int omap3_hwc_flat_update(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list)
+{
+    struct omap3_hwc_flat *flat = &hwc_dev->flat;
+    unsigned int i, n = list ? min(list->numHwLayers, (size_t) MAX_CACHED_LAYERS) : 0;
+    int replan = 0;
+
+    if (!flat->frames)
+        return 0;
+
+    /* layers may have been added, removed or moved */
+    if (!list || (list->flags & HWC_GEOMETRY_CHANGED) || n != flat->num_layers) {
+        memset(flat->age, 0, sizeof(flat->age));
+        flat->num_layers = n;
+        if (flat->valid)
+            flat->invalidations++;
+        flat->valid = 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        IMG_native_handle_t *handle = (IMG_native_handle_t *)list->hwLayers[i].handle;
+        __u64 stamp = handle ? handle->ui64Stamp : 0;
+
+        if (list->hwLayers[i].handle != flat->handle[i] || stamp != flat->stamp[i]) {
+            flat->handle[i] = list->hwLayers[i].handle;
+            flat->stamp[i] = stamp;
+            flat->age[i] = 0;
+            if (flat->valid && (flat->contents & (1U << i))) {
+                flat->valid = 0;
+                flat->invalidations++;
+            }
+            if (flat->mask & (1U << i))
+                replan = 1;
+        } else if (flat->age[i] < flat->frames && ++flat->age[i] == flat->frames) {
+            replan = 1;
+        }
+    }
+    return replan;
+}
+
+/* whether Blit2 can copy the layer into a flattened buffer as it is */
+static int omap3_hwc_can_flatten(omap3_hwc_device_t *hwc_dev, hwc_layer_1_t *layer)
+{
+    IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+    hwc_rect_t *f = &layer->displayFrame;
+
+    if (!handle || (layer->flags & HWC_SKIP_LAYER) || is_protected(layer) ||
+        !(is_RGB(handle->iFormat) || is_BGR(handle->iFormat)))
+        return 0;
+    /* Blit2 copies from the buffer origin, without scaling or transform */
+    if (layer->transform || scaled(layer) || layer->sourceCrop.left || layer->sourceCrop.top)
+        return 0;
+    /* nor blending: the copy is right for opaque and premultiplied layers over black */
+    if (layer->blending != HWC_BLENDING_NONE && layer->blending != HWC_BLENDING_PREMULT)
+        return 0;
+    if (f->left < 0 || f->top < 0 || f->left >= f->right || f->top >= f->bottom ||
+        f->right > (int) hwc_dev->fb_dev->base.width || f->bottom > (int) hwc_dev->fb_dev->base.height)
+        return 0;
+    /* same rules as for any other overlay */
+    if (hwc_dev->flags_nv12_only ||
+        ((hwc_dev->swap_rb ? is_RGB(handle->iFormat) : is_BGR(handle->iFormat)) &&
+         hwc_dev->flags_rgb_order))
+        return 0;
+    return 1;
+}
+
+/* sets up an overlay for a flattened buffer covering region */
+static void omap3_hwc_setup_flat(omap3_hwc_device_t *hwc_dev, struct dss2_ovl_info *o,
+                                 hwc_rect_t *region, int format, int z)
+{
+    hwc_layer_1_t layer;
+
+    memset(&layer, 0, sizeof(layer));
+    layer.blending = HWC_BLENDING_NONE;
+    layer.sourceCrop.right = WIDTH(*region);
+    layer.sourceCrop.bottom = HEIGHT(*region);
+    layer.displayFrame = *region;
+    omap3_hwc_setup_layer(hwc_dev, o, &layer, z, format, WIDTH(*region), HEIGHT(*region));
+}
+
+/* copies the layers in mask into the buffer that is not on screen */
+static int omap3_hwc_flat_build(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list,
+                                __u32 mask, hwc_rect_t *region, int format)
+{
+    struct omap3_hwc_backend *be = hwc_dev->backend;
+    struct omap3_hwc_flat *flat = &hwc_dev->flat;
+    int next = flat->cur ^ 1;
+    IMG_native_handle_t *handle = (IMG_native_handle_t *)flat->buffer[next];
+    unsigned int i;
+    int err;
+
+    if (handle && (handle->iFormat != format || handle->iWidth != WIDTH(*region) ||
+                   handle->iHeight != HEIGHT(*region)))
+        omap3_hwc_flat_release(hwc_dev, &flat->buffer[next]);
+    if (!flat->buffer[next]) {
+        /* gralloc memory, but it counts against the composer's footprint */
+        err = ion_pool_reserve(&hwc_dev->ion_pool, flat_mem(region, format));
+        if (err)
+            return err;
+        err = be->ops->alloc_buffer(be, WIDTH(*region), HEIGHT(*region), format, &flat->buffer[next]);
+        if (err) {
+            ion_pool_unreserve(&hwc_dev->ion_pool, flat_mem(region, format));
+            flat->buffer[next] = NULL;
+            return err;
+        }
+    }
+
+    for (i = 0; i < list->numHwLayers && i < MAX_CACHED_LAYERS; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+
+        if (!(mask & (1U << i)))
+            continue;
+        err = be->ops->blit(be, layer->handle, flat->buffer[next],
+                            WIDTH(layer->displayFrame), HEIGHT(layer->displayFrame),
+                            layer->displayFrame.left - region->left,
+                            layer->displayFrame.top - region->top);
+        if (err)
+            return err;
+    }
+
+    flat->cur = next;
+    flat->contents = mask;
+    flat->region = *region;
+    flat->valid = 1;
+    flat->builds++;
+    return 0;
+}
+
+/*
+ * Picks the layers to flatten in this composition, next to the overlays in
+ * ovl_mask, and makes sure the current buffer holds them.  These are the
+ * longest run of old enough layers from the bottom that Blit2 can copy, that
+ * do not overlap and that together cover a rectangle.  Returns their mask.
+ */
+static __u32 omap3_hwc_flat_plan(omap3_hwc_device_t *hwc_dev, hwc_display_contents_1_t *list,
+                                 __u32 ovl_mask)
+{
+    struct omap3_hwc_flat *flat = &hwc_dev->flat;
+    struct dss2_ovl_info o;
+    hwc_rect_t bounds = { 0, 0, 0, 0 }, region = { 0, 0, 0, 0 };
+    struct omap3_hwc_tiler_map maps[MAX_HW_OVERLAYS];
+    __u32 mask = 0, run = 0, area = 0;
+    __u64 bw;
+    int format = 0, rebuild, err, n;
+    unsigned int i, j;
+
+    /* OMAP3 has no z-order: only layers under the framebuffer can be flattened */
+    if (!flat->frames || !list || !hwc_dev->use_sgx || hwc_dev->colorkey || hdmi_enabled || tv_enabled ||
+        (int) __builtin_popcount(ovl_mask) >= MAX_HW_OVERLAYS - hwc_dev->last_ext_ovls - 1)
+        goto out;
+
+    for (i = 0; i < list->numHwLayers && i < MAX_FLAT_LAYERS; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+        hwc_rect_t *f = &layer->displayFrame;
+
+        if (flat->age[i] < flat->frames || !omap3_hwc_can_flatten(hwc_dev, layer) ||
+            (format && handle->iFormat != format))
+            break;
+        for (j = 0; j < i; j++)
+            if (rects_overlap(f, &list->hwLayers[j].displayFrame))
+                break;
+        if (j < i)
+            break;
+
+        format = handle->iFormat;
+        if (i) {
+            bounds.left = min(bounds.left, f->left);
+            bounds.top = min(bounds.top, f->top);
+            bounds.right = max(bounds.right, f->right);
+            bounds.bottom = max(bounds.bottom, f->bottom);
+        } else {
+            bounds = *f;
+        }
+        area += WIDTH(*f) * HEIGHT(*f);
+        run |= 1U << i;
+
+        /* anything in the buffer that no layer covers would show up */
+        if (area == (__u32) (WIDTH(bounds) * HEIGHT(bounds))) {
+            mask = run;
+            region = bounds;
+        }
+    }
+    if (!mask)
+        goto out;
+
+    rebuild = !flat->valid || mask != flat->contents || memcmp(&region, &flat->region, sizeof(region)) ||
+              ((IMG_native_handle_t *)flat->buffer[flat->cur])->iFormat != format;
+
+    /*
+     * the buffers and the overlay have to fit into the limits; a rebuilt
+     * buffer is mapped while the current one is still on screen
+     */
+    memset(&o, 0, sizeof(o));
+    omap3_hwc_setup_flat(hwc_dev, &o, &region, format, 0);
+    bw = fb_bandwidth(hwc_dev) + ovl_bandwidth(&o.cfg, &hwc_dev->fb_dis.timings);
+    if (rebuild) {
+        memset(maps, 0, sizeof(*maps));
+        maps[0].pages = tiler_slot_pages(flat_mem(&region, format));
+    } else {
+        omap3_hwc_get_map(flat->buffer[flat->cur], maps);
+    }
+    for (i = 0, n = 1; i < list->numHwLayers && i < MAX_CACHED_LAYERS; i++) {
+        if (ovl_mask & (1U << i)) {
+            /* fewer than MAX_HW_OVERLAYS - 1, see above */
+            maps[n++] = hwc_dev->layers[i].map;
+            bw += hwc_dev->layers[i].bw;
+        }
+    }
+    if (2 * flat_mem(&region, format) > flat->max_mem || tiler_slot_place(&hwc_dev->tiler, maps, n) ||
+        bw > hwc_dev->dss_bw_limit) {
+        mask = 0;
+        goto out;
+    }
+
+    if (rebuild) {
+        err = omap3_hwc_flat_build(hwc_dev, list, mask, &region, format);
+        if (err == -ENOMEM) {
+            /* try again with the next plan */
+            mask = 0;
+            goto out;
+        } else if (err) {
+            ALOGW("layer flattening failed (%d), disabling it", err);
+            flat->frames = 0;
+            flat->valid = 0;
+            mask = 0;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < MAX_CACHED_LAYERS; i++)
+        if (mask & (1U << i))
+            hwc_dev->sgx_stats.layer_reason[i] = SGX_REASON_NONE;
+    flat->area = WIDTH(region) * HEIGHT(region);
+
+out:
+    flat->mask = mask;
+    if (!mask)
+        flat->area = 0;
+    return mask;
+}
+
+/* frees the buffers once flattening has been off the screen for a frame */
+static void omap3_hwc_flat_posted(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_flat *flat = &hwc_dev->flat;
+
+    if (flat->mask)
+        flat->idle_posts = 0;
+    else if ((flat->buffer[0] || flat->buffer[1]) && ++flat->idle_posts > 1)
+        omap3_hwc_flat_free(hwc_dev);
 }
 
 static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDisplays,
@@ -939,47 +2958,60 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
     omap3_hwc_device_t *hwc_dev = (omap3_hwc_device_t *)dev;
     struct dsscomp_setup_dispc_data *dsscomp = &hwc_dev->dsscomp_data;
     struct counts num = { .composited_layers = list ? list->numHwLayers : 0 };
+    struct omap3_hwc_sgx_stats *stats = &hwc_dev->sgx_stats;
     unsigned int i, ix;
     int num_fb = 0;
+    int colorkey = 0;
+    int reason = SGX_REASON_UI;
 
-    pthread_mutex_lock(&hwc_dev->lock);
-    memset(dsscomp, 0x0, sizeof(*dsscomp));
-    dsscomp->sync_id = sync_id++;
-	hwc_dev->force_sgx = 1; //Always all UI layers have to go to SGX for composition in OMAP3.
-
-    /* Figure out how many layers we can support via DSS */
-    for (i = 0; list && i < list->numHwLayers; i++) {
-        hwc_layer_1_t *layer = &list->hwLayers[i];
-        IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
+    omap3_hwc_lock(hwc_dev);
 
-        layer->compositionType = HWC_FRAMEBUFFER;
+    if (hwc_dev->trace_fd >= 0)
+        omap3_hwc_trace_contents(hwc_dev, HWC_TRACE_PREPARE, list);
 
-        if (omap3_hwc_is_valid_layer(hwc_dev, layer, handle)) {
-            num.possible_overlay_layers++;
+    omap3_hwc_apply_ext_request(hwc_dev);
+    omap3_hwc_apply_idle_request(hwc_dev);
+    if (omap3_hwc_apply_mode_switch(hwc_dev))
+        hwc_dev->plan.valid = 0;
 
-            /* NV12 layers can only be rendered on scaling overlays */
-            if (scaled(layer) || is_NV12(handle->iFormat))
-                num.scaled_layers++;
+    /*
+     * nothing changed since the last post: claim all layers, so that
+     * SurfaceFlinger does not draw, and let set skip the swap and the post
+     */
+    hwc_dev->skip_frame = omap3_hwc_is_static(hwc_dev, list);
+    if (hwc_dev->skip_frame) {
+        for (i = 0; i < list->numHwLayers; i++) {
+            list->hwLayers[i].compositionType = HWC_OVERLAY;
+            list->hwLayers[i].hints = 0;
+        }
+        omap3_hwc_unlock(hwc_dev);
+        return 0;
+    }
 
-            if (is_BGR(handle->iFormat))
-                num.BGR++;
-            else if (is_RGB(handle->iFormat))
-                num.RGB++;
-            else if (is_NV12(handle->iFormat))
-                num.NV12++;
+    /* flattened layers changed, or there are new layers to flatten */
+    if (omap3_hwc_flat_update(hwc_dev, list))
+        hwc_dev->plan.valid = 0;
+    /* the video layer started or stopped moving */
+    if (omap3_hwc_transition_update(hwc_dev, list))
+        hwc_dev->plan.valid = 0;
+
+    /* geometry unchanged: only the buffers and the sync id need updating */
+    if (omap3_hwc_reuse_plan(hwc_dev, list)) {
+        omap3_hwc_count_sgx_reasons(hwc_dev);
+        dsscomp->sync_id = sync_id++;
+        omap3_hwc_unlock(hwc_dev);
+        return 0;
+    }
 
-            if (dockable(layer))
-                num.dockable++;
+    memset(dsscomp, 0x0, sizeof(*dsscomp));
+    dsscomp->sync_id = sync_id++;
+	hwc_dev->force_sgx = 1; //Always all UI layers have to go to SGX for composition in OMAP3.
 
-            num.mem += mem1d(handle);
+    /* Figure out how many layers we can support via DSS */
+    for (i = 0; list && i < list->numHwLayers; i++)
+        list->hwLayers[i].compositionType = HWC_FRAMEBUFFER;
+    omap3_hwc_analyze_layers(hwc_dev, list, &num);
 
-           /* Check if any of the layers are protected.
-           * if so, disable the SGX force usage
-           */
-            if (hwc_dev->force_sgx && is_protected(layer))
-                hwc_dev->force_sgx = 0;
-        }
-    }
     /* hack for OMAP3: OMAP3 doesn't support z-order hence whenever
      * more than one FB and overlay comes then this has to go from SGX
      */
@@ -991,17 +3023,37 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
     {
           hwc_dev->force_sgx = 0;
     }
+    else if (num.NV12 && hwc_dev->flags_colorkey && omap3_hwc_colorkey_possible(hwc_dev, list))
+    {
+          /* the UI is on top: key the framebuffer instead of blending the video with SGX */
+          hwc_dev->force_sgx = 0;
+          colorkey = 1;
+    }
+    else if (num.NV12)
+    {
+          reason = SGX_REASON_ZORDER;
+    }
 
     /* Fix for lenovo tablet, during rotation the transition was rendered
-       by DSS. Added condition to force transition to happed through SGX.
+       by DSS. Force the transition to happen through SGX, but only while the
+       video layer is moving.
     */
-    if (num.NV12 && (num.possible_overlay_layers == 1))
+    if (num.NV12 && (num.possible_overlay_layers == 1) && hwc_dev->transition.active)
     {
           hwc_dev->force_sgx = 1;
+          reason = SGX_REASON_TRANSITION;
+    }
+
+    /* the screen went idle; protected layers still have to go to the DSS */
+    if (hwc_dev->idle_frames && !num.protected) {
+        hwc_dev->force_sgx = 1;
+        colorkey = 0;
+        reason = SGX_REASON_IDLE;
     }
 
     /* phase 3 logic */
-    if (!hwc_dev->force_sgx && can_dss_render_all(hwc_dev, &num)) {
+    if (!hwc_dev->force_sgx && can_dss_render_all(hwc_dev, &num, &reason) &&
+        omap3_hwc_conv_all(hwc_dev, list, &num, &reason)) {
         /* All layers can be handled by the DSS -- don't use SGX for composition */
         hwc_dev->use_sgx = 0;
         hwc_dev->swap_rb = num.BGR != 0;
@@ -1010,6 +3062,9 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
         hwc_dev->use_sgx = 1;
         hwc_dev->swap_rb = is_BGR(hwc_dev->fb_dev->base.format);
     }
+    stats->frame_reason = hwc_dev->use_sgx ? reason : SGX_REASON_NONE;
+    hwc_dev->colorkey = colorkey && hwc_dev->use_sgx;
+    stats->num_layers = list ? min(list->numHwLayers, (size_t) MAX_CACHED_LAYERS) : 0;
   
     /*if (debug) {
         ALOGD("prepare (%d) - %s (comp=%d, poss=%d/%d scaled, RGB=%d,BGR=%d,NV12=%d) (ext=%s%s%ddeg%s %dex/%dmx (last %dex,%din)\n",
@@ -1031,25 +3086,39 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
     int fb_z = -1;
     int scaled_gfx = 0;
     int ix_docking = -1;
+    __u32 ovl_mask = omap3_hwc_plan_overlays(hwc_dev, list, &num);
+    /* planar layers are scanned out from an NV12 copy */
+    ovl_mask = omap3_hwc_conv_plan(hwc_dev, list, ovl_mask);
+    __u32 flat_mask = omap3_hwc_flat_plan(hwc_dev, list, ovl_mask);
 
     /* set up if DSS layers */
-    unsigned int mem_used = 0;
     hwc_dev->ovls_blending = 0;
     for (i = 0; list && i < list->numHwLayers; i++) {
         hwc_layer_1_t *layer = &list->hwLayers[i];
         IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
 
-        if (dsscomp->num_ovls < num.max_hw_overlays &&
-            can_dss_render_layer(hwc_dev, layer) &&
-            (!hwc_dev->force_sgx ||
-             /* render protected and dockable layers via DSS */
-             is_protected(layer) ||
-             (hwc_dev->ext.current.docking && hwc_dev->ext.current.enabled && dockable(layer))) &&
-            mem_used + mem1d(handle) < MAX_TILER_SLOT &&
-            /* can't have a transparent overlay in the middle of the framebuffer stack */
-            !(is_BLENDED(layer->blending) && fb_z >= 0)) {
+        if (i < MAX_CACHED_LAYERS && (flat_mask & (1U << i))) {
+            /* the flattened layers start at the bottom and share one overlay */
+            layer->compositionType = HWC_OVERLAY;
+            layer->hints |= HWC_HINT_CLEAR_FB;
+            if (i)
+                continue;
+
+            hwc_dev->buffers[dsscomp->num_ovls] = hwc_dev->flat.buffer[hwc_dev->flat.cur];
+            hwc_dev->plan.layer_ix[dsscomp->num_ovls] = FLAT_LAYER_IX;
+
+            omap3_hwc_setup_flat(hwc_dev, &dsscomp->ovls[dsscomp->num_ovls], &hwc_dev->flat.region,
+                                 ((IMG_native_handle_t *)hwc_dev->buffers[dsscomp->num_ovls])->iFormat, z);
+
+            dsscomp->ovls[dsscomp->num_ovls].cfg.ix = dsscomp->num_ovls;
+            dsscomp->ovls[dsscomp->num_ovls].addressing = OMAP_DSS_BUFADDR_LAYER_IX;
+            dsscomp->ovls[dsscomp->num_ovls].ba = dsscomp->num_ovls;
+            dsscomp->ovls[dsscomp->num_ovls].cfg.mgr_ix = 0;
+
+            dsscomp->num_ovls++;
+            z++;
+        } else if (i < MAX_CACHED_LAYERS && (ovl_mask & (1U << i))) {
             /* render via DSS overlay */
-            mem_used += mem1d(handle);
             layer->compositionType = HWC_OVERLAY;
 
             /* clear FB above all opaque layers if rendering via SGX */
@@ -1063,18 +3132,24 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
                 hwc_dev->ovls_blending = 1;
 
             hwc_dev->buffers[dsscomp->num_ovls] = layer->handle;
+            hwc_dev->plan.layer_ix[dsscomp->num_ovls] = i;
 
-            omap3_hwc_setup_layer(hwc_dev,
-                                  &dsscomp->ovls[dsscomp->num_ovls],
-                                  layer,
-                                  z,
-                                  handle->iFormat,
-                                  handle->iWidth,
-                                  handle->iHeight);
+            if ((int) i == hwc_dev->conv.ix)
+                omap3_hwc_conv_setup_layer(hwc_dev, &dsscomp->ovls[dsscomp->num_ovls], layer, z);
+            else
+                omap3_hwc_setup_layer(hwc_dev,
+                                      &dsscomp->ovls[dsscomp->num_ovls],
+                                      layer,
+                                      z,
+                                      handle->iFormat,
+                                      handle->iWidth,
+                                      handle->iHeight);
 
             dsscomp->ovls[dsscomp->num_ovls].cfg.ix = dsscomp->num_ovls;
             dsscomp->ovls[dsscomp->num_ovls].addressing = OMAP_DSS_BUFADDR_LAYER_IX;
             dsscomp->ovls[dsscomp->num_ovls].ba = dsscomp->num_ovls;
+            if ((int) i == hwc_dev->conv.ix)
+                omap3_hwc_conv_setup_ovl(hwc_dev, &dsscomp->ovls[dsscomp->num_ovls]);
 
 	    if(tv_enabled)
 		dsscomp->ovls[dsscomp->num_ovls].cfg.mgr_ix = 1;
@@ -1083,8 +3158,8 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
 
             /* ensure GFX layer is never scaled */
             if (dsscomp->num_ovls == 0) {
-                scaled_gfx = scaled(layer) || is_NV12(handle->iFormat);
-            } else if (scaled_gfx && !scaled(layer) && !is_NV12(handle->iFormat)) {
+                scaled_gfx = hwc_dev->layers[i].scaled;
+            } else if (scaled_gfx && !hwc_dev->layers[i].scaled) {
                 /* swap GFX layer with this one */
                 dsscomp->ovls[dsscomp->num_ovls].cfg.ix = 0;
                 dsscomp->ovls[0].cfg.ix = dsscomp->num_ovls;
@@ -1092,7 +3167,7 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
             }
 
             /* remember largest dockable layer */
-            if (dockable(layer) &&
+            if (hwc_dev->layers[i].dockable &&
                 (ix_docking < 0 ||
                  display_area(dsscomp->ovls + dsscomp->num_ovls) > display_area(dsscomp->ovls + ix_docking)))
                 ix_docking = dsscomp->num_ovls;
@@ -1125,6 +3200,7 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
         }
 
         hwc_dev->buffers[0] = NULL;
+        hwc_dev->plan.layer_ix[0] = -1;
         omap3_hwc_setup_layer_base(&dsscomp->ovls[0].cfg, fb_z,
                                    hwc_dev->fb_dev->base.format,
                                    1,   /* FB is always premultiplied */
@@ -1156,7 +3232,7 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
                 __u32 yres = HEIGHT(hwc_dev->ext.mirror_region);
                 if (hwc_dev->ext.current.rotation & 1)
                    swap(xres, yres);
-                omap3_hwc_set_best_hdmi_mode(hwc_dev, xres, yres, 1.);
+                omap3_hwc_set_best_hdmi_mode(hwc_dev, xres, yres, make_ratio(1, 1));
                 set_ext_matrix(&hwc_dev->ext, hwc_dev->ext.mirror_region);
             }
         }
@@ -1169,26 +3245,22 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
             /* reserve overlays at end for other display */
             o->cfg.ix = MAX_HW_OVERLAYS - 1 - (ix - ix_back);
             o->cfg.mgr_ix = 1;
-            o->ba = ix;
+            if (o->addressing == OMAP_DSS_BUFADDR_LAYER_IX)
+                o->ba = ix;
 
             if (hwc_dev->ext.current.docking) {
                 /* full screen video after transformation */
                 __u32 xres = o->cfg.crop.w, yres = o->cfg.crop.h;
                 if ((hwc_dev->ext.current.rotation + o->cfg.rotation) & 1)
                     swap(xres, yres);
-                float xpy = (float) o->cfg.win.w / o->cfg.win.h;
-                if (o->cfg.rotation & 1)
-                    xpy = o->cfg.crop.h / xpy / o->cfg.crop.w;
-                else
-                    xpy = o->cfg.crop.h * xpy / o->cfg.crop.w;
-                if (hwc_dev->ext.current.rotation & 1)
-                    xpy = 1. / xpy;
+                struct ratio xpy = ovl_pixel_ratio(&hwc_dev->ext, &o->cfg);
+                struct ratio last = hwc_dev->ext.last_xpy;
 
                 /* adjust hdmi mode based on resolution */
                 if (xres != hwc_dev->ext.last_xres_used ||
                     yres != hwc_dev->ext.last_yres_used ||
-                    xpy < hwc_dev->ext.last_xpy * (1.f - ASPECT_RATIO_TOLERANCE) ||
-                    xpy * (1.f - ASPECT_RATIO_TOLERANCE) > hwc_dev->ext.last_xpy) {
+                    ratio_below((__u64) xpy.num * last.den, (__u64) last.num * xpy.den) ||
+                    ratio_below((__u64) last.num * xpy.den, (__u64) xpy.num * last.den)) {
                     /*ALOGD("set up HDMI for %d*%d\n", xres, yres);*/
                     if (omap3_hwc_set_best_hdmi_mode(hwc_dev, xres, yres, xpy)) {
                         o->cfg.enabled = 0;
@@ -1204,6 +3276,9 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
                 };
                 set_ext_matrix(&hwc_dev->ext, region);
             }
+            /* keep the external display dark until the mode worker is done */
+            if (omap3_hwc_mode_switching(hwc_dev))
+                continue;
             omap3_hwc_adjust_ext_layer(&hwc_dev->ext, o);
             dsscomp->num_ovls++;
             z++;
@@ -1226,13 +3301,18 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
         ix |= 1 << c->ix;
     }
 
+    /* only needed if the video actually made it onto an overlay */
+    hwc_dev->colorkey = hwc_dev->colorkey && ovl_mask;
+
     dsscomp->mode = DSSCOMP_SETUP_DISPLAY;
     dsscomp->mgrs[0].ix = 0;
-    dsscomp->mgrs[0].alpha_blending = 1;
+    dsscomp->mgrs[0].alpha_blending = !hwc_dev->colorkey;
     /*
      Enable transperency key to make graphics & video layers visible together
     */
-    dsscomp->mgrs[0].trans_enabled = 0;
+    dsscomp->mgrs[0].trans_enabled = hwc_dev->colorkey;
+    dsscomp->mgrs[0].trans_key_type = OMAP_DSS_COLOR_KEY_GFX_DST;
+    dsscomp->mgrs[0].trans_key = COLORKEY;
     dsscomp->mgrs[0].swap_rb = hwc_dev->swap_rb;
     dsscomp->num_mgrs = 1;
 
@@ -1241,10 +3321,76 @@ static int omap3_hwc_prepare(struct hwc_composer_device_1 *dev, size_t numDispla
         dsscomp->mgrs[1].ix = 1;
         dsscomp->num_mgrs++;
     }
-    pthread_mutex_unlock(&hwc_dev->lock);
+
+    hwc_dev->dss_bw = omap3_hwc_dispc_bandwidth(hwc_dev, dsscomp);
+    if (hwc_dev->dss_bw > hwc_dev->dss_bw_limit)
+        ALOGW("composition needs %lluMB/s of DSS bandwidth (limit %lluMB/s)",
+              hwc_dev->dss_bw >> 20, hwc_dev->dss_bw_limit >> 20);
+
+    omap3_hwc_count_sgx_reasons(hwc_dev);
+    omap3_hwc_store_plan(hwc_dev, list);
+    omap3_hwc_unlock(hwc_dev);
     return 0;
 }
 
+/*
+ * All-overlay frames have to be on screen before SurfaceFlinger may reuse the
+ * buffers of the frame before.  Instead of waiting for the vsync in set, the
+ * present worker waits for it, and the next set waits for the worker.  So set
+ * returns right after Post2 while at most one frame is in flight.
+ */
+static void *omap3_hwc_present_thread(void *data)
+{
+    omap3_hwc_device_t *hwc_dev = data;
+    int err;
+
+    setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
+
+    pthread_mutex_lock(&hwc_dev->present_lock);
+    do {
+        while (!hwc_dev->present_pending && !__atomic_load_n(&hwc_dev->quit, __ATOMIC_RELAXED))
+            pthread_cond_wait(&hwc_dev->present_cond, &hwc_dev->present_lock);
+        if (__atomic_load_n(&hwc_dev->quit, __ATOMIC_RELAXED))
+            break;
+        pthread_mutex_unlock(&hwc_dev->present_lock);
+
+        err = hwc_dev->backend->ops->wait_vsync(hwc_dev->backend);
+        if (err)
+            ALOGE("failed to wait for vsync (%d)", -err);
+
+        pthread_mutex_lock(&hwc_dev->present_lock);
+        hwc_dev->present_pending = 0;
+        pthread_cond_broadcast(&hwc_dev->present_cond);
+    } while (1);
+    pthread_mutex_unlock(&hwc_dev->present_lock);
+
+    return NULL;
+}
+
+/* waits until the frame in flight is presented; returns the time waited in ns */
+static __u64 omap3_hwc_wait_present(omap3_hwc_device_t *hwc_dev)
+{
+    __u64 start = 0;
+
+    pthread_mutex_lock(&hwc_dev->present_lock);
+    if (hwc_dev->present_pending) {
+        start = now_ns();
+        while (hwc_dev->present_pending)
+            pthread_cond_wait(&hwc_dev->present_cond, &hwc_dev->present_lock);
+    }
+    pthread_mutex_unlock(&hwc_dev->present_lock);
+
+    return start ? now_ns() - start : 0;
+}
+
+static void omap3_hwc_queue_present(omap3_hwc_device_t *hwc_dev)
+{
+    pthread_mutex_lock(&hwc_dev->present_lock);
+    hwc_dev->present_pending = 1;
+    pthread_cond_signal(&hwc_dev->present_cond);
+    pthread_mutex_unlock(&hwc_dev->present_lock);
+}
+
 static int omap3_hwc_set(struct hwc_composer_device_1 *dev,
         size_t numDisplays, hwc_display_contents_1_t** displays)
 {
@@ -1261,82 +3407,43 @@ static int omap3_hwc_set(struct hwc_composer_device_1 *dev,
     }
     omap3_hwc_device_t *hwc_dev = (omap3_hwc_device_t *)dev;
     struct dsscomp_setup_dispc_data *dsscomp = &hwc_dev->dsscomp_data;
+    struct omap3_hwc_tiler_map maps[MAX_HW_OVERLAYS];
     int err = 0;
-    unsigned int i;
     int invalidate;
+    __u64 t0, t1, t2, wait;
 
-    pthread_mutex_lock(&hwc_dev->lock);
+    /* keep at most one frame in flight */
+    wait = omap3_hwc_wait_present(hwc_dev);
+
+    omap3_hwc_lock(hwc_dev);
+
+    if (hwc_dev->trace_fd >= 0)
+        omap3_hwc_trace_contents(hwc_dev, HWC_TRACE_SET, list);
 
     invalidate = hwc_dev->ext_ovls_wanted && !hwc_dev->ext_ovls;
 
-    char big_log[1024];
-    int e = sizeof(big_log);
-    char *end = big_log + e;
-    e -= snprintf(end - e, e, "set H{");
-    for (i = 0; list && i < list->numHwLayers; i++) {
-        if (i)
-            e -= snprintf(end - e, e, " ");
-        hwc_layer_1_t *layer = &list->hwLayers[i];
-        IMG_native_handle_t *handle = (IMG_native_handle_t *)layer->handle;
-        e -= snprintf(end - e, e, "%p:%s,", handle, layer->compositionType == HWC_OVERLAY ? "DSS" : "SGX");
-        if ((layer->flags & HWC_SKIP_LAYER) || !handle) {
-            e -= snprintf(end - e, e, "SKIP");
-            continue;
-        }
-        if (layer->flags & HWC_HINT_CLEAR_FB)
-            e -= snprintf(end - e, e, "CLR,");
-#define FMT(f) ((f) == HAL_PIXEL_FORMAT_TI_NV12 ? "NV12" : \
-                (f) == HAL_PIXEL_FORMAT_BGRX_8888 ? "xRGB32" : \
-                (f) == HAL_PIXEL_FORMAT_RGBX_8888 ? "xBGR32" : \
-                (f) == HAL_PIXEL_FORMAT_BGRA_8888 ? "ARGB32" : \
-                (f) == HAL_PIXEL_FORMAT_RGBA_8888 ? "ABGR32" : \
-                (f) == HAL_PIXEL_FORMAT_RGB_565 ? "RGB565" : "??")
-        e -= snprintf(end - e, e, "%d*%d(%s)", handle->iWidth, handle->iHeight, FMT(handle->iFormat));
-        if (layer->transform)
-            e -= snprintf(end - e, e, "~%d", layer->transform);
-#undef FMT
-    }
-    e -= snprintf(end - e, e, "} D{");
-    for (i = 0; i < dsscomp->num_ovls; i++) {
-        if (i)
-            e -= snprintf(end - e, e, " ");
-        e -= snprintf(end - e, e, "%d=", dsscomp->ovls[i].cfg.ix);
-#define FMT(f) ((f) == OMAP_DSS_COLOR_NV12 ? "NV12" : \
-                (f) == OMAP_DSS_COLOR_RGB24U ? "xRGB32" : \
-                (f) == OMAP_DSS_COLOR_ARGB32 ? "ARGB32" : \
-                (f) == OMAP_DSS_COLOR_RGB16 ? "RGB565" : "??")
-        if (dsscomp->ovls[i].cfg.enabled)
-            e -= snprintf(end - e, e, "%08x:%d*%d,%s",
-                          dsscomp->ovls[i].ba,
-                          dsscomp->ovls[i].cfg.width,
-                          dsscomp->ovls[i].cfg.height,
-                          FMT(dsscomp->ovls[i].cfg.color_mode));
-#undef FMT
+    if (hwc_dev->skip_frame && dpy && sur) {
+        /* the screen already shows this frame */
+        hwc_dev->skip_frame = 0;
+        if (hwc_dev->use_sgx)
+            hwc_dev->posted.skipped_sgx++;
         else
-            e -= snprintf(end - e, e, "-");
-    }
-    e -= snprintf(end - e, e, "} L{");
-    for (i = 0; i < hwc_dev->post2_layers; i++) {
-        if (i)
-            e -= snprintf(end - e, e, " ");
-        e -= snprintf(end - e, e, "%p", hwc_dev->buffers[i]);
+            hwc_dev->posted.skipped_ovl++;
+        goto err_out;
     }
-    e -= snprintf(end - e, e, "}%s\n", hwc_dev->use_sgx ? " swap" : "");
-    /*if (debug) {
-        ALOGD("%s", big_log);
-    }*/
-
-    // ALOGD("set %d layers (sgx=%d)\n", dsscomp->num_ovls, hwc_dev->use_sgx);
+    hwc_dev->skip_frame = 0;
 
     if (dpy && sur) {
         // list can be NULL which means hwc is temporarily disabled.
         // however, if dpy and sur are null it means we're turning the
         // screen off. no shall not call eglSwapBuffers() in that case.
 
+        t0 = now_ns();
         if (hwc_dev->use_sgx) {
             if (!eglSwapBuffers((EGLDisplay)dpy, (EGLSurface)sur)) {
                 ALOGE("eglSwapBuffers error");
                 err = HWC_EGL_ERROR;
+                hwc_dev->posted.valid = 0;
                 goto err_out;
             }
         }
@@ -1344,24 +3451,37 @@ static int omap3_hwc_set(struct hwc_composer_device_1 *dev,
         if (debug)
 		dump_dsscomp(dsscomp);
 
-        // signal the event thread that a post has happened
-        write(hwc_dev->pipe_fds[1], "s", 1);
-        if (hwc_dev->force_sgx > 0)
-            hwc_dev->force_sgx--;
-
-        err = hwc_dev->fb_dev->Post2((framebuffer_device_t *)hwc_dev->fb_dev,
-                                 hwc_dev->buffers,
-                                 hwc_dev->post2_layers,
-                                 dsscomp, sizeof(*dsscomp));
-
-        if (!hwc_dev->use_sgx) {
-            __u32 crt = 0;
-            int err2 = ioctl(hwc_dev->fb_fd, FBIO_WAITFORVSYNC, &crt);
-            if (err2) {
-                ALOGE("failed to wait for vsync (%d)", errno);
-                err = err ? : -errno;
-            }
+        // restart the idle timer; while it runs, it follows last_post itself
+        __atomic_store_n(&hwc_dev->last_post, now_ns(), __ATOMIC_SEQ_CST);
+        if (hwc_dev->idle && !__atomic_exchange_n(&hwc_dev->idle_armed, 1, __ATOMIC_SEQ_CST))
+            eventfd_write(hwc_dev->post_fd, 1);
+        if (hwc_dev->idle_frames > 0)
+            __atomic_store_n(&hwc_dev->idle_frames, hwc_dev->idle_frames - 1, __ATOMIC_RELAXED);
+
+        t1 = now_ns();
+        err = hwc_dev->backend->ops->post2(hwc_dev->backend,
+                                           hwc_dev->buffers,
+                                           hwc_dev->post2_layers,
+                                           dsscomp, sizeof(*dsscomp));
+        t2 = now_ns();
+
+        if (!hwc_dev->use_sgx && !err)
+            omap3_hwc_queue_present(hwc_dev);
+
+        omap3_hwc_telemetry_record(hwc_dev, list, (t1 - t0) / 1000, (t2 - t1) / 1000,
+                                   wait / 1000);
+        if (err) {
+            hwc_dev->posted.valid = 0;
+            hwc_dev->plan.valid = 0;
+        } else {
+            if (!omap3_hwc_place_buffers(hwc_dev, maps))
+                tiler_slot_commit(&hwc_dev->tiler, maps, hwc_dev->post2_layers);
+            omap3_hwc_record_posted(hwc_dev, list);
+            omap3_hwc_flat_posted(hwc_dev);
+            ion_pool_posted(&hwc_dev->ion_pool);
         }
+    } else {
+        hwc_dev->posted.valid = 0;
     }
     hwc_dev->last_ext_ovls = hwc_dev->ext_ovls;
     hwc_dev->last_int_ovls = hwc_dev->post2_layers;
@@ -1369,7 +3489,7 @@ static int omap3_hwc_set(struct hwc_composer_device_1 *dev,
         ALOGE("Post2 error");
 
 err_out:
-    pthread_mutex_unlock(&hwc_dev->lock);
+    omap3_hwc_unlock(hwc_dev);
 
     if (invalidate && hwc_dev->procs && hwc_dev->procs->invalidate)
         hwc_dev->procs->invalidate(hwc_dev->procs);
@@ -1392,6 +3512,158 @@ static int dump_printf(char *buff, int buff_len, int len, const char *fmt, ...)
     return len + print_len;
 }
 
+static int dump_hist(char *buff, int buff_len, int len, const char *name, __u32 *hist)
+{
+    int b;
+
+    len = dump_printf(buff, buff_len, len, "    %-6s", name);
+    for (b = 0; b < TELEMETRY_BUCKETS; b++)
+        len = dump_printf(buff, buff_len, len, " %6u", hist[b]);
+    return dump_printf(buff, buff_len, len, "\n");
+}
+
+static int dump_lock_stats(omap3_hwc_device_t *hwc_dev, char *buff, int buff_len, int len)
+{
+    struct omap3_hwc_lock_stats *ls = &hwc_dev->lock_stats;
+
+    return dump_printf(buff, buff_len, len, "  lock: %u acquisitions, wait %lluus avg %lluus max, hold %lluus avg %lluus max\n",
+                       ls->count, ls->count ? ls->wait_ns / ls->count / 1000 : 0, ls->max_wait_ns / 1000,
+                       ls->count ? ls->hold_ns / ls->count / 1000 : 0, ls->max_hold_ns / 1000);
+}
+
+static int dump_vsync(omap3_hwc_device_t *hwc_dev, char *buff, int buff_len, int len)
+{
+    struct omap3_hwc_sw_vsync m;
+
+    pthread_mutex_lock(&hwc_dev->vsync_lock);
+    m = hwc_dev->vsync;
+    pthread_mutex_unlock(&hwc_dev->vsync_lock);
+
+    len = dump_printf(buff, buff_len, len, "  vsync: period %lld.%03lldus (nominal %lld.%03lldus), %u samples",
+                      (long long) sw_vsync_period(&m) / 1000, (long long) sw_vsync_period(&m) % 1000,
+                      (long long) m.nominal / 1000, (long long) m.nominal % 1000, m.samples);
+    return dump_printf(buff, buff_len, len, ", jitter %lldus avg %lldus max, %u missed, %u predicted, %u resyncs\n",
+                       m.samples ? (long long) m.jitter_sum / m.samples / 1000 : 0, (long long) m.jitter_max / 1000,
+                       m.missed, m.predicted, m.resyncs);
+}
+
+static int dump_sgx_stats(omap3_hwc_device_t *hwc_dev, char *buff, int buff_len, int len)
+{
+    struct omap3_hwc_sgx_stats *stats = &hwc_dev->sgx_stats;
+    unsigned int i;
+
+    len = dump_printf(buff, buff_len, len, "  SGX fallbacks (frames/layers):");
+    for (i = SGX_REASON_NONE + 1; i < SGX_REASON_COUNT; i++)
+        if (stats->frames[i] || stats->layers[i])
+            len = dump_printf(buff, buff_len, len, " %s=%u/%u", sgx_reason_names[i],
+                              stats->frames[i], stats->layers[i]);
+    len = dump_printf(buff, buff_len, len, "\n  last frame: %s, layers:",
+                      sgx_reason_names[stats->frame_reason]);
+    for (i = 0; i < stats->num_layers; i++)
+        len = dump_printf(buff, buff_len, len, " %s", sgx_reason_names[stats->layer_reason[i]]);
+    return dump_printf(buff, buff_len, len, "\n");
+}
+
+static int dump_flat(omap3_hwc_device_t *hwc_dev, char *buff, int buff_len, int len)
+{
+    struct omap3_hwc_flat *flat = &hwc_dev->flat;
+
+    if (!flat->frames && !flat->builds)
+        return dump_printf(buff, buff_len, len, "  flattening: off\n");
+
+    len = dump_printf(buff, buff_len, len, "  flattening: after %u frames, %u builds, %u invalidations\n",
+                      flat->frames, flat->builds, flat->invalidations);
+    if (flat->mask)
+        len = dump_printf(buff, buff_len, len, "    layers %08x at (%d,%d) %dx%d\n", flat->mask,
+                          flat->region.left, flat->region.top,
+                          WIDTH(flat->region), HEIGHT(flat->region));
+    return dump_printf(buff, buff_len, len, "    SGX fill avoided: %llu pixels in %u frames\n",
+                       (unsigned long long) flat->area_saved, flat->frames_used);
+}
+
+static int dump_conv(omap3_hwc_device_t *hwc_dev, char *buff, int buff_len, int len)
+{
+    struct omap3_hwc_conv *conv = &hwc_dev->conv;
+
+    if (!conv->enabled)
+        return dump_printf(buff, buff_len, len, "  planar conversion: off\n");
+    len = dump_printf(buff, buff_len, len,
+                      "  planar conversion: %u frames, %u reused, %u failures, %lluus per frame\n",
+                      conv->conversions, conv->reuses, conv->failures,
+                      conv->conversions ? (unsigned long long) (conv->time_ns / conv->conversions / 1000) : 0ULL);
+    if (!conv->prerotate)
+        return dump_printf(buff, buff_len, len, "    pre-rotation: off\n");
+    return dump_printf(buff, buff_len, len, "    pre-rotation: %u frames, %lluns per kpixel, SGX at %uMpixels/s\n",
+                       conv->rotations,
+                       (unsigned long long) (conv->rot_pixels ? conv->rot_time_ns * 1000 / conv->rot_pixels :
+                                             PREROTATE_PS_PER_PIXEL),
+                       conv->sgx_mpps);
+}
+
+static int dump_ion_pool(omap3_hwc_device_t *hwc_dev, char *buff, int buff_len, int len)
+{
+    struct omap3_hwc_ion_pool *pool = &hwc_dev->ion_pool;
+    int i;
+
+    len = dump_printf(buff, buff_len, len,
+                      "  memory: %ukB of %ukB (%ukB flattening), %s heap%s, %u allocs, %u reuses, %u frees, %u failures\n",
+                      pool->footprint >> 10, pool->limit >> 10, pool->reserved >> 10,
+                      pool->heap ? pool->heap->name : "no", pool->tiler ? " (TILER)" : "",
+                      pool->allocs, pool->reuses, pool->frees, pool->failures);
+    for (i = 0; i < ION_POOL_MAX_BUFS; i++)
+        if (pool->bufs[i].handle)
+            len = dump_printf(buff, buff_len, len, "    %ukB%s%s\n", pool->bufs[i].size >> 10,
+                              pool->bufs[i].tiler ? " tiler" : "",
+                              pool->bufs[i].in_use ? " in use" : "");
+    return len;
+}
+
+static int dump_telemetry(omap3_hwc_device_t *hwc_dev, char *buff, int buff_len, int len)
+{
+    struct omap3_hwc_telemetry *t = &hwc_dev->telemetry;
+    __u32 head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    __u32 n = min(head, (__u32) TELEMETRY_DUMP_FRAMES);
+    __u32 f;
+    int b, i;
+
+    len = dump_printf(buff, buff_len, len, "  last %u of %u frames (sync sgx ovls/layers formats swap/post/vsync us):\n",
+                      n, head);
+    for (f = head - n; f != head; f++) {
+        struct omap3_hwc_frame_rec *r = &t->ring[f % TELEMETRY_FRAMES];
+        struct omap3_hwc_frame_rec c;
+        __u32 seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+
+        memcpy(&c, r, sizeof(c));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((seq & 1) || __atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        len = dump_printf(buff, buff_len, len, "    [%08x] %s %u/%u", c.sync_id,
+                          c.use_sgx ? "sgx" : "ovl", c.num_ovls, c.num_layers);
+        for (i = 0; i < MAX_HW_OVERLAYS; i++)
+            len = dump_printf(buff, buff_len, len, " %04x", c.color_mode[i]);
+        len = dump_printf(buff, buff_len, len, " %u/%u/%u\n", c.swap_us, c.post_us, c.vsync_us);
+    }
+
+    len = dump_printf(buff, buff_len, len, "  latency histogram (us):\n          ");
+    for (b = 0; b < TELEMETRY_BUCKETS - 1; b++)
+        len = dump_printf(buff, buff_len, len, " <%5u", 250U << b);
+    len = dump_printf(buff, buff_len, len, " >=%4u\n", 250U << (TELEMETRY_BUCKETS - 2));
+    len = dump_hist(buff, buff_len, len, "swap", t->swap_hist);
+    len = dump_hist(buff, buff_len, len, "post", t->post_hist);
+    return dump_hist(buff, buff_len, len, "vsync", t->vsync_hist);
+}
+
+static int dump_tiler(omap3_hwc_device_t *hwc_dev, char *buff, int buff_len, int len)
+{
+    struct omap3_hwc_tiler_slot *t = &hwc_dev->tiler;
+    __u32 largest, free = tiler_slot_free(t, &largest);
+
+    return dump_printf(buff, buff_len, len,
+                       "  TILER 1D slot: %u of %u pages mapped, largest free range %u; %u mapped, %u kept\n",
+                       t->pages - free, t->pages, largest, t->maps, t->kept);
+}
+
 static void omap3_hwc_dump(struct hwc_composer_device_1 *dev, char *buff, int buff_len)
 {
     omap3_hwc_device_t *hwc_dev = (omap3_hwc_device_t *)dev;
@@ -1401,6 +3673,34 @@ static void omap3_hwc_dump(struct hwc_composer_device_1 *dev, char *buff, int bu
 
     len = dump_printf(buff, buff_len, len, "omap3_hwc %d:\n", dsscomp->num_ovls);
     len = dump_printf(buff, buff_len, len, "  idle timeout: %dms\n", hwc_dev->idle);
+    len = dump_printf(buff, buff_len, len, "  plan cache: %u hits, %u misses\n",
+                      hwc_dev->plan.hits, hwc_dev->plan.misses);
+    len = dump_printf(buff, buff_len, len, "  unchanged frames skipped: %u SGX+OVL, %u all-OVL\n",
+                      hwc_dev->posted.skipped_sgx, hwc_dev->posted.skipped_ovl);
+    len = dump_printf(buff, buff_len, len, "  DSS bandwidth: %lluMB/s predicted, %lluMB/s limit\n",
+                      hwc_dev->dss_bw >> 20, hwc_dev->dss_bw_limit >> 20);
+    len = dump_tiler(hwc_dev, buff, buff_len, len);
+    if (hwc_dev->modedb.queries)
+        len = dump_printf(buff, buff_len, len, "  HDMI modes: %u queries, %u choices reused, %u scored\n",
+                          hwc_dev->modedb.queries, hwc_dev->modedb.hits, hwc_dev->modedb.misses);
+    pthread_mutex_lock(&hwc_dev->mode_lock);
+    if (hwc_dev->mode_switches)
+        len = dump_printf(buff, buff_len, len, "  HDMI mode switches: %u, %lluus avg%s\n",
+                          hwc_dev->mode_switches, hwc_dev->mode_switch_ns / 1000 / hwc_dev->mode_switches,
+                          hwc_dev->mode_pending || hwc_dev->mode_busy ? " (switching)" : "");
+    pthread_mutex_unlock(&hwc_dev->mode_lock);
+    len = dump_printf(buff, buff_len, len, "  video transitions: %u%s\n",
+                      hwc_dev->transition.transitions, hwc_dev->transition.active ? " (active)" : "");
+    if (hwc_dev->flags_colorkey)
+        len = dump_printf(buff, buff_len, len, "  colour key: %u frames\n",
+                          hwc_dev->sgx_stats.colorkey_frames);
+    len = dump_flat(hwc_dev, buff, buff_len, len);
+    len = dump_conv(hwc_dev, buff, buff_len, len);
+    len = dump_ion_pool(hwc_dev, buff, buff_len, len);
+    len = dump_lock_stats(hwc_dev, buff, buff_len, len);
+    len = dump_vsync(hwc_dev, buff, buff_len, len);
+    len = dump_sgx_stats(hwc_dev, buff, buff_len, len);
+    len = dump_telemetry(hwc_dev, buff, buff_len, len);
 
     for (i = 0; i < dsscomp->num_ovls; i++) {
         struct dss2_ovl_cfg *cfg = &dsscomp->ovls[i].cfg;
@@ -1420,21 +3720,116 @@ static void omap3_hwc_dump(struct hwc_composer_device_1 *dev, char *buff, int bu
 }
 
 
+/* makes the threads that were started return and waits for them */
+static void omap3_hwc_stop_threads(omap3_hwc_device_t *hwc_dev)
+{
+    __atomic_store_n(&hwc_dev->quit, 1, __ATOMIC_RELEASE);
+
+    /* the event thread checks quit whenever epoll_wait returns */
+    if (hwc_dev->threads & THREAD_EVENT) {
+        eventfd_write(hwc_dev->post_fd, 1);
+        pthread_join(hwc_dev->event_thread, NULL);
+    }
+    if (hwc_dev->threads & THREAD_PRESENT) {
+        pthread_mutex_lock(&hwc_dev->present_lock);
+        pthread_cond_broadcast(&hwc_dev->present_cond);
+        pthread_mutex_unlock(&hwc_dev->present_lock);
+        pthread_join(hwc_dev->present_thread, NULL);
+    }
+    if (hwc_dev->threads & THREAD_MODE) {
+        pthread_mutex_lock(&hwc_dev->mode_lock);
+        pthread_cond_broadcast(&hwc_dev->mode_cond);
+        pthread_mutex_unlock(&hwc_dev->mode_lock);
+        pthread_join(hwc_dev->mode_thread, NULL);
+    }
+    hwc_dev->threads = 0;
+}
+
+/* closes the event sources; the event thread has to be stopped */
+static void omap3_hwc_close_events(omap3_hwc_device_t *hwc_dev)
+{
+    if (hwc_dev->epoll_fd >= 0)
+        close(hwc_dev->epoll_fd);
+    if (hwc_dev->idle_fd >= 0)
+        close(hwc_dev->idle_fd);
+    if (hwc_dev->post_fd >= 0)
+        close(hwc_dev->post_fd);
+    if (hwc_dev->vsync_timer_fd >= 0)
+        close(hwc_dev->vsync_timer_fd);
+    hwc_dev->epoll_fd = hwc_dev->idle_fd = hwc_dev->post_fd = hwc_dev->vsync_timer_fd = -1;
+}
+
+/* creates the locks of the device; returns 0, or -errno with none of them left */
+static int omap3_hwc_create_locks(omap3_hwc_device_t *hwc_dev)
+{
+    int err;
+
+    err = pthread_mutex_init(&hwc_dev->lock, NULL);
+    if (err)
+        return -err;
+    err = pthread_mutex_init(&hwc_dev->vsync_lock, NULL);
+    if (err)
+        goto vsync_lock;
+    err = pthread_mutex_init(&hwc_dev->present_lock, NULL);
+    if (err)
+        goto present_lock;
+    err = pthread_cond_init(&hwc_dev->present_cond, NULL);
+    if (err)
+        goto present_cond;
+    err = pthread_mutex_init(&hwc_dev->mode_lock, NULL);
+    if (err)
+        goto mode_lock;
+    err = pthread_cond_init(&hwc_dev->mode_cond, NULL);
+    if (!err)
+        return 0;
+
+    pthread_mutex_destroy(&hwc_dev->mode_lock);
+mode_lock:
+    pthread_cond_destroy(&hwc_dev->present_cond);
+present_cond:
+    pthread_mutex_destroy(&hwc_dev->present_lock);
+present_lock:
+    pthread_mutex_destroy(&hwc_dev->vsync_lock);
+vsync_lock:
+    pthread_mutex_destroy(&hwc_dev->lock);
+    return -err;
+}
+
+static void omap3_hwc_destroy_locks(omap3_hwc_device_t *hwc_dev)
+{
+    pthread_mutex_destroy(&hwc_dev->lock);
+    pthread_mutex_destroy(&hwc_dev->vsync_lock);
+    pthread_mutex_destroy(&hwc_dev->present_lock);
+    pthread_cond_destroy(&hwc_dev->present_cond);
+    pthread_mutex_destroy(&hwc_dev->mode_lock);
+    pthread_cond_destroy(&hwc_dev->mode_cond);
+}
+
 static int omap3_hwc_device_close(hw_device_t* device)
 {
     omap3_hwc_device_t *hwc_dev = (omap3_hwc_device_t *) device;;
 
     if (hwc_dev) {
-        if (hwc_dev->dsscomp_fd >= 0)
-            close(hwc_dev->dsscomp_fd);
+        /* let the frame in flight reach the screen and the mode switch finish */
+        omap3_hwc_wait_present(hwc_dev);
+        omap3_hwc_wait_mode(hwc_dev);
+        omap3_hwc_stop_threads(hwc_dev);
+        /* no timer can fire after this */
+        omap3_hwc_close_events(hwc_dev);
 #if 0 /* Currently commented hdmi fd close*/
         if (hwc_dev->hdmi_fb_fd >= 0)
             close(hwc_dev->hdmi_fb_fd);
 #endif
-        if (hwc_dev->fb_fd >= 0)
-            close(hwc_dev->fb_fd);
-        /* pthread will get killed when parent process exits */
-        pthread_mutex_destroy(&hwc_dev->lock);
+        if (hwc_dev->backend) {
+            omap3_hwc_flat_free(hwc_dev);
+            omap3_hwc_conv_release(hwc_dev);
+            ion_pool_destroy(&hwc_dev->ion_pool);
+            hwc_dev->backend->ops->close(hwc_dev->backend);
+        }
+        if (hwc_dev->trace_fd >= 0)
+            close(hwc_dev->trace_fd);
+        omap3_hwc_destroy_locks(hwc_dev);
+        free(hwc_dev->buffers);
         free(hwc_dev);
     }
 
@@ -1467,49 +3862,33 @@ err_out:
     return err;
 }
 
+/*
+ * Reconfigures the display pipeline and publishes the new external display
+ * state; the next prepare picks it up.
+ */
 static void handle_hotplug(omap3_hwc_device_t *hwc_dev, int state)
 {
-    omap3_hwc_ext_t *ext = &hwc_dev->ext;
+    __u32 gen = __atomic_load_n(&hwc_dev->ext_req_gen, __ATOMIC_RELAXED);
+    struct omap3_hwc_ext_request *req = &hwc_dev->ext_req[(gen + 1) & 1];
+    int err;
 
-    pthread_mutex_lock(&hwc_dev->lock);
-    ext->dock.enabled = ext->mirror.enabled = 0;
+    if (state != OMAP3_HWC_OUTPUT_HDMI && state != OMAP3_HWC_OUTPUT_TV)
+        state = OMAP3_HWC_OUTPUT_LCD;
 
-    if (state == 1) { /* hdmi panel enable */
-	hdmi_enabled = 1;
-	tv_enabled = 0;
-
-	system("echo 0 >" "/sys/devices/platform/dsscomp/isprsz/enable");
-	system("echo 0 >" "/sys/devices/platform/omapdss/display1/enabled");
-	system("echo 0 >" "/sys/devices/platform/omapdss/overlay0/enabled");
-	system("echo 0 >" "/sys/devices/platform/omapdss/display0/enabled");
-	system("echo hdmi >" "/sys/devices/platform/omapdss/manager0/display");
-	system("echo 1 >" "/sys/devices/platform/omapdss/display1/enabled");
-	system("echo 1 >" "/sys/devices/platform/omapdss/overlay0/enabled");
-    } else if(state == 2) { /* tv-out enable */
-	hdmi_enabled = 0;
-	tv_enabled = 1;
-	system("echo 0 >" "/sys/devices/platform/omapdss/overlay1/enabled");
-	system("echo tv >" "/sys/devices/platform/omapdss/overlay1/manager");
-	system("echo 1 >" "/sys/devices/platform/omapdss/overlay1/enabled");
-	system("echo 1 >" "/sys/devices/platform/omapdss/display2/enabled");
-    } else { /* lcd enable */
-        hdmi_enabled = 0;
-        ext->last_mode = 0;
-	tv_enabled = 0;
+    /*
+     * the slot was the current one before the last bump: the bump has to be
+     * visible before the slot changes, or prepare may copy a torn request
+     * and not notice
+     */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    req->hdmi_enabled = state == OMAP3_HWC_OUTPUT_HDMI;
+    req->tv_enabled = state == OMAP3_HWC_OUTPUT_TV;
 
-	system("echo 1 >" "/sys/devices/platform/dsscomp/isprsz/enable");
-        system("echo 0 >" "/sys/devices/platform/omapdss/display1/enabled");
-        system("echo 0 >" "/sys/devices/platform/omapdss/overlay0/enabled");
-	system("echo 0 >" "/sys/devices/platform/omapdss/overlay1/enabled");
-	system("echo 480,800 >" "/sys/devices/platform/omapdss/overlay1/output_size");
-	system("echo 480,800 >" "/sys/devices/platform/omapdss/overlay0/output_size");
-        system("echo lcd >" "/sys/devices/platform/omapdss/manager0/display");
-        system("echo 1 >" "/sys/devices/platform/omapdss/display0/enabled");
-	system("echo 1 >" "/sys/devices/platform/omapdss/overlay1/enabled");
-        system("echo 1 >" "/sys/devices/platform/omapdss/overlay0/enabled");
-    }
+    err = hwc_dev->backend->ops->route_output(hwc_dev->backend, state);
+    if (err)
+        ALOGE("failed to route the display to output %d (%d)", state, err);
 
-    omap3_hwc_create_ext_matrix(ext);
+    __atomic_store_n(&hwc_dev->ext_req_gen, gen + 1, __ATOMIC_RELEASE);
     /*ALOGI("external display changed (state=%d, mirror={%s tform=%ddeg%s}, dock={%s tform=%ddeg%s}, tv=%d", state,
          ext->mirror.enabled ? "enabled" : "disabled",
          ext->mirror.rotation * 90,
@@ -1519,44 +3898,79 @@ static void handle_hotplug(omap3_hwc_device_t *hwc_dev, int state)
          ext->dock.hflip ? "+hflip" : "",
          ext->on_tv);*/
 
-    pthread_mutex_unlock(&hwc_dev->lock);
-
     if (hwc_dev->procs && hwc_dev->procs->invalidate)
             hwc_dev->procs->invalidate(hwc_dev->procs);
 }
 
-static void *vsync_loop(void *param)
+static void arm_vsync_timer(omap3_hwc_device_t *hwc_dev, int64_t when)
 {
-    static char buf[4096];
-    int fb0_vsync_fd;
-    fd_set exceptfds;
-    int res;
-    int64_t timestamp = 0;
-    omap3_hwc_device_t *hwc_dev = param;
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = when / 1000000000,
+            .tv_nsec = when % 1000000000,
+        },
+    };
 
-    fb0_vsync_fd = open("/sys/devices/platform/omapfb/graphics/fb0/vsync_time", O_RDONLY);
-    if (fb0_vsync_fd < 0)
-        return NULL;
+    timerfd_settime(hwc_dev->vsync_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
 
-    setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
-    memset(buf, 0, sizeof(buf));
+/* reports a vsync unless a timestamp for the same vsync was already reported */
+static void report_vsync(omap3_hwc_device_t *hwc_dev, int64_t timestamp)
+{
+    int report;
 
-    /*ALOGI("Using sysfs mechanism for VSYNC notification");*/
+    pthread_mutex_lock(&hwc_dev->vsync_lock);
+    report = timestamp > hwc_dev->last_vsync + sw_vsync_period(&hwc_dev->vsync) / 2;
+    if (report)
+        hwc_dev->last_vsync = timestamp;
+    pthread_mutex_unlock(&hwc_dev->vsync_lock);
 
-    FD_ZERO(&exceptfds);
-    FD_SET(fb0_vsync_fd, &exceptfds);
+    if (report && hwc_dev->procs && hwc_dev->procs->vsync)
+        hwc_dev->procs->vsync(hwc_dev->procs, 0, timestamp);
+}
 
-    do {
-        ssize_t len = read(fb0_vsync_fd, buf, sizeof(buf));
-        timestamp = strtoull(buf, NULL, 0);
-        if (hwc_dev->procs && hwc_dev->procs->vsync) {
-            hwc_dev->procs->vsync(hwc_dev->procs, 0, timestamp);
-        }
-        select(fb0_vsync_fd + 1, NULL, NULL, &exceptfds, NULL);
-        lseek(fb0_vsync_fd, 0, SEEK_SET);
-    } while (1);
+/*
+ * Hardware vsync: feed the model and report the filtered timestamp.  While
+ * vsync is enabled, the vsync timer stays a quarter period behind the next
+ * predicted vsync, so a vsync the hardware misses is still reported.
+ */
+static void omap3_hwc_vsync_event(omap3_hwc_device_t *hwc_dev, int64_t timestamp)
+{
+    struct omap3_hwc_sw_vsync *m = &hwc_dev->vsync;
 
-    return NULL;
+    pthread_mutex_lock(&hwc_dev->vsync_lock);
+    timestamp = sw_vsync_sample(m, timestamp);
+    if (timestamp >= 0 && hwc_dev->vsync_enabled && sw_vsync_locked(m, timestamp))
+        arm_vsync_timer(hwc_dev, sw_vsync_next(m, timestamp) + m->period / 4);
+    pthread_mutex_unlock(&hwc_dev->vsync_lock);
+
+    if (timestamp >= 0)
+        report_vsync(hwc_dev, timestamp);
+}
+
+/* vsync timer: report the predicted vsync */
+static void handle_vsync_timer(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_sw_vsync *m = &hwc_dev->vsync;
+    int64_t now = now_ns(), timestamp = -1;
+    __u64 expirations;
+
+    read(hwc_dev->vsync_timer_fd, &expirations, sizeof(expirations));
+
+    pthread_mutex_lock(&hwc_dev->vsync_lock);
+    if (hwc_dev->vsync_enabled && sw_vsync_locked(m, now)) {
+        /* the latest predicted vsync that has passed */
+        timestamp = sw_vsync_next(m, now - m->period);
+        if (timestamp > now)
+            timestamp -= m->period;
+        arm_vsync_timer(hwc_dev, sw_vsync_next(m, now) + m->period / 4);
+        if (timestamp > hwc_dev->last_vsync + m->period / 2)
+            m->predicted++;
+    }
+    pthread_mutex_unlock(&hwc_dev->vsync_lock);
+
+    if (timestamp >= 0)
+        report_vsync(hwc_dev, timestamp);
 }
 
 static void handle_uevents(omap3_hwc_device_t *hwc_dev, const char *buff, int len)
@@ -1589,73 +4003,158 @@ static void handle_uevents(omap3_hwc_device_t *hwc_dev, const char *buff, int le
             break;
     }
 
-    if (vsync) {
-        if (hwc_dev->procs && hwc_dev->procs->vsync) {
-            hwc_dev->procs->vsync(hwc_dev->procs, 0, timestamp);
-        }
+    if (vsync)
+        omap3_hwc_vsync_event(hwc_dev, timestamp);
+    else
+        handle_hotplug(hwc_dev, state);
+}
+
+/* event sources of the event thread */
+enum {
+    EVENT_UEVENT,
+    EVENT_VSYNC,
+    EVENT_IDLE,
+    EVENT_POST,
+    EVENT_VSYNC_TIMER,
+};
+
+static void arm_idle_timer(omap3_hwc_device_t *hwc_dev, __u64 deadline)
+{
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = deadline / 1000000000,
+            .tv_nsec = deadline % 1000000000,
+        },
+    };
+
+    timerfd_settime(hwc_dev->idle_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * The idle timer is armed for idle ms after the last post.  set only updates
+ * last_post, so when the timer fires early it is re-armed for the deadline of
+ * the latest post.  Once the screen went idle, the timer stops and set wakes
+ * us through post_fd on the next post.
+ */
+static void handle_idle(omap3_hwc_device_t *hwc_dev)
+{
+    __u64 expirations, last_post;
+    int prev_idle;
+
+    read(hwc_dev->idle_fd, &expirations, sizeof(expirations));
+
+    last_post = __atomic_load_n(&hwc_dev->last_post, __ATOMIC_SEQ_CST);
+    if (now_ns() < last_post + hwc_dev->idle * 1000000ULL) {
+        arm_idle_timer(hwc_dev, last_post + hwc_dev->idle * 1000000ULL);
+        return;
     }
+
+    /* the composer owns idle_frames; we only ask prepare to set it */
+    prev_idle = __atomic_load_n(&hwc_dev->idle_frames, __ATOMIC_RELAXED) ||
+                __atomic_exchange_n(&hwc_dev->idle_req, 1, __ATOMIC_ACQ_REL);
+    if (prev_idle) {
+        arm_idle_timer(hwc_dev, now_ns() + hwc_dev->idle * 1000000ULL);
+        return;
+    }
+
+    __atomic_store_n(&hwc_dev->idle_armed, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hwc_dev->last_post, __ATOMIC_SEQ_CST) != last_post) {
+        /* set posted meanwhile and may have seen the timer still armed */
+        if (!__atomic_exchange_n(&hwc_dev->idle_armed, 1, __ATOMIC_SEQ_CST))
+            arm_idle_timer(hwc_dev, now_ns() + hwc_dev->idle * 1000000ULL);
+        return;
+    }
+
+    if (hwc_dev->procs && hwc_dev->procs->invalidate)
+        hwc_dev->procs->invalidate(hwc_dev->procs);
+}
+
+static void handle_vsync(omap3_hwc_device_t *hwc_dev)
+{
+    struct omap3_hwc_backend *be = hwc_dev->backend;
+    int64_t timestamp = 0;
+
+    if (!be->ops->read_vsync(be, &timestamp))
+        omap3_hwc_vsync_event(hwc_dev, timestamp);
+}
+
+static int add_event(omap3_hwc_device_t *hwc_dev, int fd, __u32 events, int source)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.u32 = source,
+    };
+
+    return epoll_ctl(hwc_dev->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-static void *omap3_hwc_hdmi_thread(void *data)
+/* uevents, vsync, the idle timeout and post notifications */
+static void *omap3_hwc_event_thread(void *data)
 {
     omap3_hwc_device_t *hwc_dev = data;
+    struct omap3_hwc_backend *be = hwc_dev->backend;
     static char uevent_desc[4096];
-    struct pollfd fds[2];
-    int prev_force_sgx = 0;
-    int timeout;
-    int err;
+    struct epoll_event events[5];
+    short vsync_events;
+    int fd, n, i;
 
     setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
 
     uevent_init();
 
-    fds[0].fd = uevent_get_fd();
-    fds[0].events = POLLIN;
-    fds[1].fd = hwc_dev->pipe_fds[0];
-    fds[1].events = POLLIN;
-
-    timeout = hwc_dev->idle ? hwc_dev->idle : -1;
+    fd = uevent_get_fd();
+    if (fd >= 0 && add_event(hwc_dev, fd, EPOLLIN, EVENT_UEVENT))
+        ALOGE("failed to watch uevents (%d): %m", errno);
+
+    fd = be->ops->get_vsync_fd(be, &vsync_events);
+    if (fd >= 0) {
+        /* sysfs nodes must be read once before they signal changes */
+        handle_vsync(hwc_dev);
+        if (add_event(hwc_dev, fd, (vsync_events & POLLPRI ? EPOLLPRI : 0) |
+                                   (vsync_events & POLLIN ? EPOLLIN : 0), EVENT_VSYNC))
+            ALOGE("failed to watch vsync (%d): %m", errno);
+    }
 
     memset(uevent_desc, 0, sizeof(uevent_desc));
 
-    do {
-        err = poll(fds, hwc_dev->idle ? 2 : 1, timeout);
-
-        if (err == 0) {
-            if (hwc_dev->idle) {
-                pthread_mutex_lock(&hwc_dev->lock);
-                prev_force_sgx = hwc_dev->force_sgx;
-                hwc_dev->force_sgx = 2;
-                pthread_mutex_unlock(&hwc_dev->lock);
-
-                if (!prev_force_sgx && hwc_dev->procs && hwc_dev->procs->invalidate) {
-                    hwc_dev->procs->invalidate(hwc_dev->procs);
-                    timeout = -1;
-                }
-
-                continue;
-            }
-        }
-
-        if (err == -1) {
+    while (!__atomic_load_n(&hwc_dev->quit, __ATOMIC_ACQUIRE)) {
+        n = epoll_wait(hwc_dev->epoll_fd, events, sizeof(events) / sizeof(*events), -1);
+        if (n < 0) {
             if (errno != EINTR)
                 ALOGE("event error: %m");
             continue;
         }
 
-        if (hwc_dev->idle && fds[1].revents & POLLIN) {
-            char c;
-            read(hwc_dev->pipe_fds[0], &c, 1);
-            if (!hwc_dev->force_sgx)
-                timeout = hwc_dev->idle ? hwc_dev->idle : -1;
-        }
+        for (i = 0; i < n; i++) {
+            switch (events[i].data.u32) {
+            case EVENT_UEVENT:
+            {
+                /* keep last 2 zeroes to ensure double 0 termination */
+                int len = uevent_next_event(uevent_desc, sizeof(uevent_desc) - 2);
+                handle_uevents(hwc_dev, uevent_desc, len);
+                break;
+            }
+            case EVENT_VSYNC:
+                handle_vsync(hwc_dev);
+                break;
+            case EVENT_IDLE:
+                handle_idle(hwc_dev);
+                break;
+            case EVENT_VSYNC_TIMER:
+                handle_vsync_timer(hwc_dev);
+                break;
+            case EVENT_POST:
+            {
+                eventfd_t posts;
 
-        if (fds[0].revents & POLLIN) {
-            /* keep last 2 zeroes to ensure double 0 termination */
-            int len = uevent_next_event(uevent_desc, sizeof(uevent_desc) - 2);
-            handle_uevents(hwc_dev, uevent_desc, len);
+                eventfd_read(hwc_dev->post_fd, &posts);
+                arm_idle_timer(hwc_dev, __atomic_load_n(&hwc_dev->last_post, __ATOMIC_SEQ_CST) +
+                                        hwc_dev->idle * 1000000ULL);
+                break;
+            }
+            }
         }
-    } while (1);
+    }
 
     return NULL;
 }
@@ -1679,8 +4178,10 @@ static int omap3_hwc_query(struct hwc_composer_device_1* dev,
         value[0] = 0;
         break;
     case HWC_VSYNC_PERIOD:
-        // vsync period in nanosecond
-        value[0] = 1000000000.0 / hwc_dev->fb_dev->base.fps;
+        // measured vsync period in nanosecond
+        pthread_mutex_lock(&hwc_dev->vsync_lock);
+        value[0] = sw_vsync_period(&hwc_dev->vsync);
+        pthread_mutex_unlock(&hwc_dev->vsync_lock);
         break;
     default:
         // unsupported query
@@ -1700,9 +4201,21 @@ static int omap3_hwc_event_control(struct hwc_composer_device_1* dev,
         int val = !!enabled;
         int err;
 
-        err = ioctl(hwc_dev->fb_fd, OMAPFB_ENABLEVSYNC, &val);
+        /*
+         * The first hardware vsync comes late after enabling it, so keep
+         * reporting predicted vsyncs until it does.
+         */
+        pthread_mutex_lock(&hwc_dev->vsync_lock);
+        hwc_dev->vsync_enabled = val;
+        if (val && sw_vsync_locked(&hwc_dev->vsync, now_ns()))
+            arm_vsync_timer(hwc_dev, sw_vsync_next(&hwc_dev->vsync, now_ns()));
+        else if (!val)
+            arm_vsync_timer(hwc_dev, 0);
+        pthread_mutex_unlock(&hwc_dev->vsync_lock);
+
+        err = hwc_dev->backend->ops->enable_vsync(hwc_dev->backend, val);
         if (err < 0)
-            return -errno;
+            return err;
 
         return 0;
     }
@@ -1726,18 +4239,18 @@ static void omap3_hwc_reset_screen(omap3_hwc_device_t *hwc_dev)
             .num_mgrs = 1,
     };
     /* remove bootloader image from the screen as blank/unblank does not change the composition */
-    ret = ioctl(hwc_dev->dsscomp_fd, DSSCIOC_SETUP_DISPC, &d);
+    ret = hwc_dev->backend->ops->setup_dispc(hwc_dev->backend, &d);
     if (ret)
         ALOGW("failed to remove bootloader image");
 
     /* blank and unblank fd to make sure display is properly programmed on boot.
      * This is needed because the bootloader can not be trusted.
      */
-    ret = ioctl(hwc_dev->fb_fd, FBIOBLANK, FB_BLANK_POWERDOWN);
+    ret = hwc_dev->backend->ops->blank(hwc_dev->backend, FB_BLANK_POWERDOWN);
     if (ret)
         ALOGW("failed to blank display");
 
-    ret = ioctl(hwc_dev->fb_fd, FBIOBLANK, FB_BLANK_UNBLANK);
+    ret = hwc_dev->backend->ops->blank(hwc_dev->backend, FB_BLANK_UNBLANK);
     if (ret)
         ALOGW("failed to blank display");
 }
@@ -1747,29 +4260,55 @@ static int omap3_hwc_device_open(const hw_module_t* module, const char* name,
 {
     omap3_hwc_module_t *hwc_mod = (omap3_hwc_module_t *)module;
     omap3_hwc_device_t *hwc_dev;
+    struct omap3_hwc_backend *backend;
+    char value[PROPERTY_VALUE_MAX];
     int err = 0;
 
     if (strcmp(name, HWC_HARDWARE_COMPOSER)) {
         return -EINVAL;
     }
 
-    if (!hwc_mod->fb_dev) {
-        err = omap3_hwc_open_fb_hal(&hwc_mod->fb_dev);
+    /* the simulated backend brings its own framebuffer device */
+    property_get("debug.hwc.backend", value, HWC_DEFAULT_BACKEND);
+    if (!strcmp(value, "sim")) {
+        err = omap3_hwc_open_sim_backend(NULL, &backend);
         if (err)
             return err;
-
+    } else {
         if (!hwc_mod->fb_dev) {
-            ALOGE("Framebuffer HAL not opened before HWC");
-            return -EFAULT;
+            err = omap3_hwc_open_fb_hal(&hwc_mod->fb_dev);
+            if (err)
+                return err;
+
+            if (!hwc_mod->fb_dev) {
+                ALOGE("Framebuffer HAL not opened before HWC");
+                return -EFAULT;
+            }
+            hwc_mod->fb_dev->bBypassPost = 1;
         }
-        hwc_mod->fb_dev->bBypassPost = 1;
+
+        err = omap3_hwc_open_kernel_backend(hwc_mod->fb_dev, &backend);
+        if (err)
+            return err;
     }
 
     hwc_dev = (omap3_hwc_device_t *)malloc(sizeof(*hwc_dev));
-    if (hwc_dev == NULL)
+    if (hwc_dev == NULL) {
+        backend->ops->close(backend);
         return -ENOMEM;
+    }
 
     memset(hwc_dev, 0, sizeof(*hwc_dev));
+    /* first, so that every failure below can tear down with them in place */
+    err = omap3_hwc_create_locks(hwc_dev);
+    if (err) {
+        ALOGE("failed to create locks (%d): %s", -err, strerror(-err));
+        backend->ops->close(backend);
+        free(hwc_dev);
+        return err;
+    }
+    hwc_dev->trace_fd = -1;
+    hwc_dev->epoll_fd = hwc_dev->idle_fd = hwc_dev->post_fd = hwc_dev->vsync_timer_fd = -1;
 
     hwc_dev->base.common.tag = HARDWARE_DEVICE_TAG;
     hwc_dev->base.common.version = HWC_DEVICE_API_VERSION_1_0;
@@ -1782,15 +4321,10 @@ static int omap3_hwc_device_open(const hw_module_t* module, const char* name,
     hwc_dev->base.dump = omap3_hwc_dump;
     hwc_dev->base.registerProcs = omap3_hwc_registerProcs;
     hwc_dev->base.query = omap3_hwc_query;
-    hwc_dev->fb_dev = hwc_mod->fb_dev;
+    hwc_dev->backend = backend;
+    hwc_dev->fb_dev = backend->fb_dev;
     *device = &hwc_dev->base.common;
 
-    hwc_dev->dsscomp_fd = open("/dev/dsscomp", O_RDWR);
-    if (hwc_dev->dsscomp_fd < 0) {
-        ALOGE("failed to open dsscomp (%d)", errno);
-        err = -errno;
-        goto done;
-    }
 #if 0 /*Currently commented hdmi fb fd*/
     hwc_dev->hdmi_fb_fd = open("/dev/graphics/fb1", O_RDWR);
     if (hwc_dev->hdmi_fb_fd < 0) {
@@ -1800,61 +4334,106 @@ static int omap3_hwc_device_open(const hw_module_t* module, const char* name,
     }
 #endif
 
-    hwc_dev->fb_fd = open("/dev/graphics/fb0", O_RDWR);
-    if (hwc_dev->fb_fd < 0) {
-        ALOGE("failed to open fb (%d)", errno);
-        err = -errno;
-        goto done;
-    }
-
     hwc_dev->buffers = malloc(sizeof(buffer_handle_t) * MAX_HW_OVERLAYS);
     if (!hwc_dev->buffers) {
         err = -ENOMEM;
         goto done;
     }
 
-    int ret = ioctl(hwc_dev->dsscomp_fd, DSSCIOC_QUERY_DISPLAY, &hwc_dev->fb_dis);
-    if (ret) {
-        ALOGE("failed to get display info (%d): %m", errno);
-        err = -errno;
+    err = backend->ops->query_display(backend, &hwc_dev->fb_dis);
+    if (err) {
+        ALOGE("failed to get display info (%d)", -err);
         goto done;
     }
 
-    if (pipe(hwc_dev->pipe_fds) == -1) {
-            ALOGE("failed to event pipe (%d): %m", errno);
-            err = -errno;
-            goto done;
-    }
-
-    if (pthread_mutex_init(&hwc_dev->lock, NULL)) {
-            ALOGE("failed to create mutex (%d): %m", errno);
+    hwc_dev->epoll_fd = epoll_create(4);
+    hwc_dev->idle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    hwc_dev->post_fd = eventfd(0, EFD_NONBLOCK);
+    hwc_dev->vsync_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (hwc_dev->epoll_fd < 0 || hwc_dev->idle_fd < 0 || hwc_dev->post_fd < 0 ||
+        hwc_dev->vsync_timer_fd < 0 ||
+        add_event(hwc_dev, hwc_dev->idle_fd, EPOLLIN, EVENT_IDLE) ||
+        add_event(hwc_dev, hwc_dev->post_fd, EPOLLIN, EVENT_POST) ||
+        add_event(hwc_dev, hwc_dev->vsync_timer_fd, EPOLLIN, EVENT_VSYNC_TIMER)) {
             err = -errno;
+            ALOGE("failed to set up event sources (%d): %s", -err, strerror(-err));
             goto done;
     }
 
+    sw_vsync_init(&hwc_dev->vsync, 1000000000LL / (hwc_dev->fb_dev->base.fps ? : 60));
 
-    if (pthread_create(&hwc_dev->hdmi_thread, NULL, omap3_hwc_hdmi_thread, hwc_dev))
-    {
-            ALOGE("failed to create uevent listening thread (%d): %m", errno);
-            err = -errno;
-            goto done;
-    }
-    if (pthread_create(&hwc_dev->vsync_thread, NULL, vsync_loop, hwc_dev))
-    {
-            ALOGE("failed to create vsync-sysfs listening thread (%d): %m", errno);
-            err = -errno;
-            goto done;
-    }
     /* get debug properties */
 
     /* see if hwc is enabled at all */
-    char value[PROPERTY_VALUE_MAX];
     property_get("debug.hwc.rgb_order", value, "1");
     hwc_dev->flags_rgb_order = atoi(value);
     property_get("debug.hwc.nv12_only", value, "0");
     hwc_dev->flags_nv12_only = atoi(value);
+    /* video under a colour-keyed framebuffer; changes how translucent UI over video looks */
+    property_get("debug.hwc.colorkey", value, "0");
+    hwc_dev->flags_colorkey = atoi(value);
     property_get("debug.hwc.idle", value, "250");
     hwc_dev->idle = atoi(value);
+    /* DSS DMA budget in MB/s; above it we have seen FIFO underflows */
+    property_get("debug.hwc.dss_bw", value, "500");
+    hwc_dev->dss_bw_limit = (__u64) atoi(value) << 20;
+    /* TILER 1D slot dsscomp maps other buffers into, in kB */
+    property_get("debug.hwc.tiler_kb", value, "");
+    tiler_slot_init(&hwc_dev->tiler, atoi(value) > 0 ? atoi(value) << 10 : MAX_TILER_SLOT);
+    /* frames a lone video layer has to be still before it goes back to the DSS */
+    property_get("debug.hwc.transition", value, "10");
+    hwc_dev->transition.frames = atoi(value);
+    /* flatten layers unchanged for this many frames; 0 disables it */
+    property_get("debug.hwc.flatten", value, "30");
+    hwc_dev->flat.frames = atoi(value);
+    /* memory for both flattening buffers in kB */
+    property_get("debug.hwc.flatten_kb", value, "4096");
+    hwc_dev->flat.max_mem = atoi(value) << 10;
+    /* scan out planar YUV layers from an NV12 copy */
+    property_get("debug.hwc.convert", value, "1");
+    hwc_dev->conv.enabled = atoi(value);
+    hwc_dev->conv.ix = -1;
+    /* and pre-rotate them when that takes the CPU less time than SGX at this fill rate */
+    property_get("debug.hwc.prerotate", value, "1");
+    hwc_dev->conv.prerotate = atoi(value);
+    property_get("debug.hwc.sgx_mpps", value, "150");
+    hwc_dev->conv.sgx_mpps = atoi(value) > 0 ? atoi(value) : 150;
+    /* YUV colour standard: 601, 709 or 0 for BT.709 above SD size; and full range */
+    property_get("debug.hwc.csc", value, "0");
+    hwc_dev->csc = atoi(value);
+    property_get("debug.hwc.csc_full", value, "0");
+    hwc_dev->csc_full = atoi(value);
+    /* all memory the composer allocates, in kB; a TILER slot by default */
+    ion_pool_init(&hwc_dev->ion_pool,
+                  strcmp(backend->name, "sim") ? &ion_pool_kernel_heap : &ion_pool_host_heap,
+                  property_get("debug.hwc.ion_kb", value, "") > 0 ? atoi(value) << 10 : MAX_TILER_SLOT);
+
+    /* the event thread needs the idle timeout */
+    err = -pthread_create(&hwc_dev->event_thread, NULL, omap3_hwc_event_thread, hwc_dev);
+    if (err)
+    {
+            ALOGE("failed to create event thread (%d): %s", -err, strerror(-err));
+            goto done;
+    }
+    hwc_dev->threads |= THREAD_EVENT;
+    err = -pthread_create(&hwc_dev->present_thread, NULL, omap3_hwc_present_thread, hwc_dev);
+    if (err)
+    {
+            ALOGE("failed to create present thread (%d): %s", -err, strerror(-err));
+            goto done;
+    }
+    hwc_dev->threads |= THREAD_PRESENT;
+    err = -pthread_create(&hwc_dev->mode_thread, NULL, omap3_hwc_mode_thread, hwc_dev);
+    if (err)
+    {
+            ALOGE("failed to create mode thread (%d): %s", -err, strerror(-err));
+            goto done;
+    }
+    hwc_dev->threads |= THREAD_MODE;
+
+    /* capture prepare/set contents for offline replay */
+    if (property_get("debug.hwc.trace", value, "") > 0)
+        omap3_hwc_trace_open(hwc_dev, value);
 
     /* get the board specific clone properties */
     /* 0:0:1280:720 */
@@ -1882,20 +4461,21 @@ static int omap3_hwc_device_open(const hw_module_t* module, const char* name,
     }
     handle_hotplug(hwc_dev, hpd);*/
 
-    ALOGE("omap3_hwc_device_open(rgb_order=%d nv12_only=%d)",
-        hwc_dev->flags_rgb_order, hwc_dev->flags_nv12_only);
+    ALOGE("omap3_hwc_device_open(rgb_order=%d nv12_only=%d colorkey=%d backend=%s)",
+        hwc_dev->flags_rgb_order, hwc_dev->flags_nv12_only, hwc_dev->flags_colorkey, backend->name);
 
 done:
     if (err && hwc_dev) {
-        if (hwc_dev->dsscomp_fd >= 0)
-            close(hwc_dev->dsscomp_fd);
 #if 0 /* Currently commentedhdmi fd close*/
         if (hwc_dev->hdmi_fb_fd >= 0)
             close(hwc_dev->hdmi_fb_fd);
 #endif
-        if (hwc_dev->fb_fd >= 0)
-            close(hwc_dev->fb_fd);
-        pthread_mutex_destroy(&hwc_dev->lock);
+        /* the threads use the event sources and the backend */
+        omap3_hwc_stop_threads(hwc_dev);
+        omap3_hwc_close_events(hwc_dev);
+        ion_pool_destroy(&hwc_dev->ion_pool);
+        backend->ops->close(backend);
+        omap3_hwc_destroy_locks(hwc_dev);
         free(hwc_dev->buffers);
         free(hwc_dev);
     } else {
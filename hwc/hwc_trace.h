@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_TRACE_H
+#define HWC_TRACE_H
+
+#include <linux/types.h>
+
+/*
+ * Binary trace of the display contents passed to prepare and set, written
+ * when debug.hwc.trace names a file.  The file starts with a header, followed
+ * by one frame record per call, each followed by num_layers layer records.
+ * All fields are in native byte order.
+ */
+
+#define HWC_TRACE_MAGIC     0x54435748  /* "HWCT" */
+#define HWC_TRACE_VERSION   1
+
+struct hwc_trace_header {
+    __u32 magic;
+    __u32 version;
+    __u32 fb_width;                     /* framebuffer device info */
+    __u32 fb_height;
+    __s32 fb_format;
+    __u32 fb_fps;
+};
+
+enum {
+    HWC_TRACE_PREPARE = 1,
+    HWC_TRACE_SET     = 2,
+};
+
+/* frame flags */
+enum {
+    HWC_TRACE_HAS_SURFACE = (1 << 0),  /* dpy and sur were supplied to set */
+};
+
+struct hwc_trace_frame {
+    __u32 type;                         /* HWC_TRACE_PREPARE or HWC_TRACE_SET */
+    __u32 num_layers;
+    __u32 list_flags;                   /* hwc_display_contents_1_t flags */
+    __u32 frame_flags;
+    __u64 timestamp;                    /* CLOCK_MONOTONIC, ns */
+};
+
+/* layer flags */
+enum {
+    HWC_TRACE_HAS_HANDLE = (1 << 0),
+};
+
+struct hwc_trace_layer {
+    __s32 composition;                  /* compositionType on entry */
+    __u32 hints;
+    __u32 flags;
+    __u32 transform;
+    __s32 blending;
+    __s32 crop[4];                      /* left, top, right, bottom */
+    __s32 frame[4];
+    __u32 layer_flags;
+
+    /* IMG_native_handle_t, if HWC_TRACE_HAS_HANDLE */
+    __s32 format;
+    __s32 width;
+    __s32 height;
+    __s32 usage;
+    __u64 stamp;
+};
+
+#endif /* HWC_TRACE_H */
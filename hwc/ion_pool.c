@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/ion.h>
+/* omap_ion.h declares kernel functions outside of __KERNEL__ */
+struct ion_client;
+#include <linux/omap_ion.h>
+
+#include <cutils/log.h>
+
+#include "ion_pool.h"
+
+#define ION_PAGE_SIZE 4096
+
+/* ---- /dev/ion ---- */
+
+static int kernel_heap_open(struct omap3_hwc_ion_pool *pool)
+{
+    pool->fd = open("/dev/ion", O_RDWR);
+    if (pool->fd < 0)
+        return -errno;
+    pool->tiler = 1;
+    return 0;
+}
+
+static int kernel_heap_alloc(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf)
+{
+    struct omap_ion_tiler_alloc_data tiler = {
+        .w = buf->size,
+        .h = 1,
+        .fmt = TILER_PIXEL_FMT_PAGE,
+    };
+    struct ion_custom_data custom = {
+        .cmd = OMAP_ION_TILER_ALLOC,
+        .arg = (unsigned long) &tiler,
+    };
+    struct ion_allocation_data data = {
+        .len = buf->size,
+        .align = ION_PAGE_SIZE,
+        .flags = 1 << OMAP_ION_HEAP_LARGE_SURFACES,
+    };
+    struct ion_fd_data map;
+    struct ion_handle_data free_data;
+    int err;
+
+    /* 1D TILER memory can be scanned out without a copy */
+    if (pool->tiler && !ioctl(pool->fd, ION_IOC_CUSTOM, &custom)) {
+        buf->handle = tiler.handle;
+        buf->tiler = 1;
+    } else {
+        if (pool->tiler) {
+            ALOGW("no TILER ION heap (%d), using the carveout", errno);
+            pool->tiler = 0;
+        }
+        if (ioctl(pool->fd, ION_IOC_ALLOC, &data))
+            return -errno;
+        buf->handle = data.handle;
+        buf->tiler = 0;
+    }
+
+    memset(&map, 0, sizeof(map));
+    map.handle = buf->handle;
+    if (ioctl(pool->fd, ION_IOC_MAP, &map)) {
+        err = -errno;
+        goto err_free;
+    }
+    buf->map_fd = map.fd;
+    buf->vaddr = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, map.fd, 0);
+    if (buf->vaddr == MAP_FAILED) {
+        err = -errno;
+        close(map.fd);
+        goto err_free;
+    }
+    return 0;
+
+err_free:
+    free_data.handle = buf->handle;
+    ioctl(pool->fd, ION_IOC_FREE, &free_data);
+    buf->handle = NULL;
+    buf->vaddr = NULL;
+    buf->map_fd = -1;
+    return err;
+}
+
+static void kernel_heap_free(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf)
+{
+    struct ion_handle_data data = { .handle = buf->handle };
+
+    munmap(buf->vaddr, buf->size);
+    close(buf->map_fd);
+    ioctl(pool->fd, ION_IOC_FREE, &data);
+}
+
+static void kernel_heap_close(struct omap3_hwc_ion_pool *pool)
+{
+    close(pool->fd);
+}
+
+const struct omap3_hwc_ion_heap ion_pool_kernel_heap = {
+    .name = "ion",
+    .open = kernel_heap_open,
+    .alloc = kernel_heap_alloc,
+    .free = kernel_heap_free,
+    .close = kernel_heap_close,
+};
+
+/* ---- host stand-in ---- */
+
+static int host_heap_open(struct omap3_hwc_ion_pool *pool)
+{
+    return 0;
+}
+
+static int host_heap_alloc(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf)
+{
+    if (posix_memalign(&buf->vaddr, ION_PAGE_SIZE, buf->size))
+        return -ENOMEM;
+    /* the mapping doubles as the handle */
+    buf->handle = buf->vaddr;
+    buf->map_fd = -1;
+    buf->tiler = 0;
+    return 0;
+}
+
+static void host_heap_free(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf)
+{
+    free(buf->vaddr);
+}
+
+static void host_heap_close(struct omap3_hwc_ion_pool *pool)
+{
+}
+
+const struct omap3_hwc_ion_heap ion_pool_host_heap = {
+    .name = "host",
+    .open = host_heap_open,
+    .alloc = host_heap_alloc,
+    .free = host_heap_free,
+    .close = host_heap_close,
+};
+
+/* ---- pool ---- */
+
+/* size classes are 2^n and 1.5 * 2^n bytes, so at most a third is wasted */
+static __u32 size_class(__u32 size)
+{
+    __u32 c = ION_POOL_MIN_SIZE;
+
+    while (c < size) {
+        if (c + c / 2 >= size)
+            return c + c / 2;
+        c *= 2;
+    }
+    return c;
+}
+
+static void pool_free_buf(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf)
+{
+    pool->heap->free(pool, buf);
+    pool->footprint -= buf->size;
+    pool->frees++;
+    memset(buf, 0, sizeof(*buf));
+    buf->map_fd = -1;
+}
+
+/* a released buffer can be on screen until the second post after it */
+static inline int buf_reusable(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf)
+{
+    return buf->handle && !buf->in_use && pool->posts - buf->released >= 2;
+}
+
+/* frees reusable buffers, least recently released first, until size fits */
+static int pool_make_room(struct omap3_hwc_ion_pool *pool, __u32 size)
+{
+    while (pool->footprint + size > pool->limit) {
+        struct omap3_hwc_ion_buf *oldest = NULL;
+        int i;
+
+        for (i = 0; i < ION_POOL_MAX_BUFS; i++)
+            if (buf_reusable(pool, pool->bufs + i) &&
+                (!oldest || pool->bufs[i].released < oldest->released))
+                oldest = pool->bufs + i;
+        if (!oldest)
+            return -ENOMEM;
+        pool_free_buf(pool, oldest);
+    }
+    return 0;
+}
+
+int ion_pool_init(struct omap3_hwc_ion_pool *pool, const struct omap3_hwc_ion_heap *heap,
+                  __u32 limit)
+{
+    int i, err;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->heap = heap;
+    pool->fd = -1;
+    pool->limit = limit;
+    for (i = 0; i < ION_POOL_MAX_BUFS; i++)
+        pool->bufs[i].map_fd = -1;
+
+    err = heap->open(pool);
+    if (err) {
+        ALOGW("failed to open %s heap (%d)", heap->name, err);
+        pool->heap = NULL;
+    }
+    return err;
+}
+
+void ion_pool_destroy(struct omap3_hwc_ion_pool *pool)
+{
+    int i;
+
+    if (!pool->heap)
+        return;
+
+    for (i = 0; i < ION_POOL_MAX_BUFS; i++)
+        if (pool->bufs[i].handle)
+            pool_free_buf(pool, pool->bufs + i);
+    pool->heap->close(pool);
+    pool->heap = NULL;
+}
+
+struct omap3_hwc_ion_buf *ion_pool_get(struct omap3_hwc_ion_pool *pool, __u32 size)
+{
+    struct omap3_hwc_ion_buf *buf = NULL;
+    __u32 c;
+    int i, err;
+
+    if (!pool->heap || size > pool->limit) {
+        pool->failures++;
+        return NULL;
+    }
+    c = size_class(size);
+
+    /* recycle a buffer of the same class */
+    for (i = 0; i < ION_POOL_MAX_BUFS; i++) {
+        if (buf_reusable(pool, pool->bufs + i) && pool->bufs[i].size == c) {
+            buf = pool->bufs + i;
+            buf->in_use = 1;
+            pool->reuses++;
+            return buf;
+        }
+    }
+
+    for (i = 0; i < ION_POOL_MAX_BUFS && !buf; i++)
+        if (!pool->bufs[i].handle)
+            buf = pool->bufs + i;
+    /* all slots taken: drop a reusable buffer of another class */
+    if (!buf) {
+        for (i = 0; i < ION_POOL_MAX_BUFS && !buf; i++)
+            if (buf_reusable(pool, pool->bufs + i)) {
+                buf = pool->bufs + i;
+                pool_free_buf(pool, buf);
+            }
+    }
+    if (!buf || pool_make_room(pool, c)) {
+        pool->failures++;
+        return NULL;
+    }
+
+    buf->size = c;
+    err = pool->heap->alloc(pool, buf);
+    if (err) {
+        ALOGE("failed to allocate %u bytes from %s heap (%d)", c, pool->heap->name, err);
+        memset(buf, 0, sizeof(*buf));
+        buf->map_fd = -1;
+        pool->failures++;
+        return NULL;
+    }
+    buf->in_use = 1;
+    pool->footprint += c;
+    pool->allocs++;
+    return buf;
+}
+
+void ion_pool_put(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf)
+{
+    if (!buf)
+        return;
+    buf->in_use = 0;
+    buf->released = pool->posts;
+}
+
+int ion_pool_reserve(struct omap3_hwc_ion_pool *pool, __u32 size)
+{
+    if (pool_make_room(pool, size))
+        return -ENOMEM;
+    pool->footprint += size;
+    pool->reserved += size;
+    return 0;
+}
+
+void ion_pool_unreserve(struct omap3_hwc_ion_pool *pool, __u32 size)
+{
+    pool->footprint -= size;
+    pool->reserved -= size;
+}
+
+void ion_pool_posted(struct omap3_hwc_ion_pool *pool)
+{
+    int i;
+
+    pool->posts++;
+    for (i = 0; i < ION_POOL_MAX_BUFS; i++)
+        if (buf_reusable(pool, pool->bufs + i) &&
+            pool->posts - pool->bufs[i].released > ION_POOL_IDLE_POSTS)
+            pool_free_buf(pool, pool->bufs + i);
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OMAP3_HWC_ION_POOL_H
+#define OMAP3_HWC_ION_POOL_H
+
+#include <linux/types.h>
+#include <linux/ion.h>
+
+#include <video/dsscomp.h>
+
+/*
+ * Pool of scratch buffers owned by the composer, e.g. for format conversion
+ * and pre-rotation.  Buffers come from ION (1D TILER if the TILER heap is
+ * there, the large surfaces carveout otherwise) or, on a host, from malloc.
+ * Sizes are rounded up to size classes, so buffers can be recycled for
+ * similar requests, and the total footprint is bounded.
+ *
+ * A released buffer may still be on screen, so it is only handed out again
+ * after two more posts.  Buffers left unused for ION_POOL_IDLE_POSTS posts
+ * are freed.  The pool does no locking.
+ */
+
+#define ION_POOL_MAX_BUFS       8
+#define ION_POOL_MIN_SIZE       (64 << 10)
+#define ION_POOL_IDLE_POSTS     120
+
+struct omap3_hwc_ion_buf {
+    struct ion_handle *handle;          /* NULL if the slot is empty */
+    void *vaddr;                        /* CPU mapping */
+    int map_fd;                         /* fd of the mapping, -1 on a host */
+    __u32 size;                         /* size class */
+    int tiler;                          /* allocated from the TILER heap */
+    int in_use;
+    __u32 released;                     /* posts when it was released */
+};
+
+struct omap3_hwc_ion_pool;
+
+/* where the memory comes from */
+struct omap3_hwc_ion_heap {
+    const char *name;
+    int (*open)(struct omap3_hwc_ion_pool *pool);
+    int (*alloc)(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf);
+    void (*free)(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf);
+    void (*close)(struct omap3_hwc_ion_pool *pool);
+};
+
+struct omap3_hwc_ion_pool {
+    const struct omap3_hwc_ion_heap *heap;
+    int fd;                             /* /dev/ion, -1 if not open */
+    int tiler;                          /* try the TILER heap first */
+    __u32 limit;                        /* max. footprint, bytes */
+    __u32 footprint;                    /* buffers allocated plus reservations */
+    __u32 reserved;                     /* memory allocated elsewhere but charged here */
+    __u32 posts;
+    struct omap3_hwc_ion_buf bufs[ION_POOL_MAX_BUFS];
+
+    /* statistics */
+    __u32 allocs;
+    __u32 reuses;
+    __u32 frees;
+    __u32 failures;
+};
+
+/* /dev/ion, and a malloc stand-in for hosts without the driver */
+extern const struct omap3_hwc_ion_heap ion_pool_kernel_heap;
+extern const struct omap3_hwc_ion_heap ion_pool_host_heap;
+
+int ion_pool_init(struct omap3_hwc_ion_pool *pool, const struct omap3_hwc_ion_heap *heap,
+                  __u32 limit);
+void ion_pool_destroy(struct omap3_hwc_ion_pool *pool);
+
+/* returns a buffer of at least size bytes, or NULL if it does not fit the limit */
+struct omap3_hwc_ion_buf *ion_pool_get(struct omap3_hwc_ion_pool *pool, __u32 size);
+void ion_pool_put(struct omap3_hwc_ion_pool *pool, struct omap3_hwc_ion_buf *buf);
+
+/*
+ * charges memory that is allocated elsewhere against the limit; returns 0 or
+ * -ENOMEM
+ */
+int ion_pool_reserve(struct omap3_hwc_ion_pool *pool, __u32 size);
+void ion_pool_unreserve(struct omap3_hwc_ion_pool *pool, __u32 size);
+
+/* called for every post: ages released buffers and frees idle ones */
+void ion_pool_posted(struct omap3_hwc_ion_pool *pool);
+
+/* points an overlay at the buffer; the caller sets up uv for two-plane formats */
+static inline void ion_pool_setup_ovl(struct omap3_hwc_ion_buf *buf, struct dss2_ovl_info *o)
+{
+    o->addressing = OMAP_DSS_BUFADDR_ION;
+    o->ba = (__u32) (unsigned long) buf->handle;
+}
+
+#endif /* OMAP3_HWC_ION_POOL_H */
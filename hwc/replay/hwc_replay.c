@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host-side replayer for traces captured with debug.hwc.trace.  The composer
+ * is built into this tool and opened on the simulated display backend, so the
+ * same prepare/set code runs as on the device.  Reports per-call latency
+ * percentiles and the resulting overlay/SGX split.
+ *
+ *   hwc_replay <trace> [repeat] [dump] [realtime]
+ *
+ * With "dump", the composer's dumpsys output is printed after the replay.
+ * With "realtime", calls are issued at the pace they were captured at with
+ * vsync events enabled, and the share of time the caller spends inside the
+ * composer is reported.
+ */
+
+#include "../hwc.c"
+
+#include <stdio.h>
+
+#define MAX_STAMPS 256
+
+/* ---- mocks for the libraries the composer links against ---- */
+
+EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface)
+{
+    return 1;
+}
+
+int uevent_init(void)
+{
+    return 0;
+}
+
+int uevent_get_fd(void)
+{
+    return -1;
+}
+
+int uevent_next_event(char *buffer, int buffer_length)
+{
+    return 0;
+}
+
+/* there is no gralloc module on the host; the simulator brings its own framebuffer */
+int hw_get_module(const char *id, const struct hw_module_t **module)
+{
+    return -ENOENT;
+}
+
+static void replay_invalidate(const struct hwc_procs *procs)
+{
+}
+
+static void replay_vsync(const struct hwc_procs *procs, int dpy, int64_t timestamp)
+{
+}
+
+static hwc_procs_t replay_procs = {
+    .invalidate = replay_invalidate,
+    .vsync = replay_vsync,
+};
+
+/* ---- trace replay ---- */
+
+struct latency {
+    __u64 *ns;
+    __u32 count;
+    __u32 size;
+};
+
+static void add_latency(struct latency *l, __u64 ns)
+{
+    if (l->count == l->size) {
+        l->size = l->size ? l->size * 2 : 1024;
+        l->ns = realloc(l->ns, l->size * sizeof(*l->ns));
+        if (!l->ns) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    l->ns[l->count++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    __u64 x = *(const __u64 *) a, y = *(const __u64 *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_latency(const char *name, struct latency *l)
+{
+    if (!l->count) {
+        printf("%-8s no calls\n", name);
+        return;
+    }
+    qsort(l->ns, l->count, sizeof(*l->ns), cmp_u64);
+    printf("%-8s %6u calls  p50 %6.2fus  p90 %6.2fus  p99 %6.2fus  max %6.2fus\n", name, l->count,
+           l->ns[l->count * 50 / 100] / 1000., l->ns[l->count * 90 / 100] / 1000.,
+           l->ns[l->count * 99 / 100] / 1000., l->ns[l->count - 1] / 1000.);
+}
+
+/* one fake gralloc handle per buffer stamp, so that handle identity is preserved */
+static IMG_native_handle_t handles[MAX_STAMPS];
+static __u32 num_handles;
+
+static IMG_native_handle_t *get_handle(struct hwc_trace_layer *t)
+{
+    __u32 i;
+
+    for (i = 0; i < num_handles; i++)
+        if (handles[i].ui64Stamp == t->stamp &&
+            handles[i].iFormat == t->format &&
+            handles[i].iWidth == t->width &&
+            handles[i].iHeight == t->height)
+            break;
+    if (i == num_handles) {
+        if (num_handles == MAX_STAMPS)
+            i = t->stamp % MAX_STAMPS;
+        else
+            num_handles++;
+    }
+
+    handles[i].base.version = sizeof(native_handle_t);
+    handles[i].base.numFds = IMG_NATIVE_HANDLE_NUMFDS;
+    handles[i].base.numInts = IMG_NATIVE_HANDLE_NUMINTS;
+    handles[i].ui64Stamp = t->stamp;
+    handles[i].usage = t->usage;
+    handles[i].iWidth = t->width;
+    handles[i].iHeight = t->height;
+    handles[i].iFormat = t->format;
+    return handles + i;
+}
+
+static void load_layer(hwc_layer_1_t *layer, struct hwc_trace_layer *t)
+{
+    memset(layer, 0, sizeof(*layer));
+    layer->compositionType = t->composition;
+    layer->hints = t->hints;
+    layer->flags = t->flags;
+    layer->transform = t->transform;
+    layer->blending = t->blending;
+    layer->sourceCrop.left = t->crop[0];
+    layer->sourceCrop.top = t->crop[1];
+    layer->sourceCrop.right = t->crop[2];
+    layer->sourceCrop.bottom = t->crop[3];
+    layer->displayFrame.left = t->frame[0];
+    layer->displayFrame.top = t->frame[1];
+    layer->displayFrame.right = t->frame[2];
+    layer->displayFrame.bottom = t->frame[3];
+    layer->handle = t->layer_flags & HWC_TRACE_HAS_HANDLE ? (buffer_handle_t) get_handle(t) : NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct hwc_trace_header h;
+    struct hwc_trace_frame tf;
+    struct hwc_trace_layer tl;
+    struct latency prepare_ns = { 0 }, set_ns = { 0 };
+    __u32 frames = 0, sgx_frames = 0, ovl_layers = 0, fb_layers = 0, mismatches = 0;
+    __u32 posts = 0, set_errors = 0;
+    __u64 ovl_area = 0, total_area = 0;
+    struct omap3_hwc_sim_config cfg;
+    hw_device_t *device;
+    hwc_display_contents_1_t *list = NULL;
+    size_t list_size = 0;
+    int repeat = argc > 2 ? atoi(argv[2]) : 1;
+    int dump = 0, realtime = 0;
+    __u64 busy = 0, start = 0, trace_start = 0;
+    char value[PROPERTY_VALUE_MAX];
+    FILE *f;
+    __u32 i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <trace> [repeat] [dump] [realtime]\n", argv[0]);
+        return 1;
+    }
+    for (i = 3; i < (__u32) argc; i++) {
+        dump |= !strcmp(argv[i], "dump");
+        realtime |= !strcmp(argv[i], "realtime");
+    }
+
+    f = fopen(argv[1], "rb");
+    if (!f || fread(&h, sizeof(h), 1, f) != 1 ||
+        h.magic != HWC_TRACE_MAGIC || h.version != HWC_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d hwc trace\n", argv[1], HWC_TRACE_VERSION);
+        return 1;
+    }
+
+    /* simulate the display the trace was captured on */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.xres = h.fb_width;
+    cfg.yres = h.fb_height;
+    cfg.refresh = h.fb_fps;
+    cfg.format = h.fb_format;
+    strcpy(cfg.modedb, "1920x1080@60,1280x720@60,720x480@60,640x480@60");
+    /* the simulated dsscomp maps into a slot of the size the composer assumes */
+    property_get("debug.hwc.tiler_kb", value, "0");
+    cfg.tiler_size = atoi(value) << 10;
+    omap3_hwc_set_sim_config(&cfg);
+
+    int err = HAL_MODULE_INFO_SYM.base.common.methods->open(&HAL_MODULE_INFO_SYM.base.common,
+                                                            HWC_HARDWARE_COMPOSER, &device);
+    if (err) {
+        fprintf(stderr, "failed to open composer (%d)\n", err);
+        return 1;
+    }
+    omap3_hwc_device_t *hwc_dev = (omap3_hwc_device_t *) device;
+
+    if (realtime) {
+        hwc_dev->base.registerProcs(&hwc_dev->base, &replay_procs);
+        hwc_dev->base.eventControl(&hwc_dev->base, 0, HWC_EVENT_VSYNC, 1);
+    }
+
+    for (; repeat > 0; repeat--) {
+        fseek(f, sizeof(h), SEEK_SET);
+
+        while (fread(&tf, sizeof(tf), 1, f) == 1) {
+            if (tf.type == HWC_TRACE_PREPARE) {
+                size_t size = sizeof(*list) + tf.num_layers * sizeof(hwc_layer_1_t);
+                if (size > list_size) {
+                    list = realloc(list, size);
+                    list_size = size;
+                    if (!list) {
+                        fprintf(stderr, "out of memory\n");
+                        return 1;
+                    }
+                }
+                memset(list, 0, sizeof(*list));
+                list->flags = tf.list_flags;
+                list->numHwLayers = tf.num_layers;
+            }
+
+            for (i = 0; i < tf.num_layers; i++) {
+                if (fread(&tl, sizeof(tl), 1, f) != 1) {
+                    fprintf(stderr, "truncated trace\n");
+                    goto done;
+                }
+                if (tf.type == HWC_TRACE_PREPARE) {
+                    load_layer(list->hwLayers + i, &tl);
+                } else if (list && i < list->numHwLayers &&
+                           tl.composition != list->hwLayers[i].compositionType) {
+                    /* decision differs from the one made on the device */
+                    mismatches++;
+                }
+            }
+
+            if (!list)
+                continue;
+
+            hwc_composer_device_1_t *dev = &hwc_dev->base;
+            hwc_display_contents_1_t *displays[1] = { list };
+
+            if (realtime) {
+                if (!start) {
+                    start = now_ns();
+                    trace_start = tf.timestamp;
+                }
+                /* sleep until the call is due, as the caller would */
+                __u64 due = start + (tf.timestamp - trace_start);
+                struct timespec ts = { .tv_sec = due / 1000000000, .tv_nsec = due % 1000000000 };
+                if (due > now_ns())
+                    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+
+            __u64 t0 = now_ns();
+            if (tf.type == HWC_TRACE_PREPARE) {
+                omap3_hwc_prepare(dev, 1, displays);
+                add_latency(&prepare_ns, now_ns() - t0);
+
+                frames++;
+                sgx_frames += hwc_dev->use_sgx;
+                /* unchanged frames are not composed at all */
+                for (i = 0; !hwc_dev->skip_frame && i < list->numHwLayers; i++) {
+                    hwc_layer_1_t *layer = list->hwLayers + i;
+                    __u64 area = (__u64) WIDTH(layer->displayFrame) * HEIGHT(layer->displayFrame);
+
+                    total_area += area;
+                    if (layer->compositionType == HWC_OVERLAY) {
+                        ovl_layers++;
+                        ovl_area += area;
+                    } else {
+                        fb_layers++;
+                    }
+                }
+            } else if (tf.type == HWC_TRACE_SET) {
+                list->dpy = list->sur = (tf.frame_flags & HWC_TRACE_HAS_SURFACE) ? list : NULL;
+                posts += list->dpy != NULL;
+                if (omap3_hwc_set(dev, 1, displays))
+                    set_errors++;
+                add_latency(&set_ns, now_ns() - t0);
+            }
+            busy += now_ns() - t0;
+        }
+    }
+
+done:
+    printf("%u frames: %u SGX+OVL, %u all-OVL; %u layers on overlays, %u layers on SGX\n",
+           frames, sgx_frames, frames - sgx_frames, ovl_layers, fb_layers);
+    printf("%u posts, %u set errors, %u layer decisions differ from trace\n",
+           posts, set_errors, mismatches);
+    printf("SGX fill avoided: %llu of %llu layer pixels (%.1f%%), %.0f pixels/frame\n",
+           (unsigned long long) ovl_area, (unsigned long long) total_area,
+           total_area ? 100. * ovl_area / total_area : 0., frames ? (double) ovl_area / frames : 0.);
+    print_latency("prepare", &prepare_ns);
+    print_latency("set", &set_ns);
+    printf("plan cache: %u hits, %u misses\n", hwc_dev->plan.hits, hwc_dev->plan.misses);
+    printf("unchanged frames skipped: %u SGX+OVL, %u all-OVL\n",
+           hwc_dev->posted.skipped_sgx, hwc_dev->posted.skipped_ovl);
+    printf("flattening: %u builds, %u invalidations, %llu pixels of SGX fill avoided in %u frames\n",
+           hwc_dev->flat.builds, hwc_dev->flat.invalidations,
+           (unsigned long long) hwc_dev->flat.area_saved, hwc_dev->flat.frames_used);
+    printf("video transitions: %u\n", hwc_dev->transition.transitions);
+    printf("planar conversion: %u frames converted, %u reused, %u failures\n",
+           hwc_dev->conv.conversions, hwc_dev->conv.reuses, hwc_dev->conv.failures);
+    printf("TILER 1D slot: %u buffers mapped, %u kept mapped\n",
+           hwc_dev->tiler.maps, hwc_dev->tiler.kept);
+    printf("colour key: %u frames with the video under the UI\n",
+           hwc_dev->sgx_stats.colorkey_frames);
+    if (realtime && start)
+        printf("caller occupancy: %.1f%% of %.2fs in prepare/set\n",
+               100. * busy / (now_ns() - start), (now_ns() - start) / 1e9);
+    if (hwc_dev->lock_stats.count)
+        printf("lock: %u acquisitions, wait %.2fus avg %.2fus max, hold %.2fus avg %.2fus max\n",
+               hwc_dev->lock_stats.count,
+               hwc_dev->lock_stats.wait_ns / 1000. / hwc_dev->lock_stats.count,
+               hwc_dev->lock_stats.max_wait_ns / 1000.,
+               hwc_dev->lock_stats.hold_ns / 1000. / hwc_dev->lock_stats.count,
+               hwc_dev->lock_stats.max_hold_ns / 1000.);
+
+    if (dump) {
+        char buf[16384];
+
+        hwc_dev->base.dump(&hwc_dev->base, buf, sizeof(buf));
+        fputs(buf, stdout);
+    }
+
+    fclose(f);
+    device->close(device);
+    return 0;
+}
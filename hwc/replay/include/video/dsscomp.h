@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The part of the dsscomp interface (include/video/dsscomp.h and the omapdss
+ * types it uses in the kernel tree) the composer uses, for the host tools.
+ * Device builds use the kernel's header; keep the layouts in sync with it.
+ */
+
+#ifndef _LINUX_DSSCOMP_H
+#define _LINUX_DSSCOMP_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* fb_videomode flags dsscomp adds for the picture aspect ratio */
+#define FB_FLAG_RATIO_4_3       64
+#define FB_FLAG_RATIO_16_9      128
+
+enum omap_color_mode {
+    OMAP_DSS_COLOR_CLUT1    = 1 << 0,
+    OMAP_DSS_COLOR_CLUT2    = 1 << 1,
+    OMAP_DSS_COLOR_CLUT4    = 1 << 2,
+    OMAP_DSS_COLOR_CLUT8    = 1 << 3,
+    OMAP_DSS_COLOR_RGB12U   = 1 << 4,
+    OMAP_DSS_COLOR_ARGB16   = 1 << 5,
+    OMAP_DSS_COLOR_RGB16    = 1 << 6,
+    OMAP_DSS_COLOR_RGB24U   = 1 << 7,
+    OMAP_DSS_COLOR_RGB24P   = 1 << 8,
+    OMAP_DSS_COLOR_YUV2     = 1 << 9,
+    OMAP_DSS_COLOR_UYVY     = 1 << 10,
+    OMAP_DSS_COLOR_ARGB32   = 1 << 11,
+    OMAP_DSS_COLOR_RGBA32   = 1 << 12,
+    OMAP_DSS_COLOR_RGBX32   = 1 << 13,
+    OMAP_DSS_COLOR_NV12     = 1 << 14,
+};
+
+enum omap_dss_ilace_mode {
+    OMAP_DSS_ILACE_NONE     = 0,
+};
+
+enum omap_channel {
+    OMAP_DSS_CHANNEL_LCD    = 0,
+    OMAP_DSS_CHANNEL_DIGIT  = 1,
+};
+
+enum omap_dss_trans_key_type {
+    OMAP_DSS_COLOR_KEY_GFX_DST = 0,
+    OMAP_DSS_COLOR_KEY_VID_SRC = 1,
+};
+
+enum dsscomp_bufaddr {
+    OMAP_DSS_BUFADDR_DIRECT,
+    OMAP_DSS_BUFADDR_BYTYPE,
+    OMAP_DSS_BUFADDR_ION,
+    OMAP_DSS_BUFADDR_GRALLOC,
+    OMAP_DSS_BUFADDR_OVL_IX,
+    OMAP_DSS_BUFADDR_LAYER_IX,
+    OMAP_DSS_BUFADDR_FB,
+};
+
+enum dsscomp_setup_mode {
+    DSSCOMP_SETUP_MODE_APPLY    = (1 << 0),
+    DSSCOMP_SETUP_MODE_DISPLAY  = (1 << 1),
+    DSSCOMP_SETUP_MODE_CAPTURE  = (1 << 2),
+
+    DSSCOMP_SETUP_DISPLAY       = DSSCOMP_SETUP_MODE_APPLY | DSSCOMP_SETUP_MODE_DISPLAY,
+};
+
+struct omap_dss_cconv_coefs {
+    __s16 ry, rcr, rcb;
+    __s16 gy, gcr, gcb;
+    __s16 by, bcr, bcb;
+
+    /* Y is 0 to 255 instead of 16 to 235 */
+    __u16 full_range;
+} __attribute__ ((aligned(4)));
+
+struct omap_dss_cpr_coefs {
+    __s16 rr, rg, rb;
+    __s16 gr, gg, gb;
+    __s16 br, bg, bb;
+};
+
+struct omap_video_timings {
+    __u16 x_res;
+    __u16 y_res;
+    __u32 pixel_clock;              /* kHz */
+    __u16 hsw;
+    __u16 hfp;
+    __u16 hbp;
+    __u16 vsw;
+    __u16 vfp;
+    __u16 vbp;
+};
+
+struct dss2_rect_t {
+    __s32 x;
+    __s32 y;
+    __u32 w;
+    __u32 h;
+};
+
+struct dss2_vc1_range_map_info {
+    __u8 enable;
+    __u8 range_y;
+    __u8 range_uv;
+};
+
+struct dss2_ovl_cfg {
+    __u16 width;
+    __u16 height;
+    __u32 stride;
+
+    enum omap_color_mode color_mode;
+    __u8 pre_mult_alpha;
+    __u8 global_alpha;
+    __u8 rotation;                  /* quarter turns clockwise */
+    __u8 mirror;
+    enum omap_dss_ilace_mode ilace;
+
+    struct dss2_rect_t win;         /* on the display */
+    struct dss2_rect_t crop;        /* in the buffer */
+    struct dss2_vc1_range_map_info vc1;
+
+    struct omap_dss_cconv_coefs cconv;
+
+    __u8 ix;
+    __u8 zorder;
+    __u8 enabled;
+    __u8 zonly;                     /* only set zorder and enabled */
+    __u8 mgr_ix;
+};
+
+struct dss2_ovl_info {
+    struct dss2_ovl_cfg cfg;
+    enum dsscomp_bufaddr addressing;
+    __u32 ba;
+    __u32 uv;
+};
+
+struct dss2_mgr_info {
+    __u32 ix;
+    __u32 default_color;
+    enum omap_dss_trans_key_type trans_key_type;
+    __u32 trans_key;
+    struct omap_dss_cpr_coefs cpr_coefs;
+
+    __u8 trans_enabled;
+    __u8 interlaced;
+    __u8 alpha_blending;
+    __u8 cpr_enabled;
+    __u8 swap_rb;
+};
+
+struct dsscomp_setup_dispc_data {
+    __u32 sync_id;
+    enum dsscomp_setup_mode mode;
+    __u16 num_ovls;
+    __u16 num_mgrs;
+    __u16 get_sync_obj;
+
+    struct dss2_ovl_info ovls[5];
+    struct dss2_mgr_info mgrs[3];
+};
+
+/* struct fb_videomode with an aspect ratio flag */
+struct dsscomp_videomode {
+    const char *name;
+    __u32 refresh;
+    __u32 xres;
+    __u32 yres;
+    __u32 pixclock;                 /* ps */
+    __u32 left_margin;
+    __u32 right_margin;
+    __u32 upper_margin;
+    __u32 lower_margin;
+    __u32 hsync_len;
+    __u32 vsync_len;
+    __u32 sync;
+    __u32 vmode;
+    __u32 flag;
+};
+
+struct dsscomp_display_info {
+    __u32 ix;
+    __u32 overlays_available;
+    __u32 overlays_owned;
+    __u32 state;
+    __u8 enabled;
+    struct omap_video_timings timings;
+    struct dss2_mgr_info mgr;
+    __u16 width_in_mm;
+    __u16 height_in_mm;
+    enum omap_channel channel;
+
+    /* entries of modedb; on input the room after the structure */
+    __u32 modedb_len;
+    struct dsscomp_videomode modedb[];
+};
+
+struct dsscomp_setup_display_data {
+    __u32 ix;
+    struct dsscomp_videomode mode;
+};
+
+#define DSSCIOC_QUERY_DISPLAY   _IOWR('O', 131, struct dsscomp_display_info)
+#define DSSCIOC_SETUP_DISPC     _IOW('O', 133, struct dsscomp_setup_dispc_data)
+#define DSSCIOC_SETUP_DISPLAY   _IOW('O', 134, struct dsscomp_setup_display_data)
+
+#endif /* _LINUX_DSSCOMP_H */
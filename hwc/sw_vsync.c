@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "sw_vsync.h"
+
+void sw_vsync_init(struct omap3_hwc_sw_vsync *m, int64_t nominal_period)
+{
+    memset(m, 0, sizeof(*m));
+    m->nominal = m->period = nominal_period;
+}
+
+static void push(struct omap3_hwc_sw_vsync *m, int64_t timestamp)
+{
+    m->t[m->head] = timestamp;
+    m->n[m->head] = m->seq;
+    m->head = (m->head + 1) % SW_VSYNC_WINDOW;
+    if (m->count < SW_VSYNC_WINDOW)
+        m->count++;
+}
+
+/*
+ * The fit runs in 64-bit integers, as doubles are done in software on the
+ * softfp ARM build.  The slope is kept to 1/FIT_ONE ns.  Samples span at most
+ * SW_VSYNC_WINDOW * SW_VSYNC_MAX_GAP vsyncs, so the sums stay in 64 bits for
+ * periods up to FIT_MAX_PERIOD.
+ */
+#define FIT_SHIFT       16
+#define FIT_ONE         (1LL << FIT_SHIFT)
+#define FIT_MAX_PERIOD  250000000LL     /* 4 Hz */
+
+/* n / d rounded half up, d > 0 */
+static int64_t div_round(int64_t n, int64_t d)
+{
+    n += d / 2;
+    return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+
+/* least squares fit of the window; updates period and base */
+static void fit(struct omap3_hwc_sw_vsync *m)
+{
+    unsigned int first = (m->head + SW_VSYNC_WINDOW - m->count) % SW_VSYNC_WINDOW;
+    int64_t t0 = m->t[first];
+    __u32 n0 = m->n[first];
+    int64_t sx = 0, sy = 0, sxx = 0, sxy = 0, se = 0, num, den, q, period;
+    int64_t x_last = m->seq - n0;
+    unsigned int i;
+
+    if (m->nominal > FIT_MAX_PERIOD)
+        return;
+
+    for (i = 0; i < m->count; i++) {
+        unsigned int j = (first + i) % SW_VSYNC_WINDOW;
+        int64_t x = m->n[j] - n0;
+        int64_t y = m->t[j] - t0;
+
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    /* slope num / den as whole ns and a fraction of FIT_ONE */
+    den = m->count * sxx - sx * sx;
+    num = m->count * sxy - sx * sy;
+    if (den <= 0 || num <= 0)
+        return;
+    q = num / den;
+    period = q * FIT_ONE + (num % den) * FIT_ONE / den;
+
+    /* do not follow a fit that is far off the display mode */
+    if (period < m->nominal * 9 * FIT_ONE / 10 || period > m->nominal * 11 * FIT_ONE / 10)
+        return;
+
+    /*
+     * the line at the last sample: q ns per vsync, plus the mean distance of
+     * the samples from that and the fraction of the slope from their centre
+     */
+    for (i = 0; i < m->count; i++) {
+        unsigned int j = (first + i) % SW_VSYNC_WINDOW;
+
+        se += m->t[j] - t0 - q * (int64_t) (m->n[j] - n0);
+    }
+    m->period = div_round(period, FIT_ONE);
+    m->base = t0 + q * x_last +
+              div_round(se * FIT_ONE + (period - q * FIT_ONE) * (m->count * x_last - sx),
+                        m->count * FIT_ONE);
+}
+
+int64_t sw_vsync_sample(struct omap3_hwc_sw_vsync *m, int64_t timestamp)
+{
+    int64_t dt, err;
+    __u32 k;
+
+    m->samples++;
+
+    if (!m->count) {
+        m->base = timestamp;
+        push(m, timestamp);
+        return timestamp;
+    }
+
+    dt = timestamp - m->base;
+    if (dt < m->period / 2)
+        return -1;
+
+    k = (dt + m->period / 2) / m->period;
+    err = dt - (int64_t) k * m->period;
+    if (k > SW_VSYNC_MAX_GAP || err > m->period / 4 || err < -m->period / 4) {
+        /* display was off or retimed: keep the period, restart the phase */
+        m->resyncs++;
+        m->count = 0;
+        m->base = timestamp;
+        push(m, timestamp);
+        return timestamp;
+    }
+
+    m->missed += k - 1;
+    m->seq += k;
+    push(m, timestamp);
+
+    if (m->count >= SW_VSYNC_MIN_FIT)
+        fit(m);
+    else
+        m->base = timestamp;
+
+    err = timestamp - m->base;
+    if (err < 0)
+        err = -err;
+    m->jitter_sum += err;
+    if (err > m->jitter_max)
+        m->jitter_max = err;
+
+    return m->base;
+}
+
+int sw_vsync_locked(struct omap3_hwc_sw_vsync *m, int64_t now)
+{
+    return m->count >= SW_VSYNC_MIN_FIT && now - m->base < SW_VSYNC_MAX_PREDICT;
+}
+
+int64_t sw_vsync_next(struct omap3_hwc_sw_vsync *m, int64_t after)
+{
+    int64_t k;
+
+    if (after < m->base)
+        return m->base;
+    k = (after - m->base) / m->period + 1;
+    return m->base + k * m->period;
+}
+
+int64_t sw_vsync_period(struct omap3_hwc_sw_vsync *m)
+{
+    return m->count >= SW_VSYNC_MIN_FIT ? m->period : m->nominal;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OMAP3_HWC_SW_VSYNC_H
+#define OMAP3_HWC_SW_VSYNC_H
+
+#include <stdint.h>
+#include <linux/types.h>
+
+/*
+ * Software vsync model.  Hardware vsync timestamps are fitted to a line
+ * (vsync number -> time) over a sliding window, which gives the real refresh
+ * period and a phase without the interrupt latency jitter of the individual
+ * timestamps.  The model can then predict vsyncs the hardware did not report.
+ *
+ * All times are CLOCK_MONOTONIC nanoseconds.  The model does no locking.
+ */
+
+#define SW_VSYNC_WINDOW     32          /* samples fitted */
+#define SW_VSYNC_MIN_FIT    8           /* samples needed to lock */
+#define SW_VSYNC_MAX_GAP    120         /* longer gaps restart the window */
+#define SW_VSYNC_MAX_PREDICT 2000000000LL /* predict at most 2s past the last sample */
+
+struct omap3_hwc_sw_vsync {
+    int64_t nominal;                    /* period from the display mode */
+    int64_t period;                     /* estimated period */
+    int64_t base;                       /* fitted time of the last sample */
+
+    /* sliding window of samples */
+    int64_t t[SW_VSYNC_WINDOW];         /* timestamp */
+    __u32 n[SW_VSYNC_WINDOW];           /* vsync number */
+    unsigned int head;
+    unsigned int count;
+    __u32 seq;                          /* vsync number of the last sample */
+
+    /* statistics */
+    __u32 samples;
+    __u32 missed;                       /* vsyncs without a hardware timestamp */
+    __u32 resyncs;                      /* samples that did not fit the model */
+    __u32 predicted;                    /* vsyncs reported from the model */
+    int64_t jitter_sum;                 /* sum of |timestamp - model| */
+    int64_t jitter_max;
+};
+
+void sw_vsync_init(struct omap3_hwc_sw_vsync *m, int64_t nominal_period);
+
+/*
+ * adds a hardware timestamp; returns the filtered time of that vsync, or -1 if
+ * the timestamp repeats a vsync already seen
+ */
+int64_t sw_vsync_sample(struct omap3_hwc_sw_vsync *m, int64_t timestamp);
+
+/* whether vsyncs around now can be predicted */
+int sw_vsync_locked(struct omap3_hwc_sw_vsync *m, int64_t now);
+
+/* first predicted vsync after the given time */
+int64_t sw_vsync_next(struct omap3_hwc_sw_vsync *m, int64_t after);
+
+/* estimated period, or the nominal one until the model is locked */
+int64_t sw_vsync_period(struct omap3_hwc_sw_vsync *m);
+
+#endif /* OMAP3_HWC_SW_VSYNC_H */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OMAP3_HWC_TEST_H
+#define OMAP3_HWC_TEST_H
+
+#include <stdio.h>
+
+/*
+ * Checks for the host tests.  A failed check is reported with its location
+ * and counted; the test goes on.
+ */
+
+extern int test_failures;
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+            test_failures++;                                                    \
+        }                                                                       \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                          \
+    do {                                                                        \
+        long long _a = (long long) (a), _b = (long long) (b);                   \
+        if (_a != _b) {                                                         \
+            fprintf(stderr, "%s:%d: %s == %s: %lld != %lld\n", __FILE__, __LINE__, \
+                    #a, #b, _a, _b);                                            \
+            test_failures++;                                                    \
+        }                                                                       \
+    } while (0)
+
+/* tests of the standalone modules */
+void test_ion_pool(void);
+void test_sw_vsync(void);
+void test_tiler_slot(void);
+void test_yuv_conv(void);
+
+/* benchmarks */
+void bench_yuv_conv(void);
+void bench_yuv_conv_transforms(void);
+
+#endif /* OMAP3_HWC_TEST_H */
@@ -0,0 +1,1927 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host tests.  The composer is built into this program like into hwc_replay
+ * and opened on the simulated display backend, so the tests reach its
+ * internals; the standalone modules are tested in files of their own.
+ *
+ *   hwc_tests [test...]
+ *
+ * Runs the named tests, or all tests but the benchmarks.  Exits with 1 if a
+ * check failed.
+ */
+
+#include "../hwc.c"
+
+#include <math.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "hwc_test.h"
+
+int test_failures;
+
+/* ---- mocks for the libraries the composer links against ---- */
+
+EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface)
+{
+    return 1;
+}
+
+/* uevents come from a socket pair the tests write into */
+static int uevent_fds[2] = { -1, -1 };
+static pthread_once_t uevent_once = PTHREAD_ONCE_INIT;
+
+static void uevent_open(void)
+{
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, uevent_fds))
+        fprintf(stderr, "cannot create the uevent socket: %s\n", strerror(errno));
+}
+
+int uevent_init(void)
+{
+    pthread_once(&uevent_once, uevent_open);
+    return uevent_fds[0] >= 0;
+}
+
+int uevent_get_fd(void)
+{
+    return uevent_fds[0];
+}
+
+int uevent_next_event(char *buffer, int buffer_length)
+{
+    ssize_t len = recv(uevent_fds[0], buffer, buffer_length, 0);
+
+    return len > 0 ? len : 0;
+}
+
+/* sends a uevent: the action@path line and the NUL-separated variables */
+static void send_uevent(const char *msg, size_t len)
+{
+    uevent_init();
+    CHECK_EQ(send(uevent_fds[1], msg, len, 0), len);
+}
+
+int hw_get_module(const char *id, const struct hw_module_t **module)
+{
+    return -ENOENT;
+}
+
+/* the next timerfd_failures timers fail as if the process were out of fds */
+static int timerfd_failures;
+
+int timerfd_create(int clockid, int flags)
+{
+    if (__atomic_load_n(&timerfd_failures, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_sub_fetch(&timerfd_failures, 1, __ATOMIC_SEQ_CST);
+        errno = EMFILE;
+        return -1;
+    }
+    return syscall(SYS_timerfd_create, clockid, flags);
+}
+
+/* ---- composer on the simulated display ---- */
+
+#define TEST_MAX_LAYERS 20
+
+/* 480x800 LCD with a pixel clock of 29.03 MHz and no blanking */
+static const struct omap3_hwc_sim_config test_display = {
+    .xres = 480,
+    .yres = 800,
+    .refresh = 60,
+    .pixel_clock = 29030,
+    .width_in_mm = 53,
+    .height_in_mm = 88,
+    .format = HAL_PIXEL_FORMAT_BGRA_8888,
+    .modedb = "1920x1080@60,1280x720@60,720x480@60,640x480@60",
+};
+
+struct test_frame {
+    hwc_display_contents_1_t list;
+    hwc_layer_1_t layers[TEST_MAX_LAYERS];
+};
+
+static omap3_hwc_device_t *open_composer(void)
+{
+    hw_device_t *device;
+    int err;
+
+    omap3_hwc_set_sim_config(&test_display);
+    err = HAL_MODULE_INFO_SYM.base.common.methods->open(&HAL_MODULE_INFO_SYM.base.common,
+                                                        HWC_HARDWARE_COMPOSER, &device);
+    CHECK_EQ(err, 0);
+    return err ? NULL : (omap3_hwc_device_t *) device;
+}
+
+static void close_composer(omap3_hwc_device_t *hwc_dev)
+{
+    hwc_dev->base.common.close(&hwc_dev->base.common);
+}
+
+static void init_buffer(IMG_native_handle_t *handle, int format, int width, int height)
+{
+    static __u64 stamp;
+
+    memset(handle, 0, sizeof(*handle));
+    handle->base.version = sizeof(native_handle_t);
+    handle->base.numFds = IMG_NATIVE_HANDLE_NUMFDS;
+    handle->base.numInts = IMG_NATIVE_HANDLE_NUMINTS;
+    handle->iFormat = format;
+    handle->iWidth = width;
+    handle->iHeight = height;
+    handle->usage = GRALLOC_USAGE_HW_COMPOSER;
+    handle->ui64Stamp = ++stamp;
+}
+
+/* adds a layer showing crop of the buffer at frame */
+static hwc_layer_1_t *add_layer(struct test_frame *f, IMG_native_handle_t *handle,
+                                hwc_rect_t crop, hwc_rect_t frame, int blending)
+{
+    hwc_layer_1_t *layer = f->layers + f->list.numHwLayers++;
+
+    memset(layer, 0, sizeof(*layer));
+    layer->handle = (buffer_handle_t) handle;
+    layer->blending = blending;
+    layer->sourceCrop = crop;
+    layer->displayFrame = frame;
+    f->list.flags = HWC_GEOMETRY_CHANGED;
+    return layer;
+}
+
+/* what the composer reported through its callbacks */
+struct test_procs {
+    hwc_procs_t base;
+    int invalidates;                    /* atomic */
+    int vsyncs;                         /* atomic */
+    int64_t last_vsync;                 /* atomic */
+    int64_t min_interval;               /* between vsyncs, ns */
+    int64_t max_interval;
+};
+
+static void test_invalidate(const struct hwc_procs *procs)
+{
+    struct test_procs *p = (struct test_procs *) procs;
+
+    __atomic_add_fetch(&p->invalidates, 1, __ATOMIC_SEQ_CST);
+}
+
+/* vsyncs are only reported from the event thread */
+static void test_vsync(const struct hwc_procs *procs, int dpy, int64_t timestamp)
+{
+    struct test_procs *p = (struct test_procs *) procs;
+    int64_t interval = timestamp - p->last_vsync;
+
+    if (p->last_vsync) {
+        if (!p->min_interval || interval < p->min_interval)
+            p->min_interval = interval;
+        if (interval > p->max_interval)
+            p->max_interval = interval;
+    }
+    __atomic_store_n(&p->last_vsync, timestamp, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&p->vsyncs, 1, __ATOMIC_SEQ_CST);
+}
+
+static void register_procs(omap3_hwc_device_t *hwc_dev, struct test_procs *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->base.invalidate = test_invalidate;
+    p->base.vsync = test_vsync;
+    hwc_dev->base.registerProcs(&hwc_dev->base, &p->base);
+}
+
+/* waits up to ms for the counter to reach n; returns its value */
+static int wait_count(int *counter, int n, int ms)
+{
+    int value;
+
+    while ((value = __atomic_load_n(counter, __ATOMIC_SEQ_CST)) < n && ms-- > 0)
+        usleep(1000);
+    return value;
+}
+
+/* prepare and set, as SurfaceFlinger calls them */
+static void compose(omap3_hwc_device_t *hwc_dev, struct test_frame *f)
+{
+    hwc_display_contents_1_t *displays[1] = { &f->list };
+    unsigned int i;
+
+    for (i = 0; i < f->list.numHwLayers; i++)
+        f->layers[i].compositionType = HWC_FRAMEBUFFER;
+    CHECK_EQ(hwc_dev->base.prepare(&hwc_dev->base, 1, displays), 0);
+    f->list.dpy = f->list.sur = f;
+    CHECK_EQ(hwc_dev->base.set(&hwc_dev->base, 1, displays), 0);
+    f->list.flags = 0;
+}
+
+/* ---- DSS bandwidth admission ---- */
+
+static void test_bandwidth(void)
+{
+    /* DMA rates worked out by hand for the test display */
+    static const struct {
+        enum omap_color_mode color_mode;
+        __u32 crop_w, crop_h;
+        __u32 win_w, win_h;
+        int rotation;
+        __u64 bw;                       /* bytes/s */
+    } ovls[] = {
+        /* 4 bytes per pixel at the pixel clock */
+        { OMAP_DSS_COLOR_ARGB32, 480, 800, 480, 800, 0, 116120000 },
+        { OMAP_DSS_COLOR_UYVY, 480, 270, 480, 270, 0, 58060000 },
+        /* 1.5 bytes per pixel, 1.5 source pixels per screen pixel */
+        { OMAP_DSS_COLOR_NV12, 720, 480, 480, 320, 0, 97976250 },
+        { OMAP_DSS_COLOR_NV12, 480, 720, 480, 320, 1, 97976250 },
+        /* 8x downscale: the DSS fetches every other line and pixel */
+        { OMAP_DSS_COLOR_NV12, 1920, 1080, 240, 135, 0, 348360000 },
+    };
+    /*
+     * Known-good and known-bad configurations: an NV12 video, alone or
+     * under a full-screen UI layer, against a DSS budget in MB/s.  The UI
+     * is composed by SGX into the framebuffer, which takes 110.7 MB/s.
+     */
+    static const struct {
+        int ui;
+        __u32 src_w, src_h;
+        hwc_rect_t frame;
+        __u32 budget;
+        int overlay;                    /* the video is on an overlay */
+        int reason;                     /* why SGX composes the frame */
+    } configs[] = {
+        /* 93.4 MB/s of video */
+        { 1, 720, 480, { 0, 240, 480, 560 }, 500, 1, SGX_REASON_UI },
+        { 1, 720, 480, { 0, 240, 480, 560 }, 210, 1, SGX_REASON_UI },
+        { 1, 720, 480, { 0, 240, 480, 560 }, 200, 0, SGX_REASON_UI },
+        /* 295.3 MB/s of video */
+        { 1, 1280, 720, { 0, 265, 480, 535 }, 500, 1, SGX_REASON_UI },
+        { 1, 1280, 720, { 0, 265, 480, 535 }, 400, 0, SGX_REASON_UI },
+        /* 73.8 MB/s of video, and the framebuffer only with SGX */
+        { 0, 640, 480, { 0, 220, 480, 580 }, 80, 1, SGX_REASON_NONE },
+        { 0, 640, 480, { 0, 220, 480, 580 }, 70, 0, SGX_REASON_BANDWIDTH },
+    };
+    struct omap_video_timings t = { .x_res = 480, .y_res = 800, .pixel_clock = 29030 };
+    struct dss2_ovl_cfg oc;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(ovls) / sizeof(*ovls); i++) {
+        memset(&oc, 0, sizeof(oc));
+        oc.enabled = 1;
+        oc.color_mode = ovls[i].color_mode;
+        oc.crop.w = ovls[i].crop_w;
+        oc.crop.h = ovls[i].crop_h;
+        oc.win.w = ovls[i].win_w;
+        oc.win.h = ovls[i].win_h;
+        oc.rotation = ovls[i].rotation;
+        CHECK_EQ(ovl_bandwidth(&oc, &t), ovls[i].bw);
+
+        /* disabled overlays and z-order updates fetch nothing */
+        oc.zonly = 1;
+        CHECK_EQ(ovl_bandwidth(&oc, &t), 0);
+        oc.zonly = 0;
+        oc.enabled = 0;
+        CHECK_EQ(ovl_bandwidth(&oc, &t), 0);
+    }
+
+    for (i = 0; i < sizeof(configs) / sizeof(*configs); i++) {
+        omap3_hwc_device_t *hwc_dev = open_composer();
+        IMG_native_handle_t ui, video;
+        struct test_frame f;
+        hwc_layer_1_t *v;
+
+        if (!hwc_dev)
+            return;
+        hwc_dev->dss_bw_limit = (__u64) configs[i].budget << 20;
+        /* the lone video appears with a geometry change; do not wait for it to be still */
+        hwc_dev->transition.frames = 0;
+
+        memset(&f, 0, sizeof(f));
+        init_buffer(&video, HAL_PIXEL_FORMAT_TI_NV12, configs[i].src_w, configs[i].src_h);
+        v = add_layer(&f, &video, (hwc_rect_t) { 0, 0, configs[i].src_w, configs[i].src_h },
+                      configs[i].frame, HWC_BLENDING_NONE);
+        if (configs[i].ui) {
+            init_buffer(&ui, HAL_PIXEL_FORMAT_RGBA_8888, 480, 800);
+            add_layer(&f, &ui, (hwc_rect_t) { 0, 0, 480, 800 }, (hwc_rect_t) { 0, 0, 480, 800 },
+                      HWC_BLENDING_PREMULT);
+            v = f.layers;
+        }
+        compose(hwc_dev, &f);
+
+        CHECK_EQ(v->compositionType, configs[i].overlay ? HWC_OVERLAY : HWC_FRAMEBUFFER);
+        CHECK_EQ(hwc_dev->use_sgx ? hwc_dev->sgx_stats.frame_reason : SGX_REASON_NONE,
+                 configs[i].reason);
+        /* an admitted video keeps the composition within the budget */
+        if (configs[i].overlay)
+            CHECK(hwc_dev->dss_bw <= hwc_dev->dss_bw_limit);
+        close_composer(hwc_dev);
+    }
+}
+
+/* ---- colour space conversion ---- */
+
+static int clamp8(double v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : (int) v;
+}
+
+/* the DSS datapath: coefficients scaled by 256, Y offset by 16 unless full range */
+static void dss_csc(const struct omap_dss_cconv_coefs *c, int y, int cb, int cr, int rgb[3])
+{
+    y -= c->full_range ? 0 : 16;
+    cb -= 128;
+    cr -= 128;
+    rgb[0] = clamp8((c->ry * y + c->rcr * cr + c->rcb * cb + 128) >> 8);
+    rgb[1] = clamp8((c->gy * y + c->gcr * cr + c->gcb * cb + 128) >> 8);
+    rgb[2] = clamp8((c->by * y + c->bcr * cr + c->bcb * cb + 128) >> 8);
+}
+
+/* Y'CbCr to R'G'B' from the luma weights Kr and Kb */
+static void ref_csc(double kr, double kb, int full, int y, int cb, int cr, int rgb[3])
+{
+    double Y = full ? y / 255. : (y - 16) / 219.;
+    double Pb = full ? (cb - 128) / 255. : (cb - 128) / 224.;
+    double Pr = full ? (cr - 128) / 255. : (cr - 128) / 224.;
+    double R = Y + 2 * (1 - kr) * Pr;
+    double B = Y + 2 * (1 - kb) * Pb;
+    double G = (Y - kr * R - kb * B) / (1 - kr - kb);
+
+    rgb[0] = clamp8(floor(R * 255 + .5));
+    rgb[1] = clamp8(floor(G * 255 + .5));
+    rgb[2] = clamp8(floor(B * 255 + .5));
+}
+
+/*
+ * The conversion tables against BT.601 and BT.709, limited and full range:
+ * each coefficient is within 1 of its derivation from Kr and Kb, and every
+ * valid Y'CbCr triplet converts to within 1 of the exact R'G'B'.
+ */
+static void test_csc(void)
+{
+    static const struct {
+        const char *name;
+        const struct omap_dss_cconv_coefs *c;
+        double kr, kb;
+        int full;
+    } tables[] = {
+        { "bt601", &ctbl_bt601_5, .299, .114, 0 },
+        { "bt601 full", &ctbl_bt601_5_full, .299, .114, 1 },
+        { "bt709", &ctbl_bt709, .2126, .0722, 0 },
+        { "bt709 full", &ctbl_bt709_full, .2126, .0722, 1 },
+    };
+    /* SD video, of up to 576 lines however wide, is BT.601, HD video BT.709 */
+    static const struct {
+        int w, h, csc;
+    } sizes[] = {
+        { 176, 144, 601 }, { 640, 480, 601 }, { 720, 576, 601 }, { 576, 720, 709 },
+        { 854, 480, 601 }, { 960, 540, 601 }, { 1024, 576, 601 }, { 1280, 720, 709 },
+        { 1440, 1080, 709 }, { 1920, 1080, 709 },
+    };
+    omap3_hwc_device_t hwc_dev;
+    hwc_layer_1_t layer;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(tables) / sizeof(*tables); i++) {
+        const struct omap_dss_cconv_coefs *c = tables[i].c;
+        double kr = tables[i].kr, kb = tables[i].kb, kg = 1 - kr - kb;
+        double ys = tables[i].full ? 1 : 255. / 219, cs = tables[i].full ? 1 : 255. / 224;
+        int lo = tables[i].full ? 0 : 16, y_hi = tables[i].full ? 255 : 235;
+        int c_hi = tables[i].full ? 255 : 240;
+        int y, cb, cr, k, a[3], b[3], max_err = 0;
+
+        const long coef[9] = {
+            c->ry, c->rcr, c->rcb, c->gy, c->gcr, c->gcb, c->by, c->bcr, c->bcb,
+        };
+        const long derived[9] = {
+            lround(256 * ys), lround(256 * cs * 2 * (1 - kr)), 0,
+            lround(256 * ys), lround(-256 * cs * 2 * (1 - kr) * kr / kg),
+            lround(-256 * cs * 2 * (1 - kb) * kb / kg),
+            lround(256 * ys), 0, lround(256 * cs * 2 * (1 - kb)),
+        };
+
+        CHECK_EQ(c->full_range, tables[i].full);
+        /* the BT.601 table has the customary 2.018 for Cb to B, one above the derivation */
+        for (k = 0; k < 9; k++)
+            CHECK(coef[k] - derived[k] >= -1 && coef[k] - derived[k] <= 1);
+
+        for (y = lo; y <= y_hi; y++) {
+            for (cb = lo; cb <= c_hi; cb++) {
+                for (cr = lo; cr <= c_hi; cr++) {
+                    dss_csc(c, y, cb, cr, a);
+                    ref_csc(kr, kb, tables[i].full, y, cb, cr, b);
+                    for (k = 0; k < 3; k++)
+                        if (abs(a[k] - b[k]) > max_err)
+                            max_err = abs(a[k] - b[k]);
+                }
+            }
+        }
+        printf("csc: %-10s max error %d\n", tables[i].name, max_err);
+        CHECK(max_err <= 1);
+    }
+
+    /* the table chosen for a layer, by size or by debug.hwc.csc and debug.hwc.csc_full */
+    memset(&hwc_dev, 0, sizeof(hwc_dev));
+    memset(&layer, 0, sizeof(layer));
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        layer.sourceCrop = (hwc_rect_t) { 0, 0, sizes[i].w, sizes[i].h };
+        CHECK(omap3_hwc_get_cconv(&hwc_dev, &layer) ==
+              (sizes[i].csc == 709 ? &ctbl_bt709 : &ctbl_bt601_5));
+    }
+    hwc_dev.csc = 601;
+    hwc_dev.csc_full = 1;
+    layer.sourceCrop = (hwc_rect_t) { 0, 0, 1920, 1080 };
+    CHECK(omap3_hwc_get_cconv(&hwc_dev, &layer) == &ctbl_bt601_5_full);
+    hwc_dev.csc = 709;
+    layer.sourceCrop = (hwc_rect_t) { 0, 0, 320, 240 };
+    CHECK(omap3_hwc_get_cconv(&hwc_dev, &layer) == &ctbl_bt709_full);
+}
+
+/* ---- external display transform ---- */
+
+/* the float matrix the external transform used to be built with */
+static void ref_translate(float m[2][3], int dx, int dy)
+{
+    m[0][2] += dx;
+    m[1][2] += dy;
+}
+
+static void ref_scale(float m[2][3], int x_from, int x_to, int y_from, int y_to)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        m[0][i] = m[0][i] * x_to / x_from;
+        m[1][i] = m[1][i] * y_to / y_from;
+    }
+}
+
+static void ref_rotate(float m[2][3], int quarter_turns)
+{
+    int i, q;
+
+    if (quarter_turns & 2)
+        ref_scale(m, 1, -1, 1, -1);
+    if (quarter_turns & 1) {
+        for (i = 0; i < 3; i++) {
+            q = m[0][i]; m[0][i] = -m[1][i]; m[1][i] = q;
+        }
+    }
+}
+
+static int ref_round(float x)
+{
+    return (int) (x < 0 ? x - 0.5 : x + 0.5);
+}
+
+/* exact n / d, d > 0, rounded half away from 0; *tie is set for .5 */
+static int exact_round(long long n, long long d, int *tie)
+{
+    long long a = n < 0 ? -n : n;
+
+    *tie = (2 * a) % d == 0 && a % d;
+    return n < 0 ? -(int) ((2 * a + d) / (2 * d)) : (int) ((2 * a + d) / (2 * d));
+}
+
+/*
+ * Windows put on the external display by the integer transform, against the
+ * float one it replaced and against exact rationals.  The integer transform
+ * must be the exactly rounded one; float error may only have moved .5 ties.
+ */
+static void test_ext_transform(void)
+{
+    static const __u32 modes[][4] = {
+        /* xres, yres, width and height in mm */
+        { 640, 480, 0, 0 },
+        { 720, 480, 160, 90 },
+        { 1280, 720, 1600, 900 },
+        { 1920, 1080, 0, 0 },
+    };
+    unsigned int seed = 1, cases = 0, ties = 0;
+    int orient, i;
+
+    for (orient = 0; orient < 8; orient++) {
+        for (i = 0; i < 20000; i++) {
+            const __u32 *mode = modes[rand_r(&seed) % 4];
+            omap3_hwc_ext_t ext;
+            struct dss2_ovl_info o;
+            hwc_rect_t r;
+            float m[2][3] = { { 1, 0, 0 }, { 0, 1, 0 } };
+            int win[4], ref[4], exact[4], tie[4];
+            int k, rot_w, rot_h;
+            long long x0, y0, to[2], from[2];
+
+            memset(&ext, 0, sizeof(ext));
+            ext.xres = mode[0];
+            ext.yres = mode[1];
+            ext.width = mode[2];
+            ext.height = mode[3];
+            ext.current.rotation = orient & 3;
+            ext.current.hflip = orient >> 2;
+            ext.current.docking = 1;
+            ext.current.enabled = 1;
+
+            /* region mirrored and a window in it */
+            r.left = rand_r(&seed) % 200;
+            r.top = rand_r(&seed) % 200;
+            r.right = r.left + 1 + rand_r(&seed) % 1200;
+            r.bottom = r.top + 1 + rand_r(&seed) % 1200;
+            memset(&o, 0, sizeof(o));
+            o.cfg.win.x = r.left + rand_r(&seed) % WIDTH(r);
+            o.cfg.win.y = r.top + rand_r(&seed) % HEIGHT(r);
+            o.cfg.win.w = 1 + rand_r(&seed) % (r.right - o.cfg.win.x);
+            o.cfg.win.h = 1 + rand_r(&seed) % (r.bottom - o.cfg.win.y);
+            win[0] = o.cfg.win.x;
+            win[1] = o.cfg.win.y;
+            win[2] = o.cfg.win.w;
+            win[3] = o.cfg.win.h;
+
+            set_ext_matrix(&ext, r);
+            omap3_hwc_adjust_ext_layer(&ext, &o);
+
+            /* the same steps in float */
+            rot_w = orient & 1 ? HEIGHT(r) : WIDTH(r);
+            rot_h = orient & 1 ? WIDTH(r) : HEIGHT(r);
+            {
+                __u32 adj_xres, adj_yres;
+                struct ratio xpy = { 1, 1 };
+
+                get_max_dimensions(rot_w, rot_h, xpy, ext.xres, ext.yres, ext.width, ext.height,
+                                   &adj_xres, &adj_yres);
+                to[0] = adj_xres;
+                to[1] = adj_yres;
+            }
+            ref_translate(m, -(WIDTH(r) >> 1) - r.left, -(HEIGHT(r) >> 1) - r.top);
+            ref_rotate(m, orient & 3);
+            if (orient & 4)
+                ref_scale(m, 1, -1, 1, 1);
+            ref_scale(m, rot_w, to[0], rot_h, to[1]);
+            ref_translate(m, ext.xres >> 1, ext.yres >> 1);
+            {
+                float x = m[0][0] * win[0] + m[0][1] * win[1] + m[0][2];
+                float y = m[1][0] * win[0] + m[1][1] * win[1] + m[1][2];
+                float fw = m[0][0] * win[2] + m[0][1] * win[3];
+                float fh = m[1][0] * win[2] + m[1][1] * win[3];
+
+                ref[0] = ref_round(fw > 0 ? x : x + fw);
+                ref[1] = ref_round(fh > 0 ? y : y + fh);
+                ref[2] = ref_round(fw > 0 ? fw : -fw);
+                ref[3] = ref_round(fh > 0 ? fh : -fh);
+            }
+
+            /* and exactly: rows of the orientation, scaled by to / from */
+            from[0] = rot_w;
+            from[1] = rot_h;
+            x0 = win[0] - (WIDTH(r) >> 1) - r.left;
+            y0 = win[1] - (HEIGHT(r) >> 1) - r.top;
+            for (k = 0; k < 2; k++) {
+                const int *row = ext_orient[orient][k];
+                long long c = k ? ext.yres >> 1 : ext.xres >> 1;
+                long long p = (row[0] * x0 + row[1] * y0) * to[k] + c * from[k];
+                long long d = (row[0] * win[2] + row[1] * win[3]) * to[k];
+
+                exact[k] = exact_round(d > 0 ? p : p + d, from[k], tie + k);
+                exact[2 + k] = exact_round(d > 0 ? d : -d, from[k], tie + 2 + k);
+            }
+
+            CHECK_EQ(o.cfg.win.x, exact[0]);
+            CHECK_EQ(o.cfg.win.y, exact[1]);
+            CHECK_EQ(o.cfg.win.w, exact[2]);
+            CHECK_EQ(o.cfg.win.h, exact[3]);
+            for (k = 0; k < 4; k++) {
+                if (ref[k] != exact[k])
+                    ties++;
+                CHECK(ref[k] == exact[k] || (tie[k] && (ref[k] - exact[k] == 1 || exact[k] - ref[k] == 1)));
+            }
+            cases++;
+        }
+    }
+    printf("ext_transform: %u windows, %u float results off by a .5 tie\n", cases, ties);
+}
+
+/* the float reference matrix for a window of region r on ext */
+static void ref_ext_matrix(const omap3_hwc_ext_t *ext, hwc_rect_t r, float m[2][3])
+{
+    int orient = (ext->current.rotation & 3) | ext->current.hflip << 2;
+    int rot_w = orient & 1 ? HEIGHT(r) : WIDTH(r);
+    int rot_h = orient & 1 ? WIDTH(r) : HEIGHT(r);
+    struct ratio xpy = { 1, 1 };
+    __u32 adj_xres, adj_yres;
+
+    m[0][0] = m[1][1] = 1;
+    m[0][1] = m[0][2] = m[1][0] = m[1][2] = 0;
+    get_max_dimensions(rot_w, rot_h, xpy, ext->xres, ext->yres, ext->width, ext->height,
+                       &adj_xres, &adj_yres);
+    ref_translate(m, -(WIDTH(r) >> 1) - r.left, -(HEIGHT(r) >> 1) - r.top);
+    ref_rotate(m, orient & 3);
+    if (orient & 4)
+        ref_scale(m, 1, -1, 1, 1);
+    ref_scale(m, rot_w, adj_xres, rot_h, adj_yres);
+    ref_translate(m, ext->xres >> 1, ext->yres >> 1);
+}
+
+#define EXT_BENCH_LAYERS 1024
+
+/*
+ * Per layer cost of the external transform, integer against the float one it
+ * replaced: building the matrix for a docked layer, and putting a window on
+ * the external display.  A host FPU does the float work in hardware, so this
+ * understates what the integer code saves on a softfp build.
+ */
+static void bench_ext_transform(void)
+{
+    static omap3_hwc_ext_t ext[EXT_BENCH_LAYERS];
+    static float m[EXT_BENCH_LAYERS][2][3];
+    static hwc_rect_t region[EXT_BENCH_LAYERS];
+    static struct dss2_ovl_info ovl[EXT_BENCH_LAYERS];
+    volatile unsigned int sink = 0;
+    unsigned int seed = 1, i;
+    __u64 start, n;
+    double int_matrix, float_matrix, int_layer, float_layer;
+
+    for (i = 0; i < EXT_BENCH_LAYERS; i++) {
+        hwc_rect_t *r = region + i;
+        struct dss2_ovl_cfg *oc = &ovl[i].cfg;
+
+        memset(ext + i, 0, sizeof(*ext));
+        ext[i].xres = 1920;
+        ext[i].yres = 1080;
+        ext[i].current.rotation = i & 3;
+        ext[i].current.hflip = (i >> 2) & 1;
+        ext[i].current.docking = 1;
+        ext[i].current.enabled = 1;
+        r->left = rand_r(&seed) % 200;
+        r->top = rand_r(&seed) % 200;
+        r->right = r->left + 1 + rand_r(&seed) % 1200;
+        r->bottom = r->top + 1 + rand_r(&seed) % 1200;
+        memset(ovl + i, 0, sizeof(*ovl));
+        oc->win.x = r->left + rand_r(&seed) % WIDTH(*r);
+        oc->win.y = r->top + rand_r(&seed) % HEIGHT(*r);
+        oc->win.w = 1 + rand_r(&seed) % (r->right - oc->win.x);
+        oc->win.h = 1 + rand_r(&seed) % (r->bottom - oc->win.y);
+        set_ext_matrix(ext + i, *r);
+        ref_ext_matrix(ext + i, *r, m[i]);
+    }
+
+    start = now_ns();
+    for (n = 0; now_ns() - start < 1000000000; n += EXT_BENCH_LAYERS)
+        for (i = 0; i < EXT_BENCH_LAYERS; i++) {
+            set_ext_matrix(ext + i, region[i]);
+            sink += ext[i].m.m[0][2];
+        }
+    int_matrix = (double) (now_ns() - start) / n;
+
+    start = now_ns();
+    for (n = 0; now_ns() - start < 1000000000; n += EXT_BENCH_LAYERS)
+        for (i = 0; i < EXT_BENCH_LAYERS; i++) {
+            ref_ext_matrix(ext + i, region[i], m[i]);
+            sink += (int) m[i][0][2];
+        }
+    float_matrix = (double) (now_ns() - start) / n;
+
+    start = now_ns();
+    for (n = 0; now_ns() - start < 1000000000; n += EXT_BENCH_LAYERS)
+        for (i = 0; i < EXT_BENCH_LAYERS; i++) {
+            struct dss2_ovl_info o = ovl[i];
+
+            omap3_hwc_adjust_ext_layer(ext + i, &o);
+            sink += o.cfg.win.x + o.cfg.win.y + o.cfg.win.w + o.cfg.win.h;
+        }
+    int_layer = (double) (now_ns() - start) / n;
+
+    start = now_ns();
+    for (n = 0; now_ns() - start < 1000000000; n += EXT_BENCH_LAYERS)
+        for (i = 0; i < EXT_BENCH_LAYERS; i++) {
+            const struct dss2_ovl_cfg *oc = &ovl[i].cfg;
+            float x = m[i][0][0] * oc->win.x + m[i][0][1] * oc->win.y + m[i][0][2];
+            float y = m[i][1][0] * oc->win.x + m[i][1][1] * oc->win.y + m[i][1][2];
+            float fw = m[i][0][0] * oc->win.w + m[i][0][1] * oc->win.h;
+            float fh = m[i][1][0] * oc->win.w + m[i][1][1] * oc->win.h;
+
+            sink += ref_round(fw > 0 ? x : x + fw) + ref_round(fh > 0 ? y : y + fh) +
+                    ref_round(fw > 0 ? fw : -fw) + ref_round(fh > 0 ? fh : -fh);
+        }
+    float_layer = (double) (now_ns() - start) / n;
+
+    printf("matrix: %6.1fns integer, %6.1fns float\n", int_matrix, float_matrix);
+    printf("layer:  %6.1fns integer, %6.1fns float (host FPU, not softfp)\n", int_layer, float_layer);
+    (void) sink;
+}
+#undef EXT_BENCH_LAYERS
+
+/* ---- open ---- */
+
+/* a failed open reports why, leaves nothing behind and a later open works */
+static void test_open_failure(void)
+{
+    hw_device_t *device = NULL;
+    omap3_hwc_device_t *hwc_dev;
+
+    omap3_hwc_set_sim_config(&test_display);
+    timerfd_failures = 1;
+    CHECK_EQ(HAL_MODULE_INFO_SYM.base.common.methods->open(&HAL_MODULE_INFO_SYM.base.common,
+                                                           HWC_HARDWARE_COMPOSER, &device), -EMFILE);
+    CHECK_EQ(timerfd_failures, 0);
+
+    hwc_dev = open_composer();
+    if (hwc_dev)
+        close_composer(hwc_dev);
+}
+
+/* ---- HDMI mode choice ---- */
+
+/* the float aspect ratio code the mode choice used to be made with */
+static void ref_get_max_dimensions(__u32 orig_xres, __u32 orig_yres, float xpy,
+                                   __u32 scr_xres, __u32 scr_yres, __u32 scr_width, __u32 scr_height,
+                                   __u32 *adj_xres, __u32 *adj_yres)
+{
+    *adj_xres = scr_xres;
+    *adj_yres = scr_yres;
+    if (!scr_width || !scr_height) {
+        scr_width = scr_xres;
+        scr_height = scr_yres;
+    }
+
+    float x_factor = orig_xres * xpy * scr_height;
+    float y_factor = orig_yres * scr_width;
+
+    if (x_factor < y_factor * (1.f - 0.02f))
+        *adj_xres = (__u32) (x_factor * *adj_xres / y_factor + 0.5);
+    else if (x_factor * (1.f - 0.02f) > y_factor)
+        *adj_yres = (__u32) (y_factor * *adj_yres / x_factor + 0.5);
+}
+
+/* omap3_hwc_score_modes with the float aspect ratio code; returns ~best mode or 0 */
+static __u32 ref_best_mode(struct dsscomp_display_info *dis, struct dsscomp_videomode *modedb,
+                           __u32 xres, __u32 yres, float xpy, __u32 pref)
+{
+    __u32 i, best = 0, best_score = 0;
+
+    for (i = 0; i < dis->modedb_len; i++) {
+        __u32 area = xres * yres;
+        __u32 mode_area = modedb[i].xres * modedb[i].yres;
+        __u32 ext_width = dis->width_in_mm, ext_height = dis->height_in_mm;
+        __u32 ext_fb_xres, ext_fb_yres, score = 0;
+
+        if (modedb[i].flag & FB_FLAG_RATIO_4_3) {
+            ext_width = 4;
+            ext_height = 3;
+        } else if (modedb[i].flag & FB_FLAG_RATIO_16_9) {
+            ext_width = 16;
+            ext_height = 9;
+        }
+        ref_get_max_dimensions(xres, yres, xpy, modedb[i].xres, modedb[i].yres,
+                               ext_width, ext_height, &ext_fb_xres, &ext_fb_yres);
+        if (!modedb[i].pixclock || modedb[i].vmode ||
+            !omap3_hwc_can_scale(xres, yres, ext_fb_xres, ext_fb_yres, 1, dis, &limits,
+                                 1000000000 / modedb[i].pixclock))
+            continue;
+
+        if (modedb[i].flag & (FB_FLAG_RATIO_4_3 | FB_FLAG_RATIO_16_9))
+            score = 1;
+        score = (score << 1) | (ext_fb_xres >= xres * 99 / 100 && ext_fb_yres >= yres * 99 / 100);
+        score = (score << 1) | (i == ~pref);
+        if (ext_fb_xres * ext_fb_yres > area)
+            score = (score << 5) | (16 * area / ext_fb_xres / ext_fb_yres);
+        else
+            score = (score << 5) | (16 * ext_fb_xres * ext_fb_yres / area);
+        score = (score << 5) | ((16 * ext_fb_xres * ext_fb_yres + (mode_area >> 1)) / mode_area);
+        score = (score << 8) | modedb[i].refresh;
+        if (best_score < score) {
+            best = ~i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+/* modes of HDMI sinks */
+static const struct {
+    __u32 xres, yres, refresh, pclk;        /* kHz */
+    __u32 vmode, flag;
+} known_modes[] = {
+    /* CEA-861 */
+    { 640, 480, 60, 25175, 0, FB_FLAG_RATIO_4_3 },
+    { 720, 480, 60, 27000, 0, FB_FLAG_RATIO_4_3 },
+    { 720, 480, 60, 27000, 0, FB_FLAG_RATIO_16_9 },
+    { 720, 576, 50, 27000, 0, FB_FLAG_RATIO_4_3 },
+    { 720, 576, 50, 27000, 0, FB_FLAG_RATIO_16_9 },
+    { 1280, 720, 50, 74250, 0, FB_FLAG_RATIO_16_9 },
+    { 1280, 720, 60, 74250, 0, FB_FLAG_RATIO_16_9 },
+    { 1920, 1080, 24, 74250, 0, FB_FLAG_RATIO_16_9 },
+    { 1920, 1080, 30, 74250, 0, FB_FLAG_RATIO_16_9 },
+    { 1920, 1080, 60, 74250, FB_VMODE_INTERLACED, FB_FLAG_RATIO_16_9 },
+    { 1920, 1080, 50, 148500, 0, FB_FLAG_RATIO_16_9 },
+    { 1920, 1080, 60, 148500, 0, FB_FLAG_RATIO_16_9 },
+    /* VESA DMT */
+    { 800, 600, 60, 40000, 0, 0 },
+    { 1024, 768, 60, 65000, 0, 0 },
+    { 1280, 768, 60, 79500, 0, 0 },
+    { 1280, 800, 60, 83500, 0, 0 },
+    { 1280, 1024, 60, 108000, 0, 0 },
+    { 1360, 768, 60, 85500, 0, 0 },
+    { 1440, 900, 60, 106500, 0, 0 },
+    { 1600, 1200, 60, 162000, 0, 0 },
+    { 1680, 1050, 60, 119000, 0, 0 },
+    { 1920, 1200, 60, 154000, 0, 0 },
+};
+#define NUM_KNOWN_MODES (sizeof(known_modes) / sizeof(*known_modes))
+
+/* puts count known modes from first into the modedb */
+static void load_modes(struct omap3_hwc_modedb *mdb, __u32 first, __u32 count)
+{
+    __u32 n;
+
+    memset(mdb->d.modedb, 0, sizeof(mdb->d.modedb));
+    for (n = 0; n < count; n++) {
+        struct dsscomp_videomode *m = mdb->d.modedb + n;
+
+        m->xres = known_modes[first + n].xres;
+        m->yres = known_modes[first + n].yres;
+        m->refresh = known_modes[first + n].refresh;
+        m->pixclock = 1000000000 / known_modes[first + n].pclk;
+        m->vmode = known_modes[first + n].vmode;
+        m->flag = known_modes[first + n].flag;
+    }
+    mdb->d.dis.modedb_len = count;
+}
+
+/*
+ * Every common CEA and VESA mode, alone and in the mode lists of typical
+ * sinks, against every common video size and pixel aspect ratio: the
+ * integer aspect ratio code must choose the mode the float code did.
+ */
+static void test_hdmi_modes(void)
+{
+    /* physical sizes in mm of the sinks */
+    static const __u16 sizes[][2] = { { 0, 0 }, { 510, 287 }, { 376, 301 }, { 473, 296 } };
+    static const __u32 videos[][2] = {
+        { 176, 144 }, { 320, 240 }, { 480, 270 }, { 480, 800 }, { 640, 360 }, { 640, 480 },
+        { 720, 480 }, { 720, 576 }, { 800, 480 }, { 854, 480 }, { 960, 540 }, { 1024, 768 },
+        { 1280, 720 }, { 1280, 800 }, { 1440, 1080 }, { 1920, 1080 },
+    };
+    /* square, CEA SD and stretched pixels */
+    static const __u32 xpys[][2] = {
+        { 1, 1 }, { 8, 9 }, { 10, 11 }, { 32, 27 }, { 40, 33 }, { 16, 15 }, { 4, 3 }, { 3, 4 },
+    };
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    struct omap3_hwc_modedb *mdb;
+    unsigned int sink, s, v, x, p, cases = 0, none = 0;
+
+    if (!hwc_dev)
+        return;
+    mdb = &hwc_dev->modedb;
+    mdb->d.dis.channel = OMAP_DSS_CHANNEL_DIGIT;
+
+    /* each mode alone, the CEA modes, the VESA modes and windows of MAX_HDMI_MODES modes */
+    for (sink = 0; sink < NUM_KNOWN_MODES + 2 + NUM_KNOWN_MODES - MAX_HDMI_MODES + 1; sink++) {
+        __u32 first, count;
+
+        if (sink < NUM_KNOWN_MODES) {
+            first = sink;
+            count = 1;
+        } else if (sink == NUM_KNOWN_MODES) {
+            first = 0;
+            count = 12;
+        } else if (sink == NUM_KNOWN_MODES + 1) {
+            first = 12;
+            count = NUM_KNOWN_MODES - 12;
+        } else {
+            first = sink - NUM_KNOWN_MODES - 2;
+            count = MAX_HDMI_MODES;
+        }
+
+        load_modes(mdb, first, count);
+
+        for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+            mdb->d.dis.width_in_mm = sizes[s][0];
+            mdb->d.dis.height_in_mm = sizes[s][1];
+            for (v = 0; v < sizeof(videos) / sizeof(*videos); v++) {
+                for (x = 0; x < sizeof(xpys) / sizeof(*xpys); x++) {
+                    /* no preference, or one for the first or the last mode */
+                    for (p = 0; p < 3; p++) {
+                        struct omap3_hwc_mode_choice c;
+                        __u32 ref;
+
+                        memset(&c, 0, sizeof(c));
+                        c.xres = videos[v][0];
+                        c.yres = videos[v][1];
+                        c.xpy = make_ratio(xpys[x][0], xpys[x][1]);
+                        c.pref = p == 0 ? 0 : p == 1 ? ~0U : ~(count - 1);
+                        omap3_hwc_score_modes(hwc_dev, &c);
+                        ref = ref_best_mode(&mdb->d.dis, mdb->d.modedb, c.xres, c.yres,
+                                            (float) xpys[x][0] / xpys[x][1], c.pref);
+                        if (c.best != ref)
+                            fprintf(stderr, "hdmi_modes: %ux%u %u:%u on %u modes from #%u: "
+                                    "mode %d, was %d\n", c.xres, c.yres, xpys[x][0], xpys[x][1],
+                                    count, first, (int) ~c.best, (int) ~ref);
+                        CHECK_EQ(c.best, ref);
+                        none += !c.best;
+                        cases++;
+                    }
+                }
+            }
+        }
+    }
+    printf("hdmi_modes: %u choices, %u without a usable mode\n", cases, none);
+    close_composer(hwc_dev);
+}
+
+/*
+ * The cost the modedb cache saves: a mode query against a cached modedb, and
+ * a mode choice that hits the cache against one that scores the CEA modes.
+ * The sim backend answers a query without the ioctl, so the query time is a
+ * lower bound.  Then a player that opens a few videos in turn, as on a dock.
+ */
+static void bench_hdmi_modes(void)
+{
+    static const __u32 videos[][2] = {
+        { 1280, 720 }, { 640, 360 }, { 1920, 1080 }, { 720, 576 }, { 1280, 720 }, { 640, 360 },
+    };
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    struct omap3_hwc_modedb *mdb;
+    struct ratio xpy = make_ratio(1, 1);
+    __u64 start, t;
+    __u32 i, n, queries, hits, misses;
+    double query, cached, hit, miss;
+
+    if (!hwc_dev)
+        return;
+    mdb = &hwc_dev->modedb;
+    hwc_dev->ext.avoid_mode_change = 0;
+
+    start = now_ns();
+    for (n = 0; now_ns() - start < 1000000000; n++) {
+        mdb->valid = 0;
+        omap3_hwc_query_modedb(hwc_dev);
+    }
+    query = (double) (now_ns() - start) / n;
+    start = now_ns();
+    for (n = 0; now_ns() - start < 1000000000; n++)
+        omap3_hwc_query_modedb(hwc_dev);
+    cached = (double) (now_ns() - start) / n;
+
+    load_modes(mdb, 0, 12);
+    mdb->d.dis.channel = OMAP_DSS_CHANNEL_DIGIT;
+    mdb->d.dis.width_in_mm = mdb->d.dis.height_in_mm = 0;
+    memset(mdb->choice, 0, sizeof(mdb->choice));
+    omap3_hwc_choose_mode(hwc_dev, 1280, 720, xpy);
+    hits = mdb->hits;
+    start = now_ns();
+    for (n = 0; now_ns() - start < 1000000000; n++)
+        omap3_hwc_choose_mode(hwc_dev, 1280, 720, xpy);
+    hit = (double) (now_ns() - start) / n;
+    hits = mdb->hits - hits;
+    misses = mdb->misses;
+    start = now_ns();
+    for (n = 0; now_ns() - start < 1000000000; n++) {
+        memset(mdb->choice, 0, sizeof(mdb->choice));
+        omap3_hwc_choose_mode(hwc_dev, 1280, 720, xpy);
+    }
+    miss = (double) (now_ns() - start) / n;
+    misses = mdb->misses - misses;
+
+    printf("modedb query:  %8.3fus, cached %.3fus\n", query / 1000, cached / 1000);
+    printf("mode choice:   %8.3fus scored (%u misses), %.3fus cached (%u hits), %.1fx\n",
+           miss / 1000, misses, hit / 1000, hits, miss / hit);
+
+    /* every video of the player twice over, with a query before each choice as on a switch */
+    memset(mdb->choice, 0, sizeof(mdb->choice));
+    queries = mdb->queries;
+    hits = mdb->hits;
+    misses = mdb->misses;
+    t = now_ns();
+    for (n = 0; n < 2; n++) {
+        for (i = 0; i < sizeof(videos) / sizeof(*videos); i++) {
+            omap3_hwc_query_modedb(hwc_dev);
+            omap3_hwc_choose_mode(hwc_dev, videos[i][0], videos[i][1], xpy);
+        }
+    }
+    t = now_ns() - t;
+    printf("player cycle:  %u choices in %.3fus, %u queries, %u hits, %u misses\n",
+           2 * (__u32) (sizeof(videos) / sizeof(*videos)), t / 1000.0, mdb->queries - queries,
+           mdb->hits - hits, mdb->misses - misses);
+    close_composer(hwc_dev);
+}
+
+/* ---- colour key ---- */
+
+static void test_colorkey(void)
+{
+    static const hwc_rect_t screen = { 0, 0, 480, 800 };
+    static const hwc_rect_t video_frame = { 0, 240, 480, 560 };
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    IMG_native_handle_t ui, bar, controls, video, video2;
+    struct dsscomp_setup_dispc_data *dsscomp;
+    struct test_frame f;
+    hwc_layer_1_t *l;
+
+    if (!hwc_dev)
+        return;
+    hwc_dev->transition.frames = 0;
+    hwc_dev->flags_colorkey = 1;
+    dsscomp = &hwc_dev->dsscomp_data;
+    init_buffer(&video, HAL_PIXEL_FORMAT_TI_NV12, 720, 480);
+    init_buffer(&video2, HAL_PIXEL_FORMAT_TI_NV12, 320, 240);
+    init_buffer(&ui, HAL_PIXEL_FORMAT_RGBA_8888, 480, 800);
+    init_buffer(&bar, HAL_PIXEL_FORMAT_RGBA_8888, 480, 38);
+    init_buffer(&controls, HAL_PIXEL_FORMAT_RGBA_8888, 480, 100);
+
+    /* a video under a window with a hole for it: the video is keyed in */
+    memset(&f, 0, sizeof(f));
+    add_layer(&f, &video, (hwc_rect_t) { 0, 0, 720, 480 }, video_frame, HWC_BLENDING_NONE);
+    add_layer(&f, &ui, screen, screen, HWC_BLENDING_PREMULT);
+    add_layer(&f, &bar, (hwc_rect_t) { 0, 0, 480, 38 }, (hwc_rect_t) { 0, 0, 480, 38 },
+              HWC_BLENDING_PREMULT);
+    CHECK(omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    compose(hwc_dev, &f);
+    CHECK_EQ(hwc_dev->colorkey, 1);
+    CHECK_EQ(hwc_dev->sgx_stats.frame_reason, SGX_REASON_UI);
+    CHECK_EQ(f.layers[0].compositionType, HWC_OVERLAY);
+    CHECK_EQ(f.layers[1].compositionType, HWC_FRAMEBUFFER);
+    CHECK_EQ(f.layers[2].compositionType, HWC_FRAMEBUFFER);
+    CHECK_EQ(dsscomp->mgrs[0].trans_enabled, 1);
+    CHECK_EQ(dsscomp->mgrs[0].alpha_blending, 0);
+    CHECK_EQ(dsscomp->mgrs[0].trans_key_type, OMAP_DSS_COLOR_KEY_GFX_DST);
+    CHECK_EQ(dsscomp->mgrs[0].trans_key, COLORKEY);
+
+    /* without the key, SGX has to blend the video under the UI */
+    hwc_dev->flags_colorkey = 0;
+    f.list.flags = HWC_GEOMETRY_CHANGED;
+    compose(hwc_dev, &f);
+    CHECK_EQ(hwc_dev->colorkey, 0);
+    CHECK_EQ(hwc_dev->sgx_stats.frame_reason, SGX_REASON_ZORDER);
+    CHECK_EQ(f.layers[0].compositionType, HWC_FRAMEBUFFER);
+    CHECK_EQ(dsscomp->mgrs[0].trans_enabled, 0);
+    hwc_dev->flags_colorkey = 1;
+
+    /* a scaled UI layer clear of the video does not matter */
+    f.layers[2].sourceCrop = (hwc_rect_t) { 0, 0, 240, 19 };
+    CHECK(omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    /* but over the video, the edges of the hole would be filtered */
+    f.layers[1].sourceCrop = (hwc_rect_t) { 0, 0, 240, 400 };
+    CHECK(!omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    f.list.flags = HWC_GEOMETRY_CHANGED;
+    compose(hwc_dev, &f);
+    CHECK_EQ(hwc_dev->colorkey, 0);
+    CHECK_EQ(hwc_dev->sgx_stats.frame_reason, SGX_REASON_ZORDER);
+    CHECK_EQ(f.layers[0].compositionType, HWC_FRAMEBUFFER);
+    f.layers[1].sourceCrop = screen;
+    f.layers[2].sourceCrop = (hwc_rect_t) { 0, 0, 480, 38 };
+
+    /* translucent controls over part of the video would be shown over black */
+    l = add_layer(&f, &controls, (hwc_rect_t) { 0, 0, 480, 100 }, (hwc_rect_t) { 0, 460, 480, 560 },
+                  HWC_BLENDING_PREMULT);
+    CHECK(!omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    compose(hwc_dev, &f);
+    CHECK_EQ(hwc_dev->colorkey, 0);
+    CHECK_EQ(f.layers[0].compositionType, HWC_FRAMEBUFFER);
+    /* opaque ones are fine, and so are translucent ones elsewhere */
+    l->blending = HWC_BLENDING_NONE;
+    CHECK(omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    l->blending = HWC_BLENDING_PREMULT;
+    l->displayFrame = (hwc_rect_t) { 0, 600, 480, 700 };
+    CHECK(omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    f.list.numHwLayers--;
+
+    /* two videos under the UI are both keyed in */
+    memset(&f, 0, sizeof(f));
+    add_layer(&f, &video, (hwc_rect_t) { 0, 0, 720, 480 }, video_frame, HWC_BLENDING_NONE);
+    add_layer(&f, &video2, (hwc_rect_t) { 0, 0, 320, 240 }, (hwc_rect_t) { 240, 600, 480, 780 },
+              HWC_BLENDING_NONE);
+    add_layer(&f, &ui, screen, screen, HWC_BLENDING_PREMULT);
+    add_layer(&f, &bar, (hwc_rect_t) { 0, 0, 480, 38 }, (hwc_rect_t) { 0, 0, 480, 38 },
+              HWC_BLENDING_PREMULT);
+    CHECK(omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    compose(hwc_dev, &f);
+    CHECK_EQ(hwc_dev->colorkey, 1);
+    CHECK_EQ(f.layers[0].compositionType, HWC_OVERLAY);
+    CHECK_EQ(f.layers[1].compositionType, HWC_OVERLAY);
+    CHECK_EQ(f.layers[2].compositionType, HWC_FRAMEBUFFER);
+    CHECK_EQ(f.layers[3].compositionType, HWC_FRAMEBUFFER);
+
+    /* but not with UI between them */
+    memset(&f, 0, sizeof(f));
+    add_layer(&f, &video, (hwc_rect_t) { 0, 0, 720, 480 }, video_frame, HWC_BLENDING_NONE);
+    add_layer(&f, &bar, (hwc_rect_t) { 0, 0, 480, 38 }, (hwc_rect_t) { 0, 0, 480, 38 },
+              HWC_BLENDING_PREMULT);
+    add_layer(&f, &video2, (hwc_rect_t) { 0, 0, 320, 240 }, (hwc_rect_t) { 240, 600, 480, 780 },
+              HWC_BLENDING_NONE);
+    add_layer(&f, &ui, screen, screen, HWC_BLENDING_PREMULT);
+    CHECK(!omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    compose(hwc_dev, &f);
+    CHECK_EQ(hwc_dev->colorkey, 0);
+    CHECK_EQ(hwc_dev->sgx_stats.frame_reason, SGX_REASON_ZORDER);
+    CHECK_EQ(f.layers[0].compositionType, HWC_FRAMEBUFFER);
+    CHECK_EQ(f.layers[2].compositionType, HWC_FRAMEBUFFER);
+
+    /* nor with an external display, which would have to key the same */
+    memset(&f, 0, sizeof(f));
+    add_layer(&f, &video, (hwc_rect_t) { 0, 0, 720, 480 }, video_frame, HWC_BLENDING_NONE);
+    add_layer(&f, &ui, screen, screen, HWC_BLENDING_PREMULT);
+    CHECK(omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    hdmi_enabled = 1;
+    CHECK(!omap3_hwc_colorkey_possible(hwc_dev, &f.list));
+    hdmi_enabled = 0;
+
+    close_composer(hwc_dev);
+}
+
+/* ---- layer flattening ---- */
+
+#define FLAT_FRAMES 3
+
+/* composes n frames in which only the buffer of the changing layer is new */
+static void compose_frames(omap3_hwc_device_t *hwc_dev, struct test_frame *f,
+                           IMG_native_handle_t *changing, int n)
+{
+    while (n--) {
+        changing->ui64Stamp++;
+        compose(hwc_dev, f);
+    }
+}
+
+/* a still background in two halves, the app drawing every frame, and the status bar */
+static void flat_frame(struct test_frame *f, IMG_native_handle_t *top, IMG_native_handle_t *bottom,
+                       IMG_native_handle_t *app, IMG_native_handle_t *bar)
+{
+    init_buffer(top, HAL_PIXEL_FORMAT_BGRA_8888, 480, 400);
+    init_buffer(bottom, HAL_PIXEL_FORMAT_BGRA_8888, 480, 400);
+    init_buffer(app, HAL_PIXEL_FORMAT_RGBA_8888, 480, 800);
+    init_buffer(bar, HAL_PIXEL_FORMAT_RGBA_8888, 480, 38);
+    memset(f, 0, sizeof(*f));
+    add_layer(f, top, (hwc_rect_t) { 0, 0, 480, 400 }, (hwc_rect_t) { 0, 0, 480, 400 },
+              HWC_BLENDING_NONE);
+    add_layer(f, bottom, (hwc_rect_t) { 0, 0, 480, 400 }, (hwc_rect_t) { 0, 400, 480, 800 },
+              HWC_BLENDING_NONE);
+    add_layer(f, app, (hwc_rect_t) { 0, 0, 480, 800 }, (hwc_rect_t) { 0, 0, 480, 800 },
+              HWC_BLENDING_PREMULT);
+    add_layer(f, bar, (hwc_rect_t) { 0, 0, 480, 38 }, (hwc_rect_t) { 0, 0, 480, 38 },
+              HWC_BLENDING_PREMULT);
+}
+
+static void test_flatten(void)
+{
+    static const hwc_rect_t screen = { 0, 0, 480, 800 }, top_half = { 0, 0, 480, 400 };
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    struct omap3_hwc_flat *flat;
+    IMG_native_handle_t top, bottom, bottom2, app, bar;
+    struct test_frame f;
+    __u32 builds, invalidations;
+
+    if (!hwc_dev)
+        return;
+    flat = &hwc_dev->flat;
+    flat->frames = FLAT_FRAMES;
+    flat_frame(&f, &top, &bottom, &app, &bar);
+
+    /* the background goes onto one overlay once it has been still for long enough */
+    compose(hwc_dev, &f);
+    compose_frames(hwc_dev, &f, &app, FLAT_FRAMES - 1);
+    CHECK_EQ(flat->mask, 0);
+    CHECK_EQ(f.layers[0].compositionType, HWC_FRAMEBUFFER);
+    compose_frames(hwc_dev, &f, &app, 1);
+    CHECK_EQ(flat->mask, 3);
+    CHECK_EQ(flat->contents, 3);
+    CHECK(rects_equal(&flat->region, (hwc_rect_t *) &screen));
+    CHECK_EQ(flat->builds, 1);
+    CHECK_EQ(flat->area, 480 * 800);
+    CHECK_EQ(f.layers[0].compositionType, HWC_OVERLAY);
+    CHECK_EQ(f.layers[1].compositionType, HWC_OVERLAY);
+    CHECK_EQ(f.layers[2].compositionType, HWC_FRAMEBUFFER);
+    CHECK(f.layers[0].hints & HWC_HINT_CLEAR_FB);
+    /* and stays there without being copied again */
+    compose_frames(hwc_dev, &f, &app, 10);
+    CHECK_EQ(flat->mask, 3);
+    CHECK_EQ(flat->builds, 1);
+    CHECK_EQ(flat->invalidations, 0);
+
+    /* a new buffer in a flattened layer: that layer leaves the mask at once */
+    invalidations = flat->invalidations;
+    builds = flat->builds;
+    compose_frames(hwc_dev, &f, &bottom, 1);
+    CHECK_EQ(flat->invalidations, invalidations + 1);
+    CHECK_EQ(flat->mask, 1);
+    CHECK(rects_equal(&flat->region, (hwc_rect_t *) &top_half));
+    CHECK_EQ(flat->builds, builds + 1);
+    CHECK_EQ(f.layers[0].compositionType, HWC_OVERLAY);
+    CHECK_EQ(f.layers[1].compositionType, HWC_FRAMEBUFFER);
+    /* and comes back when it is still again */
+    compose_frames(hwc_dev, &f, &app, FLAT_FRAMES);
+    CHECK_EQ(flat->mask, 3);
+    CHECK_EQ(flat->builds, builds + 2);
+    CHECK_EQ(flat->invalidations, invalidations + 1);
+
+    /* another buffer handle, e.g. a live wallpaper's next one */
+    init_buffer(&bottom2, HAL_PIXEL_FORMAT_BGRA_8888, 480, 400);
+    f.layers[1].handle = (buffer_handle_t) &bottom2;
+    compose_frames(hwc_dev, &f, &app, 1);
+    CHECK_EQ(flat->invalidations, invalidations + 2);
+    CHECK_EQ(flat->mask, 1);
+    compose_frames(hwc_dev, &f, &app, FLAT_FRAMES);
+    CHECK_EQ(flat->mask, 3);
+
+    /* a geometry change restarts the count for all layers */
+    builds = flat->builds;
+    f.list.flags = HWC_GEOMETRY_CHANGED;
+    compose_frames(hwc_dev, &f, &app, 1);
+    CHECK_EQ(flat->invalidations, invalidations + 3);
+    CHECK_EQ(flat->mask, 0);
+    CHECK_EQ(f.layers[0].compositionType, HWC_FRAMEBUFFER);
+    compose_frames(hwc_dev, &f, &app, FLAT_FRAMES);
+    CHECK_EQ(flat->mask, 3);
+    CHECK_EQ(flat->builds, builds + 1);
+
+    /* as does a moved layer, which then no longer tiles the region */
+    f.layers[1].displayFrame = (hwc_rect_t) { 0, 380, 480, 780 };
+    f.list.flags = HWC_GEOMETRY_CHANGED;
+    compose_frames(hwc_dev, &f, &app, FLAT_FRAMES + 1);
+    CHECK_EQ(flat->mask, 1);
+    CHECK(rects_equal(&flat->region, (hwc_rect_t *) &top_half));
+    CHECK_EQ(f.layers[1].compositionType, HWC_FRAMEBUFFER);
+
+    /* without the still layers, the buffers go after a frame off the screen */
+    f.list.numHwLayers = 0;
+    add_layer(&f, &app, screen, screen, HWC_BLENDING_PREMULT);
+    compose_frames(hwc_dev, &f, &app, 1);
+    CHECK_EQ(flat->mask, 0);
+    CHECK(flat->buffer[0] || flat->buffer[1]);
+    compose_frames(hwc_dev, &f, &app, 1);
+    CHECK(!flat->buffer[0] && !flat->buffer[1]);
+    CHECK_EQ(hwc_dev->ion_pool.reserved, 0);
+
+    close_composer(hwc_dev);
+}
+
+/*
+ * SGX fill with and without flattening on a home screen: the still
+ * background, an app drawing every frame and the status bar.  The fill is
+ * what SurfaceFlinger draws into the framebuffer, at 4 bytes per pixel.
+ */
+static void bench_flatten(void)
+{
+    int frames;
+
+    for (frames = 0; frames <= FLAT_FRAMES; frames += FLAT_FRAMES) {
+        omap3_hwc_device_t *hwc_dev = open_composer();
+        IMG_native_handle_t top, bottom, app, bar;
+        struct test_frame f;
+        __u64 fill = 0, start, ns = 0;
+        unsigned int i, n;
+
+        if (!hwc_dev)
+            return;
+        hwc_dev->flat.frames = frames;
+        flat_frame(&f, &top, &bottom, &app, &bar);
+        for (n = 0; n < 600; n++) {
+            start = now_ns();
+            compose_frames(hwc_dev, &f, &app, 1);
+            ns += now_ns() - start;
+            for (i = 0; i < f.list.numHwLayers; i++)
+                if (f.layers[i].compositionType == HWC_FRAMEBUFFER)
+                    fill += WIDTH(f.layers[i].displayFrame) * HEIGHT(f.layers[i].displayFrame);
+        }
+        printf("flattening %-3s: SGX fill %4.2f Mpixel per frame, %3.0f MB/s at 60 fps, "
+               "%5.2fus per frame; %u builds, %.2f Mpixel saved per frame\n",
+               frames ? "on" : "off", fill / 1e6 / n, fill * 4.0 * 60 / n / (1 << 20),
+               ns / 1000.0 / n, hwc_dev->flat.builds,
+               hwc_dev->flat.area_saved / 1e6 / n);
+        close_composer(hwc_dev);
+    }
+}
+
+#undef FLAT_FRAMES
+
+/* ---- unchanged frames ---- */
+
+/* composes the frame; returns whether set found it on screen already */
+static int compose_skipped(omap3_hwc_device_t *hwc_dev, struct test_frame *f)
+{
+    __u32 skipped = hwc_dev->posted.skipped_sgx + hwc_dev->posted.skipped_ovl;
+    unsigned int i;
+
+    compose(hwc_dev, f);
+    if (hwc_dev->posted.skipped_sgx + hwc_dev->posted.skipped_ovl == skipped)
+        return 0;
+    /* SurfaceFlinger must not draw the layers either */
+    for (i = 0; i < f->list.numHwLayers; i++)
+        CHECK_EQ(f->layers[i].compositionType, HWC_OVERLAY);
+    return 1;
+}
+
+static void test_skip_frame(void)
+{
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    IMG_native_handle_t ui, video, video2;
+    struct test_frame f;
+    __u32 sgx;
+
+    if (!hwc_dev)
+        return;
+    hwc_dev->transition.frames = 0;
+
+    memset(&f, 0, sizeof(f));
+    init_buffer(&video, HAL_PIXEL_FORMAT_TI_NV12, 720, 480);
+    init_buffer(&ui, HAL_PIXEL_FORMAT_RGBA_8888, 480, 800);
+    add_layer(&f, &video, (hwc_rect_t) { 0, 0, 720, 480 }, (hwc_rect_t) { 0, 240, 480, 560 },
+              HWC_BLENDING_NONE);
+    add_layer(&f, &ui, (hwc_rect_t) { 0, 0, 480, 800 }, (hwc_rect_t) { 0, 0, 480, 800 },
+              HWC_BLENDING_PREMULT);
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK_EQ(f.layers[0].compositionType, HWC_OVERLAY);
+    CHECK_EQ(f.layers[1].compositionType, HWC_FRAMEBUFFER);
+    /* the plan depends on the overlays the last post used, so it settles on the next frame */
+    CHECK(!compose_skipped(hwc_dev, &f));
+
+    /* the same frame again: no swap and no post */
+    sgx = hwc_dev->posted.skipped_sgx;
+    CHECK(compose_skipped(hwc_dev, &f));
+    CHECK(compose_skipped(hwc_dev, &f));
+    CHECK_EQ(hwc_dev->posted.skipped_sgx, sgx + 2);
+
+    /* new contents in the same buffer */
+    video.ui64Stamp++;
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(compose_skipped(hwc_dev, &f));
+    ui.ui64Stamp++;
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(compose_skipped(hwc_dev, &f));
+
+    /* another buffer of the same size, as a buffer queue cycles them */
+    video2 = video;
+    f.layers[0].handle = (buffer_handle_t) &video2;
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(compose_skipped(hwc_dev, &f));
+    f.layers[0].handle = (buffer_handle_t) &video;
+    CHECK(!compose_skipped(hwc_dev, &f));
+
+    /* the video moves, and the frame is composed again */
+    f.layers[0].displayFrame = (hwc_rect_t) { 0, 200, 480, 520 };
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(compose_skipped(hwc_dev, &f));
+    f.layers[0].sourceCrop = (hwc_rect_t) { 0, 0, 704, 480 };
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(compose_skipped(hwc_dev, &f));
+
+    /* SurfaceFlinger says the geometry changed, with the same layers */
+    f.list.flags = HWC_GEOMETRY_CHANGED;
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(compose_skipped(hwc_dev, &f));
+
+    /* a layer SurfaceFlinger draws itself may have changed */
+    f.layers[1].flags = HWC_SKIP_LAYER;
+    f.list.flags = HWC_GEOMETRY_CHANGED;
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(!compose_skipped(hwc_dev, &f));
+    f.layers[1].flags = 0;
+    f.list.flags = HWC_GEOMETRY_CHANGED;
+    CHECK(!compose_skipped(hwc_dev, &f));
+
+    /* a layer goes away */
+    f.list.numHwLayers = 1;
+    f.list.flags = HWC_GEOMETRY_CHANGED;
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(!compose_skipped(hwc_dev, &f));
+    CHECK(compose_skipped(hwc_dev, &f));
+    CHECK_EQ(hwc_dev->use_sgx, 0);
+    CHECK(hwc_dev->posted.skipped_ovl > 0);
+
+    close_composer(hwc_dev);
+}
+
+/* ---- HDMI mode switch ---- */
+
+static int mode_setups;                 /* atomic */
+static int mode_failures;
+static const struct omap3_hwc_backend_ops *sim_backend_ops;
+
+/* fails the first mode_failures switches, then passes them to the simulator */
+static int failing_setup_display(struct omap3_hwc_backend *be, struct dsscomp_setup_display_data *sdis)
+{
+    if (__atomic_add_fetch(&mode_setups, 1, __ATOMIC_SEQ_CST) <= mode_failures)
+        return -EIO;
+    return sim_backend_ops->setup_display(be, sdis);
+}
+
+static void test_mode_switch(void)
+{
+    static struct omap3_hwc_backend_ops ops;
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    IMG_native_handle_t video;
+    struct test_frame f;
+
+    if (!hwc_dev)
+        return;
+    hwc_dev->transition.frames = 0;
+    sim_backend_ops = hwc_dev->backend->ops;
+    ops = *sim_backend_ops;
+    ops.setup_display = failing_setup_display;
+    hwc_dev->backend->ops = &ops;
+    mode_setups = 0;
+    mode_failures = 1;
+
+    /* dock a 720p video on the external display */
+    hwc_dev->ext.dock.enabled = 1;
+    hwc_dev->ext.dock.docking = 1;
+    memset(&f, 0, sizeof(f));
+    init_buffer(&video, HAL_PIXEL_FORMAT_TI_NV12, 1280, 720);
+    video.usage |= GRALLOC_USAGE_EXTERNAL_DISP;
+    add_layer(&f, &video, (hwc_rect_t) { 0, 0, 1280, 720 }, (hwc_rect_t) { 0, 265, 480, 535 },
+              HWC_BLENDING_NONE);
+    compose(hwc_dev, &f);
+    omap3_hwc_wait_mode(hwc_dev);
+    CHECK_EQ(mode_setups, 1);
+
+    /* the next frame picks up the failure and selects the mode again */
+    video.ui64Stamp++;
+    compose(hwc_dev, &f);
+    omap3_hwc_wait_mode(hwc_dev);
+    CHECK_EQ(mode_setups, 2);
+
+    /* which takes this time, and is not set up again */
+    video.ui64Stamp++;
+    compose(hwc_dev, &f);
+    CHECK(hwc_dev->modedb.valid);
+    CHECK_EQ(hwc_dev->modedb.d.dis.timings.x_res, 1280);
+    CHECK_EQ(hwc_dev->modedb.d.dis.timings.y_res, 720);
+    video.ui64Stamp++;
+    compose(hwc_dev, &f);
+    omap3_hwc_wait_mode(hwc_dev);
+    CHECK_EQ(mode_setups, 2);
+    CHECK_EQ(hwc_dev->ext.last_xres_used, 1280);
+    CHECK_EQ(hwc_dev->ext.last_yres_used, 720);
+
+    hwc_dev->backend->ops = sim_backend_ops;
+    close_composer(hwc_dev);
+}
+
+/* ---- event thread ---- */
+
+static void test_event_loop(void)
+{
+    static const char vsync_uevent[] = "change@/devices/virtual/switch/omapfb-vsync";
+    static const char other_uevent[] = "change@/devices/virtual/switch/h2w\0SWITCH_STATE=1";
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    IMG_native_handle_t video;
+    struct test_procs procs;
+    struct test_frame f;
+    char msg[128];
+    int period, n, len;
+    int64_t ts;
+
+    if (!hwc_dev)
+        return;
+    register_procs(hwc_dev, &procs);
+    hwc_dev->transition.frames = 0;
+
+    /* vsync from the simulator's vsync fd, only while it is enabled */
+    CHECK_EQ(hwc_dev->base.eventControl(&hwc_dev->base, 0, HWC_EVENT_VSYNC, 1), 0);
+    CHECK(wait_count(&procs.vsyncs, 20, 1000) >= 20);
+    CHECK(procs.min_interval > 16666667 * 3 / 4 && procs.max_interval < 16666667 * 5 / 4);
+    CHECK_EQ(hwc_dev->base.query(&hwc_dev->base, HWC_VSYNC_PERIOD, &period), 0);
+    CHECK(period > 16666667 - 100000 && period < 16666667 + 100000);
+
+    CHECK_EQ(hwc_dev->base.eventControl(&hwc_dev->base, 0, HWC_EVENT_VSYNC, 0), 0);
+    usleep(50000);
+    n = __atomic_load_n(&procs.vsyncs, __ATOMIC_SEQ_CST);
+    usleep(100000);
+    CHECK_EQ(__atomic_load_n(&procs.vsyncs, __ATOMIC_SEQ_CST), n);
+
+    /* vsync uevents are reported once per vsync; other switches are not ours */
+    ts = now_ns();
+    memcpy(msg, vsync_uevent, sizeof(vsync_uevent));
+    len = sizeof(vsync_uevent) + snprintf(msg + sizeof(vsync_uevent), sizeof(msg) - sizeof(vsync_uevent),
+                                          "VSYNC=%lld", (long long) ts) + 1;
+    send_uevent(msg, len);
+    CHECK_EQ(wait_count(&procs.vsyncs, n + 1, 1000), n + 1);
+    send_uevent(msg, len);
+    send_uevent(other_uevent, sizeof(other_uevent));
+    usleep(50000);
+    CHECK_EQ(__atomic_load_n(&procs.vsyncs, __ATOMIC_SEQ_CST), n + 1);
+    CHECK_EQ(__atomic_load_n(&procs.invalidates, __ATOMIC_SEQ_CST), 0);
+
+    /* the idle timeout runs from the last post */
+    hwc_dev->idle = 100;
+    memset(&f, 0, sizeof(f));
+    init_buffer(&video, HAL_PIXEL_FORMAT_TI_NV12, 720, 480);
+    add_layer(&f, &video, (hwc_rect_t) { 0, 0, 720, 480 }, (hwc_rect_t) { 0, 240, 480, 560 },
+              HWC_BLENDING_NONE);
+    compose(hwc_dev, &f);
+    CHECK_EQ(f.layers[0].compositionType, HWC_OVERLAY);
+    for (n = 0; n < 5; n++) {
+        usleep(20000);
+        video.ui64Stamp++;
+        compose(hwc_dev, &f);
+    }
+    CHECK_EQ(__atomic_load_n(&procs.invalidates, __ATOMIC_SEQ_CST), 0);
+    CHECK_EQ(wait_count(&procs.invalidates, 1, 1000), 1);
+
+    /* SGX composes the idle screen for two frames, then the video goes back */
+    for (n = 0; n < 3; n++) {
+        video.ui64Stamp++;
+        compose(hwc_dev, &f);
+        CHECK_EQ(f.layers[0].compositionType, n < 2 ? HWC_FRAMEBUFFER : HWC_OVERLAY);
+        if (n < 2)
+            CHECK_EQ(hwc_dev->sgx_stats.frame_reason, SGX_REASON_IDLE);
+    }
+
+    /* and the next post wakes the timer again */
+    CHECK_EQ(wait_count(&procs.invalidates, 2, 1000), 2);
+
+    close_composer(hwc_dev);
+}
+
+/* ---- hotplug ---- */
+
+static int route_calls;                 /* atomic */
+static int route_last;                  /* atomic */
+
+static int recording_route_output(struct omap3_hwc_backend *be, int output)
+{
+    __atomic_store_n(&route_last, output, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&route_calls, 1, __ATOMIC_SEQ_CST);
+    return sim_backend_ops->route_output(be, output);
+}
+
+/* sends a display_support switch uevent, waiting for room in the socket */
+static int send_hotplug(int state)
+{
+    static const char hotplug_uevent[] = "change@/devices/virtual/switch/display_support";
+    char msg[96];
+    int len;
+
+    uevent_init();
+    memcpy(msg, hotplug_uevent, sizeof(hotplug_uevent));
+    len = sizeof(hotplug_uevent) + snprintf(msg + sizeof(hotplug_uevent), sizeof(msg) - sizeof(hotplug_uevent),
+                                            "SWITCH_STATE=%d", state) + 1;
+    while (send(uevent_fds[1], msg, len, 0) != len) {
+        if (errno != EAGAIN)
+            return -1;
+        usleep(100);
+    }
+    return 0;
+}
+
+#define HOTPLUG_STORM 20000
+
+/*
+ * Plugs and unplugs as fast as the event thread takes it.  Two requests
+ * for each output, so that each slot of ext_req flips between HDMI and TV:
+ * a torn copy would enable both.
+ */
+static void *hotplug_storm(void *data)
+{
+    int i, *failed = data;
+
+    for (i = 0; i < HOTPLUG_STORM; i++)
+        *failed |= send_hotplug(i & 2 ? OMAP3_HWC_OUTPUT_TV : OMAP3_HWC_OUTPUT_HDMI);
+    *failed |= send_hotplug(OMAP3_HWC_OUTPUT_LCD);
+    return NULL;
+}
+
+static void test_hotplug(void)
+{
+    static struct omap3_hwc_backend_ops ops;
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    IMG_native_handle_t video;
+    struct test_procs procs;
+    struct test_frame f;
+    unsigned int frames = 0, applied = 0, both = 0;
+    __u32 gen;
+    __u64 start, poll_ns = 0;
+    pthread_t storm;
+    int failed = 0;
+
+    if (!hwc_dev)
+        return;
+    register_procs(hwc_dev, &procs);
+    hwc_dev->transition.frames = 0;
+    sim_backend_ops = hwc_dev->backend->ops;
+    ops = *sim_backend_ops;
+    ops.route_output = recording_route_output;
+    hwc_dev->backend->ops = &ops;
+    route_calls = 0;
+
+    memset(&f, 0, sizeof(f));
+    init_buffer(&video, HAL_PIXEL_FORMAT_TI_NV12, 720, 480);
+    add_layer(&f, &video, (hwc_rect_t) { 0, 0, 720, 480 }, (hwc_rect_t) { 0, 240, 480, 560 },
+              HWC_BLENDING_NONE);
+    compose(hwc_dev, &f);
+
+    /* each switch is routed, and the next frame picks it up */
+    CHECK_EQ(send_hotplug(OMAP3_HWC_OUTPUT_HDMI), 0);
+    CHECK_EQ(wait_count(&procs.invalidates, 1, 1000), 1);
+    CHECK_EQ(route_calls, 1);
+    CHECK_EQ(route_last, OMAP3_HWC_OUTPUT_HDMI);
+    CHECK_EQ(hdmi_enabled, 0);
+    video.ui64Stamp++;
+    compose(hwc_dev, &f);
+    CHECK_EQ(hdmi_enabled, 1);
+    CHECK_EQ(tv_enabled, 0);
+
+    CHECK_EQ(send_hotplug(OMAP3_HWC_OUTPUT_TV), 0);
+    CHECK_EQ(wait_count(&procs.invalidates, 2, 1000), 2);
+    video.ui64Stamp++;
+    compose(hwc_dev, &f);
+    CHECK_EQ(route_last, OMAP3_HWC_OUTPUT_TV);
+    CHECK_EQ(hdmi_enabled, 0);
+    CHECK_EQ(tv_enabled, 1);
+
+    /* unknown states fall back to the LCD */
+    CHECK_EQ(send_hotplug(7), 0);
+    CHECK_EQ(wait_count(&procs.invalidates, 3, 1000), 3);
+    video.ui64Stamp++;
+    compose(hwc_dev, &f);
+    CHECK_EQ(route_last, OMAP3_HWC_OUTPUT_LCD);
+    CHECK_EQ(hdmi_enabled, 0);
+    CHECK_EQ(tv_enabled, 0);
+
+    /* composing while the event thread refills the request slots */
+    route_calls = 0;
+    gen = hwc_dev->ext_req_applied;
+    CHECK_EQ(pthread_create(&storm, NULL, hotplug_storm, &failed), 0);
+    start = now_ns();
+    while (__atomic_load_n(&route_calls, __ATOMIC_SEQ_CST) < HOTPLUG_STORM + 1 &&
+           now_ns() - start < 10000000000ull) {
+        __u64 t = now_ns();
+
+        omap3_hwc_lock(hwc_dev);
+        omap3_hwc_apply_ext_request(hwc_dev);
+        omap3_hwc_unlock(hwc_dev);
+        poll_ns += now_ns() - t;
+        both += hdmi_enabled && tv_enabled;
+        applied += hwc_dev->ext_req_applied != gen;
+        gen = hwc_dev->ext_req_applied;
+        frames++;
+    }
+    pthread_join(storm, NULL);
+    CHECK(!failed);
+    CHECK_EQ(route_calls, HOTPLUG_STORM + 1);
+    CHECK_EQ(both, 0);
+
+    /* and the last request wins */
+    video.ui64Stamp++;
+    compose(hwc_dev, &f);
+    CHECK_EQ(hwc_dev->ext_req_applied, hwc_dev->ext_req_gen);
+    CHECK_EQ(route_last, OMAP3_HWC_OUTPUT_LCD);
+    CHECK_EQ(hdmi_enabled, 0);
+    CHECK_EQ(tv_enabled, 0);
+    printf("hotplug: %u requests, %u applied over %u polls, %.2fus per poll\n",
+           HOTPLUG_STORM + 1, applied, frames, frames ? poll_ns / 1000.0 / frames : 0);
+
+    hwc_dev->backend->ops = sim_backend_ops;
+    close_composer(hwc_dev);
+}
+#undef HOTPLUG_STORM
+
+/* ---- planar conversion ---- */
+
+/*
+ * Only the crop of a planar buffer, out to whole chroma samples, is
+ * converted, and the overlay on the copy shows the crop in every transform.
+ * Pre-rotation is priced by the crop too.
+ */
+/* converts layer and posts the copy, so that the pool can take back the one before */
+static int convert_posted(omap3_hwc_device_t *hwc_dev, hwc_layer_1_t *layer)
+{
+    int err = omap3_hwc_convert(hwc_dev, layer);
+
+    ion_pool_posted(&hwc_dev->ion_pool);
+    ion_pool_posted(&hwc_dev->ion_pool);
+    return err;
+}
+
+static void test_conv_crop(void)
+{
+    /* transform, and the source pixel the top left of the screen shows */
+    static const struct {
+        int transform, x, y;
+    } transforms[] = {
+        { 0, 3, 1 },
+        { HWC_TRANSFORM_FLIP_H, 12, 1 },
+        { HWC_TRANSFORM_FLIP_V, 3, 8 },
+        { HWC_TRANSFORM_ROT_90, 3, 8 },
+        { HWC_TRANSFORM_ROT_180, 12, 8 },
+        { HWC_TRANSFORM_ROT_270, 12, 1 },
+    };
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    struct omap3_hwc_conv *conv;
+    IMG_native_handle_t yuv, big;
+    hwc_layer_1_t layer;
+    struct dss2_ovl_info o;
+    __u8 *pixels, *copy;
+    void *vaddr;
+    unsigned int i;
+    int x, y;
+
+    if (!hwc_dev)
+        return;
+    conv = &hwc_dev->conv;
+
+    /* 16x12 YV12 with a luma sample unique to each pixel: 16-byte rows, Cr then Cb */
+    init_buffer(&yuv, HAL_PIXEL_FORMAT_YV12, 16, 12);
+    CHECK_EQ(hwc_dev->backend->ops->lock_buffer(hwc_dev->backend, (buffer_handle_t) &yuv, &vaddr), 0);
+    pixels = vaddr;
+    for (y = 0; y < 12; y++)
+        for (x = 0; x < 16; x++)
+            pixels[y * 16 + x] = y * 16 + x;
+    memset(&layer, 0, sizeof(layer));
+    layer.handle = (buffer_handle_t) &yuv;
+    layer.sourceCrop = (hwc_rect_t) { 3, 1, 13, 9 };
+    layer.displayFrame = (hwc_rect_t) { 0, 0, 240, 160 };
+
+    for (i = 0; i < sizeof(transforms) / sizeof(*transforms); i++) {
+        int rot = transforms[i].transform & HWC_TRANSFORM_ROT_90;
+
+        layer.transform = transforms[i].transform;
+        CHECK_EQ(convert_posted(hwc_dev, &layer), 0);
+        CHECK_EQ(conv->rect.left, 2);
+        CHECK_EQ(conv->rect.top, 0);
+        CHECK_EQ(conv->rect.right, 14);
+        CHECK_EQ(conv->rect.bottom, 10);
+
+        memset(&o, 0, sizeof(o));
+        omap3_hwc_conv_setup_layer(hwc_dev, &o, &layer, 0);
+        CHECK_EQ(o.cfg.width, rot ? 10 : 12);
+        CHECK_EQ(o.cfg.height, rot ? 12 : 10);
+        CHECK_EQ(o.cfg.crop.w, rot ? 8 : 10);
+        CHECK_EQ(o.cfg.crop.h, rot ? 10 : 8);
+        CHECK_EQ(o.cfg.rotation, 0);
+        CHECK_EQ(o.cfg.mirror, 0);
+        copy = conv->y->vaddr;
+        CHECK_EQ(copy[o.cfg.crop.y * o.cfg.stride + o.cfg.crop.x],
+                 transforms[i].y * 16 + transforms[i].x);
+    }
+
+    /* a new crop is a new copy */
+    layer.transform = 0;
+    CHECK_EQ(convert_posted(hwc_dev, &layer), 0);
+    CHECK_EQ(convert_posted(hwc_dev, &layer), 0);
+    CHECK_EQ(conv->reuses, 1);
+    layer.sourceCrop = (hwc_rect_t) { 0, 4, 16, 12 };
+    CHECK_EQ(convert_posted(hwc_dev, &layer), 0);
+    CHECK_EQ(conv->reuses, 1);
+    copy = conv->y->vaddr;
+    CHECK_EQ(copy[0], 4 * 16);
+
+    /* a 1080p buffer is too big to pre-rotate at the default speed, a 320x180 crop of it is not */
+    init_buffer(&big, HAL_PIXEL_FORMAT_YV12, 1920, 1080);
+    layer.handle = (buffer_handle_t) &big;
+    layer.transform = HWC_TRANSFORM_ROT_90;
+    layer.displayFrame = (hwc_rect_t) { 0, 0, 480, 270 };
+    conv->rot_pixels = conv->rot_time_ns = 0;
+    layer.sourceCrop = (hwc_rect_t) { 0, 0, 1920, 1080 };
+    CHECK(!omap3_hwc_prerotate_pays(hwc_dev, &layer));
+    layer.sourceCrop = (hwc_rect_t) { 800, 450, 1120, 630 };
+    CHECK(omap3_hwc_prerotate_pays(hwc_dev, &layer));
+
+    close_composer(hwc_dev);
+}
+
+/* ---- prepare benchmark ---- */
+
+/*
+ * Mean time of prepare over a second of frames that each bring a new video
+ * buffer, with or without a geometry change.  set runs between the frames
+ * but is not timed.
+ */
+static double time_prepare(omap3_hwc_device_t *hwc_dev, struct test_frame *f,
+                           IMG_native_handle_t *video, int geometry_changed)
+{
+    hwc_display_contents_1_t *displays[1] = { &f->list };
+    __u64 start = now_ns(), total = 0, t;
+    unsigned int i, frames = 0;
+
+    do {
+        for (i = 0; i < f->list.numHwLayers; i++)
+            f->layers[i].compositionType = HWC_FRAMEBUFFER;
+        f->list.flags = geometry_changed ? HWC_GEOMETRY_CHANGED : 0;
+        video->ui64Stamp++;
+        t = now_ns();
+        hwc_dev->base.prepare(&hwc_dev->base, 1, displays);
+        total += now_ns() - t;
+        f->list.dpy = f->list.sur = f;
+        hwc_dev->base.set(&hwc_dev->base, 1, displays);
+        frames++;
+    } while (now_ns() - start < 1000000000);
+    return (double) total / frames;
+}
+
+/*
+ * prepare on a video frame when the cached plan is reused, and when it is
+ * rebuilt, as the frame grows from a video under the UI and the status bar
+ * to TEST_MAX_LAYERS layers with small UI windows over the video.
+ */
+static void bench_prepare(void)
+{
+    static const unsigned int counts[] = { 3, 5, 10, 15, TEST_MAX_LAYERS };
+    omap3_hwc_device_t *hwc_dev = open_composer();
+    IMG_native_handle_t ui, bar, video, windows[TEST_MAX_LAYERS - 3];
+    struct test_frame f;
+    unsigned int c, i;
+    __u32 hits, misses;
+    double hit, miss;
+
+    if (!hwc_dev)
+        return;
+    hwc_dev->transition.frames = 0;
+
+    init_buffer(&video, HAL_PIXEL_FORMAT_TI_NV12, 1280, 720);
+    init_buffer(&ui, HAL_PIXEL_FORMAT_RGBA_8888, 480, 800);
+    init_buffer(&bar, HAL_PIXEL_FORMAT_RGBA_8888, 480, 38);
+    for (i = 0; i < TEST_MAX_LAYERS - 3; i++)
+        init_buffer(windows + i, HAL_PIXEL_FORMAT_RGBA_8888, 200, 40);
+
+    printf("layers     reused                   rebuilt\n");
+    for (c = 0; c < sizeof(counts) / sizeof(*counts); c++) {
+        memset(&f, 0, sizeof(f));
+        add_layer(&f, &video, (hwc_rect_t) { 0, 0, 1280, 720 }, (hwc_rect_t) { 0, 265, 480, 535 },
+                  HWC_BLENDING_NONE);
+        add_layer(&f, &ui, (hwc_rect_t) { 0, 0, 480, 800 }, (hwc_rect_t) { 0, 0, 480, 800 },
+                  HWC_BLENDING_PREMULT);
+        add_layer(&f, &bar, (hwc_rect_t) { 0, 0, 480, 38 }, (hwc_rect_t) { 0, 0, 480, 38 },
+                  HWC_BLENDING_PREMULT);
+        for (i = 0; i < counts[c] - 3; i++) {
+            int x = (i & 1) * 260, y = 50 + (i >> 1) * 45;
+
+            add_layer(&f, windows + i, (hwc_rect_t) { 0, 0, 200, 40 },
+                      (hwc_rect_t) { x, y, x + 200, y + 40 }, HWC_BLENDING_PREMULT);
+        }
+        compose(hwc_dev, &f);
+
+        hits = hwc_dev->plan.hits;
+        hit = time_prepare(hwc_dev, &f, &video, 0);
+        hits = hwc_dev->plan.hits - hits;
+        misses = hwc_dev->plan.misses;
+        miss = time_prepare(hwc_dev, &f, &video, 1);
+        misses = hwc_dev->plan.misses - misses;
+
+        printf("%6u %8.2fus (%7u hits) %8.2fus (%7u misses) %.1fx\n", counts[c], hit / 1000, hits,
+               miss / 1000, misses, miss / hit);
+    }
+    close_composer(hwc_dev);
+}
+
+/* ---- main ---- */
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+    int bench;                          /* only run when named */
+} tests[] = {
+    { "bandwidth", test_bandwidth, 0 },
+    { "csc", test_csc, 0 },
+    { "ext_transform", test_ext_transform, 0 },
+    { "hdmi_modes", test_hdmi_modes, 0 },
+    { "colorkey", test_colorkey, 0 },
+    { "skip_frame", test_skip_frame, 0 },
+    { "flatten", test_flatten, 0 },
+    { "mode_switch", test_mode_switch, 0 },
+    { "open_failure", test_open_failure, 0 },
+    { "event_loop", test_event_loop, 0 },
+    { "hotplug", test_hotplug, 0 },
+    { "conv_crop", test_conv_crop, 0 },
+    { "ion_pool", test_ion_pool, 0 },
+    { "sw_vsync", test_sw_vsync, 0 },
+    { "tiler_slot", test_tiler_slot, 0 },
+    { "yuv_conv", test_yuv_conv, 0 },
+    { "ext_transform_cost", bench_ext_transform, 1 },
+    { "flatten_fill", bench_flatten, 1 },
+    { "hdmi_mode_choice", bench_hdmi_modes, 1 },
+    { "prepare", bench_prepare, 1 },
+    { "yuv_conv_fps", bench_yuv_conv, 1 },
+    { "yuv_conv_transforms", bench_yuv_conv_transforms, 1 },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned int i;
+    int j, failed = 0;
+
+    for (i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+        int run = argc == 1 && !tests[i].bench;
+        int failures = test_failures;
+
+        for (j = 1; j < argc; j++)
+            run |= !strcmp(argv[j], tests[i].name);
+        if (!run)
+            continue;
+
+        tests[i].run();
+        printf("%-20s %s\n", tests[i].name, test_failures == failures ? "ok" : "FAILED");
+        failed |= test_failures != failures;
+    }
+    return failed;
+}
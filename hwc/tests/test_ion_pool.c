@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ION scratch pool: size classes, reuse only after the buffer left the
+ * screen, freeing of idle buffers, the footprint limit with reservations,
+ * and the fallback from the TILER heap to the carveout.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/ion.h>
+struct ion_client;
+#include <linux/omap_ion.h>
+
+#include "ion_pool.h"
+#include "hwc_test.h"
+
+#define KB(n) ((n) << 10)
+
+static void post(struct omap3_hwc_ion_pool *pool, int n)
+{
+    while (n--)
+        ion_pool_posted(pool);
+}
+
+static void test_size_classes(void)
+{
+    static const struct {
+        __u32 size, class;
+    } sizes[] = {
+        { 1, KB(64) }, { KB(64), KB(64) }, { KB(64) + 1, KB(96) }, { KB(96), KB(96) },
+        { KB(96) + 1, KB(128) }, { KB(150), KB(192) }, { KB(200), KB(256) },
+        /* an NV12 frame of 720x480 */
+        { 720 * 480 * 3 / 2, KB(512) }, { KB(1536), KB(1536) }, { KB(1536) + 1, KB(2048) },
+    };
+    struct omap3_hwc_ion_pool pool;
+    struct omap3_hwc_ion_buf *buf;
+    unsigned int i;
+
+    CHECK_EQ(ion_pool_init(&pool, &ion_pool_host_heap, 16 << 20), 0);
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        buf = ion_pool_get(&pool, sizes[i].size);
+        CHECK(buf != NULL);
+        if (!buf)
+            continue;
+        CHECK_EQ(buf->size, sizes[i].class);
+        CHECK_EQ(pool.footprint, sizes[i].class);
+        /* the memory is there and page aligned */
+        memset(buf->vaddr, 0x5a, buf->size);
+        CHECK_EQ((unsigned long) buf->vaddr & 4095, 0);
+        ion_pool_put(&pool, buf);
+        /* drop it, so the next size gets a buffer of its own */
+        post(&pool, ION_POOL_IDLE_POSTS + 1);
+        CHECK_EQ(pool.footprint, 0);
+    }
+    ion_pool_destroy(&pool);
+}
+
+static void test_reuse(void)
+{
+    struct omap3_hwc_ion_pool pool;
+    struct omap3_hwc_ion_buf *a, *b, *c;
+
+    CHECK_EQ(ion_pool_init(&pool, &ion_pool_host_heap, 16 << 20), 0);
+    a = ion_pool_get(&pool, KB(100));
+    ion_pool_put(&pool, a);
+
+    /* a may be on screen until the second post after it was released */
+    b = ion_pool_get(&pool, KB(100));
+    CHECK(b != a);
+    post(&pool, 1);
+    c = ion_pool_get(&pool, KB(100));
+    CHECK(c != a && c != b);
+    CHECK_EQ(pool.allocs, 3);
+    post(&pool, 1);
+    CHECK(ion_pool_get(&pool, KB(120)) == a);
+    CHECK_EQ(pool.reuses, 1);
+    CHECK_EQ(pool.allocs, 3);
+
+    /* only buffers of the same class are recycled */
+    ion_pool_put(&pool, b);
+    post(&pool, 2);
+    CHECK(ion_pool_get(&pool, KB(60)) != b);
+    CHECK_EQ(pool.allocs, 4);
+    CHECK(ion_pool_get(&pool, KB(128)) == b);
+
+    /* idle buffers are freed after ION_POOL_IDLE_POSTS posts */
+    ion_pool_put(&pool, c);
+    post(&pool, ION_POOL_IDLE_POSTS);
+    CHECK(c->handle != NULL);
+    CHECK_EQ(pool.frees, 0);
+    post(&pool, 1);
+    CHECK(c->handle == NULL);
+    CHECK_EQ(pool.frees, 1);
+    CHECK_EQ(pool.footprint, KB(128) + KB(128) + KB(64));
+    ion_pool_destroy(&pool);
+}
+
+static void test_limit(void)
+{
+    struct omap3_hwc_ion_pool pool;
+    struct omap3_hwc_ion_buf *a, *b, *c;
+
+    CHECK_EQ(ion_pool_init(&pool, &ion_pool_host_heap, KB(256)), 0);
+    CHECK(ion_pool_get(&pool, KB(256) + 1) == NULL);
+    a = ion_pool_get(&pool, KB(128));
+    b = ion_pool_get(&pool, KB(128));
+    CHECK(a && b);
+    CHECK_EQ(pool.footprint, KB(256));
+
+    /* nothing can be freed while both are in use or on screen */
+    CHECK(ion_pool_get(&pool, KB(64)) == NULL);
+    ion_pool_put(&pool, a);
+    CHECK(ion_pool_get(&pool, KB(64)) == NULL);
+    CHECK_EQ(pool.failures, 3);
+
+    /* then a released buffer of another class makes room */
+    post(&pool, 2);
+    c = ion_pool_get(&pool, KB(64));
+    CHECK(c != NULL);
+    CHECK(a->handle == NULL);
+    CHECK_EQ(pool.frees, 1);
+    CHECK_EQ(pool.footprint, KB(192));
+
+    /* reservations are charged against the same limit */
+    CHECK_EQ(ion_pool_reserve(&pool, KB(64)), 0);
+    CHECK_EQ(pool.footprint, KB(256));
+    CHECK_EQ(pool.reserved, KB(64));
+    CHECK_EQ(ion_pool_reserve(&pool, KB(64)), -ENOMEM);
+    CHECK(ion_pool_get(&pool, KB(64)) == NULL);
+    /* and evict buffers that are no longer used */
+    ion_pool_put(&pool, c);
+    post(&pool, 2);
+    CHECK_EQ(ion_pool_reserve(&pool, KB(64)), 0);
+    CHECK_EQ(pool.frees, 2);
+    CHECK_EQ(pool.footprint, KB(256));
+    CHECK_EQ(pool.reserved, KB(128));
+    ion_pool_unreserve(&pool, KB(128));
+    CHECK_EQ(pool.footprint, KB(128));
+    CHECK_EQ(pool.reserved, 0);
+    CHECK(ion_pool_get(&pool, KB(128)) != NULL);
+    ion_pool_destroy(&pool);
+}
+
+#ifndef __ANDROID__
+/*
+ * /dev/ion stand-in for the kernel heap: ioctls on fake_ion_fd are
+ * answered here, with the TILER heap failing while fake_tiler is 0, and
+ * mappings of /dev/zero.  Other fds go to the kernel.
+ */
+static int fake_ion_fd = -1;
+static int fake_tiler;
+static int fake_tiler_allocs, fake_carveout_allocs, fake_ion_frees;
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (fd != fake_ion_fd || fd < 0)
+        return syscall(SYS_ioctl, fd, request, arg);
+
+    if (request == ION_IOC_CUSTOM) {
+        struct ion_custom_data *custom = arg;
+        struct omap_ion_tiler_alloc_data *tiler = (void *) custom->arg;
+
+        if (custom->cmd != OMAP_ION_TILER_ALLOC || !fake_tiler) {
+            errno = ENODEV;
+            return -1;
+        }
+        tiler->handle = (struct ion_handle *) (unsigned long) (0x1000 + ++fake_tiler_allocs);
+        return 0;
+    } else if (request == ION_IOC_ALLOC) {
+        struct ion_allocation_data *data = arg;
+
+        data->handle = (struct ion_handle *) (unsigned long) (0x2000 + ++fake_carveout_allocs);
+        return 0;
+    } else if (request == ION_IOC_MAP) {
+        struct ion_fd_data *map = arg;
+
+        map->fd = open("/dev/zero", O_RDWR);
+        return map->fd < 0 ? -1 : 0;
+    } else if (request == ION_IOC_FREE) {
+        fake_ion_frees++;
+        return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+static int fake_ion_open(struct omap3_hwc_ion_pool *pool)
+{
+    pool->fd = fake_ion_fd = open("/dev/null", O_RDWR);
+    if (pool->fd < 0)
+        return -errno;
+    pool->tiler = 1;
+    return 0;
+}
+
+static void test_tiler_fallback(void)
+{
+    struct omap3_hwc_ion_heap heap = ion_pool_kernel_heap;
+    struct omap3_hwc_ion_pool pool;
+    struct omap3_hwc_ion_buf *a, *b;
+
+    heap.open = fake_ion_open;
+
+    /* TILER memory while the heap is there */
+    fake_tiler = 1;
+    CHECK_EQ(ion_pool_init(&pool, &heap, 16 << 20), 0);
+    a = ion_pool_get(&pool, KB(64));
+    CHECK(a && a->tiler);
+    CHECK_EQ(fake_tiler_allocs, 1);
+    CHECK(a && a->map_fd >= 0);
+    if (a)
+        memset(a->vaddr, 0, a->size);
+    ion_pool_destroy(&pool);
+    CHECK_EQ(fake_ion_frees, 1);
+
+    /* the carveout without it, and TILER is not asked again */
+    fake_tiler = 0;
+    CHECK_EQ(ion_pool_init(&pool, &heap, 16 << 20), 0);
+    a = ion_pool_get(&pool, KB(64));
+    CHECK(a && !a->tiler);
+    CHECK_EQ(pool.tiler, 0);
+    fake_tiler = 1;
+    b = ion_pool_get(&pool, KB(64));
+    CHECK(b && !b->tiler);
+    CHECK_EQ(fake_tiler_allocs, 1);
+    CHECK_EQ(fake_carveout_allocs, 2);
+    if (b)
+        memset(b->vaddr, 0, b->size);
+    ion_pool_destroy(&pool);
+    CHECK_EQ(fake_ion_frees, 3);
+    fake_ion_fd = -1;
+}
+#endif
+
+void test_ion_pool(void)
+{
+    test_size_classes();
+    test_reuse();
+    test_limit();
+#ifndef __ANDROID__
+    test_tiler_fallback();
+#endif
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Software vsync model fed with a synthetic hardware vsync: a 61Hz display
+ * the mode claims is 60Hz, with interrupt latency jitter, lost and repeated
+ * timestamps and a long gap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sw_vsync.h"
+#include "hwc_test.h"
+
+#define NOMINAL     16666667LL          /* 60Hz */
+#define PERIOD      16393443LL          /* 61Hz */
+#define JITTER      500000              /* +-0.5ms */
+#define T0          1000000000LL
+
+/* time of vsync k of the synthetic display */
+static int64_t vsync_time(int k)
+{
+    return T0 + k * PERIOD;
+}
+
+static int64_t jitter(unsigned int *seed)
+{
+    return (int64_t) (rand_r(seed) % (2 * JITTER + 1)) - JITTER;
+}
+
+static int64_t dist(int64_t a, int64_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+void test_sw_vsync(void)
+{
+    struct omap3_hwc_sw_vsync m;
+    unsigned int seed = 1;
+    int64_t ts, filtered, max_err = 0;
+    __u32 missed = 0;
+    int k;
+
+    sw_vsync_init(&m, NOMINAL);
+
+    /* 400 vsyncs; every 7th timestamp is lost, every 5th is read twice */
+    for (k = 0; k < 400; k++) {
+        if (k % 7 == 3) {
+            missed++;
+            continue;
+        }
+        ts = vsync_time(k) + jitter(&seed);
+        filtered = sw_vsync_sample(&m, ts);
+        CHECK(filtered >= 0);
+
+        /* nominal period and no predictions until the window has enough samples */
+        if (m.count < SW_VSYNC_MIN_FIT) {
+            CHECK_EQ(sw_vsync_period(&m), NOMINAL);
+            CHECK(!sw_vsync_locked(&m, ts));
+        } else if (k >= 2 * SW_VSYNC_WINDOW) {
+            /* the fit removes most of the jitter */
+            if (dist(filtered, vsync_time(k)) > max_err)
+                max_err = dist(filtered, vsync_time(k));
+            CHECK(sw_vsync_locked(&m, ts));
+        }
+
+        if (k % 5 == 0)
+            CHECK_EQ(sw_vsync_sample(&m, ts + jitter(&seed) / 2), -1);
+    }
+    CHECK(max_err < JITTER / 2);
+    CHECK(m.jitter_max <= 2 * JITTER);
+    CHECK_EQ(m.missed, missed);
+    CHECK_EQ(m.resyncs, 0);
+
+    /* the measured period converges on the real one */
+    CHECK(dist(sw_vsync_period(&m), PERIOD) < 20000);
+
+    /* predictions follow the display, but only for a while */
+    ts = vsync_time(k - 1);
+    CHECK(dist(sw_vsync_next(&m, ts + 10 * PERIOD + PERIOD / 2), vsync_time(k + 10)) < JITTER / 2);
+    CHECK(sw_vsync_next(&m, ts) > ts);
+    CHECK(sw_vsync_locked(&m, ts + SW_VSYNC_MAX_PREDICT - 100000000));
+    CHECK(!sw_vsync_locked(&m, ts + SW_VSYNC_MAX_PREDICT + 100000000));
+
+    /* after a long gap, e.g. a blanked display, the phase restarts */
+    k += 2 * SW_VSYNC_MAX_GAP;
+    ts = vsync_time(k) + jitter(&seed);
+    CHECK_EQ(sw_vsync_sample(&m, ts), ts);
+    CHECK_EQ(m.resyncs, 1);
+    CHECK(!sw_vsync_locked(&m, ts));
+    CHECK_EQ(sw_vsync_period(&m), NOMINAL);
+    for (k++; m.count < SW_VSYNC_MIN_FIT; k++)
+        CHECK(sw_vsync_sample(&m, vsync_time(k) + jitter(&seed)) >= 0);
+    CHECK(sw_vsync_locked(&m, vsync_time(k)));
+    CHECK(dist(sw_vsync_period(&m), PERIOD) < 200000);
+
+    /* so does a vsync off the predicted phase, e.g. after a mode change */
+    ts = vsync_time(k) + PERIOD / 2;
+    CHECK_EQ(sw_vsync_sample(&m, ts), ts);
+    CHECK_EQ(m.resyncs, 2);
+    CHECK(!sw_vsync_locked(&m, ts));
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * TILER 1D slot model: buffers staying on screen keep their range, a new
+ * stamp needs a new one, and fragmentation can fail a composition that
+ * would fit into the free pages.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "tiler_slot.h"
+#include "hwc_test.h"
+
+static int buffers[8];                  /* handles */
+
+static struct omap3_hwc_tiler_map map(int buffer, __u64 stamp, __u32 pages)
+{
+    struct omap3_hwc_tiler_map m = {
+        .handle = buffers + buffer,
+        .stamp = stamp,
+        .pages = pages,
+    };
+
+    return m;
+}
+
+/* places and commits; returns the result of tiler_slot_place */
+static int post(struct omap3_hwc_tiler_slot *t, struct omap3_hwc_tiler_map *maps, int n)
+{
+    int err = tiler_slot_place(t, maps, n);
+
+    if (!err)
+        tiler_slot_commit(t, maps, n);
+    return err;
+}
+
+void test_tiler_slot(void)
+{
+    struct omap3_hwc_tiler_slot t;
+    struct omap3_hwc_tiler_map m[4];
+    __u32 largest;
+
+    CHECK_EQ(tiler_slot_pages(1), 1);
+    CHECK_EQ(tiler_slot_pages(TILER_PAGE_SIZE), 1);
+    CHECK_EQ(tiler_slot_pages(TILER_PAGE_SIZE + 1), 2);
+
+    tiler_slot_init(&t, 256 * TILER_PAGE_SIZE);
+    CHECK_EQ(tiler_slot_free(&t, &largest), 256);
+    CHECK_EQ(largest, 256);
+
+    /* first fit; buffers that need no mapping are skipped */
+    m[0] = map(0, 1, 100);
+    m[1] = map(1, 1, 0);
+    m[2] = map(2, 1, 50);
+    CHECK_EQ(post(&t, m, 3), 0);
+    CHECK_EQ(m[0].start, 0);
+    CHECK_EQ(m[2].start, 100);
+    CHECK_EQ(t.maps, 2);
+    CHECK_EQ(tiler_slot_free(&t, &largest), 106);
+    CHECK_EQ(largest, 106);
+
+    /* a live buffer keeps its range; the new one goes around the old composition */
+    m[1] = map(3, 1, 60);
+    CHECK_EQ(post(&t, m, 2), 0);
+    CHECK_EQ(m[0].start, 0);
+    CHECK_EQ(m[1].start, 150);
+    CHECK_EQ(t.kept, 1);
+    CHECK_EQ(t.maps, 3);
+    CHECK_EQ(tiler_slot_free(&t, &largest), 96);
+    CHECK_EQ(largest, 50);
+
+    /* the same buffer twice in a composition is mapped once */
+    m[1] = map(3, 1, 60);
+    m[2] = map(3, 1, 60);
+    CHECK_EQ(post(&t, m, 3), 0);
+    CHECK_EQ(m[2].start, 150);
+    CHECK_EQ(t.kept, 3);
+    CHECK_EQ(t.num_live, 2);
+
+    /* a restamped buffer is new content: both ranges are mapped during the switch */
+    m[0] = map(0, 2, 100);
+    CHECK_EQ(tiler_slot_place(&t, m, 1), -ENOSPC);
+    m[0] = map(0, 2, 50);
+    CHECK_EQ(post(&t, m, 1), 0);
+    CHECK_EQ(m[0].start, 100);
+    CHECK_EQ(t.num_live, 1);
+
+    /* buffers without a handle never match a live one */
+    tiler_slot_init(&t, 100 * TILER_PAGE_SIZE);
+    m[0] = map(0, 1, 60);
+    m[0].handle = NULL;
+    CHECK_EQ(post(&t, m, 1), 0);
+    CHECK_EQ(tiler_slot_place(&t, m, 1), -ENOSPC);
+
+    /* fill the slot, then keep every other buffer */
+    tiler_slot_init(&t, 100 * TILER_PAGE_SIZE);
+    m[0] = map(0, 1, 25);
+    m[1] = map(1, 1, 25);
+    m[2] = map(2, 1, 25);
+    m[3] = map(3, 1, 25);
+    CHECK_EQ(post(&t, m, 4), 0);
+    CHECK_EQ(m[3].start, 75);
+    CHECK_EQ(tiler_slot_free(&t, &largest), 0);
+    CHECK_EQ(largest, 0);
+    m[1] = m[2];
+    CHECK_EQ(post(&t, m, 2), 0);
+    CHECK_EQ(tiler_slot_free(&t, &largest), 50);
+    CHECK_EQ(largest, 25);
+
+    /* 50 pages are free, but not 30 in a row */
+    m[2] = map(4, 1, 30);
+    CHECK_EQ(tiler_slot_place(&t, m, 3), -ENOSPC);
+    m[2] = map(4, 1, 25);
+    CHECK_EQ(post(&t, m, 3), 0);
+    CHECK_EQ(m[2].start, 25);
+    CHECK_EQ(tiler_slot_free(&t, &largest), 25);
+    CHECK_EQ(largest, 25);
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Planar 4:2:0 to NV12 conversion against a per-pixel reference, for every
+ * transform and odd sizes, and its frame rate.  Built for ARM, this runs the
+ * NEON kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "yuv_conv.h"
+#include "hwc_test.h"
+
+#define GUARD 0xee                      /* in bytes the conversion must not write */
+
+/* a planar frame as a software decoder lays it out */
+struct frame {
+    __u8 *mem;
+    struct yuv_conv_planes p;
+};
+
+static void alloc_frame(struct frame *f, __u32 width, __u32 height, unsigned int *seed)
+{
+    __u32 y_stride = (width + 15) & ~15, c_stride = (y_stride / 2 + 15) & ~15;
+    __u32 c_height = (height + 1) / 2, size = y_stride * height + 2 * c_stride * c_height, i;
+
+    f->mem = malloc(size);
+    for (i = 0; i < size; i++)
+        f->mem[i] = seed ? rand_r(seed) : 0;
+    f->p.y = f->mem;
+    f->p.cb = f->mem + y_stride * height;
+    f->p.cr = f->p.cb + c_stride * c_height;
+    f->p.y_stride = y_stride;
+    f->p.c_stride = c_stride;
+}
+
+/* sample of the w x h plane at (x, y) of the transformed plane */
+static __u8 ref_sample(const __u8 *p, __u32 stride, __u32 w, __u32 h, int transform, __u32 x, __u32 y)
+{
+    __u32 sx = x, sy = y;
+
+    /* undo the quarter turn, then the flips */
+    if (transform & YUV_CONV_ROT_90) {
+        sx = y;
+        sy = h - 1 - x;
+    }
+    if (transform & YUV_CONV_FLIP_H)
+        sx = w - 1 - sx;
+    if (transform & YUV_CONV_FLIP_V)
+        sy = h - 1 - sy;
+    return p[sy * stride + sx];
+}
+
+void test_yuv_conv(void)
+{
+    unsigned int seed = 1, cases = 0;
+    __u32 w, h, x, y;
+    int t;
+
+    for (t = 0; t < 8; t++) {
+        for (w = 1; w <= 85; w += 6) {
+            for (h = 1; h <= 53; h += 4) {
+                __u32 cw = (w + 1) / 2, ch = (h + 1) / 2;
+                __u32 ow = t & YUV_CONV_ROT_90 ? h : w, oh = t & YUV_CONV_ROT_90 ? w : h;
+                __u32 ocw = t & YUV_CONV_ROT_90 ? ch : cw, och = t & YUV_CONV_ROT_90 ? cw : ch;
+                __u32 stride = (ow + 31) & ~31;
+                struct frame f;
+                __u8 *out_y, *out_uv;
+                int bad = 0;
+
+                alloc_frame(&f, w, h, &seed);
+                out_y = malloc(stride * oh + stride);
+                out_uv = malloc(stride * och + stride);
+                memset(out_y, GUARD, stride * oh + stride);
+                memset(out_uv, GUARD, stride * och + stride);
+
+                yuv_conv_to_nv12(&f.p, w, h, t, out_y, out_uv, stride);
+
+                /* luma, and nothing past the width */
+                for (y = 0; y < oh; y++)
+                    for (x = 0; x < stride; x++)
+                        bad += out_y[y * stride + x] !=
+                               (x < ow ? ref_sample(f.p.y, f.p.y_stride, w, h, t, x, y) : GUARD);
+                /* Cb before Cr */
+                for (y = 0; y < och; y++)
+                    for (x = 0; x < ocw; x++)
+                        bad += out_uv[y * stride + 2 * x] !=
+                               ref_sample(f.p.cb, f.p.c_stride, cw, ch, t, x, y) ||
+                               out_uv[y * stride + 2 * x + 1] !=
+                               ref_sample(f.p.cr, f.p.c_stride, cw, ch, t, x, y);
+                /* nothing below the planes */
+                bad += out_y[stride * oh] != GUARD || out_uv[stride * och] != GUARD;
+
+                if (bad)
+                    fprintf(stderr, "yuv_conv: %ux%u transform %d: %d bad samples\n", w, h, t, bad);
+                CHECK_EQ(bad, 0);
+                cases++;
+
+                free(f.mem);
+                free(out_y);
+                free(out_uv);
+            }
+        }
+    }
+    printf("yuv_conv: %u sizes and transforms\n", cases);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* best time of a conversion over a second */
+static double time_conv(const struct yuv_conv_planes *p, __u32 width, __u32 height, int transform,
+                        __u8 *y, __u8 *uv, __u32 stride)
+{
+    double start = now(), best = 1, t;
+
+    do {
+        t = now();
+        yuv_conv_to_nv12(p, width, height, transform, y, uv, stride);
+        t = now() - t;
+        if (t < best)
+            best = t;
+    } while (now() - start < 1);
+    return best;
+}
+
+void bench_yuv_conv(void)
+{
+    static const __u32 sizes[][2] = { { 640, 480 }, { 854, 480 }, { 1280, 720 } };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        __u32 w = sizes[i][0], h = sizes[i][1], stride = (w + 31) & ~31;
+        struct frame f;
+        __u8 *y = malloc(stride * h), *uv = malloc(stride * h / 2);
+        double t;
+
+        alloc_frame(&f, w, h, NULL);
+        t = time_conv(&f.p, w, h, 0, y, uv, stride);
+        printf("%4ux%-4u %6.0f fps, %5.0fus per frame, %.2fns per pixel\n",
+               w, h, 1 / t, t * 1e6, t * 1e9 / (w * h));
+        free(f.mem);
+        free(y);
+        free(uv);
+    }
+}
+
+/* cost of each transform against a plain copy; the rotations run the 8x8 transpose kernels */
+void bench_yuv_conv_transforms(void)
+{
+    static const __u32 sizes[][2] = { { 854, 480 }, { 1280, 720 } };
+    unsigned int i;
+    int t;
+
+#ifdef __ARM_NEON__
+    printf("NEON kernels\n");
+#else
+    printf("C kernels\n");
+#endif
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        __u32 w = sizes[i][0], h = sizes[i][1], stride = ((w > h ? w : h) + 31) & ~31;
+        struct frame f;
+        __u8 *y = malloc(stride * stride), *uv = malloc(stride * stride / 2);
+        double copy = 0, tm;
+
+        alloc_frame(&f, w, h, NULL);
+        for (t = 0; t < 8; t++) {
+            tm = time_conv(&f.p, w, h, t, y, uv, stride);
+            if (!t)
+                copy = tm;
+            printf("%4ux%-4u %s%s%s: %5.0fus per frame, %.2fns per pixel, %.1fx copy\n", w, h,
+                   t & YUV_CONV_FLIP_H ? "H" : "-", t & YUV_CONV_FLIP_V ? "V" : "-",
+                   t & YUV_CONV_ROT_90 ? "R" : "-", tm * 1e6, tm * 1e9 / (w * h), tm / copy);
+        }
+        free(f.mem);
+        free(y);
+        free(uv);
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "tiler_slot.h"
+
+struct range {
+    __u32 start;
+    __u32 end;
+};
+
+/* mapping of the same buffer among maps, if any */
+static const struct omap3_hwc_tiler_map *find_map(const struct omap3_hwc_tiler_map *maps, int n,
+                                                  const struct omap3_hwc_tiler_map *m)
+{
+    int i;
+
+    if (!m->handle)
+        return NULL;
+    for (i = 0; i < n; i++)
+        if (maps[i].pages && maps[i].handle == m->handle && maps[i].stamp == m->stamp)
+            return maps + i;
+    return NULL;
+}
+
+void tiler_slot_init(struct omap3_hwc_tiler_slot *t, __u32 size)
+{
+    memset(t, 0, sizeof(*t));
+    t->pages = size / TILER_PAGE_SIZE;
+}
+
+int tiler_slot_place(const struct omap3_hwc_tiler_slot *t, struct omap3_hwc_tiler_map *maps, int n)
+{
+    struct range used[2 * TILER_SLOT_MAX_MAPS];
+    int num_used = 0, i, j;
+
+    /* the composition on screen stays mapped meanwhile */
+    for (i = 0; i < t->num_live; i++) {
+        used[num_used].start = t->live[i].start;
+        used[num_used].end = t->live[i].start + t->live[i].pages;
+        num_used++;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct omap3_hwc_tiler_map *m = maps + i;
+        const struct omap3_hwc_tiler_map *same;
+        __u32 start = 0;
+
+        if (!m->pages)
+            continue;
+        same = find_map(t->live, t->num_live, m);
+        if (!same)
+            same = find_map(maps, i, m);
+        if (same) {
+            m->start = same->start;
+            continue;
+        }
+        if (num_used == 2 * TILER_SLOT_MAX_MAPS)
+            return -ENOSPC;
+
+        /* first fit; used is sorted and its ranges do not overlap */
+        for (j = 0; j < num_used && used[j].start < start + m->pages; j++)
+            start = used[j].end;
+        if (start + m->pages > t->pages)
+            return -ENOSPC;
+
+        memmove(used + j + 1, used + j, (num_used - j) * sizeof(*used));
+        used[j].start = start;
+        used[j].end = start + m->pages;
+        num_used++;
+        m->start = start;
+    }
+    return 0;
+}
+
+void tiler_slot_commit(struct omap3_hwc_tiler_slot *t, const struct omap3_hwc_tiler_map *maps, int n)
+{
+    struct omap3_hwc_tiler_map live[TILER_SLOT_MAX_MAPS];
+    int num_live = 0, i, j;
+
+    for (i = 0; i < n && num_live < TILER_SLOT_MAX_MAPS; i++) {
+        const struct omap3_hwc_tiler_map *m = maps + i;
+
+        if (!m->pages || find_map(live, num_live, m))
+            continue;
+        if (find_map(t->live, t->num_live, m))
+            t->kept++;
+        else
+            t->maps++;
+
+        for (j = num_live; j > 0 && live[j - 1].start > m->start; j--)
+            live[j] = live[j - 1];
+        live[j] = *m;
+        num_live++;
+    }
+
+    memcpy(t->live, live, num_live * sizeof(*live));
+    t->num_live = num_live;
+}
+
+__u32 tiler_slot_free(const struct omap3_hwc_tiler_slot *t, __u32 *largest)
+{
+    __u32 free = 0, start = 0, end;
+    int i;
+
+    *largest = 0;
+    for (i = 0; i <= t->num_live; i++) {
+        end = i < t->num_live ? t->live[i].start : t->pages;
+        free += end - start;
+        if (end - start > *largest)
+            *largest = end - start;
+        if (i < t->num_live)
+            start = t->live[i].start + t->live[i].pages;
+    }
+    return free;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OMAP3_HWC_TILER_SLOT_H
+#define OMAP3_HWC_TILER_SLOT_H
+
+#include <linux/types.h>
+
+/*
+ * Model of the TILER 1D slot that dsscomp maps non-TILER buffers into for
+ * scan-out.  Every buffer of a composition gets a page aligned range, first
+ * fit, while the buffers of the composition on screen stay mapped until the
+ * new one replaces it.  A buffer that stays on screen (same handle and stamp)
+ * keeps its range.  So a composition can fail to map although its buffers add
+ * up to less than the slot, if the free ranges are fragmented.
+ *
+ * The model does no locking.
+ */
+
+#define TILER_PAGE_SIZE         4096
+#define TILER_SLOT_MAX_MAPS     8
+
+struct omap3_hwc_tiler_map {
+    const void *handle;                 /* buffer, NULL if it never stays mapped */
+    __u64 stamp;
+    __u32 pages;                        /* 0 if the buffer needs no mapping */
+    __u32 start;                        /* first page, set by tiler_slot_place */
+};
+
+struct omap3_hwc_tiler_slot {
+    __u32 pages;                        /* slot size */
+    struct omap3_hwc_tiler_map live[TILER_SLOT_MAX_MAPS];   /* on screen, by start */
+    int num_live;
+
+    /* statistics */
+    __u32 maps;                         /* buffers mapped */
+    __u32 kept;                         /* buffers that stayed mapped for the next composition */
+};
+
+static inline __u32 tiler_slot_pages(__u32 size)
+{
+    return (size + TILER_PAGE_SIZE - 1) / TILER_PAGE_SIZE;
+}
+
+void tiler_slot_init(struct omap3_hwc_tiler_slot *t, __u32 size);
+
+/*
+ * places the buffers of a composition in this order; returns 0, or -ENOSPC if
+ * they cannot all be mapped next to the composition on screen
+ */
+int tiler_slot_place(const struct omap3_hwc_tiler_slot *t, struct omap3_hwc_tiler_map *maps, int n);
+
+/* the placed composition replaced the one on screen */
+void tiler_slot_commit(struct omap3_hwc_tiler_slot *t, const struct omap3_hwc_tiler_map *maps, int n);
+
+/* pages not mapped, and the longest free range */
+__u32 tiler_slot_free(const struct omap3_hwc_tiler_slot *t, __u32 *largest);
+
+#endif /* OMAP3_HWC_TILER_SLOT_H */
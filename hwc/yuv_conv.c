@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "yuv_conv.h"
+
+/* output block, so that the source rows a rotation walks across stay in the cache */
+#define BLOCK 32
+
+/* a plane seen through the transform: the sample at output (0, 0) and the steps right and down */
+struct walk {
+    const __u8 *origin;
+    ptrdiff_t dx;
+    ptrdiff_t dy;
+};
+
+static void setup_walk(struct walk *wk, const __u8 *p, __u32 stride, __u32 w, __u32 h, int transform)
+{
+    ptrdiff_t right = transform & YUV_CONV_FLIP_H ? -1 : 1;
+    ptrdiff_t down = transform & YUV_CONV_FLIP_V ? -(ptrdiff_t) stride : (ptrdiff_t) stride;
+    const __u8 *o = p + (transform & YUV_CONV_FLIP_H ? w - 1 : 0) +
+                    (transform & YUV_CONV_FLIP_V ? (ptrdiff_t) (h - 1) * stride : 0);
+
+    if (transform & YUV_CONV_ROT_90) {
+        /* output rows are the columns of the flipped plane, bottom up */
+        wk->origin = o + (ptrdiff_t) (h - 1) * down;
+        wk->dx = -down;
+        wk->dy = right;
+    } else {
+        wk->origin = o;
+        wk->dx = right;
+        wk->dy = down;
+    }
+}
+
+static inline const __u8 *walk_at(const struct walk *wk, __u32 x, __u32 y)
+{
+    return wk->origin + (ptrdiff_t) x * wk->dx + (ptrdiff_t) y * wk->dy;
+}
+
+#ifdef __ARM_NEON__
+/* 8 samples from s on, in the direction of step (1 or -1) */
+static inline uint8x8_t load8(const __u8 *s, ptrdiff_t step)
+{
+    return step > 0 ? vld1_u8(s) : vrev64_u8(vld1_u8(s - 7));
+}
+
+/*
+ * the 8x8 samples at output (x, y) of a rotating walk, which steps by one
+ * sample down the output; r gets one vector per output row
+ */
+static inline void transpose8(const struct walk *wk, __u32 x, __u32 y, uint8x8_t r[8])
+{
+    const __u8 *s = walk_at(wk, x, y);
+    ptrdiff_t dx = wk->dx, dy = wk->dy;
+    uint8x8x2_t a0 = vtrn_u8(load8(s, dy), load8(s + dx, dy));
+    uint8x8x2_t a1 = vtrn_u8(load8(s + 2 * dx, dy), load8(s + 3 * dx, dy));
+    uint8x8x2_t a2 = vtrn_u8(load8(s + 4 * dx, dy), load8(s + 5 * dx, dy));
+    uint8x8x2_t a3 = vtrn_u8(load8(s + 6 * dx, dy), load8(s + 7 * dx, dy));
+    uint16x4x2_t b0 = vtrn_u16(vreinterpret_u16_u8(a0.val[0]), vreinterpret_u16_u8(a1.val[0]));
+    uint16x4x2_t b1 = vtrn_u16(vreinterpret_u16_u8(a0.val[1]), vreinterpret_u16_u8(a1.val[1]));
+    uint16x4x2_t b2 = vtrn_u16(vreinterpret_u16_u8(a2.val[0]), vreinterpret_u16_u8(a3.val[0]));
+    uint16x4x2_t b3 = vtrn_u16(vreinterpret_u16_u8(a2.val[1]), vreinterpret_u16_u8(a3.val[1]));
+    uint32x2x2_t c0 = vtrn_u32(vreinterpret_u32_u16(b0.val[0]), vreinterpret_u32_u16(b2.val[0]));
+    uint32x2x2_t c1 = vtrn_u32(vreinterpret_u32_u16(b1.val[0]), vreinterpret_u32_u16(b3.val[0]));
+    uint32x2x2_t c2 = vtrn_u32(vreinterpret_u32_u16(b0.val[1]), vreinterpret_u32_u16(b2.val[1]));
+    uint32x2x2_t c3 = vtrn_u32(vreinterpret_u32_u16(b1.val[1]), vreinterpret_u32_u16(b3.val[1]));
+
+    r[0] = vreinterpret_u8_u32(c0.val[0]);
+    r[1] = vreinterpret_u8_u32(c1.val[0]);
+    r[2] = vreinterpret_u8_u32(c2.val[0]);
+    r[3] = vreinterpret_u8_u32(c3.val[0]);
+    r[4] = vreinterpret_u8_u32(c0.val[1]);
+    r[5] = vreinterpret_u8_u32(c1.val[1]);
+    r[6] = vreinterpret_u8_u32(c2.val[1]);
+    r[7] = vreinterpret_u8_u32(c3.val[1]);
+}
+#endif
+
+/* copies the w x h samples at output (x0, y0) of the walk into d */
+static void copy_block(const struct walk *wk, __u32 x0, __u32 y0, __u32 w, __u32 h,
+                       __u8 *d, __u32 stride)
+{
+    __u32 x, y, done_w = 0, done_h = 0;
+
+#ifdef __ARM_NEON__
+    if (wk->dy == 1 || wk->dy == -1) {
+        uint8x8_t r[8];
+        int i;
+
+        done_w = w & ~7;
+        done_h = h & ~7;
+        for (y = 0; y < done_h; y += 8) {
+            for (x = 0; x < done_w; x += 8) {
+                transpose8(wk, x0 + x, y0 + y, r);
+                for (i = 0; i < 8; i++)
+                    vst1_u8(d + (y0 + y + i) * stride + x0 + x, r[i]);
+            }
+        }
+    }
+#endif
+    for (y = 0; y < h; y++) {
+        const __u8 *s;
+        __u8 *o = d + (y0 + y) * stride + x0;
+
+        x = y < done_h ? done_w : 0;
+        for (s = walk_at(wk, x0 + x, y0 + y); x < w; x++, s += wk->dx)
+            o[x] = *s;
+    }
+}
+
+/* interleaves the w x h samples at output (x0, y0) of the chroma walks into d */
+static void interleave_block(const struct walk *cb, const struct walk *cr, __u32 x0, __u32 y0,
+                             __u32 w, __u32 h, __u8 *d, __u32 stride)
+{
+    __u32 x, y, done_w = 0, done_h = 0;
+
+#ifdef __ARM_NEON__
+    if (cb->dy == 1 || cb->dy == -1) {
+        uint8x8x2_t c;
+        uint8x8_t u[8], v[8];
+        int i;
+
+        done_w = w & ~7;
+        done_h = h & ~7;
+        for (y = 0; y < done_h; y += 8) {
+            for (x = 0; x < done_w; x += 8) {
+                transpose8(cb, x0 + x, y0 + y, u);
+                transpose8(cr, x0 + x, y0 + y, v);
+                for (i = 0; i < 8; i++) {
+                    c.val[0] = u[i];
+                    c.val[1] = v[i];
+                    vst2_u8(d + (y0 + y + i) * stride + 2 * (x0 + x), c);
+                }
+            }
+        }
+    }
+#endif
+    for (y = 0; y < h; y++) {
+        const __u8 *u, *v;
+        __u8 *o = d + (y0 + y) * stride + 2 * x0;
+
+        x = y < done_h ? done_w : 0;
+        u = walk_at(cb, x0 + x, y0 + y);
+        v = walk_at(cr, x0 + x, y0 + y);
+        for (; x < w; x++, u += cb->dx, v += cr->dx) {
+            o[2 * x] = *u;
+            o[2 * x + 1] = *v;
+        }
+    }
+}
+
+/* interleaves n samples of each chroma plane into uv */
+static void interleave_row(const __u8 *cb, const __u8 *cr, __u8 *uv, __u32 n)
+{
+    __u32 i = 0;
+
+#ifdef __ARM_NEON__
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t c;
+
+        c.val[0] = vld1q_u8(cb + i);
+        c.val[1] = vld1q_u8(cr + i);
+        vst2q_u8(uv + 2 * i, c);
+    }
+#endif
+    for (; i < n; i++) {
+        uv[2 * i] = cb[i];
+        uv[2 * i + 1] = cr[i];
+    }
+}
+
+static void transform_to_nv12(const struct yuv_conv_planes *src, __u32 width, __u32 height, int transform,
+                              __u8 *y, __u8 *uv, __u32 stride)
+{
+    __u32 cw = (width + 1) / 2, ch = (height + 1) / 2, bx, by;
+    struct walk wy, wcb, wcr;
+
+    setup_walk(&wy, src->y, src->y_stride, width, height, transform);
+    setup_walk(&wcb, src->cb, src->c_stride, cw, ch, transform);
+    setup_walk(&wcr, src->cr, src->c_stride, cw, ch, transform);
+    if (transform & YUV_CONV_ROT_90) {
+        __u32 t = width;
+
+        width = height;
+        height = t;
+        t = cw;
+        cw = ch;
+        ch = t;
+    }
+
+    for (by = 0; by < height; by += BLOCK)
+        for (bx = 0; bx < width; bx += BLOCK)
+            copy_block(&wy, bx, by, width - bx < BLOCK ? width - bx : BLOCK,
+                       height - by < BLOCK ? height - by : BLOCK, y, stride);
+    for (by = 0; by < ch; by += BLOCK)
+        for (bx = 0; bx < cw; bx += BLOCK)
+            interleave_block(&wcb, &wcr, bx, by, cw - bx < BLOCK ? cw - bx : BLOCK,
+                             ch - by < BLOCK ? ch - by : BLOCK, uv, stride);
+}
+
+void yuv_conv_to_nv12(const struct yuv_conv_planes *src, __u32 width, __u32 height, int transform,
+                      __u8 *y, __u8 *uv, __u32 stride)
+{
+    __u32 r;
+
+    if (transform) {
+        transform_to_nv12(src, width, height, transform, y, uv, stride);
+        return;
+    }
+
+    for (r = 0; r < height; r++)
+        memcpy(y + r * stride, src->y + r * src->y_stride, width);
+    for (r = 0; r < (height + 1) / 2; r++)
+        interleave_row(src->cb + r * src->c_stride, src->cr + r * src->c_stride,
+                       uv + r * stride, (width + 1) / 2);
+}
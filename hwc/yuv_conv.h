@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) Texas Instruments - http://www.ti.com/
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OMAP3_HWC_YUV_CONV_H
+#define OMAP3_HWC_YUV_CONV_H
+
+#include <linux/types.h>
+
+/*
+ * Conversion of planar 4:2:0 frames, as the software decoders write them, to
+ * the NV12 the VID pipes scan out: the luma plane is copied and the two chroma
+ * planes are interleaved.  The frame can be transformed on the way, for
+ * buffers the DSS cannot rotate.  Rotations walk the output in blocks, so that
+ * the source rows they cross stay in the cache, and transpose 8x8 samples at a
+ * time with NEON if the compiler targets it.
+ */
+
+/* the HAL_TRANSFORM_* bits: flips first, then a clockwise quarter turn */
+#define YUV_CONV_FLIP_H         0x01
+#define YUV_CONV_FLIP_V         0x02
+#define YUV_CONV_ROT_90         0x04
+
+struct yuv_conv_planes {
+    const __u8 *y;
+    const __u8 *cb;
+    const __u8 *cr;
+    __u32 y_stride;
+    __u32 c_stride;                     /* of both chroma planes */
+};
+
+/*
+ * converts width x height pixels into the planes y and uv of the given stride;
+ * with YUV_CONV_ROT_90 the result is height x width
+ */
+void yuv_conv_to_nv12(const struct yuv_conv_planes *src, __u32 width, __u32 height, int transform,
+                      __u8 *y, __u8 *uv, __u32 stride);
+
+#endif /* OMAP3_HWC_YUV_CONV_H */